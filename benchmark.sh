@@ -0,0 +1,14 @@
+# Measure CVBasic compilation speed over the examples (optional argument: compiler to test)
+CVBASIC=$(pwd)/${1:-cvbasic}
+cd examples
+time for pass in 1 2 3 4 5 6 7 8 9 10; do
+    for f in *.bas; do
+        case $f in
+            *_sms.bas) t=--sms ;;
+            *_nes.bas) t=--nes ;;
+            *_msx2.bas) t=--msx2 ;;
+            *) t= ;;
+        esac
+        $CVBASIC $t $f /tmp/benchmark.asm .. >/dev/null 2>&1
+    done
+done
@@ -1,2 +1,2 @@
 # Compile CVBasic with Clang warnings, except some too twisted
-gcc -Weverything -Wno-sign-conversion -Wno-implicit-int-conversion -Wno-switch-enum -Wno-padded -Wno-poison-system-directories -Wno-shadow cvbasic.c node.c driver.c cpu6502.c cpuz80.c cpu9900.c -o cvbasic
+gcc -Weverything -Wno-sign-conversion -Wno-implicit-int-conversion -Wno-switch-enum -Wno-padded -Wno-poison-system-directories -Wno-shadow cvbasic.c node.c driver.c cpu6502.c cpuz80.c cpu9900.c inst.c stats.c library.c -o cvbasic
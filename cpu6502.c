@@ -12,7 +12,9 @@
 #include <stdlib.h>
 #include "cvbasic.h"
 #include "node.h"
+#include "inst.h"
 #include "cpu6502.h"
+#include "stats.h"
 
 #define REG_NONE    0
 #define REG_ALL     (REG_ACC | REG_X | REG_Y | REG_TEMP)
@@ -25,7 +27,17 @@
 
 static char temp2[MAX_LINE_SIZE];
 
-static char cpu6502_line[MAX_LINE_SIZE];
+/*
+ ** Mnemonics (sorted, it must match enum m6502_opcode)
+ */
+static char *cpu6502_mnemonics[] = {
+    "ADC", "AND", "ASL", "BCC", "BCC.L", "BCS", "BCS.L", "BEQ", "BEQ.L", "BMI",
+    "BNE", "BNE.L", "BPL", "CLC", "CLI", "CMP", "CPX", "CPY", "DB", "DEC",
+    "DEX", "DEY", "DW", "EOR", "FORG", "INC", "INX", "INY", "JMP", "JSR",
+    "LDA", "LDX", "LDY", "LSR", "ORA", "ORG", "PHA", "PLA", "ROL", "ROR",
+    "RTS", "SBC", "SEC", "SEI", "STA", "STX", "STY", "TAX", "TAY", "TXA",
+    "TYA",
+};
 
 static char cpu6502_a_value[MAX_LINE_SIZE];
 static char cpu6502_a_alias[MAX_LINE_SIZE];
@@ -35,16 +47,686 @@ static char cpu6502_y_value[MAX_LINE_SIZE];
 static char cpu6502_y_alias[MAX_LINE_SIZE];
 static char cpu6502_pointer_alias[MAX_LINE_SIZE];
 static int cpu6502_flag_z_valid;
+static int cpu6502_carry = -1;  /* Known state of carry flag (-1 = unknown) */
+
+static int cpu6502_opcode(char *);
+static enum operand_kind cpu6502_kind(int, char *);
+static void cpu6502_emit(int, char *, char *);
+static void cpu6502_peephole(int);
+static int cpu6502_size(int);
+static int cpu6502_distance(int, char *);
+static int cpu6502_match(int, int, char *);
+static void cpu6502_replace(int, int, char *);
+static void cpu6502_multiply(int, int, int);
 
-static void cpu6502_emit_line(void);
+/*
+ ** Get the opcode for a mnemonic
+ */
+int cpu6502_opcode(char *mnemonic)
+{
+    return inst_lookup(cpu6502_mnemonics, sizeof(cpu6502_mnemonics) / sizeof(char *), mnemonic);
+}
 
-void cpu6502_emit_line(void)
+/*
+ ** Classify an operand
+ */
+enum operand_kind cpu6502_kind(int opcode, char *operand)
 {
-    fprintf(output, "%s", cpu6502_line);
+    if (operand == NULL)
+        return OPERAND_NONE;
+    switch (opcode) {
+        case M6502_JMP:
+        case M6502_JSR:
+        case M6502_BCC:
+        case M6502_BCC_L:
+        case M6502_BCS:
+        case M6502_BCS_L:
+        case M6502_BEQ:
+        case M6502_BEQ_L:
+        case M6502_BMI:
+        case M6502_BNE:
+        case M6502_BNE_L:
+        case M6502_BPL:
+            return OPERAND_LABEL;
+        case M6502_DB:
+        case M6502_DW:
+        case M6502_ORG:
+        case M6502_FORG:
+            return OPERAND_OTHER;
+        default:
+            break;
+    }
+    if (strcmp(operand, "A") == 0)
+        return OPERAND_REGISTER;
+    if (operand[0] == '#')
+        return OPERAND_NUMBER;
+    return OPERAND_MEMORY;
+}
+
+/*
+ ** Emit a 6502 instruction into the stream
+ */
+void cpu6502_emit(int opcode, char *mnemonic, char *operand)
+{
+    int index;
+    
+    index = inst_add(INST_OP, opcode, mnemonic);
+    if (operand != NULL)
+        inst_set_operand(index, 0, operand, cpu6502_kind(opcode, operand));
+    stats_start(PHASE_PEEPHOLE);
+    cpu6502_peephole(index);
+    stats_stop();
+    
+    /*
+     ** Track the carry flag
+     */
+    switch (opcode) {
+        case M6502_CLC:
+        case M6502_BCS:
+        case M6502_BCS_L:
+            cpu6502_carry = 0;
+            break;
+        case M6502_SEC:
+        case M6502_BCC:
+        case M6502_BCC_L:
+            cpu6502_carry = 1;
+            break;
+        case M6502_ADC:
+        case M6502_SBC:
+        case M6502_CMP:
+        case M6502_CPX:
+        case M6502_CPY:
+        case M6502_ASL:
+        case M6502_LSR:
+        case M6502_ROL:
+        case M6502_ROR:
+        case M6502_JSR:
+        case M6502_JMP:
+        case M6502_RTS:
+        case M6502_DB:
+        case M6502_DW:
+        case M6502_ORG:
+        case M6502_FORG:
+        case -1:
+            cpu6502_carry = -1;
+            break;
+        default:
+            /* Carry isn't affected */
+            break;
+    }
 }
 
+/*
+ ** Peephole optimizer, called after adding an entry to the stream.
+ */
+void cpu6502_peephole(int index)
+{
+    struct inst *inst;
+    struct inst *previous;
+    struct inst *previous2;
+    char *label;
+    char *operand;
+    int c;
+    int d;
+    int opcode;
+    
+    inst = &inst_stream[index];
+    
+    /*
+     ** Optimize the following case:
+     **     BEQ.L cv1
+     **     JMP somewhere
+     ** cv1:
+     ** into:
+     **     BNE.L somewhere
+     */
+    if (inst->type == INST_LABEL) {
+        label = inst_string(inst->text);
+        if (memcmp(label, INTERNAL_PREFIX, 2) != 0 || !isdigit(label[2]))
+            return;
+        c = inst_previous(index);
+        d = (c >= 0) ? inst_previous(c) : -1;
+        if (d < 0)
+            return;
+        previous = &inst_stream[c];
+        previous2 = &inst_stream[d];
+        if (previous->type != INST_OP || previous->opcode != M6502_JMP)
+            return;
+        if (previous2->type != INST_OP || strcmp(inst_string(previous2->operand[0]), label) != 0)
+            return;
+        switch (previous2->opcode) {
+            case M6502_BEQ:
+            case M6502_BEQ_L:
+                opcode = M6502_BNE_L;
+                break;
+            case M6502_BNE:
+            case M6502_BNE_L:
+                opcode = M6502_BEQ_L;
+                break;
+            case M6502_BCC:
+            case M6502_BCC_L:
+                opcode = M6502_BCS_L;
+                break;
+            case M6502_BCS:
+            case M6502_BCS_L:
+                opcode = M6502_BCC_L;
+                break;
+            default:
+                return;
+        }
+        previous2->opcode = opcode;
+        inst_set_text(d, cpu6502_mnemonics[opcode]);
+        previous2 = &inst_stream[d];
+        previous = &inst_stream[c];
+        previous2->operand[0] = previous->operand[0];
+        inst_delete(c);
+        inst_delete(index);
+        stats_rule("6502: branch over JMP");
+        return;
+    }
+    if (inst->type != INST_OP)
+        return;
+    c = inst_previous(index);
+    if (c < 0)
+        return;
+    previous = &inst_stream[c];
+    if (previous->type != INST_OP)
+        return;
+    
+    /*
+     ** Optimize the following case:
+     **     JSR cv1
+     **     RTS
+     */
+    if (inst->opcode == M6502_RTS && previous->opcode == M6502_JSR &&
+        memcmp(inst_string(previous->operand[0]), INTERNAL_PREFIX, 2) == 0) {
+        inst->opcode = M6502_JMP;
+        inst_set_text(index, "JMP");
+        inst = &inst_stream[index];
+        previous = &inst_stream[c];
+        inst->operand[0] = previous->operand[0];
+        inst->kind[0] = OPERAND_LABEL;
+        inst_delete(c);
+        stats_rule("6502: JSR/RTS into JMP");
+        return;
+    }
+    
+    /*
+     ** Remove the store in these cases:
+     **     LDA cvb_A           STA cvb_A
+     **     STA cvb_A           STA cvb_A
+     */
+    if (inst->opcode == M6502_STA && (previous->opcode == M6502_LDA || previous->opcode == M6502_STA)) {
+        operand = inst_string(inst->operand[0]);
+        if (memcmp(operand, LABEL_PREFIX, 4) == 0 && strchr(operand, ',') == NULL &&
+            strcmp(operand, inst_string(previous->operand[0])) == 0) {
+            inst_delete(index);
+            stats_rule("6502: redundant STA");
+            return;
+        }
+    }
+}
+
+/*
+ ** Get the maximum size in bytes of an entry (-1 if unknown)
+ */
+int cpu6502_size(int index)
+{
+    struct inst *inst;
+    char *operand;
+    
+    inst = &inst_stream[index];
+    switch (inst->type) {
+        case INST_NONE:
+        case INST_LABEL:
+        case INST_COMMENT:
+            return 0;
+        case INST_OP:
+            break;
+        default:
+            return -1;
+    }
+    switch (inst->opcode) {
+        case M6502_BCC:
+        case M6502_BCS:
+        case M6502_BEQ:
+        case M6502_BNE:
+        case M6502_BMI:
+        case M6502_BPL:
+            return 2;
+        case M6502_BCC_L:
+        case M6502_BCS_L:
+        case M6502_BEQ_L:
+        case M6502_BNE_L:
+            return 5;
+        case M6502_JMP:
+        case M6502_JSR:
+            return 3;
+        case M6502_DB:
+        case M6502_DW:
+        case M6502_ORG:
+        case M6502_FORG:
+        case -1:
+            return -1;
+        default:
+            break;
+    }
+    if (inst->operand[0] < 0)
+        return 1;
+    operand = inst_string(inst->operand[0]);
+    if (strcmp(operand, "A") == 0)
+        return 1;
+    if (operand[0] == '#' || operand[0] == '(')
+        return 2;
+    return 3;
+}
+
+/*
+ ** Get the distance from a branch to a label, if it is at reach of a
+ ** short branch. Otherwise returns a value out of range.
+ */
+int cpu6502_distance(int index, char *label)
+{
+    int c;
+    int size;
+    int distance;
+    
+    /*
+     ** Forward (counted from the end of the short branch)
+     */
+    distance = 0;
+    for (c = index + 1; c < inst_count && distance <= 127; c++) {
+        if (inst_stream[c].type == INST_LABEL && strcmp(inst_string(inst_stream[c].text), label) == 0)
+            return distance;
+        size = cpu6502_size(c);
+        if (size < 0)
+            break;
+        distance += size;
+    }
+    
+    /*
+     ** Backward
+     */
+    distance = -2;
+    for (c = index - 1; c >= 0 && distance >= -128; c--) {
+        size = cpu6502_size(c);
+        if (size < 0)
+            break;
+        distance -= size;
+        if (inst_stream[c].type == INST_LABEL && strcmp(inst_string(inst_stream[c].text), label) == 0)
+            return distance;
+    }
+    return 256;
+}
+
+/*
+ ** Branch relaxation. Replace long branches with short ones when the target
+ ** is near. Sizes are estimated by excess, so it is repeated while something
+ ** changes.
+ */
+void cpu6502_relax(void)
+{
+    struct inst *inst;
+    int c;
+    int distance;
+    int changed;
+    
+    do {
+        changed = 0;
+        for (c = 0; c < inst_count; c++) {
+            inst = &inst_stream[c];
+            if (inst->type != INST_OP)
+                continue;
+            if (inst->opcode != M6502_BEQ_L && inst->opcode != M6502_BNE_L &&
+                inst->opcode != M6502_BCC_L && inst->opcode != M6502_BCS_L)
+                continue;
+            distance = cpu6502_distance(c, inst_string(inst->operand[0]));
+            if (distance < -128 || distance > 127)
+                continue;
+            inst->opcode--;    /* The short branch precedes the long one */
+            inst_set_text(c, cpu6502_mnemonics[inst_stream[c].opcode]);
+            changed = 1;
+            stats_rule("6502: short branch");
+        }
+    } while (changed) ;
+}
+
+/*
+ ** Bytes pushed in the stack by an entry of the instruction stream
+ ** (negative if popped). For a call (2 bytes for the return address)
+ ** or a jump, the target label is returned in *callee.
+ */
+int cpu6502_stack(int index, char **callee)
+{
+    struct inst *inst;
+    
+    *callee = NULL;
+    inst = &inst_stream[index];
+    if (inst->type != INST_OP)
+        return 0;
+    switch (inst->opcode) {
+        case M6502_PHA:
+            return 1;
+        case M6502_PLA:
+            return -1;
+        case M6502_JSR:
+            *callee = inst_string(inst->operand[0]);
+            return 2;
+        case M6502_JMP:
+            if (inst_string(inst->operand[0])[0] != '(')
+                *callee = inst_string(inst->operand[0]);
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+/*
+ ** Check if an entry of the instruction stream only stores a register
+ ** into a variable (or its high byte). Returns the target operand.
+ */
+char *cpu6502_store(int index, char *variable)
+{
+    struct inst *inst;
+    char *operand;
+    int length;
+    
+    inst = &inst_stream[index];
+    if (inst->type != INST_OP)
+        return NULL;
+    if (inst->opcode != M6502_STA && inst->opcode != M6502_STX && inst->opcode != M6502_STY)
+        return NULL;
+    operand = inst_string(inst->operand[0]);
+    length = strlen(variable);
+    if (strncmp(operand, variable, length) != 0)
+        return NULL;
+    if (operand[length] != '\0' && strcmp(operand + length, "+1") != 0)
+        return NULL;
+    return operand;
+}
+
+/*
+ ** Check if the body of a FOR loop (from start to the end of the stream)
+ ** can keep the 8-bit loop variable in register X, and replace
+ ** the reads of the variable with TXA.
+ **
+ ** It cannot call anything, use X, jump outside of itself (except to
+ ** the exit), or access the variable other than loading it in A.
+ */
+int cpu6502_for_register(int start, char *variable, char *exit)
+{
+    struct inst *inst;
+    char *operand;
+    int c;
+    int e;
+    
+    for (e = 0; e < 2; e++) {  /* The first pass checks, the second one replaces */
+        for (c = start; c < inst_count; c++) {
+            inst = &inst_stream[c];
+            if (inst->type == INST_TEXT)
+                return 0;
+            if (inst->type == INST_LABEL) {
+                if (!inst_internal(inst_string(inst->text)))
+                    return 0;
+                continue;
+            }
+            if (inst->type != INST_OP)
+                continue;
+            switch (inst->opcode) {
+                case -1:
+                case M6502_JSR:
+                case M6502_RTS:
+                case M6502_TAX:
+                case M6502_TXA:
+                case M6502_LDX:
+                case M6502_STX:
+                case M6502_INX:
+                case M6502_DEX:
+                case M6502_CPX:
+                case M6502_DB:
+                case M6502_DW:
+                    return 0;
+                default:
+                    break;
+            }
+            if (inst->operand[0] < 0)
+                continue;
+            operand = inst_string(inst->operand[0]);
+            if (inst->kind[0] == OPERAND_LABEL) {
+                if (operand[0] == '(' || !inst_inside(start, operand, exit))
+                    return 0;
+                continue;
+            }
+            if (strstr(operand, ",X") != NULL)
+                return 0;
+            if (inst->opcode == M6502_LDA && strcmp(operand, variable) == 0) {
+                if (e) {
+                    inst->opcode = M6502_TXA;
+                    inst_set_text(c, "TXA");
+                    inst_stream[c].operand[0] = -1;
+                    inst_stream[c].kind[0] = OPERAND_NONE;
+                }
+                continue;
+            }
+            if (inst_symbol(operand, variable))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ ** Check an instruction and its operand (NULL for any operand)
+ */
+static int cpu6502_match(int index, int opcode, char *operand)
+{
+    struct inst *inst;
+    
+    if (index < 0)
+        return 0;
+    inst = &inst_stream[index];
+    if (inst->type != INST_OP || inst->opcode != opcode)
+        return 0;
+    if (operand != NULL && strcmp(inst_string(inst->operand[0]), operand) != 0)
+        return 0;
+    return 1;
+}
+
+/*
+ ** Replace an instruction
+ */
+static void cpu6502_replace(int index, int opcode, char *operand)
+{
+    inst_stream[index].opcode = opcode;
+    inst_set_text(index, cpu6502_mnemonics[opcode]);
+    inst_set_operand(index, 0, operand, cpu6502_kind(opcode, operand));
+}
+
+/*
+ ** Check for the address of an array element indexed by a 8-bit variable:
+ **
+ **     LDA #array          LDA variable
+ **     CLC                 ASL A
+ **     ADC variable        LDY #0
+ **     TAX                 BCC $+3
+ **     LDA #array>>8       INY
+ **     ADC #0              CLC
+ **     TAY                 ADC #array
+ **     TXA                 TAX
+ **                         TYA
+ **                         ADC #array>>8
+ **                         TAY
+ **                         TXA
+ **
+ ** Returns the size of the elements (zero if it doesn't match), the
+ ** name of the array, and the last instruction of the sequence.
+ */
+int cpu6502_index(int index, char *variable, char *array, int *last)
+{
+    char high[MAX_LINE_SIZE];
+    char *operand;
+    int size;
+    
+    if (cpu6502_match(index, M6502_LDA, variable)) {
+        size = 2;
+        index = inst_next(index);
+        if (!cpu6502_match(index, M6502_ASL, "A"))
+            return 0;
+        index = inst_next(index);
+        if (!cpu6502_match(index, M6502_LDY, "#0"))
+            return 0;
+        index = inst_next(index);
+        if (!cpu6502_match(index, M6502_BCC, "$+3"))
+            return 0;
+        index = inst_next(index);
+        if (!cpu6502_match(index, M6502_INY, NULL))
+            return 0;
+        index = inst_next(index);
+        if (cpu6502_match(index, M6502_CLC, NULL))
+            index = inst_next(index);
+        if (!cpu6502_match(index, M6502_ADC, NULL))
+            return 0;
+    } else {
+        size = 1;
+        if (!cpu6502_match(index, M6502_LDA, NULL))
+            return 0;
+    }
+    operand = inst_string(inst_stream[index].operand[0]);
+    if (operand[0] != '#' || memcmp(operand + 1, ARRAY_PREFIX, strlen(ARRAY_PREFIX)) != 0 || strpbrk(operand, "+->") != NULL)
+        return 0;
+    strcpy(array, operand + 1);
+    sprintf(high, "#%s>>8", array);
+    index = inst_next(index);
+    if (size == 1) {
+        if (cpu6502_match(index, M6502_CLC, NULL))
+            index = inst_next(index);
+        if (!cpu6502_match(index, M6502_ADC, variable))
+            return 0;
+        index = inst_next(index);
+        if (!cpu6502_match(index, M6502_TAX, NULL))
+            return 0;
+        index = inst_next(index);
+        if (!cpu6502_match(index, M6502_LDA, high))
+            return 0;
+        index = inst_next(index);
+        if (!cpu6502_match(index, M6502_ADC, "#0"))
+            return 0;
+    } else {
+        if (!cpu6502_match(index, M6502_TAX, NULL))
+            return 0;
+        index = inst_next(index);
+        if (!cpu6502_match(index, M6502_TYA, NULL))
+            return 0;
+        index = inst_next(index);
+        if (!cpu6502_match(index, M6502_ADC, high))
+            return 0;
+    }
+    index = inst_next(index);
+    if (!cpu6502_match(index, M6502_TAY, NULL))
+        return 0;
+    index = inst_next(index);
+    if (!cpu6502_match(index, M6502_TXA, NULL))
+        return 0;
+    *last = index;
+    return size;
+}
+
+/*
+ ** Check if the body of a FOR loop (from start to the end of the stream)
+ ** can keep a pointer to an array indexed by the 8-bit loop variable in
+ ** the zero page (loop_pointer), and replace the address calculation
+ ** with the pointer.
+ **
+ ** It can only call library routines, cannot jump outside of itself
+ ** (except to the exit), and can only read the variable.
+ */
+int cpu6502_for_pointer(int start, char *variable, char *exit, char *array, int size)
+{
+    struct inst *inst;
+    char name[MAX_LINE_SIZE];
+    char *operand;
+    int last;
+    int c;
+    int e;
+    
+    for (e = 0; e < 2; e++) {  /* The first pass checks, the second one replaces */
+        for (c = start; c < inst_count; c++) {
+            inst = &inst_stream[c];
+            if (inst->type == INST_TEXT)
+                return 0;
+            if (inst->type == INST_LABEL) {
+                if (!inst_internal(inst_string(inst->text)))
+                    return 0;
+                continue;
+            }
+            if (inst->type != INST_OP)
+                continue;
+            switch (inst->opcode) {
+                case -1:
+                case M6502_RTS:
+                case M6502_DB:
+                case M6502_DW:
+                    return 0;
+                case M6502_JSR:    /* Only library routines */
+                    if (inst_string(inst->operand[0])[0] != '_')
+                        return 0;
+                    continue;
+                default:
+                    break;
+            }
+            if (cpu6502_index(c, variable, name, &last) == size && strcmp(name, array) == 0) {
+                if (e) {
+                    cpu6502_replace(c, M6502_LDA, "loop_pointer");
+                    c = inst_next(c);
+                    cpu6502_replace(c, M6502_LDY, "loop_pointer+1");
+                    while (c < last)
+                        inst_delete(++c);
+                }
+                c = last;
+                continue;
+            }
+            if (inst->operand[0] < 0)
+                continue;
+            operand = inst_string(inst->operand[0]);
+            if (inst->kind[0] == OPERAND_LABEL) {
+                if (operand[0] == '(' || !inst_inside(start, operand, exit))
+                    return 0;
+                continue;
+            }
+            if (inst_symbol(operand, "loop_pointer"))
+                return 0;
+            if (strcmp(operand, variable) == 0) {
+                switch (inst->opcode) {
+                    case M6502_LDA:
+                    case M6502_LDX:
+                    case M6502_LDY:
+                    case M6502_ADC:
+                    case M6502_SBC:
+                    case M6502_CMP:
+                    case M6502_CPX:
+                    case M6502_CPY:
+                    case M6502_AND:
+                    case M6502_ORA:
+                    case M6502_EOR:
+                        continue;
+                    default:
+                        return 0;
+                }
+            }
+            if (inst_symbol(operand, variable))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ ** Close the peephole window (used before emitting data)
+ */
 void cpu6502_dump(void)
 {
+    inst_barrier = inst_count;
+    cpu6502_carry = -1;
 }
 
 /*
@@ -52,8 +734,13 @@ void cpu6502_dump(void)
  */
 void cpu6502_label(char *label)
 {
-    sprintf(cpu6502_line, "%s:\n", label);
-    cpu6502_emit_line();
+    int index;
+    
+    index = inst_add(INST_LABEL, -1, label);
+    inst_set_suffix(index, ":");
+    stats_start(PHASE_PEEPHOLE);
+    cpu6502_peephole(index);
+    stats_stop();
     cpu6502_a_value[0] = '\0';
     cpu6502_a_alias[0] = '\0';
     cpu6502_x_value[0] = '\0';
@@ -62,6 +749,7 @@ void cpu6502_label(char *label)
     cpu6502_y_alias[0] = '\0';
     cpu6502_pointer_alias[0] = '\0';
     cpu6502_flag_z_valid = 0;
+    cpu6502_carry = -1;
 }
 
 /*
@@ -77,6 +765,7 @@ void cpu6502_empty(void)
     cpu6502_y_alias[0] = '\0';
     cpu6502_pointer_alias[0] = '\0';
     cpu6502_flag_z_valid = 0;
+    cpu6502_carry = -1;
 }
 
 /*
@@ -84,6 +773,8 @@ void cpu6502_empty(void)
  */
 void cpu6502_noop(char *mnemonic)
 {
+    int opcode;
+    
     /*
      ** The following instructions aren't used in the compiler
      ** o BRK
@@ -97,44 +788,73 @@ void cpu6502_noop(char *mnemonic)
      ** o TSX
      ** o NOP
      */
-    sprintf(cpu6502_line, "\t%s\n", mnemonic);
-    cpu6502_emit_line();
-    if (strcmp(mnemonic, "PHA") == 0 || strcmp(mnemonic, "SEI") == 0 || strcmp(mnemonic, "CLI") == 0 || strcmp(mnemonic, "SEC") == 0 || strcmp(mnemonic, "CLC") == 0) {
-        /* Nothing to do */
-    } else if (strcmp(mnemonic, "PLA") == 0) {
-        cpu6502_a_value[0] = '\0';
-        cpu6502_a_alias[0] = '\0';
-        cpu6502_flag_z_valid = 1;
-    } else if (strcmp(mnemonic, "TAX") == 0) {
-        strcpy(cpu6502_x_value, cpu6502_a_value);
-        cpu6502_flag_z_valid = 1;
-    } else if (strcmp(mnemonic, "TAY") == 0) {
-        strcpy(cpu6502_y_value, cpu6502_a_value);
-        cpu6502_flag_z_valid = 1;
-    } else if (strcmp(mnemonic, "TXA") == 0) {
-        strcpy(cpu6502_a_value, cpu6502_x_value);
-        cpu6502_flag_z_valid = 1;
-    } else if (strcmp(mnemonic, "TYA") == 0) {
-        strcpy(cpu6502_a_value, cpu6502_y_value);
-        cpu6502_flag_z_valid = 1;
-    } else if (strcmp(mnemonic, "INX") == 0 || strcmp(mnemonic, "DEX") == 0) {
-        cpu6502_x_value[0] = '\0';
-        cpu6502_x_alias[0] = '\0';
-        cpu6502_flag_z_valid = 0;
-    } else if (strcmp(mnemonic, "INY") == 0 || strcmp(mnemonic, "DEY") == 0) {
-        cpu6502_y_value[0] = '\0';
-        cpu6502_y_alias[0] = '\0';
-        cpu6502_flag_z_valid = 0;
-    } else if (strcmp(mnemonic, "RTS") == 0) {
-        cpu6502_a_value[0] = '\0';
-        cpu6502_a_alias[0] = '\0';
-        cpu6502_x_value[0] = '\0';
-        cpu6502_x_alias[0] = '\0';
-        cpu6502_y_value[0] = '\0';
-        cpu6502_y_alias[0] = '\0';
-        cpu6502_flag_z_valid = 0;
-    } else {
-        fprintf(stderr, "cpu6502_noop: not found mnemonic %s\n", mnemonic);
+    opcode = cpu6502_opcode(mnemonic);
+    
+    /*
+     ** Avoid setting carry flag to the state it already has
+     */
+    if ((opcode == M6502_CLC && cpu6502_carry == 0) || (opcode == M6502_SEC && cpu6502_carry == 1)) {
+        stats_rule("6502: carry already set/clear");
+        return;
+    }
+    cpu6502_emit(opcode, mnemonic, NULL);
+    switch (opcode) {
+        case M6502_PHA:
+        case M6502_SEI:
+        case M6502_CLI:
+        case M6502_SEC:
+        case M6502_CLC:
+            /* Nothing to do */
+            break;
+        case M6502_PLA:
+            cpu6502_a_value[0] = '\0';
+            cpu6502_a_alias[0] = '\0';
+            cpu6502_flag_z_valid = 1;
+            break;
+        case M6502_TAX:
+            strcpy(cpu6502_x_value, cpu6502_a_value);
+            strcpy(cpu6502_x_alias, cpu6502_a_alias);
+            cpu6502_flag_z_valid = 1;
+            break;
+        case M6502_TAY:
+            strcpy(cpu6502_y_value, cpu6502_a_value);
+            strcpy(cpu6502_y_alias, cpu6502_a_alias);
+            cpu6502_flag_z_valid = 1;
+            break;
+        case M6502_TXA:
+            strcpy(cpu6502_a_value, cpu6502_x_value);
+            strcpy(cpu6502_a_alias, cpu6502_x_alias);
+            cpu6502_flag_z_valid = 1;
+            break;
+        case M6502_TYA:
+            strcpy(cpu6502_a_value, cpu6502_y_value);
+            strcpy(cpu6502_a_alias, cpu6502_y_alias);
+            cpu6502_flag_z_valid = 1;
+            break;
+        case M6502_INX:
+        case M6502_DEX:
+            cpu6502_x_value[0] = '\0';
+            cpu6502_x_alias[0] = '\0';
+            cpu6502_flag_z_valid = 0;
+            break;
+        case M6502_INY:
+        case M6502_DEY:
+            cpu6502_y_value[0] = '\0';
+            cpu6502_y_alias[0] = '\0';
+            cpu6502_flag_z_valid = 0;
+            break;
+        case M6502_RTS:
+            cpu6502_a_value[0] = '\0';
+            cpu6502_a_alias[0] = '\0';
+            cpu6502_x_value[0] = '\0';
+            cpu6502_x_alias[0] = '\0';
+            cpu6502_y_value[0] = '\0';
+            cpu6502_y_alias[0] = '\0';
+            cpu6502_flag_z_valid = 0;
+            break;
+        default:
+            fprintf(stderr, "cpu6502_noop: not found mnemonic %s\n", mnemonic);
+            break;
     }
 }
 
@@ -143,18 +863,21 @@ void cpu6502_noop(char *mnemonic)
  */
 void cpu6502_1op(char *mnemonic, char *operand)
 {
+    int opcode;
+    
     /*
      ** The following instructions aren't used in the compiler
      ** o BVC
      ** o BVS
      ** o BIT
      */
+    opcode = cpu6502_opcode(mnemonic);
     
     /*
      ** Optimize code finding constants in registers, and
      ** copy into registers using a single byte instruction.
      */
-    if (strcmp(mnemonic, "LDA") == 0) {
+    if (opcode == M6502_LDA) {
         if (strcmp(operand, cpu6502_a_value) == 0 || strcmp(operand, cpu6502_a_alias) == 0)
             return;
         if (strcmp(operand, cpu6502_x_value) == 0 || strcmp(operand, cpu6502_x_alias) == 0) {
@@ -170,7 +893,7 @@ void cpu6502_1op(char *mnemonic, char *operand)
             return;
         }
     }
-    if (strcmp(mnemonic, "LDX") == 0) {
+    if (opcode == M6502_LDX) {
         if (strcmp(operand, cpu6502_x_value) == 0 || strcmp(operand, cpu6502_x_alias) == 0)
             return;
         if (strcmp(operand, cpu6502_a_value) == 0 || strcmp(operand, cpu6502_a_alias) == 0) {
@@ -180,7 +903,7 @@ void cpu6502_1op(char *mnemonic, char *operand)
             return;
         }
     }
-    if (strcmp(mnemonic, "LDY") == 0) {
+    if (opcode == M6502_LDY) {
         if (strcmp(operand, cpu6502_y_value) == 0 || strcmp(operand, cpu6502_y_alias) == 0)
             return;
         if (strcmp(operand, cpu6502_a_value) == 0 || strcmp(operand, cpu6502_a_alias) == 0) {
@@ -190,104 +913,179 @@ void cpu6502_1op(char *mnemonic, char *operand)
             return;
         }
     }
-    sprintf(cpu6502_line, "\t%s %s\n", mnemonic, operand);
-    cpu6502_emit_line();
-    if (strcmp(mnemonic, "LDA") == 0) {
-        if (strchr(operand, ',') != NULL) {
-            cpu6502_a_value[0] = '\0';
-            cpu6502_a_alias[0] = '\0';
-        } else if (operand[0] == '#') {
-            strcpy(cpu6502_a_value, operand);
-            cpu6502_a_alias[0] = '\0';
-        } else {
-            cpu6502_a_value[0] = '\0';
-            strcpy(cpu6502_a_alias, operand);
-        }
-        cpu6502_flag_z_valid = 1;
-    } else if (strcmp(mnemonic, "LDX") == 0) {
-        if (strchr(operand, ',') != NULL) {
-            cpu6502_x_value[0] = '\0';
-            cpu6502_x_alias[0] = '\0';
-        } else if (operand[0] == '#') {
-            strcpy(cpu6502_x_value, operand);
-            cpu6502_x_alias[0] = '\0';
-        } else {
-            cpu6502_x_value[0] = '\0';
-            strcpy(cpu6502_x_alias, operand);
-        }
-        cpu6502_flag_z_valid = 0;
-    } else if (strcmp(mnemonic, "LDY") == 0) {
-        if (strchr(operand, ',') != NULL) {
-            cpu6502_y_value[0] = '\0';
-            cpu6502_y_alias[0] = '\0';
-        } else if (operand[0] == '#') {
-            strcpy(cpu6502_y_value, operand);
-            cpu6502_y_alias[0] = '\0';
-        } else {
-            cpu6502_y_value[0] = '\0';
-            strcpy(cpu6502_y_alias, operand);
-        }
-        cpu6502_flag_z_valid = 0;
-    } else if (strcmp(mnemonic, "CMP") == 0 || strcmp(mnemonic, "CPX") == 0 || strcmp(mnemonic, "CPY") == 0) {
-        /* Only flags affected */
-        cpu6502_flag_z_valid = 0;
-    } else if (strcmp(mnemonic, "ADC") == 0 || strcmp(mnemonic, "SBC") == 0 || strcmp(mnemonic, "ORA") == 0 || strcmp(mnemonic, "EOR") == 0 || strcmp(mnemonic, "AND") == 0) {
-        cpu6502_a_value[0] = '\0';
-        cpu6502_a_alias[0] = '\0';
-        cpu6502_flag_z_valid = 1;
-    } else if (strcmp(mnemonic, "ROR") == 0 || strcmp(mnemonic, "ROL") == 0 || strcmp(mnemonic, "ASL") == 0 || strcmp(mnemonic, "LSR") == 0) {
-        if (strcmp(operand, "A") == 0) {
+    cpu6502_emit(opcode, mnemonic, operand);
+    switch (opcode) {
+        case M6502_LDA:
+            if (strchr(operand, ',') != NULL) {
+                cpu6502_a_value[0] = '\0';
+                cpu6502_a_alias[0] = '\0';
+            } else if (operand[0] == '#') {
+                strcpy(cpu6502_a_value, operand);
+                cpu6502_a_alias[0] = '\0';
+            } else {
+                cpu6502_a_value[0] = '\0';
+                strcpy(cpu6502_a_alias, operand);
+            }
+            cpu6502_flag_z_valid = 1;
+            break;
+        case M6502_LDX:
+            if (strchr(operand, ',') != NULL) {
+                cpu6502_x_value[0] = '\0';
+                cpu6502_x_alias[0] = '\0';
+            } else if (operand[0] == '#') {
+                strcpy(cpu6502_x_value, operand);
+                cpu6502_x_alias[0] = '\0';
+            } else {
+                cpu6502_x_value[0] = '\0';
+                strcpy(cpu6502_x_alias, operand);
+            }
+            cpu6502_flag_z_valid = 0;
+            break;
+        case M6502_LDY:
+            if (strchr(operand, ',') != NULL) {
+                cpu6502_y_value[0] = '\0';
+                cpu6502_y_alias[0] = '\0';
+            } else if (operand[0] == '#') {
+                strcpy(cpu6502_y_value, operand);
+                cpu6502_y_alias[0] = '\0';
+            } else {
+                cpu6502_y_value[0] = '\0';
+                strcpy(cpu6502_y_alias, operand);
+            }
+            cpu6502_flag_z_valid = 0;
+            break;
+        case M6502_CMP:
+        case M6502_CPX:
+        case M6502_CPY:
+            /* Only flags affected */
+            cpu6502_flag_z_valid = 0;
+            break;
+        case M6502_ADC:
+        case M6502_SBC:
+        case M6502_ORA:
+        case M6502_EOR:
+        case M6502_AND:
             cpu6502_a_value[0] = '\0';
             cpu6502_a_alias[0] = '\0';
             cpu6502_flag_z_valid = 1;
-        } else {
+            break;
+        case M6502_ROR:
+        case M6502_ROL:
+        case M6502_ASL:
+        case M6502_LSR:
+            if (strcmp(operand, "A") == 0) {
+                cpu6502_a_value[0] = '\0';
+                cpu6502_a_alias[0] = '\0';
+                cpu6502_flag_z_valid = 1;
+            } else {
+                cpu6502_a_alias[0] = '\0';
+                cpu6502_x_alias[0] = '\0';
+                cpu6502_y_alias[0] = '\0';
+                cpu6502_flag_z_valid = 0;
+            }
+            break;
+        case M6502_INC:
+        case M6502_DEC:
             cpu6502_a_alias[0] = '\0';
             cpu6502_x_alias[0] = '\0';
             cpu6502_y_alias[0] = '\0';
             cpu6502_flag_z_valid = 0;
-        }
-    } else if (strcmp(mnemonic, "INC") == 0 || strcmp(mnemonic, "DEC") == 0) {
-        cpu6502_a_alias[0] = '\0';
-        cpu6502_x_alias[0] = '\0';
-        cpu6502_y_alias[0] = '\0';
-        cpu6502_flag_z_valid = 0;
-    } else if (strcmp(mnemonic, "JSR") == 0 || strcmp(mnemonic, "JMP") == 0 || strcmp(mnemonic, "ORG") == 0 || strcmp(mnemonic, "FORG") == 0) {
-        cpu6502_a_value[0] = '\0';
-        cpu6502_a_alias[0] = '\0';
-        cpu6502_x_value[0] = '\0';
-        cpu6502_x_alias[0] = '\0';
-        cpu6502_y_value[0] = '\0';
-        cpu6502_y_alias[0] = '\0';
-        cpu6502_pointer_alias[0] = '\0';
-        cpu6502_flag_z_valid = 0;
-    } else if (strcmp(mnemonic, "STA") == 0) {
-        if (strchr(operand, ',') != NULL) {
+            break;
+        case M6502_JSR:
+        case M6502_JMP:
+        case M6502_ORG:
+        case M6502_FORG:
+            cpu6502_a_value[0] = '\0';
             cpu6502_a_alias[0] = '\0';
-        } else {
-            strcpy(cpu6502_a_alias, operand);
-        }
-    } else if (strcmp(mnemonic, "STX") == 0) {
-        if (strchr(operand, ',') != NULL) {
+            cpu6502_x_value[0] = '\0';
             cpu6502_x_alias[0] = '\0';
-        } else {
-            strcpy(cpu6502_x_alias, operand);
-        }
-    } else if (strcmp(mnemonic, "STY") == 0) {
-        if (strchr(operand, ',') != NULL) {
+            cpu6502_y_value[0] = '\0';
             cpu6502_y_alias[0] = '\0';
-        } else {
-            strcpy(cpu6502_y_alias, operand);
+            cpu6502_pointer_alias[0] = '\0';
+            cpu6502_flag_z_valid = 0;
+            break;
+        case M6502_STA:
+            if (strchr(operand, ',') != NULL) {
+                cpu6502_a_alias[0] = '\0';
+            } else {
+                strcpy(cpu6502_a_alias, operand);
+            }
+            break;
+        case M6502_STX:
+            if (strchr(operand, ',') != NULL) {
+                cpu6502_x_alias[0] = '\0';
+            } else {
+                strcpy(cpu6502_x_alias, operand);
+            }
+            break;
+        case M6502_STY:
+            if (strchr(operand, ',') != NULL) {
+                cpu6502_y_alias[0] = '\0';
+            } else {
+                strcpy(cpu6502_y_alias, operand);
+            }
+            break;
+        case M6502_BEQ:
+        case M6502_BEQ_L:
+        case M6502_BNE:
+        case M6502_BNE_L:
+        case M6502_BCC:
+        case M6502_BCC_L:
+        case M6502_BCS:
+        case M6502_BCS_L:
+        case M6502_BMI:
+        case M6502_BPL:
+        case M6502_DB:
+        case M6502_DW:
+            /* Do nothing */
+            break;
+        default:
+            fprintf(stderr, "cpu6502_1op: not found mnemonic %s\n", mnemonic);
+            break;
+    }
+}
+
+/*
+ ** Multiply by a constant with shifts and adds, from the top bit down.
+ ** The original value is in temp (8-bit) or in temp2 (16-bit, the
+ ** high byte of the result is kept in temp).
+ **
+ ** With high set only the high byte of the 16-bit result is wanted,
+ ** and it is left in A.
+ */
+static void cpu6502_multiply(int value, int bits16, int high)
+{
+    int bit;
+    
+    bit = 0x8000;
+    while ((value & bit) == 0)
+        bit >>= 1;
+    while (bit >>= 1) {
+        cpu6502_1op("ASL", "A");
+        if (bits16)
+            cpu6502_1op("ROL", "temp");
+        if (value & bit) {
+            cpu6502_noop("CLC");
+            if (bits16 && high && bit == 1) {
+                cpu6502_1op("ADC", "temp2");
+                cpu6502_1op("LDA", "temp");
+                cpu6502_1op("ADC", "temp2+1");
+                return;
+            }
+            if (bits16) {
+                cpu6502_1op("ADC", "temp2");
+                cpu6502_noop("TAX");
+                cpu6502_1op("LDA", "temp");
+                cpu6502_1op("ADC", "temp2+1");
+                cpu6502_1op("STA", "temp");
+                cpu6502_noop("TXA");
+            } else {
+                cpu6502_1op("ADC", "temp");
+            }
         }
-    } else if (strcmp(mnemonic, "BEQ") == 0 || strcmp(mnemonic, "BEQ.L") == 0
-               || strcmp(mnemonic, "BNE") == 0 || strcmp(mnemonic, "BNE.L") == 0
-               || strcmp(mnemonic, "BCC") == 0 || strcmp(mnemonic, "BCC.L") == 0
-               || strcmp(mnemonic, "BCS") == 0 || strcmp(mnemonic, "BCS.L") == 0
-               || strcmp(mnemonic, "BMI") == 0 || strcmp(mnemonic, "BPL") == 0
-               || strcmp(mnemonic, "DB") == 0 || strcmp(mnemonic, "DW") == 0) {
-        /* Do nothing */
-    } else {
-        fprintf(stderr, "cpu6502_1op: not found mnemonic %s\n", mnemonic);
     }
+    if (high)
+        cpu6502_1op("LDA", "temp");
 }
 
 /*
@@ -403,6 +1201,11 @@ void cpu6502_node_label(struct node *node)
                 node->regs = node->left->regs;
                 break;
             }
+            if (node->type == N_MUL8 && node->right->type == N_NUM8 && node->right->value > 2) {
+                cpu6502_node_label(node->left);
+                node->regs = node->left->regs | REG_TEMP;
+                break;
+            }
             if (node->type == N_DIV8 && node->right->type == N_NUM8 && is_power_of_two(node->right->value)) {
                 cpu6502_node_label(node->left);
                 node->regs = node->left->regs;
@@ -604,7 +1407,7 @@ void cpu6502_node_label(struct node *node)
                     explore = node->right;
                 else
                     explore = NULL;
-                if (explore != NULL && (explore->value == 0 || explore->value == 1 || is_power_of_two(explore->value))) {
+                if (explore != NULL && (explore->value == 0 || explore->value == 1 || is_cheap_multiply(explore->value))) {
                     c = explore->value;
                     if (c == 0) {
                         node->regs = REG_ACC | REG_Y;
@@ -619,7 +1422,7 @@ void cpu6502_node_label(struct node *node)
                             node->regs = explore->regs;
                             break;
                         }
-                        if (c >= 256) {
+                        if ((c & 0xff) == 0) {
                             if (explore->type == N_EXTEND8 || explore->type == N_EXTEND8S) {
                                 cpu6502_node_label(explore->left);
                                 explore->regs = explore->left->regs | REG_Y;
@@ -632,6 +1435,8 @@ void cpu6502_node_label(struct node *node)
                             cpu6502_node_label(explore);
                         }
                         node->regs = explore->regs;
+                        if (c > 1 && !is_power_of_two(c))
+                            node->regs |= REG_X | REG_Y | REG_TEMP;
                     }
                     break;
                 }
@@ -642,6 +1447,11 @@ void cpu6502_node_label(struct node *node)
                     node->regs = node->left->regs | REG_TEMP;
                     break;
                 }
+                if (node->right->type == N_NUM16 && node->right->value == 256) {
+                    cpu6502_node_label(node->left);
+                    node->regs = node->left->regs | REG_ACC | REG_Y;
+                    break;
+                }
             }
             if (node->type == N_LESSEQUAL16 || node->type == N_GREATER16) {
                 if (node->left->type == N_NUM16) {
@@ -689,6 +1499,9 @@ void cpu6502_node_label(struct node *node)
             } else if (node->type == N_EQUAL16 || node->type == N_NOTEQUAL16) {
                 if (!stack)
                     node->regs |= REG_TEMP;
+            } else if (node->type == N_MUL16 || node->type == N_DIV16 || node->type == N_MOD16
+                       || node->type == N_DIV16S || node->type == N_MOD16S) {
+                node->regs |= REG_X | REG_TEMP;     /* The operand goes in temp */
             } else {
                 node->regs |= REG_X;
             }
@@ -777,6 +1590,20 @@ void cpu6502_node_generate(struct node *node, int decision)
             cpu6502_1op("LDY", "#0");
             break;
         case N_REDUCE16:    /* Reduce 16-bit value to 8-bit */
+            explore = node->left;
+            if (explore->type == N_DIV16 && explore->right->type == N_NUM16 && explore->right->value == 256
+                && explore->left->type == N_MUL16 && explore->left->right->type == N_NUM16) {
+                c = explore->left->right->value;
+                if (c > 2 && (c & 0xff) != 0 && !is_power_of_two(c) && is_cheap_multiply(c)) {
+                    /* High byte of the product is already in temp */
+                    cpu6502_node_generate(explore->left->left, 0);
+                    cpu6502_1op("STA", "temp2");
+                    cpu6502_1op("STY", "temp2+1");
+                    cpu6502_1op("STY", "temp");
+                    cpu6502_multiply(c, 1, 1);
+                    break;
+                }
+            }
             cpu6502_node_generate(node->left, 0);
             break;
         case N_READ8:   /* Read 8-bit value */
@@ -926,6 +1753,12 @@ void cpu6502_node_generate(struct node *node, int decision)
                 }
                 break;
             }
+            if (node->type == N_MUL8 && node->right->type == N_NUM8 && node->right->value > 2) {
+                cpu6502_node_generate(node->left, 0);
+                cpu6502_1op("STA", "temp");
+                cpu6502_multiply(node->right->value & 0xff, 0, 0);
+                break;
+            }
             if (node->type == N_DIV8 && node->right->type == N_NUM8 && is_power_of_two(node->right->value)) {
                 cpu6502_node_generate(node->left, 0);
                 c = node->right->value;
@@ -1472,7 +2305,7 @@ void cpu6502_node_generate(struct node *node, int decision)
                     explore = node->right;
                 else
                     explore = NULL;
-                if (explore != NULL && (explore->value == 0 || explore->value == 1 || is_power_of_two(explore->value))) {
+                if (explore != NULL && (explore->value == 0 || explore->value == 1 || is_cheap_multiply(explore->value))) {
                     c = explore->value;
                     if (c == 0) {
                         cpu6502_1op("LDA", "#0");
@@ -1490,7 +2323,7 @@ void cpu6502_node_generate(struct node *node, int decision)
                             cpu6502_noop("INY");
                             break;
                         }
-                        if (c >= 256) {
+                        if ((c & 0xff) == 0) {
                             if (node->type == N_EXTEND8 || node->type == N_EXTEND8S) {
                                 cpu6502_node_generate(node->left, 0);
                                 cpu6502_noop("TAY");
@@ -1504,6 +2337,14 @@ void cpu6502_node_generate(struct node *node, int decision)
                         } else {
                             cpu6502_node_generate(node, 0);
                         }
+                        if (c > 1 && !is_power_of_two(c)) {
+                            cpu6502_1op("STA", "temp2");
+                            cpu6502_1op("STY", "temp2+1");
+                            cpu6502_1op("STY", "temp");
+                            cpu6502_multiply(c, 1, 0);
+                            cpu6502_1op("LDY", "temp");
+                            break;
+                        }
                         cpu6502_1op("STY", "temp");
                         while (c > 1) {
                             cpu6502_1op("ASL", "A");
@@ -1528,6 +2369,12 @@ void cpu6502_node_generate(struct node *node, int decision)
                     cpu6502_1op("LDY", "temp");
                     break;
                 }
+                if (node->right->type == N_NUM16 && node->right->value == 256) {
+                    cpu6502_node_generate(node->left, 0);
+                    cpu6502_noop("TYA");
+                    cpu6502_1op("LDY", "#0");
+                    break;
+                }
             }
             if (node->type == N_LESSEQUAL16 || node->type == N_GREATER16) {
                 if (node->left->type == N_NUM16) {
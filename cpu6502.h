@@ -11,11 +11,29 @@
 #define REG_Y     4
 #define REG_TEMP  8
 
+/*
+ ** Opcodes in the instruction stream (sorted by mnemonic)
+ */
+enum m6502_opcode {
+    M6502_ADC, M6502_AND, M6502_ASL, M6502_BCC, M6502_BCC_L, M6502_BCS, M6502_BCS_L, M6502_BEQ, M6502_BEQ_L, M6502_BMI,
+    M6502_BNE, M6502_BNE_L, M6502_BPL, M6502_CLC, M6502_CLI, M6502_CMP, M6502_CPX, M6502_CPY, M6502_DB, M6502_DEC,
+    M6502_DEX, M6502_DEY, M6502_DW, M6502_EOR, M6502_FORG, M6502_INC, M6502_INX, M6502_INY, M6502_JMP, M6502_JSR,
+    M6502_LDA, M6502_LDX, M6502_LDY, M6502_LSR, M6502_ORA, M6502_ORG, M6502_PHA, M6502_PLA, M6502_ROL, M6502_ROR,
+    M6502_RTS, M6502_SBC, M6502_SEC, M6502_SEI, M6502_STA, M6502_STX, M6502_STY, M6502_TAX, M6502_TAY, M6502_TXA,
+    M6502_TYA,
+};
+
 extern void cpu6502_dump(void);
 extern void cpu6502_label(char *);
 extern void cpu6502_empty(void);
 extern void cpu6502_noop(char *);
 extern void cpu6502_1op(char *, char *);
+extern void cpu6502_relax(void);
+extern int cpu6502_stack(int, char **);
+extern char *cpu6502_store(int, char *);
+extern int cpu6502_for_register(int, char *, char *);
+extern int cpu6502_index(int, char *, char *, int *);
+extern int cpu6502_for_pointer(int, char *, char *, char *, int);
 
 extern void cpu6502_node_label(struct node *);
 extern void cpu6502_node_generate(struct node *, int);
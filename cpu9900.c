@@ -12,7 +12,9 @@
 #include <stdlib.h>
 #include "cvbasic.h"
 #include "node.h"
+#include "inst.h"
 #include "cpu9900.h"
+#include "stats.h"
 
 #define REG_ALL  (REG_0 | REG_1 | REG_2 | REG_3 | REG_4 | REG_5 | REG_6 | REG_7)
 
@@ -28,39 +30,44 @@
 #define ADDRESS 4
 
 /*
- ** If enabled, replaced code from emit_line will be commented out in the assembler output
+ ** If enabled, the peephole optimizer leaves a comment in the assembler output
  */
 /*#define DEBUGPEEP*/
 
+/*
+ ** Mnemonics (sorted, it must match enum tms9900_opcode)
+ */
+static char *cpu9900_mnemonics[] = {
+    "a", "ab", "abs", "ai", "andi", "b", "bank", "bl", "bss", "c",
+    "cb", "ci", "clr", "data", "dec", "dect", "div", "even", "inc", "inct",
+    "inv", "jeq", "jh", "jhe", "jl", "jle", "jmp", "jne", "li", "limi",
+    "mov", "movb", "mpy", "neg", "ori", "s", "sb", "seto", "sla", "soc",
+    "socb", "sra", "src", "srl", "swpb", "szc", "szcb", "xor",
+};
+
 /*
  ** Some tracking for peepholes
  */
-static char cpu9900_line[MAX_LINE_SIZE] = "";
-static char cpu9900_lastline[MAX_LINE_SIZE] = "";
-static char cpu9900_lastline2[MAX_LINE_SIZE] = "";
-static char cpu9900_lastline3[MAX_LINE_SIZE] = "";
-static char cpu9900_lastline4[MAX_LINE_SIZE] = "";
 static char last_r0_load[MAX_LINE_SIZE] = "";
-static size_t pushpos = 0;
-static size_t loadr0pos = 0;
-static size_t lastclr = 0;
-static size_t movtor0 = 0;
-static char op1[128], op2[128], op3[128], op4[128];
-static char s1[128], s2[128], s3[128], s4[128], s5[128], s6[128], s7[128], s8[128];
 
-static void cpu9900_emit_line(void);
-static void nomatch(char *);
+static int cpu9900_opcode(char *);
+static void cpu9900_emit(enum inst_type, char *, char *);
 static int getargument(char *src, char *dest, int start);
-static int skipcomma(char *src, int start);
-static void parseline(char *buf, char *op, char *s1, char *s2);
-static int loadsr0(char *op, char *s1, char *s2);
+static int loadsr0(int op, char *s1, char *s2);
+static int writesr0(int op, char *s1, char *s2);
+static void cpu9900_history(int index, int *op, char **s1, char **s2);
+static void cpu9900_note(char *);
+static int cpu9900_match(int, int, char *, char *);
+static void cpu9900_replace(int, int, char *, char *);
+static void cpu9900_copy_r0(void);
+static void cpu9900_multiply(int);
 
-// set to a unique string that will never match
-void nomatch(char *src)
+/*
+ ** Get the opcode for a mnemonic
+ */
+int cpu9900_opcode(char *mnemonic)
 {
-    static int nomatch = 0;
-    
-    sprintf(src,"nomatch%d", ++nomatch);
+    return inst_lookup(cpu9900_mnemonics, sizeof(cpu9900_mnemonics) / sizeof(char *), mnemonic);
 }
 
 // parse a string to extract one assembly argument
@@ -70,11 +77,6 @@ int getargument(char *src, char *dest, int start)
     
     src += start;
     
-    if (strlen(src) > 127) {
-        nomatch(dest);
-        return 0;
-    }
-    
     while (*src != '\0' && *src <= ' ')
         ++src;
     
@@ -87,79 +89,103 @@ int getargument(char *src, char *dest, int start)
 }
 
 /*
- ** Returns the character AFTER the comma
+ ** Return true if a load loads r0
  */
-int skipcomma(char *src, int start)
+int loadsr0(int op, char *s1, char *s2)
 {
-    char *p = src;
-    
-    src += start;
-    while (*src != '\0' && *src != ',')
-        ++src;
-    if (*src == ',')
-        ++src; /* skip past */
-    return (int) (src - p);
+    if ( ((op == TMS9900_LI) && (0 == strcmp(s1,"r0"))) ||
+         ((op == TMS9900_MOV || op == TMS9900_MOVB) && (0 == strcmp(s2,"r0"))) ||
+         ((op == TMS9900_CLR) && (0 == strcmp(s1,"r0"))) ||
+         ((op == TMS9900_SETO) && (0 == strcmp(s1,"r0"))) ) {
+         return 1;
+    } else {
+        return 0;
+    }
 }
 
 /*
- ** Break up a string into opcode, arg1, arg2.
- ** Do not pass comments to this function.
+ ** Return true if an instruction changes r0
  */
-void parseline(char *buf, char *op, char *s1, char *s2)
+int writesr0(int op, char *s1, char *s2)
 {
-    int p = 0;
-    
-    while (buf[p] != '\0' && buf[p] <= ' ')
-        ++p;
-    
-    if (buf[p] == ';' || buf[p]=='*' || buf[p] == '\0') {
-        /* Comment line */
-        nomatch(op);
-        nomatch(s1);
-        nomatch(s2);
-    } else if (buf[0] > ' ') {
-        /*
-         ** label - we don't generate lines with both label and opcode
-         ** but we'll copy the label so it looks like an opcode
-         */
-        getargument(buf, op, p);
-        nomatch(s1);
-        nomatch(s2);
-    } else {
-        p = getargument(buf, op, p);    /* get opcode */
-        p = getargument(buf, s1, p);    /* first arg */
-        p = skipcomma(buf, p);
-        p = getargument(buf, s2, p);    /* second arg */
+    switch (op) {
+        case TMS9900_C:
+        case TMS9900_CB:
+        case TMS9900_CI:
+            return 0;
+        case TMS9900_A:
+        case TMS9900_AB:
+        case TMS9900_S:
+        case TMS9900_SB:
+        case TMS9900_SOC:
+        case TMS9900_SOCB:
+        case TMS9900_SZC:
+        case TMS9900_SZCB:
+        case TMS9900_MOV:
+        case TMS9900_MOVB:
+        case TMS9900_MPY:
+        case TMS9900_DIV:
+        case TMS9900_XOR:
+            return strcmp(s2, "r0") == 0;
+        default:
+            return strcmp(s1, "r0") == 0;
     }
 }
 
 /*
- ** Return true if a load loads r0
+ ** Get the opcode and arguments of a previous entry in the stream
  */
-int loadsr0(char *op, char *s1, char *s2)
+void cpu9900_history(int index, int *op, char **s1, char **s2)
 {
-    if ( ((0 == strcmp(op,"li")) && (0 == strcmp(s1,"r0"))) ||
-         ((0 == strncmp(op,"mov",3)) && (0 == strcmp(s2,"r0"))) ||
-         ((0 == strcmp(op,"clr")) && (0 == strcmp(s1,"r0"))) ||
-         ((0 == strcmp(op,"seto")) && (0 == strcmp(s1,"r0"))) ) {
-         return 1;
-    } else {
-        return 0;
+    if (index < 0 || inst_stream[index].type != INST_OP) {
+        *op = -2;   /* Never matches */
+        *s1 = "";
+        *s2 = "";
+        return;
     }
+    *op = inst_stream[index].opcode;
+    *s1 = inst_string(inst_stream[index].operand[0]);
+    *s2 = inst_string(inst_stream[index].operand[1]);
+}
+
+/*
+ ** Leave a comment about an optimization
+ */
+void cpu9900_note(char *note)
+{
+    stats_rule(note);
+#ifdef DEBUGPEEP
+    inst_printf("\t;PEEP: %s\n", note);
+    inst_stream[inst_count - 1].type = INST_COMMENT;
+#endif
 }
 
-// Final emit phase. Some peephole optimizations can be placed here
-// TODO: the roll-back and rewrite approach this uses can cause
-// BASIC source lines to be discarded in the assembly output. No
-// practical effect but could be occasionally annoying.
-void cpu9900_emit_line(void)
+// Final emit phase. Some peephole optimizations can be placed here.
+// The lines arrive as separate opcode and arguments, and the
+// previous lines are read back from the instruction stream.
+void cpu9900_emit(enum inst_type type, char *mnemonic, char *operands)
 {
     // xdt99 doesn't like '#' in labels, it has meaning, so map it to _
     char buf[MAX_LINE_SIZE];
-    char *p = buf;
+    char s1[MAX_LINE_SIZE], s2[MAX_LINE_SIZE];
+    char *s3, *s4, *s5, *s6, *s7, *s8;
+    char *suffix;
+    char *p;
+    int op1, op2, op3, op4;
+    int h1, h2, h3;
+    int out_op;
+    char *out_s1;
+    char *out_s2;
+    char *out_mnemonic;
+    int index;
+    int c;
 
-    strncpy(buf, cpu9900_line, MAX_LINE_SIZE);
-    buf[MAX_LINE_SIZE-1]='\0';
+    if (operands != NULL) {
+        strcpy(buf, operands);
+    } else {
+        buf[0] = '\0';
+    }
+    p = buf;
     while (p != NULL) {
         p = strchr(p, '#');
         if (NULL != p) {
@@ -167,360 +193,275 @@ void cpu9900_emit_line(void)
         }
     }
 
-    // We check both 0 and 1 because some lines are "; comment" and some are "\t; comment"
-    if ((buf[0] != ';')&&(buf[1] != ';')) {
-        parseline(buf, op1, s1, s2);
-        parseline(cpu9900_lastline, op2, s3, s4);
-        parseline(cpu9900_lastline2, op3, s5, s6);
-        parseline(cpu9900_lastline3, op4, s7, s8);
-        // note: lastline4 is only for recovery from a stack pop, we don't need to parse it
-        
-        // there's some simple things we can check for
-        
-        // Replace immediate operations for select cases
-        if ((0 == strcmp(op1,"li")) && (s1[0] == 'r') && (0 == strcmp(s2,"0"))) {
-            sprintf(buf, "\tclr %s\n", s1);
-            fflush(output);
-            lastclr = ftell(output);
-        } else if ((0 == strcmp(op1,"ai")) && (0 == strcmp(s1,"r0")) && (0 == strcmp(s2,"0"))) {
-#ifdef DEBUGPEEP
-            fprintf(output, "\t;PEEP: don't add zero\n");
-            fprintf(output, "\t;ai r0,0\n");    // doesn't count as a line anymore
-#endif
+    if (type == INST_LABEL) {
+        // labels cancel all bets
+        strcpy(last_r0_load, "");
+        inst_add(INST_LABEL, -1, buf);
+        return;
+    }
+    
+    // separate the arguments, keeping any trailing comment apart
+    op1 = cpu9900_opcode(mnemonic);
+    c = getargument(buf, s1, 0);
+    if (buf[c] == ',')
+        c = getargument(buf, s2, c + 1);
+    else
+        s2[0] = '\0';
+    suffix = &buf[c];
+    if (*suffix != '\0' && !isspace(*suffix)) {
+        // something we don't understand, keep it as a whole
+        strcpy(s1, buf);
+        s2[0] = '\0';
+        suffix = "";
+    }
+    out_op = op1;
+    out_mnemonic = mnemonic;
+    out_s1 = s1;
+    out_s2 = s2;
+
+    // the last three lines
+    h1 = inst_last();
+    h2 = (h1 >= 0) ? inst_previous(h1) : -1;
+    h3 = (h2 >= 0) ? inst_previous(h2) : -1;
+    cpu9900_history(h1, &op2, &s3, &s4);
+    cpu9900_history(h2, &op3, &s5, &s6);
+    cpu9900_history(h3, &op4, &s7, &s8);
+
+    // there's some simple things we can check for
+    
+    // Replace immediate operations for select cases
+    if ((op1 == TMS9900_LI) && (s1[0] == 'r') && (0 == strcmp(s2,"0"))) {
+        cpu9900_note("clear instead of load zero");
+        out_op = TMS9900_CLR;
+        out_s2 = "";
+    } else if ((op1 == TMS9900_AI) && (0 == strcmp(s1,"r0")) && (0 == strcmp(s2,"0"))) {
+        cpu9900_note("don't add zero");
+        return;
+    } else if ((op1 == TMS9900_AI) && (0 == strcmp(s1,"r0")) && (0 == strcmp(s2,"1"))) {
+        cpu9900_note("inc instead of add immediate");
+        out_op = TMS9900_INC;
+        out_s2 = "";
+    } else if ((op1 == TMS9900_AI) && (0 == strcmp(s1,"r0")) && (0 == strcmp(s2,"2"))) {
+        cpu9900_note("inct instead of add immediate");
+        out_op = TMS9900_INCT;
+        out_s2 = "";
+    } else if ((op1 == TMS9900_AI) && (0 == strcmp(s1,"r0")) && (0 == strcmp(s2,"-1"))) {
+        cpu9900_note("dec instead of add immediate");
+        out_op = TMS9900_DEC;
+        out_s2 = "";
+    } else if ((op1 == TMS9900_AI) && (0 == strcmp(s1,"r0")) && (0 == strcmp(s2,"-2"))) {
+        cpu9900_note("dect instead of add immediate");
+        out_op = TMS9900_DECT;
+        out_s2 = "";
+    }
+
+    // remove second half of mov a,b / mov b,a, which happens a lot
+    // are last two both movs of the same size?
+    if ((op1 == TMS9900_MOV || op1 == TMS9900_MOVB) && (op1 == op2)) {
+        // yes. see if they are using the same source and dest (in either order)
+        if (
+            ((0 == strcmp(s1,s3)) || (0 == strcmp(s1, s4))) &&
+            ((0 == strcmp(s2,s3)) || (0 == strcmp(s2, s4)))
+           ) {
+            cpu9900_note("skip second step of mov a,b / mov b,a");
             return;
-        } else if ((0 == strcmp(op1,"ai")) && (0 == strcmp(s1,"r0")) && (0 == strcmp(s2,"1"))) {
-            strcpy(buf, "\tinc r0\n");
-        } else if ((0 == strcmp(op1,"ai")) && (0 == strcmp(s1,"r0")) && (0 == strcmp(s2,"2"))) {
-            strcpy(buf, "\tinct r0\n");
-        } else if ((0 == strcmp(op1,"ai")) && (0 == strcmp(s1,"r0")) && (0 == strcmp(s2,"-1"))) {
-            strcpy(buf, "\tdec r0\n");
-        } else if ((0 == strcmp(op1,"ai")) && (0 == strcmp(s1,"r0")) && (0 == strcmp(s2,"-2"))) {
-            strcpy(buf, "\tdect r0\n");
         }
+    }
     
-        // remove second half of mov a,b / mov b,a, which happens a lot
-        // all bets are off if there is a label, but try to catch comments
-        // are last two both movs?
-        if ((0 == strncmp(op1, "mov", 3)) && (0 == strncmp(op2, "mov", 3))) {
-            // yes, are they both the same size?
-            if (op1[3] == op2[3]) {
-                // yes. see if they are using the same source and dest (in either order)
-                if (
-                    ((0 == strcmp(s1,s3)) || (0 == strcmp(s1, s4))) &&
-                    ((0 == strcmp(s2,s3)) || (0 == strcmp(s2, s4)))
-                   ) {
-#ifdef DEBUGPEEP                   
-                   // drop this one
-                   fprintf(output, "\t;PEEP: skip second step of mov a,b / mov b,a\n");
-                   fprintf(output, "\t;%s", &buf[2]);
-#endif 
-                   return;
-                }
+    // check for mov[b] xxx,r0 / clr r1 / c[b] r1,r0 - the mov[b] is enough
+    if (((op3 == TMS9900_MOV && op1 == TMS9900_C) || (op3 == TMS9900_MOVB && op1 == TMS9900_CB))
+        && (op2 == TMS9900_CLR) && (0 == strcmp(s2,s6)) && (0 == strcmp(s1,s3))) {
+        // all three opcodes match, the registers compared match, and byte/word matches
+        // We can drop the clr and compare
+        cpu9900_note("skip clr and compare for zero test after move");
+        inst_delete(h1);
+        return;
+    }
+    
+    // look for push/pop - happens sometimes, mostly around immediates due to the
+    // simplified process handling I coded. But it's an easy fix.
+    // We have both r1 and r0 sequences
+    if ( ((op3 == TMS9900_DECT) && (0 == strcmp(s5,"r10"))) && 
+         ((op2 == TMS9900_MOV) && (0 == strcmp(s3,"r1")) && (0 == strcmp(s4,"*r10"))) &&
+         ((op1 == TMS9900_MOV) && (0 == strcmp(s1,"*r10+")) && (0 == strcmp(s2,"r1"))) ) {
+        cpu9900_note("skip push/pop r1");
+        inst_delete(h2);
+        inst_delete(h1);
+        return;
+    } else if ( ((op3 == TMS9900_DECT) && (0 == strcmp(s5,"r10"))) && 
+                ((op2 == TMS9900_MOV) && (0 == strcmp(s3,"r0")) && (0 == strcmp(s4,"*r10"))) &&
+                ((op1 == TMS9900_MOV) && (0 == strcmp(s1,"*r10+")) && (0 == strcmp(s2,"r0"))) ) {
+        cpu9900_note("skip push/pop r0");
+        inst_delete(h2);
+        inst_delete(h1);
+        return;
+    }
+ 
+    // similar case, but push/pop to different regs - only seen r0->r1 so I'll just code for that
+    if ( ((op3 == TMS9900_DECT) && (0 == strcmp(s5,"r10"))) && 
+         ((op2 == TMS9900_MOV) && (0 == strcmp(s3,"r0")) && (0 == strcmp(s4,"*r10"))) &&
+         ((op1 == TMS9900_MOV) && (0 == strcmp(s1,"*r10+")) && (0 == strcmp(s2,"r1"))) ) {
+        cpu9900_note("simplify push r0/pop r1");
+        inst_delete(h2);
+        inst_delete(h1);
+        out_s1 = "r0";
+        out_s2 = "r1";
+    }        
+    
+    // check for repeated absolute loads. Doesn't happen very often, but the savings is worth it
+    // We can try to get smarter with the registers like the other ports later...
+    if (op1 == TMS9900_MOV && strcmp(s2, "r0") == 0) {
+        // is the source the same as remembered?
+        if ((0 == strcmp(s1,last_r0_load)) && (last_r0_load[0] != '\0')) {
+            // then never mind this one
+            cpu9900_note("skip repeated r0 load");
+            return;
+        } else if (s1[0] == '@') {
+            // remember only addressed loads without offset
+            if (NULL != strchr(s1,'(')) {
+                strcpy(last_r0_load, "");
+            } else {
+                strcpy(last_r0_load, s1);
             }
+        } else {
+            strcpy(last_r0_load, "");
         }
-        
-        // check for mov[b] xxx,r0 / clr r1 / c[b] r1,r0 - the mov[b] is enough
-        if ((0 == strncmp(op3,"mov",3)) && (0 == strcmp(op2,"clr")) && (op1[0] == 'c')
-           && (0 == strcmp(s2,s6)) && (0 == strcmp(s1,s3)) && (op3[3] == op1[1])) {
-            // all three opcodes match, the registers compared match, and byte/word matches
-            // We can drop the clr and compare
-            fseek(output, lastclr, SEEK_SET);
-#ifdef DEBUGPEEP
-            fprintf(output, "\t;PEEP: skip clr and compare for zero test after move\n");
-            fprintf(output, "\t;%s %s\n",op2,s3);
-            fprintf(output, "\t;%s %s,%s\n",op1,s1,s2);
-#endif
-            // remove one line from history
-            strcpy(cpu9900_lastline, cpu9900_lastline2);
-            strcpy(cpu9900_lastline2, cpu9900_lastline3);
-            strcpy(cpu9900_lastline3, cpu9900_lastline4);
-            strcpy(cpu9900_lastline4, "");
-            return;
+    } else if (writesr0(op1, s1, s2)) {
+        strcpy(last_r0_load, "");
+    } else if (op1 == TMS9900_BL) {
+        // and bl - all bets are off
+        strcpy(last_r0_load, "");
+    } else if (last_r0_load[0] != '\0') {
+        // a write to the remembered address (or through a pointer) invalidates it
+        if (op1 == TMS9900_MOV || op1 == TMS9900_MOVB || op1 == TMS9900_A || op1 == TMS9900_AB ||
+            op1 == TMS9900_S || op1 == TMS9900_SB || op1 == TMS9900_SOC || op1 == TMS9900_SOCB ||
+            op1 == TMS9900_SZC || op1 == TMS9900_SZCB) {
+            p = s2;
+        } else {
+            p = s1;
         }
-        
-        // look for push/pop - happens sometimes, mostly around immediates due to the
-        // simplified process handling I coded. But it's an easy fix. We remember where
-        // we saw the dect r10 which might indicate the start of the sequence. If it completes,
-        // we back up and rewrite those lines as comments to show what we removed
-        // We have both r1 and r0 sequences
-        if ((0 == strcmp(op1,"dect")) && (0 == strcmp(s1,"r10"))) {
-            fflush(output);
-            pushpos = ftell(output);
-        } else if ( ((0 == strcmp(op3,"dect")) && (0 == strcmp(s5,"r10"))) && 
-                    ((0 == strcmp(op2,"mov")) && (0 == strcmp(s3,"r1")) && (0 == strcmp(s4,"*r10"))) &&
-                    ((0 == strcmp(op1,"mov")) && (0 == strcmp(s1,"*r10+")) && (0 == strcmp(s2,"r1"))) ) {
-            fflush(output);
-            fseek(output, pushpos, SEEK_SET);
-            // update history - we should have JUST enough for the largest pattern
-            strcpy(cpu9900_lastline, cpu9900_lastline3);
-            strcpy(cpu9900_lastline2, cpu9900_lastline4);
-            strcpy(cpu9900_lastline3, "");
-            strcpy(cpu9900_lastline4, "");
-#ifdef DEBUGPEEP
-            fprintf(output, "\t;PEEP: skip push/pop r1\n");
-            fprintf(output, "\t;dect r10\n\t;mov r1,*r10\n\t;mov *r10+,r1\n");
-#endif
-            return;
-        } else if ( ((0 == strcmp(op3,"dect")) && (0 == strcmp(s5,"r10"))) && 
-                    ((0 == strcmp(op2,"mov")) && (0 == strcmp(s3,"r0")) && (0 == strcmp(s4,"*r10"))) &&
-                    ((0 == strcmp(op1,"mov")) && (0 == strcmp(s1,"*r10+")) && (0 == strcmp(s2,"r0"))) ) {
-            fflush(output);
-            fseek(output, pushpos, SEEK_SET);
-            // update history - we should have JUST enough for the largest pattern
-            strcpy(cpu9900_lastline, cpu9900_lastline3);
-            strcpy(cpu9900_lastline2, cpu9900_lastline4);
-            strcpy(cpu9900_lastline3, "");
-            strcpy(cpu9900_lastline4, "");
-#ifdef DEBUGPEEP            
-            fprintf(output, "\t;PEEP: skip push/pop r0\n");
-            fprintf(output, "\t;ect r10\n\t;ov r0,*r10\n\t;ov *r10+,r0\n");
-#endif
-            return;
+        if (0 == strcmp(p, last_r0_load) || p[0] == '*' || strchr(p, '(') != NULL) {
+            if (!(op1 == TMS9900_MOV && 0 == strcmp(s1, "r0") && 0 == strcmp(p, last_r0_load)))
+                strcpy(last_r0_load, "");
         }
- 
-        // similar case, but push/pop to different regs - only seen r0->r1 so I'll just code for that
-        if ( ((0 == strcmp(op3,"dect")) && (0 == strcmp(s5,"r10"))) && 
-                    ((0 == strcmp(op2,"mov")) && (0 == strcmp(s3,"r0")) && (0 == strcmp(s4,"*r10"))) &&
-                    ((0 == strcmp(op1,"mov")) && (0 == strcmp(s1,"*r10+")) && (0 == strcmp(s2,"r1"))) ) {
-            fflush(output);
-            fseek(output, pushpos, SEEK_SET);
-            // update history - we should have JUST enough for the largest pattern
-            strcpy(cpu9900_lastline, cpu9900_lastline3);
-            strcpy(cpu9900_lastline2, cpu9900_lastline4);
-            strcpy(cpu9900_lastline3, "");
-            strcpy(cpu9900_lastline4, "");
-#ifdef DEBUGPEEP
-            fprintf(output, "\t;PEEP: simplify push r0/pop r1\n");
-            fprintf(output, "\t;ect r10\n\t;ov r0,*r10\n\t;ov *r10+,r1\n");
-#endif
-            strcpy(buf,"\tmov r0,r1\n");
-        }        
-        
-        // check for repeated absolute loads. Doesn't happen very often, but the savings is worth it
-        // first check - labels cancels all bets. We can try to get smarter with the registers like
-        // the other ports later...
-        if (buf[0] > ' ') {
+    }
+    
+    // optimize loading a value into r0 then moving it into another register (r1 or r2)
+    // we can check for li, mov, clr or seto
+    if (loadsr0(op1, s1, s2)) {
+        /* Nothing to do */
+    } else if (loadsr0(op2, s3, s4)) {
+        if ((op1 == TMS9900_MOV || op1 == TMS9900_MOVB) && (0 == strcmp(s1,"r0")) && (s2[0] == 'r') && (s2[1] != '0')) {
+            // change the last line to load r'X' (s2)
+            cpu9900_note("simplify load r0 / mov r0,rx");
+            inst_delete(h1);
             strcpy(last_r0_load, "");
-        } else {
-            // is r0 the target?
-            if (strcmp(op1, "mov") == 0 && strcmp(s2, "r0") == 0) {
-                // is the source the same as remembered?
-                if ((0 == strcmp(s1,last_r0_load)) && (last_r0_load[0] != '\0')) {
-                    // then never mind this one
-#ifdef DEBUGPEEP
-                    fprintf(output, "\t;PEEP: skip repeated r0 load\n");
-                    fprintf(output, "\t;%s", &buf[2]);
-#endif
-                    return;
-                } else if (s1[0] == '@') {
-                    // remember only addressed loads without offset
-                    if (NULL != strchr(s1,'(')) {
-                        strcpy(last_r0_load, "");
-                    } else {
-                        strcpy(last_r0_load, s1);
-                    }
-                } else {
-                    strcpy(last_r0_load, "");
-                }
-            } else if (strcmp(s2, "r0") == 0) {
-                if (strcmp(op1, "c") != 0 && strcmp(op1, "cb") != 0)
-                    strcpy(last_r0_load, "");
+            out_op = op2;
+            out_mnemonic = inst_string(inst_stream[h1].text);
+            if (op2 == TMS9900_MOV || op2 == TMS9900_MOVB) {
+                out_s1 = s3;
+                out_s2 = s2;
             } else {
-                // also check for ai
-                if ((strcmp(op1, "ai") == 0 || strcmp(op1, "andi") == 0 || strcmp(op1, "ori") == 0 || strcmp(op1, "sla") == 0 || strcmp(op1, "srl") == 0 || strcmp(op1, "src") == 0 || strcmp(op1, "sra") == 0) && strcmp(s1,"r0") == 0) {
-                    strcpy(last_r0_load, "");
-                }
-                // and bl - all bets are off
-                if (0 == strcmp(op1,"bl")) {
-                    strcpy(last_r0_load, "");
-                }
+                out_s1 = s2;
+                out_s2 = s4;
             }
         }
+    }
+    
+    // check for mov rx,r0 / sla r0,8 / movb r0,rx (reduce 16 bit to 8 bit) - we can sla directly
+    if ((op1 == TMS9900_MOVB) && (op2 == TMS9900_SLA) && (op3 == TMS9900_MOV) 
+        && (0 == strcmp(s5,s2)) && (s5[0] == 'r') && (0 == strcmp(s6,"r0")) && (0 == strcmp(s3,"r0"))
+        && (0 == strcmp(s4,"8")) && (0 == strcmp(s1,"r0"))) {
+        // replace the first mov with the sla
+        cpu9900_note("simplify demotion from 16 bit to 8 bit");
+        inst_delete(h2);
+        inst_delete(h1);
+        out_op = TMS9900_SLA;
+        out_s1 = s2;
+        out_s2 = "8";
+    }
+    
+    // specifically test for clr r0, then mov to an address (not movb!), we can then clear directly
+    if ((op2 == TMS9900_CLR) && (0 == strcmp(s3,"r0")) && 
+        (op1 == TMS9900_MOV) && (0 == strcmp(s1,"r0")) && (s2[0] == '@')) {
+        cpu9900_note("simplify clr r0 / mov r0,@xxx");
+        inst_delete(h1);
+        strcpy(last_r0_load, "");
+        out_op = TMS9900_CLR;
+        out_s1 = s2;
+        out_s2 = "";
+    }
+    
+    // specifically test for mov or movb to r0, them mov or movb to an address - we can move directly
+    if ((op2 == TMS9900_MOV || op2 == TMS9900_MOVB) && (0 == strcmp(s4,"r0")) && 
+        (op1 == TMS9900_MOV || op1 == TMS9900_MOVB) && (0 == strcmp(s1,"r0")) && (s2[0] == '@')) {
+        cpu9900_note("simplify mov xxx,r0 / mov r0,@xxx");
+        inst_delete(h1);
+        strcpy(last_r0_load, "");
+        out_s1 = s3;
+        out_s2 = s2;
+    }
+    
+    // check for mov @x,r0, inc r0, mov r0,@x - inc, inct, dec, dect
+    if ((op3 == TMS9900_MOV) && (s5[0] == '@') && (0 == strcmp(s6,"r0")) &&
+        (op2 == TMS9900_INC || op2 == TMS9900_INCT || op2 == TMS9900_DEC || op2 == TMS9900_DECT) && (0 == strcmp(s3,"r0")) &&
+        (op1 == TMS9900_MOV) && (0 == strcmp(s1,"r0")) && (s2[0] == '@') &&
+        (0 == strcmp(s5,s2))) {
+        // that was a lot, but it looks good!
+        cpu9900_note("simplify mov @x,r0 / inc r0 / mov r0,@x (all forms)");
+        inst_delete(h2);
+        inst_delete(h1);
+        strcpy(last_r0_load, "");
+        out_op = op2;
+        out_s1 = s2;
+        out_s2 = "";
+    }
+    
+    // 4 step sequence: mov[b] @x,r0 / li r1,>xx00 / a[b] r1,r0 / mov[b] r0,@x -> li r1,>xx00 / a[b] r1,@x
+    // I don't think we'd ever generate it using s[b]...
+    if ((op4 == TMS9900_MOV || op4 == TMS9900_MOVB) && (s7[0] == '@') && (0 == strcmp(s8,"r0")) &&
+        (op3 == TMS9900_LI) && (0 == strcmp(s5,"r1")) &&
+        (op2 == TMS9900_A || op2 == TMS9900_AB || op2 == TMS9900_S || op2 == TMS9900_SB) && (0 == strcmp(s3,"r1")) && (0 == strcmp(s4,"r0")) &&
+        (op1 == op4) && (0 == strcmp(s1,"r0")) && (s2[0] == '@') &&
+        (0 == strcmp(s7,s2)) ) {
+        cpu9900_note("simplify mov @x,r0 / li r1,>xxxx / a r1,r0 / mov r0,@x");
+        inst_delete(h3);
+        inst_delete(h2);
+        inst_delete(h1);
+        strcpy(last_r0_load, "");
         
-        // optimize loading a value into r0 then moving it into another register (r1 or r2)
-        // we can check for li, mov, clr or seto
-        if (loadsr0(op1, s1, s2)) {
-             fflush(output);
-             loadr0pos = ftell(output);
-        } else if (loadsr0(op2, s3, s4)) {
-            if ((0 == strncmp(op1,"mov",3)) && (0 == strcmp(s1,"r0")) && (s2[0] == 'r') && (s2[1] != '0')) {
-                // change the last line to load r'X' (s2)
-                fseek(output, loadr0pos, SEEK_SET);
-#ifdef DEBUGPEEP
-                char tmp[MAX_LINE_SIZE];
-                char old = cpu9900_lastline[1];
-                strcpy(tmp, buf);
-                cpu9900_lastline[0]=';';
-                tmp[0] = ';';
-                fprintf(output, "\t;PEEP: simplify load r0 / mov r0,rx\n");
-                fprintf(output, "\t%s\t%s", cpu9900_lastline, tmp);
-                cpu9900_lastline[1]=old;
-#endif
-                // remove one line from history
-                strcpy(cpu9900_lastline, cpu9900_lastline2);
-                strcpy(cpu9900_lastline2, cpu9900_lastline3);
-                strcpy(cpu9900_lastline3, cpu9900_lastline4);
-                strcpy(cpu9900_lastline4, "");
-                
-                if (0 == strncmp(op2,"mov",3)) {
-                    sprintf(buf, "\t%s %s,%s\n", op2, s3, s2);
-                } else {
-                    if (s4[0] == '\0') {
-                        sprintf(buf, "\t%s %s\n", op2, s2);
-                    } else {
-                        sprintf(buf, "\t%s %s,%s\n", op2, s2, s4);
-                    }
-                }
-            }
-        }
-        
-        // check for mov rx,r0 / sla r0,8 / movb r0,rx (reduce 16 bit to 8 bit) - we can sla directly
-        if ((0 == strcmp(op1,"mov")) && (s1[0]=='r') && (0 == strcmp(s2,"r0"))) {
-            fflush(output);
-            movtor0 = ftell(output);
-        } else if ((0 == strcmp(op1,"movb")) && (0 == strcmp(op2,"sla")) && (0 == strcmp(op3,"mov")) 
-            && (0 == strcmp(s5,s2)) && (0 == strcmp(s6,"r0")) && (0 == strcmp(s3,"r0"))
-            && (0 == strcmp(s4,"8")) && (0 == strcmp(s1,"r0"))) {
-            // roll back and replace the first mov with the sla
-            fseek(output, movtor0, SEEK_SET);
-#ifdef DEBUGPEEP
-            fprintf(output,"\t;PEEP: simplify demotion from 16 bit to 8 bit\n");
-            fprintf(output,"\t;%s %s,%s\n", op3,s5,s6);
-            fprintf(output,"\t;%s %s,%s\n", op2,s3,s4);
-            fprintf(output,"\t;%s %s,%s\n", op1,s1,s2);
-#endif
-            // remove one line from history
-            strcpy(cpu9900_lastline, cpu9900_lastline2);
-            strcpy(cpu9900_lastline2, cpu9900_lastline3);
-            strcpy(cpu9900_lastline3, cpu9900_lastline4);
-            strcpy(cpu9900_lastline4, "");
-            // new line
-            sprintf(buf,"\tsla %s,8\n", s2);
-        }
-        
-        // specifically test for clr r0, then mov to an address (not movb!), we can then clear directly
-        if ((0 == strcmp(op2,"clr")) && (0 == strcmp(s3,"r0")) && 
-            (0 == strcmp(op1,"mov")) && (0 == strcmp(s1,"r0")) && (s2[0] == '@')) {
-            fseek(output, loadr0pos, SEEK_SET);
-
-#ifdef DEBUGPEEP
-            char tmp[MAX_LINE_SIZE];
-            char old = cpu9900_lastline[1];
-            strcpy(tmp, buf);
-            cpu9900_lastline[1]=';';
-            tmp[1] = ';';
-            fprintf(output, "\t;PEEP: simplify clr r0 / mov r0,@xxx\n");
-            fprintf(output, "%s%s", cpu9900_lastline, tmp);
-#endif
-            
-            // remove one line from history
-            strcpy(cpu9900_lastline, cpu9900_lastline2);
-            strcpy(cpu9900_lastline2, cpu9900_lastline3);
-            strcpy(cpu9900_lastline3, cpu9900_lastline4);
-            strcpy(cpu9900_lastline4, "");
-
-            sprintf(buf, "\tclr %s\n", s2);
-        }
-        
-        // specifically test for mov or movb to r0, them mov or movb to an address - we can move directly
-        if ((0 == strncmp(op2,"mov",3)) && (0 == strcmp(s4,"r0")) && 
-            (0 == strncmp(op1,"mov",3)) && (0 == strcmp(s1,"r0")) && (s2[0] == '@')) {
-            fseek(output, loadr0pos, SEEK_SET);
-
-#ifdef DEBUGPEEP
-            char tmp[MAX_LINE_SIZE];
-            char old = cpu9900_lastline[1];
-            strcpy(tmp, buf);
-            cpu9900_lastline[1]=';';
-            tmp[1] = ';';
-            fprintf(output, "\t;PEEP: simplify mov xxx,r0 / mov r0,@xxx\n");
-            fprintf(output, "%s%s", cpu9900_lastline, tmp);
-#endif
-
-            // remove one line from history
-            strcpy(cpu9900_lastline, cpu9900_lastline2);
-            strcpy(cpu9900_lastline2, cpu9900_lastline3);
-            strcpy(cpu9900_lastline3, cpu9900_lastline4);
-            strcpy(cpu9900_lastline4, "");
-
-            sprintf(buf, "\t%s %s,%s\n", op1, s3, s2);
-        }
-        
-        // check for mov @x,r0, inc r0, mov r0,@x - inc, inct, dec, dect
-        if ((0 == strcmp(op3,"mov")) && (s5[0] == '@') && (0 == strcmp(s6,"r0")) &&
-            ((0 == strncmp(op2,"inc",3))||(0 == strncmp(op2,"dec",3))) && (0 == strcmp(s3,"r0")) &&
-            (0 == strcmp(op1,"mov")) && (0 == strcmp(s1,"r0")) && (s2[0] == '@') &&
-            (0 == strcmp(s5,s2))) {
-            // that was a lot, but it looks good!
-            fseek(output, loadr0pos, SEEK_SET);
-
-#ifdef DEBUGPEEP
-            char tmp[MAX_LINE_SIZE];
-            cpu9900_lastline2[1]=';';
-            cpu9900_lastline[1]=';';
-            strcpy(tmp, buf);
-            tmp[1]=';';
-            fprintf(output, "\t;PEEP: simplify mov @x,r0 / inc r0 / mov r0,@x (all forms)\n");
-            fprintf(output,"%s%s%s", cpu9900_lastline2, cpu9900_lastline, tmp);
-#endif
-
-            // remove two lines from history
-            strcpy(cpu9900_lastline, cpu9900_lastline3);
-            strcpy(cpu9900_lastline2, cpu9900_lastline4);
-            strcpy(cpu9900_lastline3, "");
-            strcpy(cpu9900_lastline4, "");
-
-            sprintf(buf,"\t%s %s\n", op2, s2);
-        }
-        
-        // 4 step sequence: mov[b] @x,r0 / li r1,>xx00 / a[b] r1,r0 / mov[b] r0,@x -> li r1,>xx00 / a[b] r1,@x
-        // I don't think we'd ever generate it using s[b]...
-        if ((0 == strncmp(op4,"mov",3)) && (s7[0] == '@') && (0 == strcmp(s8,"r0")) &&
-            (0 == strcmp(op3,"li")) && (0 == strcmp(s5,"r1")) &&
-            ((0 == strcmp(op2,"a"))||(0 == strcmp(op2,"ab"))||(0 == strcmp(op2,"s"))||(0 == strcmp(op2,"sb"))) && (0 == strcmp(s3,"r1")) && (0 == strcmp(s4,"r0")) &&
-            (0 == strncmp(op1,"mov",3)) && (0 == strcmp(s1,"r0")) && (s2[0] == '@') &&
-            (0 == strcmp(op4,op1)) && (0 == strcmp(s7,s2)) ) {
-            fseek(output, loadr0pos, SEEK_SET);
-
-#ifdef DEBUGPEEP
-            char tmp[MAX_LINE_SIZE];
-            cpu9900_lastline3[1]=';';
-            cpu9900_lastline2[1]=';';
-            cpu9900_lastline[1]=';';
-            strcpy(tmp, buf);
-            tmp[1]=';';
-            fprintf(output, "\t;PEEP: simplify mov @x,r0 / li r1,>xxxx / a r1,r0 / mov r0,@x\n");
-            fprintf(output,"%s%s%s%s", cpu9900_lastline3, cpu9900_lastline2, cpu9900_lastline, tmp);
-#endif
-
-            // remove three lines from history, but shift it so we can inject one too,
-            // cause we want to write two lines. TODO: there may be further optimization
-            // opportunity, but this will do for now...
-            strcpy(cpu9900_lastline, "");
-            strcpy(cpu9900_lastline2, cpu9900_lastline4);
-            strcpy(cpu9900_lastline3, "");
-            strcpy(cpu9900_lastline4, "");
-
-            sprintf(cpu9900_lastline,"\tli r1,%s\n", s6);
-            fprintf(output, "%s", cpu9900_lastline);
-            
-            sprintf(buf,"\t%s r1,%s\n", op2, s2);
-        }
+        // we want to write two lines. TODO: there may be further optimization
+        // opportunity, but this will do for now...
+        index = inst_add(INST_OP, TMS9900_LI, "li");
+        inst_set_operand(index, 0, "r1", OPERAND_REGISTER);
+        inst_set_operand(index, 1, s6, OPERAND_NUMBER);
+        out_op = op2;
+        out_s1 = "r1";
+        out_s2 = s2;
+    }
 
-        // rotate the line buffer
-        strcpy(cpu9900_lastline4, cpu9900_lastline3);
-        strcpy(cpu9900_lastline3, cpu9900_lastline2);
-        strcpy(cpu9900_lastline2, cpu9900_lastline);
-        strcpy(cpu9900_lastline, buf);
+    if (out_op != op1) {
+        out_mnemonic = cpu9900_mnemonics[out_op];
+        suffix = "";
+    } else if (out_s1 != s1 || out_s2 != s2) {
+        suffix = "";
     }
-    
-    fprintf(output, "%s", buf);
+    index = inst_add(INST_OP, out_op, out_mnemonic);
+    if (out_s1[0] != '\0') {
+        inst_set_operand(index, 0, out_s1, (out_s1[0] == 'r' && isdigit(out_s1[1])) ? OPERAND_REGISTER : OPERAND_OTHER);
+        if (out_s2[0] != '\0')
+            inst_set_operand(index, 1, out_s2, (out_s2[0] == 'r' && isdigit(out_s2[1])) ? OPERAND_REGISTER : OPERAND_OTHER);
+    }
+    if (suffix[0] != '\0')
+        inst_set_suffix(index, suffix);
 }
 
-// Nothing here. The Z80 code uses this to emit the three line buffers,
-// but we emit the one and only buffer in emit_line.
+/*
+ ** Close the peephole window (used before emitting data)
+ */
 void cpu9900_dump(void)
 {
+    inst_barrier = inst_count;
 }
 
 /*
@@ -529,8 +470,9 @@ void cpu9900_dump(void)
 void cpu9900_label(char *label)
 {
     // the z80 version also clears its register flags
-    sprintf(cpu9900_line, "%s\n", label);
-    cpu9900_emit_line();
+    stats_start(PHASE_PEEPHOLE);
+    cpu9900_emit(INST_LABEL, NULL, label);
+    stats_stop();
 }
 
 /*
@@ -543,13 +485,22 @@ void cpu9900_empty(void)
 {
 }
 
+/*
+ ** Reset the peephole tracking (start of a new program)
+ */
+void cpu9900_reset(void)
+{
+    strcpy(last_r0_load, "");
+}
+
 /*
  ** Emit a 9900 instruction with no operand
  */
 void cpu9900_noop(char *mnemonic)
 {
-    sprintf(cpu9900_line, "\t%s\n", mnemonic);
-    cpu9900_emit_line();
+    stats_start(PHASE_PEEPHOLE);
+    cpu9900_emit(INST_OP, mnemonic, NULL);
+    stats_stop();
 }
 
 /*
@@ -557,8 +508,9 @@ void cpu9900_noop(char *mnemonic)
  */
 void cpu9900_1op(char *mnemonic, char *operand)
 {
-    sprintf(cpu9900_line, "\t%s %s\n", mnemonic, operand);
-    cpu9900_emit_line();
+    stats_start(PHASE_PEEPHOLE);
+    cpu9900_emit(INST_OP, mnemonic, operand);
+    stats_stop();
 }
 
 /*
@@ -566,8 +518,531 @@ void cpu9900_1op(char *mnemonic, char *operand)
  */
 void cpu9900_2op(char *mnemonic, char *operand1, char *operand2)
 {
-    sprintf(cpu9900_line, "\t%s %s,%s\n", mnemonic, operand1, operand2);
-    cpu9900_emit_line();
+    char buf[MAX_LINE_SIZE];
+    
+    sprintf(buf, "%s,%s", operand1, operand2);
+    stats_start(PHASE_PEEPHOLE);
+    cpu9900_emit(INST_OP, mnemonic, buf);
+    stats_stop();
+}
+
+/*
+ ** Check if the body of a FOR loop (from start to the end of the stream)
+ ** can keep the 8-bit loop variable in the high byte of r9, and replace
+ ** the reads of the variable with r9.
+ **
+ ** It cannot call anything, use r9, jump outside of itself (except to
+ ** the exit), or access the variable other than as a byte source.
+ */
+int cpu9900_for_register(int start, char *variable, char *exit)
+{
+    struct inst *inst;
+    char memory[MAX_LINE_SIZE];
+    char *operand;
+    int c;
+    int d;
+    int e;
+    
+    sprintf(memory, "@%s", variable);
+    for (e = 0; e < 2; e++) {  /* The first pass checks, the second one replaces */
+        for (c = start; c < inst_count; c++) {
+            inst = &inst_stream[c];
+            if (inst->type == INST_TEXT)
+                return 0;
+            if (inst->type == INST_LABEL) {
+                if (!inst_internal(inst_string(inst->text)))
+                    return 0;
+                continue;
+            }
+            if (inst->type != INST_OP)
+                continue;
+            if (inst->opcode < 0 || inst->opcode == TMS9900_BL || inst->opcode == TMS9900_DATA)
+                return 0;
+            for (d = 0; d < 2; d++) {
+                if (inst->operand[d] < 0)
+                    continue;
+                operand = inst_string(inst->operand[d]);
+                if (inst->opcode == TMS9900_B) {
+                    if (operand[0] != '@' || !inst_inside(start, operand + 1, exit))
+                        return 0;
+                    continue;
+                }
+                if (inst->opcode >= TMS9900_JEQ && inst->opcode <= TMS9900_JNE) {
+                    if (!inst_inside(start, operand, exit))
+                        return 0;
+                    continue;
+                }
+                if (inst_symbol(operand, "r9"))
+                    return 0;
+                if (d == 0 && strcmp(operand, memory) == 0 &&
+                    (inst->opcode == TMS9900_MOVB || inst->opcode == TMS9900_CB || inst->opcode == TMS9900_AB ||
+                     inst->opcode == TMS9900_SB || inst->opcode == TMS9900_SOCB || inst->opcode == TMS9900_SZCB)) {
+                    if (e)
+                        inst_set_operand(c, 0, "r9", OPERAND_REGISTER);
+                    continue;
+                }
+                if (inst_symbol(operand, variable))
+                    return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/*
+ ** Check an instruction and its operands (NULL for any operand)
+ */
+static int cpu9900_match(int index, int opcode, char *operand1, char *operand2)
+{
+    struct inst *inst;
+    
+    if (index < 0)
+        return 0;
+    inst = &inst_stream[index];
+    if (inst->type != INST_OP || inst->opcode != opcode)
+        return 0;
+    if (operand1 != NULL && strcmp(inst_string(inst->operand[0]), operand1) != 0)
+        return 0;
+    if (operand2 != NULL && strcmp(inst_string(inst->operand[1]), operand2) != 0)
+        return 0;
+    return 1;
+}
+
+/*
+ ** Replace an instruction
+ */
+static void cpu9900_replace(int index, int opcode, char *operand1, char *operand2)
+{
+    inst_stream[index].opcode = opcode;
+    inst_set_text(index, cpu9900_mnemonics[opcode]);
+    inst_set_operand(index, 0, operand1, (operand1[0] == 'r' && isdigit(operand1[1])) ? OPERAND_REGISTER : OPERAND_OTHER);
+    inst_set_operand(index, 1, operand2, (operand2[0] == 'r' && isdigit(operand2[1])) ? OPERAND_REGISTER : OPERAND_OTHER);
+    inst_stream[index].suffix = -1;
+}
+
+/*
+ ** Size in bytes of an entry of the instruction stream (an upper bound
+ ** for even), or -1 if it cannot be known.
+ */
+int cpu9900_size(int index)
+{
+    struct inst *inst;
+    char *operand;
+    int size;
+    int d;
+    
+    inst = &inst_stream[index];
+    if (inst->type == INST_NONE || inst->type == INST_LABEL || inst->type == INST_COMMENT)
+        return 0;
+    if (inst->type != INST_OP)
+        return -1;
+    switch (inst->opcode) {
+        case -1:
+        case TMS9900_BANK:
+            return -1;
+        case TMS9900_EVEN:
+            return 1;
+        case TMS9900_BSS:
+            return atoi(inst_string(inst->operand[0]));
+        case TMS9900_DATA:
+            return (inst->operand[1] >= 0) ? 4 : 2;
+        case TMS9900_AI:
+        case TMS9900_ANDI:
+        case TMS9900_CI:
+        case TMS9900_LI:
+        case TMS9900_LIMI:
+        case TMS9900_ORI:
+            return 4;
+        default:
+            size = 2;
+            for (d = 0; d < 2; d++) {
+                if (inst->operand[d] < 0)
+                    continue;
+                operand = inst_string(inst->operand[d]);
+                if (operand[0] == '@')    /* Symbolic or indexed address */
+                    size += 2;
+            }
+            return size;
+    }
+}
+
+/*
+ ** Get the distance in bytes from a jump to a label, if it is at reach
+ ** of a relative jump replacing the entries from index to last.
+ ** Otherwise returns a value out of range. The code copied into the
+ ** scratchpad cannot jump outside of itself, nor be jumped into.
+ */
+static int cpu9900_distance(int index, int last, char *label)
+{
+    char *name;
+    int c;
+    int size;
+    int distance;
+    
+    /*
+     ** Forward (counted from the end of the relative jump)
+     */
+    distance = 0;
+    for (c = last + 1; c < inst_count && distance <= 254; c++) {
+        if (inst_stream[c].type == INST_LABEL) {
+            name = inst_string(inst_stream[c].text);
+            if (strcmp(name, "scratchpad_code") == 0 || strcmp(name, "scratchpad_end") == 0)
+                break;
+            if (strcmp(name, label) == 0)
+                return distance;
+        }
+        size = cpu9900_size(c);
+        if (size < 0)
+            break;
+        distance += size;
+    }
+    
+    /*
+     ** Backward
+     */
+    distance = -2;
+    for (c = index - 1; c >= 0 && distance >= -256; c--) {
+        size = cpu9900_size(c);
+        if (size < 0)
+            break;
+        distance -= size;
+        if (inst_stream[c].type == INST_LABEL) {
+            name = inst_string(inst_stream[c].text);
+            if (strcmp(name, "scratchpad_code") == 0 || strcmp(name, "scratchpad_end") == 0)
+                break;
+            if (strcmp(name, label) == 0)
+                return distance;
+        }
+    }
+    return 512;
+}
+
+/*
+ ** Branch relaxation. An absolute branch to a near label is replaced
+ ** with a relative jump, and when it is skipped by a conditional jump:
+ **
+ **     jne cv1
+ **     b @label
+ ** cv1
+ **
+ ** both are replaced with the opposite conditional jump. Sizes are
+ ** estimated by excess, so it is repeated while something changes.
+ */
+void cpu9900_relax(void)
+{
+    static int opposite[][2] = {
+        {TMS9900_JEQ, TMS9900_JNE},
+        {TMS9900_JNE, TMS9900_JEQ},
+        {TMS9900_JH,  TMS9900_JLE},
+        {TMS9900_JLE, TMS9900_JH},
+        {TMS9900_JHE, TMS9900_JL},
+        {TMS9900_JL,  TMS9900_JHE},
+    };
+    char label[MAX_LINE_SIZE];
+    struct inst *inst;
+    int distance;
+    int changed;
+    int c;
+    int d;
+    int e;
+    int f;
+    
+    do {
+        changed = 0;
+        for (c = 0; c < inst_count; c++) {
+            inst = &inst_stream[c];
+            if (inst->type != INST_OP || inst->opcode != TMS9900_B || inst_string(inst->operand[0])[0] != '@')
+                continue;
+            strcpy(label, inst_string(inst->operand[0]) + 1);
+            
+            /*
+             ** Skipped by a conditional jump
+             */
+            d = c - 1;
+            while (d >= 0 && (inst_stream[d].type == INST_NONE || inst_stream[d].type == INST_COMMENT))
+                d--;
+            e = c + 1;
+            while (e < inst_count && (inst_stream[e].type == INST_NONE || inst_stream[e].type == INST_COMMENT))
+                e++;
+            if (d >= 0 && e < inst_count && inst_stream[d].type == INST_OP && inst_stream[e].type == INST_LABEL &&
+                strcmp(inst_string(inst_stream[d].operand[0]), inst_string(inst_stream[e].text)) == 0) {
+                for (f = 0; f < (int) (sizeof(opposite) / sizeof(opposite[0])); f++) {
+                    if (opposite[f][0] == inst_stream[d].opcode)
+                        break;
+                }
+                if (f < (int) (sizeof(opposite) / sizeof(opposite[0]))) {
+                    distance = cpu9900_distance(d, c, label);
+                    if (distance >= -256 && distance <= 254) {
+                        inst_stream[d].opcode = opposite[f][1];
+                        inst_set_text(d, cpu9900_mnemonics[opposite[f][1]]);
+                        inst_set_operand(d, 0, label, OPERAND_OTHER);
+                        inst_delete(c);
+                        changed = 1;
+                        cpu9900_note("9900: conditional jump to label");
+                        continue;
+                    }
+                }
+            }
+            
+            /*
+             ** Alone
+             */
+            distance = cpu9900_distance(c, c, label);
+            if (distance >= -256 && distance <= 254) {
+                inst_stream[c].opcode = TMS9900_JMP;
+                inst_set_text(c, cpu9900_mnemonics[TMS9900_JMP]);
+                inst_set_operand(c, 0, label, OPERAND_OTHER);
+                changed = 1;
+                cpu9900_note("9900: relative jump");
+            }
+        }
+    } while (changed) ;
+}
+
+/*
+ ** Bytes pushed in the stack (R10) by an entry of the instruction
+ ** stream (negative if popped). For a call through jsr (2 bytes for
+ ** the return address) or a jump, the target label is returned in
+ ** *callee.
+ */
+int cpu9900_stack(int index, char **callee)
+{
+    struct inst *inst;
+    char *operand;
+    int c;
+    
+    *callee = NULL;
+    inst = &inst_stream[index];
+    if (inst->type != INST_OP || inst->operand[0] < 0)
+        return 0;
+    operand = inst_string(inst->operand[0]);
+    switch (inst->opcode) {
+        case TMS9900_DECT:
+            return strcmp(operand, "r10") == 0 ? 2 : 0;
+        case TMS9900_INCT:
+            return strcmp(operand, "r10") == 0 ? -2 : 0;
+        case TMS9900_MOV:
+            return strcmp(operand, "*r10+") == 0 ? -2 : 0;
+        case TMS9900_BL:
+            if (strcmp(operand, "@jsr") != 0 && strcmp(operand, "@JSR") != 0)
+                return 0;
+            c = inst_next(index);
+            if (c < 0 || inst_stream[c].type != INST_OP || inst_stream[c].opcode != TMS9900_DATA)
+                return 2;
+            *callee = inst_string(inst_stream[c].operand[0]);
+            return 2;
+        case TMS9900_B:
+            if (operand[0] == '@')
+                *callee = operand + 1;
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+/*
+ ** Check if an entry of the instruction stream only stores a register
+ ** into a variable. Returns the target operand.
+ **
+ ** MOV and MOVB also set the status, so they are kept if a conditional
+ ** jump follows.
+ */
+char *cpu9900_store(int index, char *variable)
+{
+    struct inst *inst;
+    char name[MAX_LINE_SIZE];
+    char *operand;
+    char *p;
+    int c;
+    
+    inst = &inst_stream[index];
+    if (inst->type != INST_OP)
+        return NULL;
+    if (inst->opcode == TMS9900_CLR && inst->operand[1] < 0)
+        operand = inst_string(inst->operand[0]);
+    else if ((inst->opcode == TMS9900_MOV || inst->opcode == TMS9900_MOVB) && inst->operand[1] >= 0
+             && inst_string(inst->operand[0])[0] == 'r')
+        operand = inst_string(inst->operand[1]);
+    else
+        return NULL;
+    name[0] = '@';
+    strcpy(name + 1, variable);
+    for (p = name; *p; p++) {
+        if (*p == '#')
+            *p = '_';
+    }
+    if (strcmp(operand, name) != 0)
+        return NULL;
+    if (inst->opcode != TMS9900_CLR) {
+        c = inst_next(index);
+        if (c >= 0 && inst_stream[c].type == INST_OP) {
+            switch (inst_stream[c].opcode) {
+                case TMS9900_JEQ: case TMS9900_JH: case TMS9900_JHE:
+                case TMS9900_JL: case TMS9900_JLE: case TMS9900_JNE:
+                    return NULL;
+                default:
+                    break;
+            }
+        }
+    }
+    return operand;
+}
+
+/*
+ ** Check for the address of an array element indexed by a 8-bit variable:
+ **
+ **     movb @variable,r0
+ **     srl r0,8
+ **     sla r0,1        ; Only for 16-bit arrays
+ **     ai r0,array
+ **
+ ** Returns the size of the elements (zero if it doesn't match), the
+ ** name of the array, and the last instruction of the sequence.
+ */
+int cpu9900_index(int index, char *variable, char *array, int *last)
+{
+    char memory[MAX_LINE_SIZE];
+    char *operand;
+    int size;
+    
+    sprintf(memory, "@%s", variable);
+    if (!cpu9900_match(index, TMS9900_MOVB, memory, "r0"))
+        return 0;
+    index = inst_next(index);
+    if (!cpu9900_match(index, TMS9900_SRL, "r0", "8"))
+        return 0;
+    index = inst_next(index);
+    size = 1;
+    if (cpu9900_match(index, TMS9900_SLA, "r0", "1")) {
+        size = 2;
+        index = inst_next(index);
+    }
+    if (!cpu9900_match(index, TMS9900_AI, "r0", NULL))
+        return 0;
+    operand = inst_string(inst_stream[index].operand[1]);
+    if (memcmp(operand, ARRAY_PREFIX, strlen(ARRAY_PREFIX)) != 0 || strpbrk(operand, "+-") != NULL)
+        return 0;
+    strcpy(array, operand);
+    *last = index;
+    return size;
+}
+
+/*
+ ** Check if the body of a FOR loop (from start to the end of the stream)
+ ** can keep a pointer to an array indexed by the 8-bit loop variable in
+ ** r8, and replace the address calculation with the pointer. The other
+ ** arrays with the same size of element are accessed at an offset from it.
+ **
+ ** It cannot call anything, use r8, jump outside of itself (except to
+ ** the exit), or access the variable other than reading it.
+ */
+int cpu9900_for_pointer(int start, char *variable, char *exit, char *array, int size)
+{
+    struct inst *inst;
+    char memory[MAX_LINE_SIZE];
+    char name[MAX_LINE_SIZE];
+    char *operand;
+    int last;
+    int c;
+    int d;
+    int e;
+    
+    sprintf(memory, "@%s", variable);
+    for (e = 0; e < 2; e++) {  /* The first pass checks, the second one replaces */
+        for (c = start; c < inst_count; c++) {
+            inst = &inst_stream[c];
+            if (inst->type == INST_TEXT)
+                return 0;
+            if (inst->type == INST_LABEL) {
+                if (!inst_internal(inst_string(inst->text)))
+                    return 0;
+                continue;
+            }
+            if (inst->type != INST_OP)
+                continue;
+            if (inst->opcode < 0 || inst->opcode == TMS9900_BL || inst->opcode == TMS9900_DATA)
+                return 0;
+            if (cpu9900_index(c, variable, name, &last) == size) {
+                if (e) {
+                    cpu9900_replace(c, TMS9900_MOV, "r8", "r0");
+                    if (strcmp(name, array) != 0) {
+                        c = inst_next(c);
+                        sprintf(name + strlen(name), "-%s", array);
+                        cpu9900_replace(c, TMS9900_AI, "r0", name);
+                    }
+                    while (c < last)
+                        inst_delete(++c);
+                }
+                c = last;
+                continue;
+            }
+            for (d = 0; d < 2; d++) {
+                if (inst->operand[d] < 0)
+                    continue;
+                operand = inst_string(inst->operand[d]);
+                if (inst->opcode == TMS9900_B) {
+                    if (operand[0] != '@' || !inst_inside(start, operand + 1, exit))
+                        return 0;
+                    continue;
+                }
+                if (inst->opcode >= TMS9900_JEQ && inst->opcode <= TMS9900_JNE) {
+                    if (!inst_inside(start, operand, exit))
+                        return 0;
+                    continue;
+                }
+                if (inst_symbol(operand, "r8"))
+                    return 0;
+                if (d == 0 && strcmp(operand, memory) == 0)
+                    continue;
+                if (inst_symbol(operand, variable))
+                    return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/*
+ ** Copy r0 to r1 keeping r0
+ */
+static void cpu9900_copy_r0(void)
+{
+    int index;
+    
+    cpu9900_2op("mov", "r0", "r1");
+    index = inst_previous(inst_count);
+    if (index >= 0 && strcmp(inst_string(inst_stream[index].operand[0]), "r0") != 0)   /* The peephole loaded r1 instead */
+        cpu9900_2op("mov", "r1", "r0");
+}
+
+/*
+ ** Multiply r0 by a constant with shifts and adds, from the top bit down.
+ ** The original value is kept in r1.
+ */
+static void cpu9900_multiply(int value)
+{
+    char count[16];
+    int bit;
+    int shift;
+    
+    cpu9900_copy_r0();
+    bit = 0x8000;
+    while ((value & bit) == 0)
+        bit >>= 1;
+    shift = 0;
+    while (bit >>= 1) {
+        shift++;
+        if (value & bit) {
+            sprintf(count, "%d", shift);
+            cpu9900_2op("sla", "r0", count);
+            cpu9900_2op("a", "r1", "r0");
+            shift = 0;
+        }
+    }
+    if (shift != 0) {
+        sprintf(count, "%d", shift);
+        cpu9900_2op("sla", "r0", count);
+    }
 }
 
 /*
@@ -579,6 +1054,7 @@ void cpu9900_2op(char *mnemonic, char *operand1, char *operand2)
 void cpu9900_node_label(struct node *node)
 {
     struct node *explore;
+    int shift;
     
     switch (node->type) {
         case N_USR:     /* Assembly language function with result */
@@ -653,6 +1129,11 @@ void cpu9900_node_label(struct node *node)
                 cpu9900_node_label(node->left);
                 break;
             }
+            if (node->type == N_MUL8 && node->right->type == N_NUM8 && node->right->value > 2) {
+                cpu9900_node_label(node->left);
+                node->regs = node->left->regs | REG_1;
+                break;
+            }
             if (node->type == N_DIV8 && node->right->type == N_NUM8 && is_power_of_two(node->right->value)) {
                 cpu9900_node_label(node->left);
                 break;
@@ -809,7 +1290,7 @@ void cpu9900_node_label(struct node *node)
                     explore = node->right;
                 else
                     explore = NULL;
-                if (explore != NULL && (explore->value == 0 || explore->value == 1 || is_power_of_two(explore->value))) {
+                if (explore != NULL && (explore->value == 0 || explore->value == 1 || is_cheap_multiply(explore->value))) {
                     int c = explore->value;
                     
                     if (c == 0) {
@@ -822,16 +1303,31 @@ void cpu9900_node_label(struct node *node)
                             cpu9900_node_label(node->right);
                             node->regs = node->right->regs;
                         }
+                        if (c > 1 && !is_power_of_two(c))
+                            node->regs |= REG_1;
                     }
                     break;
                 }
             }
+            if (node->type == N_DIV16S || node->type == N_MOD16S) {
+                if (node->right->type == N_NUM16 && is_power_of_two(node->right->value) && node->right->value < 32768) {
+                    cpu9900_node_label(node->left);
+                    node->regs = node->left->regs | REG_1;
+                    break;
+                }
+            }
             if (node->type == N_DIV16) {
                 if (node->right->type == N_NUM16 && is_power_of_two(node->right->value)) {
                     cpu9900_node_label(node->left);
                     node->regs = node->left->regs;
                     break;
                 }
+                if (node->right->type == N_NUM16 && node->right->value > 2 &&
+                    reciprocal_of(node->right->value, 16, &shift) != 0) {
+                    cpu9900_node_label(node->left);
+                    node->regs = node->left->regs | REG_1;
+                    break;
+                }
             }
             if (node->type == N_LESSEQUAL16 || node->type == N_GREATER16) {
                 if (node->left->type == N_LOAD16) {
@@ -1098,6 +1594,12 @@ void cpu9900_node_generate(struct node *node, int decision)
                 cpu9900_2op("sla", "r0", temp);
                 break;
             }
+            if (node->type == N_MUL8 && node->right->type == N_NUM8 && node->right->value > 2) {
+                cpu9900_node_generate(node->left, 0);
+                cpu9900_2op("andi", "r0", ">ff00"); /* Avoid trash bits 7-0 getting into */
+                cpu9900_multiply(node->right->value & 0xff);
+                break;
+            }
             if (node->type == N_DIV8 && node->right->type == N_NUM8 && is_power_of_two(node->right->value)) {
                 int c, cnt;
                 
@@ -1526,7 +2028,7 @@ void cpu9900_node_generate(struct node *node, int decision)
                     explore = node->right;
                 else
                     explore = NULL;
-                if (explore != NULL && (explore->value == 0 || explore->value == 1 || is_power_of_two(explore->value))) {
+                if (explore != NULL && (explore->value == 0 || explore->value == 1 || is_cheap_multiply(explore->value))) {
                     int c = explore->value;
                     if (node->left != explore)
                         node = node->left;
@@ -1537,6 +2039,9 @@ void cpu9900_node_generate(struct node *node, int decision)
                         cpu9900_1op("clr", "r0");
                     } else if (c == 1) {
                         cpu9900_node_generate(node, 0);
+                    } else if (!is_power_of_two(c)) {
+                        cpu9900_node_generate(node, 0);
+                        cpu9900_multiply(c);
                     } else {
                         int cnt;
                         
@@ -1552,6 +2057,39 @@ void cpu9900_node_generate(struct node *node, int decision)
                     break;
                 }
             }
+            if (node->type == N_DIV16S || node->type == N_MOD16S) {
+                if (node->right->type == N_NUM16 && is_power_of_two(node->right->value) && node->right->value < 32768) {
+                    int cnt;
+                    int c;
+                    
+                    /*
+                     ** Negative values get a bias of divisor - 1 so the
+                     ** shift rounds to zero like the runtime library.
+                     */
+                    cpu9900_node_generate(node->left, 0);
+                    c = node->right->value;
+                    cpu9900_copy_r0();
+                    cpu9900_2op("sra", "r1", "15");
+                    sprintf(temp, "%d", c - 1);
+                    cpu9900_2op("andi", "r1", temp);
+                    if (node->type == N_DIV16S) {
+                        cpu9900_2op("a", "r1", "r0");
+                        cnt = 0;
+                        while (c > 1) {
+                            ++cnt;
+                            c /= 2;
+                        }
+                        sprintf(temp, "%d", cnt);
+                        cpu9900_2op("sra", "r0", temp);
+                    } else {
+                        cpu9900_2op("a", "r0", "r1");
+                        sprintf(temp, "%d", 0x10000 - c);
+                        cpu9900_2op("andi", "r1", temp);
+                        cpu9900_2op("s", "r1", "r0");
+                    }
+                    break;
+                }
+            }
             if (node->type == N_DIV16) {
                 if (node->right->type == N_NUM16 && is_power_of_two(node->right->value)) {
                     int cnt;
@@ -1568,6 +2106,27 @@ void cpu9900_node_generate(struct node *node, int decision)
                     cpu9900_2op("srl", "r0", temp);
                     break;
                 }
+                if (node->right->type == N_NUM16 && node->right->value > 2) {
+                    int multiplier;
+                    int shift;
+                    
+                    /*
+                     ** Multiply by the reciprocal, the high word of the product
+                     ** is the quotient. MPY takes less than half of DIV.
+                     */
+                    multiplier = reciprocal_of(node->right->value, 16, &shift);
+                    if (multiplier != 0) {
+                        cpu9900_node_generate(node->left, 0);
+                        sprintf(temp, "%d", multiplier);
+                        cpu9900_2op("li", "r1", temp);
+                        cpu9900_2op("mpy", "r1", "r0");   /* r1 * r0 => r0_r1 (32 bit) */
+                        if (shift > 16) {
+                            sprintf(temp, "%d", shift - 16);
+                            cpu9900_2op("srl", "r0", temp);
+                        }
+                        break;
+                    }
+                }
             }
             if (node->type == N_LESSEQUAL16 || node->type == N_GREATER16) {
                 if (node->left->type == N_LOAD16) {
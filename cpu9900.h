@@ -15,12 +15,31 @@
 #define REG_6    0x40
 #define REG_7    0x80
 
+/*
+ ** Opcodes in the instruction stream (sorted by mnemonic)
+ */
+enum tms9900_opcode {
+    TMS9900_A, TMS9900_AB, TMS9900_ABS, TMS9900_AI, TMS9900_ANDI, TMS9900_B, TMS9900_BANK, TMS9900_BL, TMS9900_BSS, TMS9900_C,
+    TMS9900_CB, TMS9900_CI, TMS9900_CLR, TMS9900_DATA, TMS9900_DEC, TMS9900_DECT, TMS9900_DIV, TMS9900_EVEN, TMS9900_INC, TMS9900_INCT,
+    TMS9900_INV, TMS9900_JEQ, TMS9900_JH, TMS9900_JHE, TMS9900_JL, TMS9900_JLE, TMS9900_JMP, TMS9900_JNE, TMS9900_LI, TMS9900_LIMI,
+    TMS9900_MOV, TMS9900_MOVB, TMS9900_MPY, TMS9900_NEG, TMS9900_ORI, TMS9900_S, TMS9900_SB, TMS9900_SETO, TMS9900_SLA, TMS9900_SOC,
+    TMS9900_SOCB, TMS9900_SRA, TMS9900_SRC, TMS9900_SRL, TMS9900_SWPB, TMS9900_SZC, TMS9900_SZCB, TMS9900_XOR,
+};
+
 extern void cpu9900_dump(void);
 extern void cpu9900_label(char *);
 extern void cpu9900_empty(void);
+extern void cpu9900_reset(void);
 extern void cpu9900_noop(char *);
 extern void cpu9900_1op(char *, char *);
 extern void cpu9900_2op(char *, char *, char *);
+extern int cpu9900_size(int);
+extern void cpu9900_relax(void);
+extern int cpu9900_stack(int, char **);
+extern char *cpu9900_store(int, char *);
+extern int cpu9900_for_register(int, char *, char *);
+extern int cpu9900_index(int, char *, char *, int *);
+extern int cpu9900_for_pointer(int, char *, char *, char *, int);
 
 extern void cpu9900_node_label(struct node *);
 extern void cpu9900_node_generate(struct node *, int);
@@ -12,7 +12,9 @@
 #include <stdlib.h>
 #include "cvbasic.h"
 #include "node.h"
+#include "inst.h"
 #include "cpuz80.h"
+#include "stats.h"
 
 #define REG_ALL (REG_AF | REG_BC | REG_DE | REG_HL)
 
@@ -22,11 +24,15 @@
 #define INDEX_ADD           '['
 #define INDEX_ADD_STRING    "["
 
-static char z80_line[MAX_LINE_SIZE];
-
-static char z80_line_1[MAX_LINE_SIZE];
-static char z80_line_2[MAX_LINE_SIZE];
-static char z80_line_3[MAX_LINE_SIZE];
+/*
+ ** Mnemonics (sorted, it must match enum z80_opcode)
+ */
+static char *z80_mnemonics[] = {
+    "ADC", "ADD", "AND", "CALL", "CP", "CPL", "DEC", "DI", "DJNZ", "DW",
+    "EI", "EX", "FORG", "HALT", "IN", "INC", "JP", "JR", "LD", "NEG",
+    "OR", "ORG", "OUT", "POP", "PUSH", "RES", "RET", "RLA", "RLCA", "RR",
+    "RRA", "RRCA", "SBC", "SET", "SRL", "SUB", "XOR",
+};
 
 static char z80_a_value[MAX_LINE_SIZE];
 static char z80_a_alias[MAX_LINE_SIZE];
@@ -34,34 +40,115 @@ static char z80_hl_value[MAX_LINE_SIZE];
 static char z80_hl_alias[MAX_LINE_SIZE];
 static int z80_flag_z_valid;
 
-static void z80_emit_line(void);
+static int z80_opcode(char *);
+static enum operand_kind z80_kind(int, int, char *);
+static void z80_emit(int, char *, char *, char *);
+static void z80_peephole(int);
+static int z80_match(int, int, char *, char *);
+static void z80_replace(int, int, char *, char *);
+static void z80_multiply(char *, char *, int);
+
+/*
+ ** Get the opcode for a mnemonic
+ */
+int z80_opcode(char *mnemonic)
+{
+    return inst_lookup(z80_mnemonics, sizeof(z80_mnemonics) / sizeof(char *), mnemonic);
+}
+
+/*
+ ** Classify an operand
+ */
+enum operand_kind z80_kind(int opcode, int operands, char *operand)
+{
+    static char *registers[] = {
+        "A", "AF", "AF'", "B", "BC", "C", "D", "DE", "E", "H", "HL", "I", "IX", "IY", "L", "R", "SP",
+    };
+    
+    if (operand == NULL)
+        return OPERAND_NONE;
+    if ((opcode == Z80_JP || opcode == Z80_JR || opcode == Z80_CALL || opcode == Z80_RET) && operands == 2)
+        return OPERAND_CONDITION;
+    if (inst_lookup(registers, sizeof(registers) / sizeof(char *), operand) >= 0)
+        return OPERAND_REGISTER;
+    if (operand[0] == '(')
+        return OPERAND_MEMORY;
+    if (isdigit(operand[0]) || operand[0] == '-' || operand[0] == '$')
+        return OPERAND_NUMBER;
+    if (opcode == Z80_JP || opcode == Z80_JR || opcode == Z80_CALL || opcode == Z80_DJNZ)
+        return OPERAND_LABEL;
+    return OPERAND_OTHER;
+}
+
+/*
+ ** Emit a Z80 instruction into the stream
+ */
+void z80_emit(int opcode, char *mnemonic, char *operand1, char *operand2)
+{
+    int operands;
+    int index;
+    
+    operands = (operand1 != NULL) + (operand2 != NULL);
+    index = inst_add(INST_OP, opcode, mnemonic);
+    if (operand1 != NULL)
+        inst_set_operand(index, 0, operand1, z80_kind(opcode, operands, operand1));
+    if (operand2 != NULL)
+        inst_set_operand(index, 1, operand2, z80_kind(opcode, 1, operand2));
+    stats_start(PHASE_PEEPHOLE);
+    z80_peephole(index);
+    stats_stop();
+}
 
-void z80_emit_line(void)
+/*
+ ** Peephole optimization over the instruction stream
+ */
+void z80_peephole(int index)
 {
+    struct inst *inst;
+    struct inst *previous;
+    struct inst *previous2;
+    int c;
+    int d;
+    
+    inst = &inst_stream[index];
     
     /*
      ** Optimize the following cases:
-     **     JP Z,cv1
+     **     JP NZ,cv1
      **     JP somewhere
      ** cv1:
      **
-     **     JP Z,cv1
+     **     JP NZ,cv1
      **     CALL somewhere
      ** cv1:
      */
-    if (memcmp(z80_line_2, "\tJP NZ," INTERNAL_PREFIX, 9) == 0 && isdigit(z80_line_2[9]) &&
-        (memcmp(z80_line_3, "\tJP ", 4) == 0 || memcmp(z80_line_3, "\tCALL ", 6) == 0) &&
-        memcmp(z80_line, INTERNAL_PREFIX, 2) == 0 && isdigit(z80_line[2]) &&
-        atoi(z80_line_2 + 9) == atoi(z80_line + 2)) {
-        if (z80_line_3[1] == 'J') {
-            strcpy(z80_line_2, "\tJP Z,");
-            strcat(z80_line_2, z80_line_3 + 4);
-        } else {
-            strcpy(z80_line_2, "\tCALL Z,");
-            strcat(z80_line_2, z80_line_3 + 6);
+    if (inst->type == INST_LABEL) {
+        c = inst_previous(index);
+        d = (c >= 0) ? inst_previous(c) : -1;
+        if (d >= 0) {
+            previous = &inst_stream[c];
+            previous2 = &inst_stream[d];
+            if (previous2->type == INST_OP && previous2->opcode == Z80_JP &&
+                strcmp(inst_string(previous2->operand[0]), "NZ") == 0 &&
+                memcmp(inst_string(previous2->operand[1]), INTERNAL_PREFIX, 2) == 0 &&
+                isdigit(inst_string(previous2->operand[1])[2]) &&
+                previous->type == INST_OP && (previous->opcode == Z80_JP || previous->opcode == Z80_CALL) &&
+                previous->operand[1] < 0 &&
+                memcmp(inst_string(inst->text), INTERNAL_PREFIX, 2) == 0 && isdigit(inst_string(inst->text)[2]) &&
+                atoi(inst_string(previous2->operand[1]) + 2) == atoi(inst_string(inst->text) + 2)) {
+                previous2->opcode = previous->opcode;
+                previous2->text = previous->text;
+                inst_set_operand(d, 0, "Z", OPERAND_CONDITION);
+                previous2 = &inst_stream[d];
+                previous = &inst_stream[c];
+                previous2->operand[1] = previous->operand[0];
+                previous2->kind[1] = previous->kind[0];
+                inst_delete(c);
+                inst_delete(index);
+                stats_rule("z80: jump over JP/CALL");
+            }
         }
-        z80_line_3[0] = '\0';
-        z80_line[0] = '\0';
+        return;
     }
     
     /*
@@ -69,29 +156,31 @@ void z80_emit_line(void)
      **     CALL cv1
      **     RET
      */
-    if (memcmp(z80_line_3, "\tCALL " INTERNAL_PREFIX, 8) == 0 && memcmp(z80_line, "\tRET\n", 5) == 0) {
-        strcpy(z80_line, "\tJP ");
-        strcat(z80_line, z80_line_3 + 6);
-        z80_line_3[0] = '\0';
+    if (inst->type == INST_OP && inst->opcode == Z80_RET && inst->operand[0] < 0) {
+        c = inst_previous(index);
+        if (c >= 0) {
+            previous = &inst_stream[c];
+            if (previous->type == INST_OP && previous->opcode == Z80_CALL && previous->operand[1] < 0 &&
+                memcmp(inst_string(previous->operand[0]), INTERNAL_PREFIX, 2) == 0) {
+                inst->opcode = Z80_JP;
+                inst_set_text(index, "JP");
+                inst = &inst_stream[index];
+                previous = &inst_stream[c];
+                inst->operand[0] = previous->operand[0];
+                inst->kind[0] = OPERAND_LABEL;
+                inst_delete(c);
+                stats_rule("z80: CALL/RET into JP");
+            }
+        }
     }
-    if (z80_line_1[0])
-        fprintf(output, "%s", z80_line_1);
-    strcpy(z80_line_1, z80_line_2);
-    strcpy(z80_line_2, z80_line_3);
-    strcpy(z80_line_3, z80_line);
 }
 
+/*
+ ** Close the peephole window (used before emitting data)
+ */
 void cpuz80_dump(void)
 {
-    if (z80_line_1[0])
-        fprintf(output, "%s", z80_line_1);
-    if (z80_line_2[0])
-        fprintf(output, "%s", z80_line_2);
-    if (z80_line_3[0])
-        fprintf(output, "%s", z80_line_3);
-    z80_line_1[0] = '\0';
-    z80_line_2[0] = '\0';
-    z80_line_3[0] = '\0';
+    inst_barrier = inst_count;
 }
 
 /*
@@ -99,8 +188,13 @@ void cpuz80_dump(void)
  */
 void cpuz80_label(char *label)
 {
-    sprintf(z80_line, "%s:\n", label);
-    z80_emit_line();
+    int index;
+    
+    index = inst_add(INST_LABEL, -1, label);
+    inst_set_suffix(index, ":");
+    stats_start(PHASE_PEEPHOLE);
+    z80_peephole(index);
+    stats_stop();
     z80_a_value[0] = '\0';
     z80_a_alias[0] = '\0';
     z80_hl_value[0] = '\0';
@@ -118,16 +212,30 @@ void cpuz80_empty(void)
     z80_flag_z_valid = 0;
 }
 
+/*
+ ** Reset all the tracked registers (start of a new program)
+ */
+void cpuz80_reset(void)
+{
+    z80_a_value[0] = '\0';
+    z80_a_alias[0] = '\0';
+    z80_hl_value[0] = '\0';
+    z80_hl_alias[0] = '\0';
+    z80_flag_z_valid = 0;
+}
+
 /*
  ** Emit a Z80 instruction with no operand
  */
 void cpuz80_noop(char *mnemonic)
 {
-    sprintf(z80_line, "\t%s\n", mnemonic);
-    z80_emit_line();
+    int opcode;
+    
+    opcode = z80_opcode(mnemonic);
+    z80_emit(opcode, mnemonic, NULL, NULL);
     z80_a_value[0] = '\0';
     z80_a_alias[0] = '\0';
-    if (strcmp(mnemonic, "NEG") == 0)
+    if (opcode == Z80_NEG)
         z80_flag_z_valid = 1;
     else
         z80_flag_z_valid = 0;
@@ -138,10 +246,14 @@ void cpuz80_noop(char *mnemonic)
  */
 void cpuz80_1op(char *mnemonic, char *operand)
 {
+    int opcode;
+    
+    opcode = z80_opcode(mnemonic);
+    
     /*
      ** Optimize zero in register A
      */
-    if (strcmp(mnemonic, "SUB") == 0) {
+    if (opcode == Z80_SUB) {
         if (strcmp(operand, "A") == 0) {
             if (strcmp(z80_a_value, "0") == 0)
                 return;
@@ -154,104 +266,101 @@ void cpuz80_1op(char *mnemonic, char *operand)
      **
      ** It is used OR A for clearing the carry flag for SBC HL,DE
      */
-    if (strcmp(mnemonic, "AND") == 0) {
+    if (opcode == Z80_AND) {
         if (strcmp(operand, "A") == 0) {
             if (z80_flag_z_valid)
                 return;
         }
     }
 
-    sprintf(z80_line, "\t%s %s\n", mnemonic, operand);
-    z80_emit_line();
+    z80_emit(opcode, mnemonic, operand, NULL);
     
-    if (strcmp(mnemonic, "PUSH") == 0) {
-        /* No affected registers */
-    } else if (strcmp(mnemonic, "CP") == 0) {
-        /* No affected registers */
-        z80_flag_z_valid = 0;
-    } else if (strcmp(mnemonic, "POP") == 0) {
-        if (strcmp(operand, "AF") == 0) {
-            z80_a_value[0] = '\0';
-            z80_a_alias[0] = '\0';
-            z80_flag_z_valid = 0;
-        } else if (strcmp(operand, "HL") == 0) {
-            z80_hl_value[0] = '\0';
-            z80_hl_alias[0] = '\0';
-        }
-    } else if (strcmp(mnemonic, "CALL") == 0 ||
-               strcmp(mnemonic, "JP") == 0 ||
-               strcmp(mnemonic, "JR") == 0) {
-        z80_a_value[0] = '\0';
-        z80_a_alias[0] = '\0';
-        z80_hl_value[0] = '\0';
-        z80_hl_alias[0] = '\0';
-        z80_flag_z_valid = 0;
-    } else if (strcmp(mnemonic, "SUB") == 0) {
-        if (strcmp(operand, "A") == 0)
-            strcpy(z80_a_value, "0");
-        else
-            z80_a_value[0] = '\0';
-        z80_a_alias[0] = '\0';
-        z80_flag_z_valid = 1;
-    } else if (strcmp(mnemonic, "OR") == 0 ||
-               strcmp(mnemonic, "XOR") == 0 ||
-               strcmp(mnemonic, "AND") == 0) {
-        z80_a_value[0] = '\0';
-        z80_a_alias[0] = '\0';
-        z80_flag_z_valid = 1;
-    } else if (strcmp(mnemonic, "SRL") == 0) {
-        if (strcmp(operand, "H") == 0) {
-            z80_hl_value[0] = '\0';
-            z80_hl_alias[0] = '\0';
-        } else if (strcmp(operand, "A") == 0) {
-            z80_flag_z_valid = 1;
-        }
-    } else if (strcmp(mnemonic, "RR") == 0) {
-        if (strcmp(operand, "L") == 0) {
-            z80_hl_value[0] = '\0';
-            z80_hl_alias[0] = '\0';
-        }
-        z80_flag_z_valid = 0;
-    } else if (strcmp(mnemonic, "INC") == 0) {
-        if (strcmp(operand, "H") == 0 ||
-            strcmp(operand, "L") == 0 ||
-            strcmp(operand, "HL") == 0) {
-            z80_hl_value[0] = '\0';
-            z80_hl_alias[0] = '\0';
+    switch (opcode) {
+        case Z80_PUSH:
+            /* No affected registers */
+            break;
+        case Z80_CP:
+            /* No affected registers */
             z80_flag_z_valid = 0;
-        } else if (strcmp(operand, "A") == 0) {
-            z80_a_value[0] = '\0';
-            z80_a_alias[0] = '\0';
-            z80_flag_z_valid = 1;
-        } else if (strcmp(operand, "(HL)") == 0) {
+            break;
+        case Z80_POP:
+            if (strcmp(operand, "AF") == 0) {
+                z80_a_value[0] = '\0';
+                z80_a_alias[0] = '\0';
+                z80_flag_z_valid = 0;
+            } else if (strcmp(operand, "HL") == 0) {
+                z80_hl_value[0] = '\0';
+                z80_hl_alias[0] = '\0';
+            }
+            break;
+        case Z80_CALL:
+        case Z80_JP:
+        case Z80_JR:
+        case Z80_DJNZ:
             z80_a_value[0] = '\0';
             z80_a_alias[0] = '\0';
-            z80_flag_z_valid = 0;
-            if (strchr(z80_hl_alias, INDEX_ADD) != NULL)
-                z80_hl_alias[0] = '\0';
-        }
-    } else if (strcmp(mnemonic, "DEC") == 0) {
-        if (strcmp(operand, "H") == 0 ||
-            strcmp(operand, "L") == 0 ||
-            strcmp(operand, "HL") == 0) {
             z80_hl_value[0] = '\0';
             z80_hl_alias[0] = '\0';
             z80_flag_z_valid = 0;
-        } else if (strcmp(operand, "A") == 0) {
-            z80_a_value[0] = '\0';
+            break;
+        case Z80_SUB:
+            if (strcmp(operand, "A") == 0)
+                strcpy(z80_a_value, "0");
+            else
+                z80_a_value[0] = '\0';
             z80_a_alias[0] = '\0';
             z80_flag_z_valid = 1;
-        } else if (strcmp(operand, "(HL)") == 0) {
+            break;
+        case Z80_OR:
+        case Z80_XOR:
+        case Z80_AND:
             z80_a_value[0] = '\0';
             z80_a_alias[0] = '\0';
+            z80_flag_z_valid = 1;
+            break;
+        case Z80_SRL:
+            if (strcmp(operand, "H") == 0) {
+                z80_hl_value[0] = '\0';
+                z80_hl_alias[0] = '\0';
+            } else if (strcmp(operand, "A") == 0) {
+                z80_flag_z_valid = 1;
+            }
+            break;
+        case Z80_RR:
+            if (strcmp(operand, "L") == 0) {
+                z80_hl_value[0] = '\0';
+                z80_hl_alias[0] = '\0';
+            }
             z80_flag_z_valid = 0;
-            if (strchr(z80_hl_alias, INDEX_ADD) != NULL)
+            break;
+        case Z80_INC:
+        case Z80_DEC:
+            if (strcmp(operand, "H") == 0 ||
+                strcmp(operand, "L") == 0 ||
+                strcmp(operand, "HL") == 0) {
+                z80_hl_value[0] = '\0';
                 z80_hl_alias[0] = '\0';
-        }
-    } else if (strcmp(mnemonic, "DW") == 0 || strcmp(mnemonic, "ORG") == 0 || strcmp(mnemonic, "FORG") == 0) {
-        /* Nothing to do */
-    } else {
-        fprintf(stderr, "cpuz80_1op: not found mnemonic %s\n", mnemonic);
+                z80_flag_z_valid = 0;
+            } else if (strcmp(operand, "A") == 0) {
+                z80_a_value[0] = '\0';
+                z80_a_alias[0] = '\0';
+                z80_flag_z_valid = 1;
+            } else if (strcmp(operand, "(HL)") == 0) {
+                z80_a_value[0] = '\0';
+                z80_a_alias[0] = '\0';
+                z80_flag_z_valid = 0;
+                if (strchr(z80_hl_alias, INDEX_ADD) != NULL)
+                    z80_hl_alias[0] = '\0';
+            }
+            break;
+        case Z80_DW:
+        case Z80_ORG:
+        case Z80_FORG:
+            /* Nothing to do */
+            break;
+        default:
+            fprintf(stderr, "cpuz80_1op: not found mnemonic %s\n", mnemonic);
+            break;
     }
 }
 
@@ -260,13 +369,16 @@ void cpuz80_1op(char *mnemonic, char *operand)
  */
 void cpuz80_2op(char *mnemonic, char *operand1, char *operand2)
 {
+    int opcode;
     int special;
     
+    opcode = z80_opcode(mnemonic);
+    
     /*
      ** Optimize constant expressions (both constants and access to memory variables)
      */
     special = 0;
-    if (strcmp(mnemonic, "LD") == 0) {
+    if (opcode == Z80_LD) {
         if (strcmp(operand1, "A") == 0) {
             if (strcmp(operand2, z80_a_alias) == 0 || strcmp(operand2, z80_a_value) == 0)
                 return;
@@ -296,81 +408,548 @@ void cpuz80_2op(char *mnemonic, char *operand1, char *operand2)
         }
     }
     
-    sprintf(z80_line, "\t%s %s,%s\n", mnemonic, operand1, operand2);
-    z80_emit_line();
+    z80_emit(opcode, mnemonic, operand1, operand2);
 
-    if (strcmp(mnemonic, "JP") == 0 ||
-        strcmp(mnemonic, "JR") == 0 ||
-        strcmp(mnemonic, "OUT") == 0 ||
-        strcmp(mnemonic, "RES") == 0 ||
-        strcmp(mnemonic, "SET") == 0) {
-        /* No affected registers or flags */
-    } else if (strcmp(mnemonic, "EX") == 0) {
-        z80_hl_value[0] = '\0';
-        z80_hl_alias[0] = '\0';
-    } else if (strcmp(mnemonic, "IN") == 0) {
-        z80_a_value[0] = '\0';
-        z80_a_alias[0] = '\0';
-        z80_flag_z_valid = 0;
-    } else if (strcmp(mnemonic, "ADD") == 0 || strcmp(mnemonic, "ADC") == 0 || strcmp(mnemonic, "SBC") == 0) {
-        if (strcmp(operand1, "A") == 0) {
-            z80_a_value[0] = '\0';
-            z80_a_alias[0] = '\0';
-            z80_flag_z_valid = 1;
-        } else {
-            z80_hl_value[0] = '\0';
-            z80_hl_alias[0] = '\0';
-            z80_flag_z_valid = 0;
-        }
-    } else if (strcmp(mnemonic, "LD") == 0) {
-        if (special != 0)
-            return;
-        if (strcmp(operand1, "A") == 0)  /* Read value into accumulator */
-            z80_flag_z_valid = 0;       /* Z status isn't valid */
-        if (strcmp(operand1, "L") == 0 || strcmp(operand1, "H") == 0) {
+    switch (opcode) {
+        case Z80_JP:
+        case Z80_JR:
+        case Z80_OUT:
+        case Z80_RES:
+        case Z80_SET:
+            /* No affected registers or flags */
+            break;
+        case Z80_EX:
             z80_hl_value[0] = '\0';
             z80_hl_alias[0] = '\0';
-        }
-        if (strcmp(operand1, "HL") == 0) {
-            if (isdigit(operand2[0])) {
-                /* Loading a value destroys any previous alias */
-                strcpy(z80_hl_value, operand2);
-                z80_hl_alias[0] = '\0';
-            } else {
-                /* Loading from an address destroy any previous value */
-                strcpy(z80_hl_alias, operand2);
-                z80_hl_value[0] = '\0';
-            }
-        } else if (strcmp(operand2, "HL") == 0) {
-            /* Saving to an address makes HL an alias AND PRESERVES the value */
-            strcpy(z80_hl_alias, operand1);
-        }
-        if (strcmp(operand1, "A") == 0 && strcmp(operand2, "(HL)") == 0) {
+            break;
+        case Z80_IN:
             z80_a_value[0] = '\0';
             z80_a_alias[0] = '\0';
-        } else if (strcmp(operand1, "(HL)") == 0 && strcmp(operand2, "A") == 0) {
-            /* A keeps its value */
-        } else if (strcmp(operand1, "A") == 0) {
-            if (isdigit(operand2[0])) {
-                /* Loading a value destroys any previous alias */
-                strcpy(z80_a_value, operand2);
-                z80_a_alias[0] = '\0';
-            } else if (operand2[0] == '(') {
-                /* Loading from an address destroy any previous value */
+            z80_flag_z_valid = 0;
+            break;
+        case Z80_ADD:
+        case Z80_ADC:
+        case Z80_SBC:
+            if (strcmp(operand1, "A") == 0) {
                 z80_a_value[0] = '\0';
-                strcpy(z80_a_alias, operand2);
+                z80_a_alias[0] = '\0';
+                z80_flag_z_valid = 1;
             } else {
+                z80_hl_value[0] = '\0';
+                z80_hl_alias[0] = '\0';
+                z80_flag_z_valid = 0;
+            }
+            break;
+        case Z80_LD:
+            if (special != 0)
+                return;
+            if (strcmp(operand1, "A") == 0)  /* Read value into accumulator */
+                z80_flag_z_valid = 0;       /* Z status isn't valid */
+            if (strcmp(operand1, "L") == 0 || strcmp(operand1, "H") == 0) {
+                z80_hl_value[0] = '\0';
+                z80_hl_alias[0] = '\0';
+            }
+            if (strcmp(operand1, "HL") == 0) {
+                if (isdigit(operand2[0])) {
+                    /* Loading a value destroys any previous alias */
+                    strcpy(z80_hl_value, operand2);
+                    z80_hl_alias[0] = '\0';
+                } else {
+                    /* Loading from an address destroy any previous value */
+                    strcpy(z80_hl_alias, operand2);
+                    z80_hl_value[0] = '\0';
+                }
+            } else if (strcmp(operand2, "HL") == 0) {
+                /* Saving to an address makes HL an alias AND PRESERVES the value */
+                strcpy(z80_hl_alias, operand1);
+            }
+            if (strcmp(operand1, "A") == 0 && strcmp(operand2, "(HL)") == 0) {
                 z80_a_value[0] = '\0';
                 z80_a_alias[0] = '\0';
+            } else if (strcmp(operand1, "(HL)") == 0 && strcmp(operand2, "A") == 0) {
+                /* A keeps its value */
+            } else if (strcmp(operand1, "A") == 0) {
+                if (isdigit(operand2[0])) {
+                    /* Loading a value destroys any previous alias */
+                    strcpy(z80_a_value, operand2);
+                    z80_a_alias[0] = '\0';
+                } else if (operand2[0] == '(') {
+                    /* Loading from an address destroy any previous value */
+                    z80_a_value[0] = '\0';
+                    strcpy(z80_a_alias, operand2);
+                } else {
+                    z80_a_value[0] = '\0';
+                    z80_a_alias[0] = '\0';
+                }
+            } else if (operand1[0] == '(' && strcmp(operand2, "A") == 0) {
+                /* Saving to an address makes A an alias AND PRESERVES the value */
+                strcpy(z80_a_alias, operand1);
+                if (strchr(z80_hl_alias, INDEX_ADD) != NULL)
+                    z80_hl_alias[0] = '\0';
             }
-        } else if (operand1[0] == '(' && strcmp(operand2, "A") == 0) {
-            /* Saving to an address makes A an alias AND PRESERVES the value */
-            strcpy(z80_a_alias, operand1);
-            if (strchr(z80_hl_alias, INDEX_ADD) != NULL)
-                z80_hl_alias[0] = '\0';
+            break;
+        default:
+            fprintf(stderr, "z80_2op: not found mnemonic %s\n", mnemonic);
+            break;
+    }
+}
+
+/*
+ ** Get the maximum size in bytes of an entry (-1 if unknown)
+ */
+int cpuz80_size(int index)
+{
+    struct inst *inst;
+    char *operand;
+    int size;
+    int d;
+    
+    inst = &inst_stream[index];
+    switch (inst->type) {
+        case INST_NONE:
+        case INST_LABEL:
+        case INST_COMMENT:
+            return 0;
+        case INST_OP:
+            break;
+        default:
+            return -1;
+    }
+    switch (inst->opcode) {
+        case Z80_JR:
+        case Z80_DJNZ:
+        case Z80_NEG:
+            return 2;
+        case Z80_CALL:
+            return 3;
+        case Z80_DW:
+        case Z80_ORG:
+        case Z80_FORG:
+            return -1;
+        case -1:    /* Only a single byte of data (WAIT) */
+            operand = inst_string(inst->text);
+            if (memcmp(operand, "DB ", 3) == 0 && strchr(operand, ',') == NULL && strchr(operand, '"') == NULL)
+                return 1;
+            return -1;
+        default:
+            break;
+    }
+    size = 1;
+    for (d = 0; d < 2; d++) {
+        if (inst->operand[d] < 0)
+            continue;
+        operand = inst_string(inst->operand[d]);
+        switch (inst->kind[d]) {
+            case OPERAND_CONDITION:
+                break;
+            case OPERAND_REGISTER:
+                if (strcmp(operand, "IX") == 0 || strcmp(operand, "IY") == 0 ||
+                    strcmp(operand, "I") == 0 || strcmp(operand, "R") == 0)
+                    size++;     /* Prefix */
+                break;
+            case OPERAND_MEMORY:
+                if (strcmp(operand, "(C)") == 0)
+                    size++;     /* Prefix */
+                else if (memcmp(operand, "(IX", 3) == 0 || memcmp(operand, "(IY", 3) == 0)
+                    size += 2;  /* Prefix and displacement */
+                else if (strcmp(operand, "(HL)") != 0 && strcmp(operand, "(BC)") != 0 &&
+                         strcmp(operand, "(DE)") != 0 && strcmp(operand, "(SP)") != 0)
+                    size += 3;  /* Address, and prefix for LD BC/DE/SP */
+                break;
+            default:
+                size += 2;      /* Immediate value or address */
+                break;
+        }
+    }
+    switch (inst->opcode) {
+        case Z80_RES:
+        case Z80_SET:
+        case Z80_SRL:
+        case Z80_RR:
+            size++;     /* Prefix */
+            break;
+        case Z80_ADC:
+        case Z80_SBC:
+            if (inst->operand[1] >= 0 && strcmp(inst_string(inst->operand[0]), "HL") == 0)
+                size++;     /* Prefix */
+            break;
+        default:
+            break;
+    }
+    return size;
+}
+
+/*
+ ** Get the distance from a jump to a label, if it is at reach of a
+ ** relative jump. Otherwise returns a value out of range.
+ */
+int cpuz80_distance(int index, char *label)
+{
+    int c;
+    int size;
+    int distance;
+    
+    /*
+     ** Forward (counted from the end of the relative jump)
+     */
+    distance = 0;
+    for (c = index + 1; c < inst_count && distance <= 127; c++) {
+        if (inst_stream[c].type == INST_LABEL && strcmp(inst_string(inst_stream[c].text), label) == 0)
+            return distance;
+        size = cpuz80_size(c);
+        if (size < 0)
+            break;
+        distance += size;
+    }
+    
+    /*
+     ** Backward
+     */
+    distance = -2;
+    for (c = index - 1; c >= 0 && distance >= -128; c--) {
+        size = cpuz80_size(c);
+        if (size < 0)
+            break;
+        distance -= size;
+        if (inst_stream[c].type == INST_LABEL && strcmp(inst_string(inst_stream[c].text), label) == 0)
+            return distance;
+    }
+    return 256;
+}
+
+/*
+ ** Branch relaxation. Replace absolute jumps with relative ones when the
+ ** target is near (only the conditions NZ, Z, NC, and C exist for JR).
+ ** Sizes are estimated by excess, so it is repeated while something
+ ** changes.
+ */
+void cpuz80_relax(void)
+{
+    struct inst *inst;
+    char *condition;
+    char *label;
+    int c;
+    int distance;
+    int changed;
+    
+    do {
+        changed = 0;
+        for (c = 0; c < inst_count; c++) {
+            inst = &inst_stream[c];
+            if (inst->type != INST_OP || inst->opcode != Z80_JP)
+                continue;
+            if (inst->operand[1] >= 0) {
+                condition = inst_string(inst->operand[0]);
+                if (strcmp(condition, "NZ") != 0 && strcmp(condition, "Z") != 0 &&
+                    strcmp(condition, "NC") != 0 && strcmp(condition, "C") != 0)
+                    continue;
+                label = inst_string(inst->operand[1]);
+            } else {
+                if (inst->kind[0] != OPERAND_LABEL)
+                    continue;
+                label = inst_string(inst->operand[0]);
+            }
+            distance = cpuz80_distance(c, label);
+            if (distance < -128 || distance > 127)
+                continue;
+            inst->opcode = Z80_JR;
+            inst_set_text(c, "JR");
+            changed = 1;
+            stats_rule("z80: relative jump");
         }
-    } else {
-        fprintf(stderr, "z80_2op: not found mnemonic %s\n", mnemonic);
+    } while (changed) ;
+}
+
+/*
+ ** Bytes pushed in the stack by an entry of the instruction stream
+ ** (negative if popped). For a call (2 bytes for the return address)
+ ** or a jump, the target label is returned in *callee.
+ */
+int cpuz80_stack(int index, char **callee)
+{
+    struct inst *inst;
+    
+    *callee = NULL;
+    inst = &inst_stream[index];
+    if (inst->type != INST_OP)
+        return 0;
+    switch (inst->opcode) {
+        case Z80_PUSH:
+            return 2;
+        case Z80_POP:
+            return -2;
+        case Z80_CALL:
+            *callee = inst_string(inst->operand[inst->operand[1] >= 0 ? 1 : 0]);
+            return 2;
+        case Z80_JP:
+        case Z80_JR:
+            if (inst->operand[1] < 0 && inst->kind[0] == OPERAND_LABEL)
+                *callee = inst_string(inst->operand[0]);
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+/*
+ ** Check if an entry of the instruction stream only stores a register
+ ** into a variable (or its high byte). Returns the target operand.
+ */
+char *cpuz80_store(int index, char *variable)
+{
+    struct inst *inst;
+    char *operand;
+    int length;
+    
+    inst = &inst_stream[index];
+    if (inst->type != INST_OP || inst->opcode != Z80_LD || inst->kind[1] != OPERAND_REGISTER)
+        return NULL;
+    operand = inst_string(inst->operand[0]);
+    length = strlen(variable);
+    if (operand[0] != '(' || strncmp(operand + 1, variable, length) != 0)
+        return NULL;
+    if (strcmp(operand + 1 + length, ")") != 0 && strcmp(operand + 1 + length, "+1)") != 0)
+        return NULL;
+    return operand;
+}
+
+/*
+ ** Check if the body of a FOR loop (from start to the end of the stream)
+ ** can keep the 8-bit loop variable in register B, and replace
+ ** the reads of the variable with B.
+ **
+ ** It cannot call anything, use BC, jump outside of itself (except to
+ ** the exit), or access the variable other than reading it.
+ */
+int cpuz80_for_register(int start, char *variable, char *exit)
+{
+    struct inst *inst;
+    char memory[MAX_LINE_SIZE];
+    char *operand;
+    int next;
+    int c;
+    int d;
+    int e;
+    
+    sprintf(memory, "(%s)", variable);
+    for (e = 0; e < 2; e++) {  /* The first pass checks, the second one replaces */
+        for (c = start; c < inst_count; c++) {
+            inst = &inst_stream[c];
+            if (inst->type == INST_TEXT)
+                return 0;
+            if (inst->type == INST_LABEL) {
+                if (!inst_internal(inst_string(inst->text)))
+                    return 0;
+                continue;
+            }
+            if (inst->type != INST_OP)
+                continue;
+            if (inst->opcode < 0 || inst->opcode == Z80_CALL || inst->opcode == Z80_RET ||
+                inst->opcode == Z80_DJNZ || inst->opcode == Z80_DW || inst->opcode == Z80_HALT)
+                return 0;
+            for (d = 0; d < 2; d++) {
+                if (inst->operand[d] < 0)
+                    continue;
+                operand = inst_string(inst->operand[d]);
+                if (inst->kind[d] == OPERAND_LABEL) {
+                    if (!inst_inside(start, operand, exit))
+                        return 0;
+                    continue;
+                }
+                if (inst->kind[d] == OPERAND_REGISTER &&
+                    (strcmp(operand, "B") == 0 || strcmp(operand, "C") == 0 || strcmp(operand, "BC") == 0))
+                    return 0;
+                if (strcmp(operand, "(BC)") == 0 || strcmp(operand, "(C)") == 0)
+                    return 0;
+                if (inst->opcode == Z80_JP && inst->kind[d] != OPERAND_CONDITION)   /* JP (HL) */
+                    return 0;
+                if (strcmp(operand, memory) == 0 && d == 1 && inst->opcode == Z80_LD) {
+                    if (strcmp(inst_string(inst->operand[0]), "A") == 0) {
+                        if (e)
+                            inst_set_operand(c, 1, "B", OPERAND_REGISTER);
+                        continue;
+                    }
+                    next = inst_next(c);
+                    if (strcmp(inst_string(inst->operand[0]), "HL") == 0 && next >= 0 &&
+                        inst_stream[next].type == INST_OP && inst_stream[next].opcode == Z80_LD &&
+                        strcmp(inst_string(inst_stream[next].operand[0]), "H") == 0 &&
+                        strcmp(inst_string(inst_stream[next].operand[1]), "0") == 0) {
+                        if (e) {    /* Only L is used */
+                            inst_set_operand(c, 0, "L", OPERAND_REGISTER);
+                            inst_set_operand(c, 1, "B", OPERAND_REGISTER);
+                        }
+                        continue;
+                    }
+                    return 0;
+                }
+                if (inst_symbol(operand, variable))
+                    return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/*
+ ** Check an instruction and its operands (NULL for any operand)
+ */
+static int z80_match(int index, int opcode, char *operand1, char *operand2)
+{
+    struct inst *inst;
+    
+    if (index < 0)
+        return 0;
+    inst = &inst_stream[index];
+    if (inst->type != INST_OP || inst->opcode != opcode)
+        return 0;
+    if (operand1 != NULL && strcmp(inst_string(inst->operand[0]), operand1) != 0)
+        return 0;
+    if (operand2 != NULL && strcmp(inst_string(inst->operand[1]), operand2) != 0)
+        return 0;
+    return 1;
+}
+
+/*
+ ** Replace an instruction
+ */
+static void z80_replace(int index, int opcode, char *operand1, char *operand2)
+{
+    int operands;
+    
+    operands = (operand1 != NULL) + (operand2 != NULL);
+    inst_stream[index].opcode = opcode;
+    inst_set_text(index, z80_mnemonics[opcode]);
+    inst_set_operand(index, 0, operand1, operand1 != NULL ? z80_kind(opcode, operands, operand1) : OPERAND_NONE);
+    inst_set_operand(index, 1, operand2, operand2 != NULL ? z80_kind(opcode, 1, operand2) : OPERAND_NONE);
+}
+
+/*
+ ** Check for the address of an array element indexed by a 8-bit variable:
+ **
+ **     LD HL,(variable)
+ **     LD H,0
+ **     ADD HL,HL       ; Only for 16-bit arrays
+ **     LD DE,array
+ **     ADD HL,DE
+ **
+ ** Returns the size of the elements (zero if it doesn't match), the
+ ** name of the array, and the last instruction of the sequence.
+ */
+int cpuz80_index(int index, char *variable, char *array, int *last)
+{
+    char memory[MAX_LINE_SIZE];
+    char *operand;
+    int size;
+    
+    sprintf(memory, "(%s)", variable);
+    if (!z80_match(index, Z80_LD, "HL", memory))
+        return 0;
+    index = inst_next(index);
+    if (!z80_match(index, Z80_LD, "H", "0"))
+        return 0;
+    index = inst_next(index);
+    size = 1;
+    if (z80_match(index, Z80_ADD, "HL", "HL")) {
+        size = 2;
+        index = inst_next(index);
+    }
+    if (!z80_match(index, Z80_LD, "DE", NULL))
+        return 0;
+    operand = inst_string(inst_stream[index].operand[1]);
+    if (memcmp(operand, ARRAY_PREFIX, strlen(ARRAY_PREFIX)) != 0 || strpbrk(operand, "+-") != NULL)
+        return 0;
+    strcpy(array, operand);
+    index = inst_next(index);
+    if (!z80_match(index, Z80_ADD, "HL", "DE"))
+        return 0;
+    *last = index;
+    return size;
+}
+
+/*
+ ** Check if the body of a FOR loop (from start to the end of the stream)
+ ** can keep a pointer to an array indexed by the 8-bit loop variable in
+ ** IY, and replace the address calculation with the pointer.
+ **
+ ** It cannot call anything, use IX or IY, jump outside of itself (except
+ ** to the exit), or access the variable other than reading it.
+ */
+int cpuz80_for_pointer(int start, char *variable, char *exit, char *array, int size)
+{
+    struct inst *inst;
+    char memory[MAX_LINE_SIZE];
+    char name[MAX_LINE_SIZE];
+    char *operand;
+    int last;
+    int c;
+    int d;
+    int e;
+    
+    sprintf(memory, "(%s)", variable);
+    for (e = 0; e < 2; e++) {  /* The first pass checks, the second one replaces */
+        for (c = start; c < inst_count; c++) {
+            inst = &inst_stream[c];
+            if (inst->type == INST_TEXT)
+                return 0;
+            if (inst->type == INST_LABEL) {
+                if (!inst_internal(inst_string(inst->text)))
+                    return 0;
+                continue;
+            }
+            if (inst->type != INST_OP)
+                continue;
+            if (inst->opcode < 0 || inst->opcode == Z80_CALL || inst->opcode == Z80_RET ||
+                inst->opcode == Z80_DW || inst->opcode == Z80_HALT)
+                return 0;
+            if (cpuz80_index(c, variable, name, &last) == size && strcmp(name, array) == 0) {
+                if (e) {
+                    z80_replace(c, Z80_PUSH, "IY", NULL);
+                    c = inst_next(c);
+                    z80_replace(c, Z80_POP, "HL", NULL);
+                    while (c < last)
+                        inst_delete(++c);
+                }
+                c = last;
+                continue;
+            }
+            for (d = 0; d < 2; d++) {
+                if (inst->operand[d] < 0)
+                    continue;
+                operand = inst_string(inst->operand[d]);
+                if (inst->kind[d] == OPERAND_LABEL) {
+                    if (!inst_inside(start, operand, exit))
+                        return 0;
+                    continue;
+                }
+                if (inst_symbol(operand, "IX") || inst_symbol(operand, "IY"))
+                    return 0;
+                if (inst->opcode == Z80_JP && inst->kind[d] != OPERAND_CONDITION)   /* JP (HL) */
+                    return 0;
+                if (strcmp(operand, memory) == 0 && d == 1 && inst->opcode == Z80_LD)
+                    continue;
+                if (inst_symbol(operand, variable))
+                    return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/*
+ ** Multiply by a constant with shifts and adds, from the top bit down.
+ ** The copy register holds the original value.
+ */
+static void z80_multiply(char *reg, char *copy, int value)
+{
+    int bit;
+    
+    bit = 0x8000;
+    while ((value & bit) == 0)
+        bit >>= 1;
+    while (bit >>= 1) {
+        cpuz80_2op("ADD", reg, reg);
+        if (value & bit)
+            cpuz80_2op("ADD", reg, copy);
     }
 }
 
@@ -538,6 +1117,11 @@ void cpuz80_node_label(struct node *node)
                     node->regs |= REG_F;
                 break;
             }
+            if (node->type == N_MUL8 && node->right->type == N_NUM8 && node->right->value > 2) {
+                cpuz80_node_label(node->left);
+                node->regs = node->left->regs | REG_AF | REG_E;
+                break;
+            }
             if (node->type == N_DIV8 && node->right->type == N_NUM8 && is_power_of_two(node->right->value)) {
                 cpuz80_node_label(node->left);
                 node->regs = node->left->regs;
@@ -554,7 +1138,7 @@ void cpuz80_node_label(struct node *node)
                     cpuz80_node_label(node->left);
                     cpuz80_node_label(node->right);
                     if (node->right->regs == REG_A) {
-                        node->regs = REG_A | REG_B;
+                        node->regs = node->left->regs | REG_A | REG_B;
                     } else {
                         node->regs = node->left->regs | node->right->regs | REG_BC;
                     }
@@ -569,7 +1153,7 @@ void cpuz80_node_label(struct node *node)
                 if ((node->type == N_PLUS8 || node->type == N_MINUS8 || node->type == N_OR8 || node->type == N_AND8 || node->type == N_XOR8) && node->right->type == N_PEEK8 && (node->right->left->regs & REG_A) == 0) {
                     node->regs = node->left->regs | node->right->left->regs;
                 } else if (node->left->regs == REG_A) {
-                    node->regs = REG_A | REG_B;
+                    node->regs = node->right->regs | REG_A | REG_B;
                 } else {
                     node->regs = node->left->regs | node->right->regs | REG_BC;
                 }
@@ -695,7 +1279,7 @@ void cpuz80_node_label(struct node *node)
                     explore = node->right;
                 else
                     explore = NULL;
-                if (explore != NULL && (explore->value == 0 || explore->value == 1 || is_power_of_two(explore->value))) {
+                if (explore != NULL && (explore->value == 0 || explore->value == 1 || is_cheap_multiply(explore->value))) {
                     c = explore->value;
                     cpuz80_node_label(node->left);
                     cpuz80_node_label(node->right);
@@ -703,6 +1287,10 @@ void cpuz80_node_label(struct node *node)
                         node->regs = REG_HL;
                     } else {
                         node->regs = node->left->regs | node->right->regs;
+                        if ((c & 0xff) == 0)
+                            c >>= 8;
+                        if (c > 1 && !is_power_of_two(c))
+                            node->regs |= REG_DE | REG_F;
                     }
                     break;
                 }
@@ -1058,6 +1646,12 @@ void cpuz80_node_generate(struct node *node, int decision)
                 }
                 break;
             }
+            if (node->type == N_MUL8 && node->right->type == N_NUM8 && node->right->value > 2) {
+                cpuz80_node_generate(node->left, 0);
+                cpuz80_2op("LD", "E", "A");
+                z80_multiply("A", "E", node->right->value & 0xff);
+                break;
+            }
             if (node->type == N_DIV8 && node->right->type == N_NUM8 && is_power_of_two(node->right->value)) {
                 cpuz80_node_generate(node->left, 0);
                 c = node->right->value;
@@ -1607,7 +2201,7 @@ void cpuz80_node_generate(struct node *node, int decision)
                     explore = node->right;
                 else
                     explore = NULL;
-                if (explore != NULL && (explore->value == 0 || explore->value == 1 || is_power_of_two(explore->value))) {
+                if (explore != NULL && (explore->value == 0 || explore->value == 1 || is_cheap_multiply(explore->value))) {
                     c = explore->value;
                     if (c == 0) {
                         cpuz80_2op("LD", "HL", "0");
@@ -1616,7 +2210,7 @@ void cpuz80_node_generate(struct node *node, int decision)
                             node = node->left;
                         else
                             node = node->right;
-                        if (c >= 256) {
+                        if ((c & 0xff) == 0) {
                             if (node->type == N_EXTEND8 || node->type == N_EXTEND8S) {
                                 cpuz80_node_generate(node->left, 0);
                                 cpuz80_2op("LD", "H", "A");
@@ -1636,6 +2230,10 @@ void cpuz80_node_generate(struct node *node, int decision)
                             cpuz80_1op("RR", "H");
                             cpuz80_2op("LD", "L", "0");
                             cpuz80_1op("RR", "L");
+                        } else if (c > 1 && !is_power_of_two(c)) {
+                            cpuz80_2op("LD", "D", "H");
+                            cpuz80_2op("LD", "E", "L");
+                            z80_multiply("HL", "DE", c);
                         } else {
                             while (c > 1) {
                                 cpuz80_2op("ADD", "HL", "HL");
@@ -20,12 +20,30 @@
 #define REG_DE  (REG_D | REG_E)
 #define REG_HL  (REG_H | REG_L)
 
+/*
+ ** Opcodes in the instruction stream (sorted by mnemonic)
+ */
+enum z80_opcode {
+    Z80_ADC, Z80_ADD, Z80_AND, Z80_CALL, Z80_CP, Z80_CPL, Z80_DEC, Z80_DI, Z80_DJNZ, Z80_DW,
+    Z80_EI, Z80_EX, Z80_FORG, Z80_HALT, Z80_IN, Z80_INC, Z80_JP, Z80_JR, Z80_LD, Z80_NEG,
+    Z80_OR, Z80_ORG, Z80_OUT, Z80_POP, Z80_PUSH, Z80_RES, Z80_RET, Z80_RLA, Z80_RLCA, Z80_RR,
+    Z80_RRA, Z80_RRCA, Z80_SBC, Z80_SET, Z80_SRL, Z80_SUB, Z80_XOR,
+};
+
 extern void cpuz80_dump(void);
 extern void cpuz80_label(char *);
 extern void cpuz80_empty(void);
+extern void cpuz80_reset(void);
 extern void cpuz80_noop(char *);
 extern void cpuz80_1op(char *, char *);
 extern void cpuz80_2op(char *, char *, char *);
+extern int cpuz80_size(int);
+extern void cpuz80_relax(void);
+extern int cpuz80_stack(int, char **);
+extern char *cpuz80_store(int, char *);
+extern int cpuz80_for_register(int, char *, char *);
+extern int cpuz80_index(int, char *, char *, int *);
+extern int cpuz80_for_pointer(int, char *, char *, char *, int);
 
 extern void cpuz80_node_label(struct node *);
 extern void cpuz80_node_generate(struct node *, int);
@@ -23,9 +23,12 @@
 #include "cvbasic.h"
 #include "node.h"
 #include "driver.h"
+#include "inst.h"
 #include "cpuz80.h"
 #include "cpu6502.h"
 #include "cpu9900.h"
+#include "stats.h"
+#include "library.h"
 
 #ifdef ASM_LIBRARY_PATH
 #define DEFAULT_ASM_LIBRARY_PATH ASM_LIBRARY_PATH
@@ -35,7 +38,6 @@
 
 #define VERSION "v0.9.2 Mar/12/2026"
 
-#define TEMPORARY_ASSEMBLER "cvbasic_temporary.asm"
 
 #define FALSE           0
 #define TRUE            1
@@ -112,10 +114,24 @@ struct console consoles[TOTAL_TARGETS] = {
 
 static int err_code;
 
+/*
+ ** Command line options (applied to each target where they make sense)
+ */
+static int option_ram16;
+static int option_konami;
+static int option_cpm;
+static int option_rom16;
+static int option_stats_json;
+static int option_tight_stack;
+
 static char library_path[4096] = DEFAULT_ASM_LIBRARY_PATH;
 static char path[4096];
 
 static int last_is_return;
+
+static struct select_case *select_pieces;
+static int select_total_pieces;
+static int select_size_pieces;
 static int music_used;
 static int compression_used;
 static int spinner_used;
@@ -154,14 +170,154 @@ static char name[MAX_LINE_SIZE];
 static int name_size;
 static char assigned[MAX_LINE_SIZE];
 
-char temp[MAX_LINE_SIZE];
+/*
+ ** Keywords are classified by get_lex() using a perfect hash.
+ ** The tables are generated by utility/keywords.c
+ */
+static enum keyword_code {
+    K_NONE,
+    K_ABS, K_ASM, K_BANK, K_BITMAP, K_BORDER, K_BUTTON, K_BUTTON2, K_CALL,
+    K_CASE, K_CHRRAM, K_CHRROM, K_CLS, K_CONST, K_CONT, K_CONT1, K_CONT2,
+    K_DATA, K_DEF, K_DEFINE, K_DIM, K_DO, K_DOWN, K_ELSE, K_ELSEIF,
+    K_END, K_EXIT, K_FM_AVAILABLE, K_FM_ENABLED, K_FOR, K_FRAME, K_GOSUB, K_GOTO,
+    K_IF, K_INCLUDE, K_INP, K_KEY, K_LEFT, K_LEN, K_LOOP, K_MODE,
+    K_MUSIC, K_NAMETABLE, K_NEXT, K_NTSC, K_ON, K_OPTION, K_OUT, K_PALETTE,
+    K_PEEK, K_PLAY, K_PLAYING, K_POKE, K_POS, K_PRINT, K_PROCEDURE, K_RANDOM,
+    K_READ, K_REM, K_RESTORE, K_RETURN, K_RIGHT, K_SCREEN, K_SCROLL, K_SELECT,
+    K_SGN, K_SIGNED, K_SOUND, K_SPINNER, K_SPRITE, K_STATUS, K_UNSIGNED, K_UP,
+    K_USR, K_VARPTR, K_VDP, K_VPEEK, K_VPOKE, K_WAIT, K_WEND, K_WHILE,
+} keyword;
+
+#define KEYWORD_MULTIPLIER  506129UL
+#define KEYWORD_SLOTS   256
 
-static struct label *label_hash[HASH_PRIME];
+static char *keyword_name[] = {
+    "",
+    "ABS", "ASM", "BANK", "BITMAP", "BORDER", "BUTTON", "BUTTON2", "CALL",
+    "CASE", "CHRRAM", "CHRROM", "CLS", "CONST", "CONT", "CONT1", "CONT2",
+    "DATA", "DEF", "DEFINE", "DIM", "DO", "DOWN", "ELSE", "ELSEIF",
+    "END", "EXIT", "FM_AVAILABLE", "FM_ENABLED", "FOR", "FRAME", "GOSUB", "GOTO",
+    "IF", "INCLUDE", "INP", "KEY", "LEFT", "LEN", "LOOP", "MODE",
+    "MUSIC", "NAMETABLE", "NEXT", "NTSC", "ON", "OPTION", "OUT", "PALETTE",
+    "PEEK", "PLAY", "PLAYING", "POKE", "POS", "PRINT", "PROCEDURE", "RANDOM",
+    "READ", "REM", "RESTORE", "RETURN", "RIGHT", "SCREEN", "SCROLL", "SELECT",
+    "SGN", "SIGNED", "SOUND", "SPINNER", "SPRITE", "STATUS", "UNSIGNED", "UP",
+    "USR", "VARPTR", "VDP", "VPEEK", "VPOKE", "WAIT", "WEND", "WHILE",
+};
+
+static unsigned char keyword_slot[KEYWORD_SLOTS] = {
+    15,  0,  0, 16,  0,  0, 36,  0,  0,  0, 49,  0,  3,  0, 61,  0,
+     0, 40,  0,  0,  0,  0, 74,  4,  0,  0,  0,  0,  0, 29, 76, 24,
+     0,  0,  7,  0,  0, 50,  0,  0, 68,  0,  0,  0,  0, 27,  0,  0,
+    43, 20,  0,  0, 58,  0,  0,  5,  0, 67,  0,  0,  0,  0, 38,  0,
+     0,  0, 22,  0,  0,  0,  0,  0,  0, 78, 69,  0, 62,  0,  0,  0,
+     0, 73,  0,  0,  1,  0,  0,  0,  0,  0,  8,  0,  0,  0,  0, 10,
+     0, 18, 66, 23,  9,  0,  0, 33,  0,  0,  0, 55,  0,  0,  0,  0,
+     0,  0,  6,  0,  0, 34, 21,  0,  0,  0,  0,  0, 71,  0,  0,  0,
+     0,  0, 14,  0, 46,  0,  0,  0,  0, 32,  0, 54, 30, 35,  0, 41,
+     0,  0,  0,  0,  0,  0,  0,  0, 65,  0,  2,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0, 39,  0, 44,  0,  0,  0,  0, 37, 77,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0, 63,  0,  0,  0,  0,  0,  0,
+    70,  0,  0, 59,  0,  0, 57,  0, 48,  0,  0,  0, 12, 11, 45,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0, 17,  0, 28,  0, 31, 52,  0,
+    53,  0, 64,  0,  0, 26, 80, 79,  0,  0,  0,  0,  0,  0,  0,  0,
+    60, 51,  0, 47,  0,  0, 25, 56, 75, 13,  0, 72, 42,  0, 19,  0,
+};
 
-static struct label *array_hash[HASH_PRIME];
+char temp[MAX_LINE_SIZE];
 
 static struct label *inside_proc;
 static struct label *frame_drive;
+static int loop_pointer;    /* FOR loops use a pointer (IY for Z80, loop_pointer for 6502) */
+
+/*
+ ** TI-99/4A scratchpad. The runtime uses >8340-lastsp for its own
+ ** variables (this must follow cvbasic_9900_prologue.asm), the
+ ** compiled program can use the rest up to >8378 for variables, and
+ ** >8380->83bf for the code of a PROCEDURE (OPTION SCRATCHPAD).
+ */
+#define SCRATCHPAD_RUNTIME  18      /* Without music and bank switching */
+#define SCRATCHPAD_MUSIC    32
+#define SCRATCHPAD_BANKS    4
+#define SCRATCHPAD_FREE     0x38
+#define SCRATCHPAD_CODE     64
+
+static char scratchpad_name[MAX_LINE_SIZE]; /* PROCEDURE requested by OPTION SCRATCHPAD */
+static struct label *scratchpad_procedure;  /* The PROCEDURE when it is placed */
+static int scratchpad_start;
+static int scratchpad_size;
+
+/*
+ ** Control flow between PROCEDUREs, used to find the LOCAL
+ ** variables that can share RAM, and the stack depth.
+ */
+struct flow {
+    struct label *from;     /* PROCEDURE (NULL for the main program) */
+    struct label *to;       /* Label called or jumped to */
+    int jump;               /* GOTO instead of GOSUB */
+};
+
+static struct flow *flows;
+static int total_flows;
+static int size_flows;
+static int overlay_size;        /* Size of the RAM shared by LOCAL variables */
+static int overlay_reclaimed;   /* Bytes saved by sharing */
+
+/*
+ ** Stack used by the runtime, estimated from the prologues: the
+ ** deepest library routine called by the compiled code (without its
+ ** return address), and the video interrupt handler before calling the
+ ** ON FRAME GOSUB procedure. The TI-99/4A library and interrupt
+ ** handler don't use the R10 stack.
+ */
+#define STACK_LIBRARY_Z80       16
+#define STACK_LIBRARY_6502      10
+#define STACK_INTERRUPT_Z80     16
+#define STACK_INTERRUPT_6502    16
+#define STACK_RESERVED          64  /* Without the -tightstack option */
+
+static int stack_main;          /* Worst case for the main program (-1 if unbounded) */
+static int stack_interrupt;     /* Worst case for the video interrupt (-1 if unbounded) */
+
+/*
+ ** Constant propagation. The compiler is single-pass, so the basic
+ ** blocks are found while parsing: a block ends with each label added
+ ** to the instruction stream (a join of control flow), and with each
+ ** statement that can change variables without an assignment (GOSUB,
+ ** NEXT, WAIT, POKE...). A variable assigned a constant keeps it until
+ ** the end of the block, and reading it gives the constant.
+ */
+static int propagate_block = 1; /* Current basic block */
+static int propagate_labels;    /* inst_labels at the start of the block */
+
+/*
+ ** Dead stores. An assignment is dead if the variable is assigned again
+ ** in the same block, without a read or a jump in between (the blocks
+ ** for stores also end with IF and PEEK). A variable never read doesn't
+ ** need its stores nor RAM, unless assembler code can read it.
+ */
+static int store_block = 1;     /* Current block for stores */
+static int assembler_used;      /* ASM, CALL or USR used */
+static int write_only_reclaimed;    /* Bytes saved by variables never read */
+
+/*
+ ** Common subexpressions. An assignment leaves the value of its
+ ** expression in the variable, so until the end of the basic block the
+ ** same expression can be read from the variable instead of computing
+ ** it again. The expressions are kept as text, because the nodes are
+ ** freed after each line. An entry dies when the variable or anything
+ ** the expression reads is assigned.
+ */
+#define AVAILABLE_SIZE  8
+
+static struct available {
+    struct label *holder;       /* Variable holding the value */
+    int block;                  /* Basic block where it is valid */
+    char key[256];              /* Expression as text */
+} available[AVAILABLE_SIZE];
+static int available_next;      /* Next entry to replace */
+
+static int decision;            /* Last constant decision (0 = not constant, 1 = always true, 2 = always false) */
 
 struct signedness {
     struct signedness *next;
@@ -175,12 +331,6 @@ struct constant {
     char name[1];
 };
 
-static struct signedness *signed_hash[HASH_PRIME];
-
-static struct constant *constant_hash[HASH_PRIME];
-
-static struct label *function_hash[HASH_PRIME];
-
 struct macro {
     struct macro *next;
     int total_arguments;
@@ -203,7 +353,32 @@ struct macro_def {
     char *name;
 };
 
-static struct macro *macro_hash[HASH_PRIME];
+/*
+ ** Each identifier is interned once, and points to its meanings.
+ ** A meaning defined again is linked through its own next field, newest first.
+ */
+struct symbol {
+    struct symbol *next;        /* Next symbol in the same hash bucket */
+    unsigned int hash;
+    struct label *label;
+    struct label *array;
+    struct label *function;
+    struct signedness *sign;
+    struct constant *constant;
+    struct macro *macro;
+    char name[1];
+};
+
+#define SYMBOL_INITIAL_BUCKETS  256    /* Power of two */
+
+static struct symbol **symbol_hash;
+static int symbol_buckets;
+
+static struct symbol **symbol_list;    /* Symbols in order of appearance */
+static int symbol_count;
+static int symbol_size;
+
+static struct symbol *lex_symbol;      /* Symbol for the current name (NULL for keywords) */
 
 static struct macro_arg accumulated;
 
@@ -222,6 +397,31 @@ struct node *evaluate_level_5(int *);
 struct node *evaluate_level_6(int *);
 struct node *evaluate_level_7(int *);
 
+/*
+** A CASE inside SELECT CASE
+*/
+struct select_case {
+    int min;            /* Range of values (unsigned) */
+    int max;
+    int label;          /* Start of the CASE code */
+};
+
+/*
+** Lowering of the SELECT CASE dispatch
+*/
+enum select_method {
+    DISPATCH_LINEAR,    /* Compare each CASE in turn */
+    DISPATCH_TREE,      /* Binary search over the sorted CASE */
+    DISPATCH_TABLE      /* Jump table */
+};
+
+struct select_cost {
+    enum select_method method;
+    int cycles;         /* Cycles added over every outcome */
+    int outcomes;       /* Number of outcomes */
+    int bytes;          /* Code size */
+};
+
 /*
 ** Representation for a loop
 */
@@ -232,6 +432,14 @@ struct loop {
     struct node *final;
     int label_loop;     /* Main label, in C this would be destination for 'continue' */
     int label_exit;     /* Exit label, in C this would be destination for 'break' */
+    int node_base;      /* Previous limit of kept expression nodes (FOR) */
+    struct select_case *cases;  /* CASE list (SELECT CASE) */
+    int total_cases;
+    int label_else;     /* CASE ELSE label (SELECT CASE) */
+    int dispatch;       /* Place in the instruction stream for the dispatch code (SELECT CASE) */
+    int body;           /* Place in the instruction stream of the loop label (FOR) */
+    int dead;           /* Place in the instruction stream of the arm never executed, or -1 (IF) */
+    int taken;          /* An arm is always executed, the next ones aren't (IF) */
     char var[1];
 };
 
@@ -378,7 +586,10 @@ void emit_error(char *);
 void emit_warning(char *);
 void bank_finish(void);
 
-int label_hash_value(char *);
+unsigned int symbol_hash_value(char *);
+struct symbol *symbol_search(char *);
+struct symbol *symbol_add(char *);
+void symbol_reset(void);
 struct label *function_search(char *);
 struct label *function_add(char *);
 struct signedness *signed_search(char *);
@@ -389,11 +600,27 @@ struct label *label_search(char *);
 struct label *label_add(char *);
 struct label *array_search(char *);
 struct label *array_add(char *);
+void label_reference(struct label *);
+void propagate_reset(void);
+int propagate_known(struct label *);
+void propagate_assign(struct label *, struct node *);
+void propagate_store(struct label *, int);
+void propagate_bound(struct label *, int, int);
+void propagate_condition(struct node *);
+void propagate_forget(struct label *, int);
+struct node *propagate_reuse(struct node *);
+int propagate_keeps(enum keyword_code);
+int unreachable_start(int);
+void unreachable_end(int);
+void label_scope(struct label *);
+void procedure_flow(struct label *, int);
 struct macro *macro_search(char *);
 struct macro *macro_add(char *);
 
 int lex_skip_spaces(void);
 int lex_sneak_peek(void);
+int keyword_lookup(char *);
+void lex_classify(void);
 void get_lex(void);
 
 void check_for_explicit(char *);
@@ -401,11 +628,34 @@ int extend_types(struct node **, int, struct node **, int);
 int mix_types(struct node **, int, struct node **, int);
 struct node *evaluate_save_expression(int, int);
 int evaluate_expression(int, int, int);
+int condition_is_boolean(struct node *);
+int condition_has_effects(struct node *);
+int condition_split(struct node *, struct node **, struct node **);
+void compile_condition(struct node *, int, int);
 void accumulated_push(enum lexical_component, int, char *);
 void compile_assignment(int);
+long compile_data_file_number(void);
+void compile_data_file(void);
+void select_add(int, int, int);
+enum select_test select_test(struct select_case *, int, int);
+void select_cost_linear(struct select_case *, int, int, int, int, struct select_cost *);
+void select_cost(int, int, int, int, int, int, struct select_cost *);
+void select_emit(int, int, int, int, int, int, int);
+void compile_select_dispatch(struct loop *);
 void compile_statement(int);
 void compile_basic(void);
 int process_variables(void);
+void process_write_only(void);
+void process_overlay(void);
+void process_stack(int);
+void process_variables_6502(int);
+void process_variables_9900(void);
+void scratchpad_close(void);
+void compile_reset(void);
+void define_constants(int, char *[], int);
+void compile_equ(char *, int);
+void compile_frame_drive(FILE *);
+void compile_program(char *, char *, int, char *[], int);
 
 /*
  ** Emit an error
@@ -440,63 +690,63 @@ void bank_finish(void)
 {
     if (machine == SG1000 || machine == SMS) {
         if (bank_current == 0) {
-            fprintf(output, "BANK_0_FREE:\tEQU $3fbf-$\n");
-            fprintf(output, "\tTIMES $3fbf-$ DB $ff\n");
+            inst_printf("BANK_0_FREE:\tEQU $3fbf-$\n");
+            inst_printf("\tTIMES $3fbf-$ DB $ff\n");
         } else if (bank_current == 7 && option_fm != 0) {
-            fprintf(output, "BANK_%d_FREE:\tEQU $7d00-$\n", bank_current);
-            fprintf(output, "\tTIMES $7fbf-$ DB $ff\n");
+            inst_printf("BANK_%d_FREE:\tEQU $7d00-$\n", bank_current);
+            inst_printf("\tTIMES $7fbf-$ DB $ff\n");
         } else {
-            fprintf(output, "BANK_%d_FREE:\tEQU $7fbf-$\n", bank_current);
-            fprintf(output, "\tTIMES $7fbf-$ DB $ff\n");
+            inst_printf("BANK_%d_FREE:\tEQU $7fbf-$\n", bank_current);
+            inst_printf("\tTIMES $7fbf-$ DB $ff\n");
         }
-        fprintf(output, "\tDB $%02x\n", bank_current);
-        fprintf(output, "\tTIMES $40 DB $ff\n");
+        inst_printf("\tDB $%02x\n", bank_current);
+        inst_printf("\tTIMES $40 DB $ff\n");
     } else if (machine == MSX || machine == MSX2) {
         if (bank_current == 0) {
-            fprintf(output, "BANK_0_FREE:\tEQU $7fff-$\n");
-            fprintf(output, "\tTIMES $7fff-$ DB $ff\n");
+            inst_printf("BANK_0_FREE:\tEQU $7fff-$\n");
+            inst_printf("\tTIMES $7fff-$ DB $ff\n");
         } else if (bank_current == 7 && option_fm != 0) {
-            fprintf(output, "BANK_%d_FREE:\tEQU $bd00-$\n", bank_current);
-            fprintf(output, "\tTIMES $bfff-$ DB $ff\n");
+            inst_printf("BANK_%d_FREE:\tEQU $bd00-$\n", bank_current);
+            inst_printf("\tTIMES $bfff-$ DB $ff\n");
         } else {
-            fprintf(output, "BANK_%d_FREE:\tEQU $bfff-$\n", bank_current);
-            fprintf(output, "\tTIMES $bfff-$ DB $ff\n");
+            inst_printf("BANK_%d_FREE:\tEQU $bfff-$\n", bank_current);
+            inst_printf("\tTIMES $bfff-$ DB $ff\n");
         }
-        fprintf(output, "\tDB $%02x\n", bank_konami ? bank_current * 2 : bank_current);
+        inst_printf("\tDB $%02x\n", bank_konami ? bank_current * 2 : bank_current);
     } else if (machine == NES) {
         if (bank_current == 0) {
-            fprintf(output, "BANK_0_FREE:\tEQU $fffa-$\n");
-            fprintf(output, "\tTIMES $fffa-$ DB $ff\n");
+            inst_printf("BANK_0_FREE:\tEQU $fffa-$\n");
+            inst_printf("\tTIMES $fffa-$ DB $ff\n");
         } else {
-            fprintf(output, "BANK_%d_FREE:\tEQU $bfff-$\n", bank_current);
-            fprintf(output, "\tTIMES $bfff-$ DB $ff\n");
+            inst_printf("BANK_%d_FREE:\tEQU $bfff-$\n", bank_current);
+            inst_printf("\tTIMES $bfff-$ DB $ff\n");
         }
-        fprintf(output, "\tDB $%02x\n", (bank_current - 1) & 0x1f);
+        inst_printf("\tDB $%02x\n", (bank_current - 1) & 0x1f);
     } else if (machine == TI994A) {
         if (bank_current == 0) {
             // bank 0 is copied to RAM so is 24k
-            fprintf(output, "BANK_0_FREE:\tEQU >fffe-$\n");
-            fprintf(output, "\t.rept >fffe-$\n");
-            fprintf(output, "\tbyte 255\n");
-            fprintf(output, "\t.endr\n");
+            inst_printf("BANK_0_FREE:\tEQU >fffe-$\n");
+            inst_printf("\t.rept >fffe-$\n");
+            inst_printf("\tbyte 255\n");
+            inst_printf("\t.endr\n");
         } else {
             // other banks are only 8k
-            fprintf(output, "BANK_%d_FREE:\tEQU >7ffe-$\n", bank_current);
-            fprintf(output, "\t.rept >7ffe-$\n");
-            fprintf(output, "\tbyte 255\n");
-            fprintf(output, "\t.endr\n");
+            inst_printf("BANK_%d_FREE:\tEQU >7ffe-$\n", bank_current);
+            inst_printf("\t.rept >7ffe-$\n");
+            inst_printf("\tbyte 255\n");
+            inst_printf("\t.endr\n");
         }
         // output the bank switch address so it doesn't need to be calculated later
-        fprintf(output, "\tdata >%04x\n", (bank_current+2)*2+0x6000);
+        inst_printf("\tdata >%04x\n", (bank_current+2)*2+0x6000);
     } else {
         int c;
         
         if (bank_current == 0) {
-            fprintf(output, "BANK_0_FREE:\tEQU $bfbf-$\n");
-            fprintf(output, "\tTIMES $bfbf-$ DB $ff\n");
+            inst_printf("BANK_0_FREE:\tEQU $bfbf-$\n");
+            inst_printf("\tTIMES $bfbf-$ DB $ff\n");
         } else {
-            fprintf(output, "BANK_%d_FREE:\tEQU $ffbf-$\n", bank_current);
-            fprintf(output, "\tTIMES $ffbf-$ DB $ff\n");
+            inst_printf("BANK_%d_FREE:\tEQU $ffbf-$\n", bank_current);
+            inst_printf("\tTIMES $ffbf-$ DB $ff\n");
         }
         c = (bank_current - 1) & 0x3f;
         if (bank_rom_size == 128)
@@ -507,36 +757,42 @@ void bank_finish(void)
             c |= 0xe0;
         else if (bank_rom_size == 1024)
             c |= 0xc0;
-        fprintf(output, "\tDB $%02x\n", c);
-        fprintf(output, "\tTIMES $40 DB $ff\n");
+        inst_printf("\tDB $%02x\n", c);
+        inst_printf("\tTIMES $40 DB $ff\n");
     }
 }
 
 /*
  ** Calculate a hash value for a name
  */
-int label_hash_value(char *name)
+unsigned int symbol_hash_value(char *name)
 {
     unsigned int value;
     
     value = 0;
     while (*name) {
-        value *= 11;    /* Another prime number */
+        value *= 31;    /* A prime number */
         value += (unsigned int) *name++;
     }
-    return value % HASH_PRIME;
+    return value ^ (value >> 16);
 }
 
 /*
- ** Search for a function
+ ** Search for a symbol
  */
-struct label *function_search(char *name)
+struct symbol *symbol_search(char *string)
 {
-    struct label *explore;
+    struct symbol *explore;
+    unsigned int hash;
     
-    explore = function_hash[label_hash_value(name)];
+    if (string == name && lex_symbol != NULL)   /* Current name is already interned */
+        return lex_symbol;
+    if (symbol_buckets == 0)
+        return NULL;
+    hash = symbol_hash_value(string);
+    explore = symbol_hash[hash & (symbol_buckets - 1)];
     while (explore != NULL) {
-        if (strcmp(explore->name, name) == 0)
+        if (explore->hash == hash && strcmp(explore->name, string) == 0)
             return explore;
         explore = explore->next;
     }
@@ -544,11 +800,141 @@ struct label *function_search(char *name)
 }
 
 /*
- ** Add a constant
+ ** Add a symbol (or get the existing one)
+ */
+struct symbol *symbol_add(char *string)
+{
+    struct symbol **previous;
+    struct symbol *new_one;
+    int c;
+    
+    new_one = symbol_search(string);
+    if (new_one != NULL)
+        return new_one;
+    
+    /*
+     ** Keep the load factor under 3/4
+     */
+    if (symbol_count + 1 > symbol_buckets - symbol_buckets / 4) {
+        free(symbol_hash);
+        if (symbol_buckets == 0)
+            symbol_buckets = SYMBOL_INITIAL_BUCKETS;
+        else
+            symbol_buckets *= 2;
+        symbol_hash = calloc(symbol_buckets, sizeof(struct symbol *));
+        if (symbol_hash == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        for (c = 0; c < symbol_count; c++) {
+            previous = &symbol_hash[symbol_list[c]->hash & (symbol_buckets - 1)];
+            symbol_list[c]->next = *previous;
+            *previous = symbol_list[c];
+        }
+    }
+    if (symbol_count == symbol_size) {
+        symbol_size = symbol_size * 2 + SYMBOL_INITIAL_BUCKETS;
+        symbol_list = realloc(symbol_list, symbol_size * sizeof(struct symbol *));
+        if (symbol_list == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    new_one = malloc(sizeof(struct symbol) + strlen(string));
+    if (new_one == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    new_one->hash = symbol_hash_value(string);
+    new_one->label = NULL;
+    new_one->array = NULL;
+    new_one->function = NULL;
+    new_one->sign = NULL;
+    new_one->constant = NULL;
+    new_one->macro = NULL;
+    strcpy(new_one->name, string);
+    previous = &symbol_hash[new_one->hash & (symbol_buckets - 1)];
+    new_one->next = *previous;
+    *previous = new_one;
+    symbol_list[symbol_count++] = new_one;
+    return new_one;
+}
+
+/*
+ ** Free all the symbols and their meanings
+ */
+void symbol_reset(void)
+{
+    struct symbol *symbol;
+    struct label *label;
+    struct signedness *signedness;
+    struct constant *constant;
+    struct macro *macro;
+    int c;
+    int d;
+    
+    for (c = 0; c < symbol_count; c++) {
+        symbol = symbol_list[c];
+        while (symbol->label != NULL) {
+            label = symbol->label;
+            symbol->label = label->next;
+            free(label);
+        }
+        while (symbol->array != NULL) {
+            label = symbol->array;
+            symbol->array = label->next;
+            free(label);
+        }
+        while (symbol->function != NULL) {
+            label = symbol->function;
+            symbol->function = label->next;
+            free(label);
+        }
+        while (symbol->sign != NULL) {
+            signedness = symbol->sign;
+            symbol->sign = signedness->next;
+            free(signedness);
+        }
+        while (symbol->constant != NULL) {
+            constant = symbol->constant;
+            symbol->constant = constant->next;
+            free(constant);
+        }
+        while (symbol->macro != NULL) {
+            macro = symbol->macro;
+            symbol->macro = macro->next;
+            for (d = 0; d < macro->length; d++)
+                free(macro->definition[d].name);
+            free(macro->definition);
+            free(macro);
+        }
+        free(symbol);
+    }
+    symbol_count = 0;
+    for (c = 0; c < symbol_buckets; c++)
+        symbol_hash[c] = NULL;
+    lex_symbol = NULL;
+}
+
+/*
+ ** Search for a function
+ */
+struct label *function_search(char *name)
+{
+    struct symbol *symbol;
+    
+    symbol = symbol_search(name);
+    if (symbol == NULL)
+        return NULL;
+    return symbol->function;
+}
+
+/*
+ ** Add a function
  */
 struct label *function_add(char *name)
 {
-    struct label **previous;
+    struct symbol *symbol;
     struct label *new_one;
     
     new_one = malloc(sizeof(struct label) + strlen(name));
@@ -559,9 +945,9 @@ struct label *function_add(char *name)
     new_one->used = 0;
     new_one->length = 0;
     strcpy(new_one->name, name);
-    previous = &function_hash[label_hash_value(name)];
-    new_one->next = *previous;
-    *previous = new_one;
+    symbol = symbol_add(name);
+    new_one->next = symbol->function;
+    symbol->function = new_one;
     return new_one;
 }
 
@@ -570,15 +956,12 @@ struct label *function_add(char *name)
  */
 struct signedness *signed_search(char *name)
 {
-    struct signedness *explore;
+    struct symbol *symbol;
     
-    explore = signed_hash[label_hash_value(name)];
-    while (explore != NULL) {
-        if (strcmp(explore->name, name) == 0)
-            return explore;
-        explore = explore->next;
-    }
-    return NULL;
+    symbol = symbol_search(name);
+    if (symbol == NULL)
+        return NULL;
+    return symbol->sign;
 }
 
 /*
@@ -586,7 +969,7 @@ struct signedness *signed_search(char *name)
  */
 struct signedness *signed_add(char *name)
 {
-    struct signedness **previous;
+    struct symbol *symbol;
     struct signedness *new_one;
     
     new_one = malloc(sizeof(struct signedness) + strlen(name));
@@ -596,9 +979,9 @@ struct signedness *signed_add(char *name)
     }
     new_one->sign = 0;
     strcpy(new_one->name, name);
-    previous = &signed_hash[label_hash_value(name)];
-    new_one->next = *previous;
-    *previous = new_one;
+    symbol = symbol_add(name);
+    new_one->next = symbol->sign;
+    symbol->sign = new_one;
     return new_one;
 }
 
@@ -607,15 +990,12 @@ struct signedness *signed_add(char *name)
  */
 struct constant *constant_search(char *name)
 {
-    struct constant *explore;
+    struct symbol *symbol;
     
-    explore = constant_hash[label_hash_value(name)];
-    while (explore != NULL) {
-        if (strcmp(explore->name, name) == 0)
-            return explore;
-        explore = explore->next;
-    }
-    return NULL;
+    symbol = symbol_search(name);
+    if (symbol == NULL)
+        return NULL;
+    return symbol->constant;
 }
 
 /*
@@ -623,7 +1003,7 @@ struct constant *constant_search(char *name)
  */
 struct constant *constant_add(char *name)
 {
-    struct constant **previous;
+    struct symbol *symbol;
     struct constant *new_one;
     
     new_one = malloc(sizeof(struct constant) + strlen(name));
@@ -633,9 +1013,9 @@ struct constant *constant_add(char *name)
     }
     new_one->value = 0;
     strcpy(new_one->name, name);
-    previous = &constant_hash[label_hash_value(new_one->name)];
-    new_one->next = *previous;
-    *previous = new_one;
+    symbol = symbol_add(name);
+    new_one->next = symbol->constant;
+    symbol->constant = new_one;
     return new_one;
 }
 
@@ -644,15 +1024,12 @@ struct constant *constant_add(char *name)
  */
 struct label *label_search(char *name)
 {
-    struct label *explore;
+    struct symbol *symbol;
     
-    explore = label_hash[label_hash_value(name)];
-    while (explore != NULL) {
-        if (strcmp(explore->name, name) == 0)
-            return explore;
-        explore = explore->next;
-    }
-    return NULL;
+    symbol = symbol_search(name);
+    if (symbol == NULL)
+        return NULL;
+    return symbol->label;
 }
 
 /*
@@ -660,7 +1037,7 @@ struct label *label_search(char *name)
  */
 struct label *label_add(char *name)
 {
-    struct label **previous;
+    struct symbol *symbol;
     struct label *new_one;
     
     new_one = malloc(sizeof(struct label) + strlen(name));
@@ -670,10 +1047,16 @@ struct label *label_add(char *name)
     }
     new_one->used = 0;
     strcpy(new_one->name, name);
-    previous = &label_hash[label_hash_value(name)];
     new_one->length = 0;
-    new_one->next = *previous;
-    *previous = new_one;
+    new_one->weight = 0;
+    new_one->scope = NULL;
+    new_one->offset = 0;
+    new_one->known_block = 0;
+    new_one->range_block = 0;
+    new_one->store_block = 0;
+    symbol = symbol_add(name);
+    new_one->next = symbol->label;
+    symbol->label = new_one;
     return new_one;
 }
 
@@ -682,15 +1065,12 @@ struct label *label_add(char *name)
  */
 struct label *array_search(char *name)
 {
-    struct label *explore;
+    struct symbol *symbol;
     
-    explore = array_hash[label_hash_value(name)];
-    while (explore != NULL) {
-        if (strcmp(explore->name, name) == 0)
-            return explore;
-        explore = explore->next;
-    }
-    return NULL;
+    symbol = symbol_search(name);
+    if (symbol == NULL)
+        return NULL;
+    return symbol->array;
 }
 
 /*
@@ -698,7 +1078,7 @@ struct label *array_search(char *name)
  */
 struct label *array_add(char *name)
 {
-    struct label **previous;
+    struct symbol *symbol;
     struct label *new_one;
     
     new_one = malloc(sizeof(struct label) + strlen(name));
@@ -708,113 +1088,581 @@ struct label *array_add(char *name)
     }
     new_one->used = 0;
     strcpy(new_one->name, name);
-    previous = &array_hash[label_hash_value(name)];
-    new_one->next = *previous;
-    *previous = new_one;
+    new_one->weight = 0;
+    new_one->scope = NULL;
+    new_one->offset = 0;
+    new_one->known_block = 0;
+    new_one->range_block = 0;
+    new_one->store_block = 0;
+    symbol = symbol_add(name);
+    new_one->next = symbol->array;
+    symbol->array = new_one;
     return new_one;
 }
 
 /*
- ** Search for a macro
+ ** Count a reference to a variable or array, each enclosing loop
+ ** makes it weigh eight times more.
  */
-struct macro *macro_search(char *name)
+void label_reference(struct label *label)
 {
-    struct macro *explore;
+    struct loop *loop;
+    int weight;
     
-    explore = macro_hash[label_hash_value(name)];
-    while (explore != NULL) {
-        if (strcmp(explore->name, name) == 0)
-            return explore;
-        explore = explore->next;
+    weight = 1;
+    for (loop = loops; loop != NULL; loop = loop->next) {
+        if (loop->type != NESTED_IF && loop->type != NESTED_SELECT && weight < 4096)
+            weight *= 8;
     }
-    return NULL;
+    if (label->weight < 0x10000000)
+        label->weight += weight;
+    label_scope(label);
 }
 
 /*
- ** Add a macro
+ ** Note the PROCEDURE using a variable, a variable used by more
+ ** than one (or by the main program) cannot be LOCAL.
  */
-struct macro *macro_add(char *name)
+void label_scope(struct label *label)
 {
-    struct macro **previous;
-    struct macro *new_one;
-    
-    new_one = malloc(sizeof(struct macro) + strlen(name));
-    if (new_one == NULL) {
-        fprintf(stderr, "Out of memory\n");
-        exit(EXIT_FAILURE);
+    if (label->used & LABEL_SCOPED) {
+        if (label->scope != inside_proc)
+            label->used |= LABEL_NOT_LOCAL;
+    } else {
+        label->used |= LABEL_SCOPED;
+        label->scope = inside_proc;
     }
-    new_one->total_arguments = 0;
-    new_one->in_use = 0;
-    new_one->definition = NULL;
-    new_one->length = 0;
-    new_one->max_length = 0;
-    strcpy(new_one->name, name);
-    previous = &macro_hash[label_hash_value(name)];
-    new_one->next = *previous;
-    *previous = new_one;
-    return new_one;
 }
 
 /*
- ** Avoid spaces
+ ** Note a GOSUB or GOTO to a label
  */
-int lex_skip_spaces(void) {
-    int something = 0;
-    
-    if (line_pos == 0)
-        something = 1;
-    while (line_pos < line_size && isspace(line[line_pos])) {
-        line_pos++;
-        something = 1;
+void procedure_flow(struct label *to, int jump)
+{
+    if (total_flows == size_flows) {
+        size_flows = size_flows * 2 + 16;
+        flows = realloc(flows, size_flows * sizeof(struct flow));
+        if (flows == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
     }
-    return something;
+    flows[total_flows].from = inside_proc;
+    flows[total_flows].to = to;
+    flows[total_flows].jump = jump;
+    total_flows++;
 }
 
 /*
- ** Sneak-peek to next character
+ ** Check if an expression is worth to keep (it isn't a single read)
  */
-int lex_sneak_peek(void) {
-    if (accumulated.length > 0) {
-        if (accumulated.definition[accumulated.length - 1].lex == C_LPAREN)
-            return '(';
+static int available_costly(struct node *tree)
+{
+    while (tree->type == N_EXTEND8 || tree->type == N_EXTEND8S || tree->type == N_REDUCE16)
+        tree = tree->left;
+    if (tree->type >= N_EQUAL8 && tree->type <= N_GREATEREQUAL16S)    /* Better as jumps */
+        return 0;
+    if ((tree->type == N_PEEK8 || tree->type == N_PEEK16) && tree->left->type == N_ADDR)
         return 0;
+    return tree->left != NULL;
+}
+
+/*
+ ** Get an expression as text, variables as {name} and addresses as [name].
+ ** Returns zero if the expression can change without an assignment.
+ */
+static int available_key(struct node *tree, char *key, int *length)
+{
+    char *name;
+    
+    switch (tree->type) {
+        case N_ASSIGN8:
+        case N_ASSIGN16:
+        case N_READ8:
+        case N_READ16:
+        case N_VPEEK:
+        case N_INP:
+        case N_JOY1:
+        case N_JOY2:
+        case N_KEY1:
+        case N_KEY2:
+        case N_SPINNER1:
+        case N_SPINNER2:
+        case N_RANDOM:
+        case N_FRAME:
+        case N_MUSIC:
+        case N_POS:
+        case N_VDPSTATUS:
+        case N_USR:
+        case N_COMMA:
+            return 0;
+        case N_PEEK8:   /* Only arrays and variables */
+        case N_PEEK16:
+            if (tree->left->type != N_ADDR
+                && (tree->left->type != N_PLUS16 || tree->left->left->type != N_ADDR))
+                return 0;
+            break;
+        case N_LOAD8:
+        case N_LOAD16:
+            if (tree->label == NULL)
+                return 0;
+            break;
+        default:
+            break;
     }
-    lex_skip_spaces();
-    if (line_pos == line_size)
-        return '\0';
-    return toupper(line[line_pos]);
+    name = (tree->label != NULL) ? tree->label->name : "";
+    if (*length + (int) strlen(name) + 32 > (int) sizeof(available[0].key))
+        return 0;
+    if (tree->type == N_LOAD8 || tree->type == N_LOAD16)
+        sprintf(key + *length, "(%d,%d{%s}", tree->type, tree->value, name);
+    else
+        sprintf(key + *length, "(%d,%d[%s]", tree->type, tree->value, name);
+    *length += strlen(key + *length);
+    if (tree->left != NULL && !available_key(tree->left, key, length))
+        return 0;
+    if (tree->right != NULL && !available_key(tree->right, key, length))
+        return 0;
+    key[(*length)++] = ')';
+    key[*length] = '\0';
+    return 1;
 }
 
 /*
- ** Gets another lexical component
- ** Output:
- **  lex = lexical component
- **  name = identifier or string
- **  value = value
+ ** Check if an expression reads a variable or array
  */
-void get_lex(void) {
-    int spaces;
-    char *p;
+static int available_reads(char *key, struct label *label, int array)
+{
+    char name[MAX_LINE_SIZE + 2];
+    
+    sprintf(name, "[%s]", label->name);
+    if (strstr(key, name) != NULL)
+        return 1;
+    if (array)
+        return 0;
+    sprintf(name, "{%s}", label->name);
+    return strstr(key, name) != NULL;
+}
 
-    if (accumulated.length > 0) {
-        --accumulated.length;
-        lex = accumulated.definition[accumulated.length].lex;
-        value = accumulated.definition[accumulated.length].value;
-        if (lex == C_STRING) {
-            name_size = value;
-            if (name_size)
-                memcpy(name, accumulated.definition[accumulated.length].name, name_size);
-        } else {
-            strcpy(name, accumulated.definition[accumulated.length].name);
-        }
-        free(accumulated.definition[accumulated.length].name);
-        return;
+/*
+ ** Start a new basic block (forget the constants)
+ */
+void propagate_reset(void)
+{
+    propagate_block++;
+    store_block++;
+    propagate_labels = inst_labels;
+}
+
+/*
+ ** Check if a variable holds a known constant
+ */
+int propagate_known(struct label *label)
+{
+    if (propagate_labels != inst_labels)
+        propagate_reset();
+    return label->known_block == propagate_block;
+}
+
+/*
+ ** Note the value assigned to a variable
+ */
+void propagate_assign(struct label *label, struct node *tree)
+{
+    char key[sizeof(available[0].key)];
+    int length;
+    
+    if (propagate_labels != inst_labels)
+        propagate_reset();
+    if (tree->type == N_NUM8 || tree->type == N_NUM16) {
+        label->known = tree->value & (tree->type == N_NUM8 ? 0xff : 0xffff);
+        label->known_block = propagate_block;
+    } else {
+        label->known_block = 0;
     }
-    name[0] = '\0';
-    spaces = lex_skip_spaces();
-    if (line_pos == line_size) {
-        lex = C_END;
-        return;
+    node_range(tree, &label->low, &label->high);
+    if ((label->used & MAIN_TYPE) == TYPE_8 && label->high > 0xff) {
+        label->low = 0;
+        label->high = 0xff;
+    }
+    label->range_block = propagate_block;
+    propagate_forget(label, 0);
+    length = 0;
+    if (available_costly(tree) && available_key(tree, key, &length) && !available_reads(key, label, 0)) {
+        strcpy(available[available_next].key, key);
+        available[available_next].holder = label;
+        available[available_next].block = propagate_block;
+        available_next = (available_next + 1) % AVAILABLE_SIZE;
+    }
+}
+
+/*
+ ** Get the range of values held by a variable
+ */
+int propagate_range(struct label *label, int *low, int *high)
+{
+    if (propagate_labels != inst_labels)
+        propagate_reset();
+    if (label->range_block != propagate_block)
+        return 0;
+    *low = label->low;
+    *high = label->high;
+    return 1;
+}
+
+/*
+ ** Note a variable is known to be inside a range
+ */
+void propagate_bound(struct label *label, int low, int high)
+{
+    int old_low;
+    int old_high;
+    
+    if (propagate_range(label, &old_low, &old_high)) {
+        if (low < old_low)
+            low = old_low;
+        if (high > old_high)
+            high = old_high;
+    }
+    if (low > high)     /* Contradiction, the code is never reached */
+        return;
+    label->low = low;
+    label->high = high;
+    label->range_block = propagate_block;
+}
+
+/*
+ ** Note the ranges of the variables when a condition is true
+ */
+void propagate_condition(struct node *tree)
+{
+    struct node *variable;
+    struct node *constant;
+    enum node_type type;
+    int mask;
+    int value;
+    int low;
+    int high;
+    
+    if (tree->type == N_AND8) {     /* Both conditions are true */
+        propagate_condition(tree->left);
+        propagate_condition(tree->right);
+        return;
+    }
+    if (tree->type < N_EQUAL8 || tree->type > N_GREATEREQUAL16)   /* Unsigned comparisons */
+        return;
+    type = tree->type;
+    variable = tree->left;
+    constant = tree->right;
+    if (variable->type == N_NUM8 || variable->type == N_NUM16) {    /* Reverse the comparison */
+        variable = tree->right;
+        constant = tree->left;
+        if (type == N_LESS8 || type == N_LESS16)
+            type = N_GREATER16;
+        else if (type == N_LESSEQUAL8 || type == N_LESSEQUAL16)
+            type = N_GREATEREQUAL16;
+        else if (type == N_GREATER8 || type == N_GREATER16)
+            type = N_LESS16;
+        else if (type == N_GREATEREQUAL8 || type == N_GREATEREQUAL16)
+            type = N_LESSEQUAL16;
+    }
+    if (constant->type != N_NUM8 && constant->type != N_NUM16)
+        return;
+    if ((variable->type != N_LOAD8 && variable->type != N_LOAD16) || variable->label == NULL)
+        return;
+    mask = (variable->type == N_LOAD8) ? 0xff : 0xffff;
+    if ((variable->label->used & MAIN_TYPE) == TYPE_16 && mask == 0xff) {  /* Low byte of a 16-bit variable */
+        if (!propagate_range(variable->label, &low, &high) || high > 0xff)
+            return;
+    }
+    value = constant->value & mask;
+    switch (type) {
+        case N_EQUAL8:
+        case N_EQUAL16:
+            propagate_bound(variable->label, value, value);
+            break;
+        case N_LESS8:
+        case N_LESS16:
+            propagate_bound(variable->label, 0, value - 1);
+            break;
+        case N_LESSEQUAL8:
+        case N_LESSEQUAL16:
+            propagate_bound(variable->label, 0, value);
+            break;
+        case N_GREATER8:
+        case N_GREATER16:
+            propagate_bound(variable->label, value + 1, mask);
+            break;
+        case N_GREATEREQUAL8:
+        case N_GREATEREQUAL16:
+            propagate_bound(variable->label, value, mask);
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ ** Forget the expressions changed by an assignment to a variable or array
+ */
+void propagate_forget(struct label *label, int array)
+{
+    int c;
+    
+    if (propagate_labels != inst_labels)
+        propagate_reset();
+    for (c = 0; c < AVAILABLE_SIZE; c++) {
+        if (available[c].block != propagate_block)
+            continue;
+        if ((!array && available[c].holder == label) || available_reads(available[c].key, label, array))
+            available[c].block = 0;
+    }
+}
+
+/*
+ ** Replace the expressions already held by variables
+ */
+struct node *propagate_reuse(struct node *tree)
+{
+    char key[sizeof(available[0].key)];
+    struct label *holder;
+    int length;
+    int c;
+    
+    if (tree == NULL)
+        return NULL;
+    if (propagate_labels != inst_labels)
+        propagate_reset();
+    length = 0;
+    if (available_costly(tree) && available_key(tree, key, &length)) {
+        for (c = 0; c < AVAILABLE_SIZE; c++) {
+            if (available[c].block == propagate_block && strcmp(available[c].key, key) == 0)
+                break;
+        }
+        if (c < AVAILABLE_SIZE) {
+            holder = available[c].holder;
+            holder->used |= LABEL_VAR_READ;
+            holder->store_block = 0;    /* The last assignment is used */
+            stats_rule("common subexpression");
+            tree = node_create((holder->used & MAIN_TYPE) == TYPE_8 ? N_LOAD8 : N_LOAD16, 0, NULL, NULL);
+            tree->label = holder;
+            return tree;
+        }
+    }
+    tree->left = propagate_reuse(tree->left);
+    tree->right = propagate_reuse(tree->right);
+    return tree;
+}
+
+/*
+ ** Note the assignment of a variable (its code starts at start), and
+ ** remove the store of the previous assignment if it is dead.
+ */
+void propagate_store(struct label *label, int start)
+{
+    char variable[MAX_LINE_SIZE];
+    char *operand;
+    int c;
+    int d;
+    
+    if (propagate_labels != inst_labels)
+        propagate_reset();
+    sprintf(variable, LABEL_PREFIX "%s", label->name);
+    if (label->store_block == store_block && (label->used & LABEL_BY_ADDRESS) == 0) {
+        for (c = label->store; c < start; c++) {
+            operand = generic_store(c, variable);
+            if (operand == NULL)
+                continue;
+            for (d = start; d < inst_count; d++) {  /* Only if stored again */
+                if (generic_store(d, variable) != NULL && strcmp(generic_store(d, variable), operand) == 0)
+                    break;
+            }
+            if (d < inst_count) {
+                inst_delete(c);
+                stats_rule("dead store");
+            }
+        }
+    }
+    label->store = start;
+    label->store_block = store_block;
+}
+
+/*
+ ** Check if a statement keeps the known constants (it doesn't
+ ** change variables, or it changes them with assignments)
+ */
+int propagate_keeps(enum keyword_code code)
+{
+    switch (code) {
+        case K_NONE:        /* Assignment */
+        case K_CONST:
+        case K_DIM:
+        case K_ELSE:
+        case K_ELSEIF:
+        case K_GOTO:
+        case K_IF:
+        case K_PRINT:
+        case K_SIGNED:
+        case K_SOUND:
+        case K_SPRITE:
+        case K_UNSIGNED:
+        case K_VPOKE:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/*
+ ** Start the code of an IF arm that is never executed
+ */
+int unreachable_start(int start)
+{
+    if (inst_barrier < start)
+        inst_barrier = start;
+    return start;
+}
+
+/*
+ ** Remove the code of an IF arm that is never executed, from start
+ ** to the end of the instruction stream.
+ */
+void unreachable_end(int start)
+{
+    if (inst_unreachable(start))
+        stats_rule("dead IF arm");
+}
+
+/*
+ ** Search for a macro
+ */
+struct macro *macro_search(char *name)
+{
+    struct symbol *symbol;
+    
+    symbol = symbol_search(name);
+    if (symbol == NULL)
+        return NULL;
+    return symbol->macro;
+}
+
+/*
+ ** Add a macro
+ */
+struct macro *macro_add(char *name)
+{
+    struct symbol *symbol;
+    struct macro *new_one;
+    
+    new_one = malloc(sizeof(struct macro) + strlen(name));
+    if (new_one == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    new_one->total_arguments = 0;
+    new_one->in_use = 0;
+    new_one->definition = NULL;
+    new_one->length = 0;
+    new_one->max_length = 0;
+    strcpy(new_one->name, name);
+    symbol = symbol_add(name);
+    new_one->next = symbol->macro;
+    symbol->macro = new_one;
+    return new_one;
+}
+
+/*
+ ** Avoid spaces
+ */
+int lex_skip_spaces(void) {
+    int something = 0;
+    
+    if (line_pos == 0)
+        something = 1;
+    while (line_pos < line_size && isspace(line[line_pos])) {
+        line_pos++;
+        something = 1;
+    }
+    return something;
+}
+
+/*
+ ** Sneak-peek to next character
+ */
+int lex_sneak_peek(void) {
+    if (accumulated.length > 0) {
+        if (accumulated.definition[accumulated.length - 1].lex == C_LPAREN)
+            return '(';
+        return 0;
+    }
+    lex_skip_spaces();
+    if (line_pos == line_size)
+        return '\0';
+    return toupper(line[line_pos]);
+}
+
+/*
+ ** Classify a name as keyword
+ */
+int keyword_lookup(char *name) {
+    unsigned long h;
+    char *p;
+    int k;
+    
+    h = 0;
+    for (p = name; *p; p++)
+        h = (h * KEYWORD_MULTIPLIER + (unsigned char) *p) & 0xffffffffUL;
+    k = keyword_slot[(h ^ (h >> 11)) % KEYWORD_SLOTS];
+    if (k != K_NONE && strcmp(keyword_name[k], name) == 0)
+        return k;
+    return K_NONE;
+}
+
+/*
+ ** Classify the current name as keyword or symbol
+ */
+void lex_classify(void) {
+    lex_symbol = NULL;
+    keyword = keyword_lookup(name);
+    if (keyword == K_NONE)
+        lex_symbol = symbol_add(name);
+}
+
+/*
+ ** Gets another lexical component
+ ** Output:
+ **  lex = lexical component
+ **  name = identifier or string
+ **  value = value
+ **  keyword = keyword code for names
+ **  lex_symbol = interned symbol for other names
+ */
+void get_lex(void) {
+    int spaces;
+    char *p;
+
+    keyword = K_NONE;
+    lex_symbol = NULL;
+    if (accumulated.length > 0) {
+        --accumulated.length;
+        lex = accumulated.definition[accumulated.length].lex;
+        value = accumulated.definition[accumulated.length].value;
+        if (lex == C_STRING) {
+            name_size = value;
+            if (name_size)
+                memcpy(name, accumulated.definition[accumulated.length].name, name_size);
+        } else {
+            strcpy(name, accumulated.definition[accumulated.length].name);
+            if (lex == C_NAME)
+                lex_classify();
+        }
+        free(accumulated.definition[accumulated.length].name);
+        return;
+    }
+    name[0] = '\0';
+    spaces = lex_skip_spaces();
+    if (line_pos == line_size) {
+        lex = C_END;
+        return;
     }
     if (isalpha(line[line_pos]) ||
         line[line_pos] == '#' ||
@@ -844,10 +1692,11 @@ void get_lex(void) {
         }
         *p = '\0';
         name_size = (int) (p - name);
+        lex_classify();
         if (line_pos < line_size && line[line_pos] == ':' && line_start
-            && strcmp(name, "RETURN") != 0 && strcmp(name, "CLS") != 0 && strcmp(name, "WAIT") != 0
-            && strcmp(name, "RESTORE") != 0 && strcmp(name, "WEND") != 0
-            && strcmp(name, "DO") != 0 && strcmp(name, "NEXT") != 0) {
+            && keyword != K_RETURN && keyword != K_CLS && keyword != K_WAIT
+            && keyword != K_RESTORE && keyword != K_WEND
+            && keyword != K_DO && keyword != K_NEXT) {
             lex = C_LABEL;
             line_pos++;
         } else {
@@ -1029,7 +1878,9 @@ void get_lex(void) {
 void check_for_explicit(char *name) {
     if (!option_explicit)
         return;
-    sprintf(temp, "variable '%s' not defined previously", name);
+    strcpy(temp, "variable '");
+    strcat(temp, name);
+    strcat(temp, "' not defined previously");
     emit_error(temp);
 }
 
@@ -1107,13 +1958,169 @@ struct node *evaluate_save_expression(int cast, int to_type)
     return tree;
 }
 
+/*
+ ** Check if an expression only can be 0 or 255 (a comparison)
+ */
+int condition_is_boolean(struct node *node)
+{
+    switch (node->type) {
+        case N_EQUAL8: case N_EQUAL16: case N_NOTEQUAL8: case N_NOTEQUAL16:
+        case N_LESS8: case N_LESS16: case N_LESSEQUAL8: case N_LESSEQUAL16:
+        case N_GREATER8: case N_GREATER16: case N_GREATEREQUAL8: case N_GREATEREQUAL16:
+        case N_LESS8S: case N_LESS16S: case N_LESSEQUAL8S: case N_LESSEQUAL16S:
+        case N_GREATER8S: case N_GREATER16S: case N_GREATEREQUAL8S: case N_GREATEREQUAL16S:
+            return 1;
+        case N_AND8: case N_OR8: case N_XOR8:
+            return condition_is_boolean(node->left) && condition_is_boolean(node->right);
+        case N_NOT8:
+            return condition_is_boolean(node->left);
+        case N_NUM8:
+            return node->value == 0 || node->value == 255;
+        default:
+            return 0;
+    }
+}
+
+/*
+ ** Check if an expression does something more than reading values,
+ ** so it cannot be skipped.
+ */
+int condition_has_effects(struct node *node)
+{
+    if (node == NULL)
+        return 0;
+    if (node->type == N_USR || node->type == N_RANDOM || node->type == N_READ8
+     || node->type == N_READ16 || node->type == N_INP || node->type == N_VDPSTATUS)
+        return 1;
+    return condition_has_effects(node->left) || condition_has_effects(node->right);
+}
+
+/*
+ ** Check if an AND/OR can be evaluated in short-circuit, the first
+ ** operand decides the result when it is false (AND) or true (OR).
+ **
+ ** This is possible if the first operand is a comparison (255 AND x is x,
+ ** 255 OR x is true), and the second one can be skipped.
+ */
+int condition_split(struct node *node, struct node **first, struct node **second)
+{
+    struct node *left;
+    struct node *right;
+    
+    if (node->type == N_AND16 || node->type == N_OR16) {
+        if (node->left->type != N_EXTEND8 || node->right->type != N_EXTEND8)
+            return 0;
+        left = node->left->left;
+        right = node->right->left;
+        if (!condition_is_boolean(left) || !condition_is_boolean(right))
+            return 0;
+    } else if (node->type == N_AND8 || node->type == N_OR8) {
+        left = node->left;
+        right = node->right;
+    } else {
+        return 0;
+    }
+    if (condition_is_boolean(left) && !condition_has_effects(right)) {
+        *first = left;
+        *second = right;
+        return 1;
+    }
+    if (condition_is_boolean(right) && !condition_has_effects(left)) {
+        *first = right;
+        *second = left;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ ** Generate a condition as a chain of jumps, jumps to label when
+ ** the condition is true (when = 1) or false (when = 0).
+ */
+void compile_condition(struct node *node, int label, int when)
+{
+    struct node *first;
+    struct node *second;
+    int skip;
+    
+    if (condition_split(node, &first, &second)) {
+        if ((node->type == N_AND8 || node->type == N_AND16) != when) {
+            compile_condition(first, label, when);
+            compile_condition(second, label, when);
+        } else {
+            skip = next_local++;
+            compile_condition(first, skip, !when);
+            compile_condition(second, label, when);
+            sprintf(temp, INTERNAL_PREFIX "%d", skip);
+            generic_label(temp);
+        }
+        return;
+    }
+    if (node->type == N_NOT8 && condition_is_boolean(node->left)) {
+        compile_condition(node->left, label, !when);
+        return;
+    }
+    if (node->type == N_NUM8 || node->type == N_NUM16) {
+        if ((node->value != 0) == when) {
+            sprintf(temp, INTERNAL_PREFIX "%d", label);
+            generic_jump(temp);
+        }
+        return;
+    }
+    
+    /*
+     ** The backends jump when a comparison is false, so the
+     ** comparison is reversed to jump when true.
+     */
+    if (when && condition_is_boolean(node) && node->type != N_AND8 && node->type != N_OR8 && node->type != N_XOR8) {
+        switch (node->type) {
+            case N_EQUAL8: node->type = N_NOTEQUAL8; break;
+            case N_EQUAL16: node->type = N_NOTEQUAL16; break;
+            case N_NOTEQUAL8: node->type = N_EQUAL8; break;
+            case N_NOTEQUAL16: node->type = N_EQUAL16; break;
+            case N_LESS8: node->type = N_GREATEREQUAL8; break;
+            case N_LESS16: node->type = N_GREATEREQUAL16; break;
+            case N_LESSEQUAL8: node->type = N_GREATER8; break;
+            case N_LESSEQUAL16: node->type = N_GREATER16; break;
+            case N_GREATER8: node->type = N_LESSEQUAL8; break;
+            case N_GREATER16: node->type = N_LESSEQUAL16; break;
+            case N_GREATEREQUAL8: node->type = N_LESS8; break;
+            case N_GREATEREQUAL16: node->type = N_LESS16; break;
+            case N_LESS8S: node->type = N_GREATEREQUAL8S; break;
+            case N_LESS16S: node->type = N_GREATEREQUAL16S; break;
+            case N_LESSEQUAL8S: node->type = N_GREATER8S; break;
+            case N_LESSEQUAL16S: node->type = N_GREATER16S; break;
+            case N_GREATER8S: node->type = N_LESSEQUAL8S; break;
+            case N_GREATER16S: node->type = N_LESSEQUAL16S; break;
+            case N_GREATEREQUAL8S: node->type = N_LESS8S; break;
+            case N_GREATEREQUAL16S: node->type = N_LESS16S; break;
+            default: break;
+        }
+        when = 0;
+    }
+    optimized = 0;
+    node_label(node);
+    node_generate(node, when ? 0 : label);
+    sprintf(temp, INTERNAL_PREFIX "%d", label);
+    if (when) {
+        generic_test_8();
+        generic_jump_nonzero(temp);
+    } else if (!optimized) {
+        generic_test_8();
+        generic_jump_zero(temp);
+    }
+}
+
 int evaluate_expression(int cast, int to_type, int label)
 {
     struct node *tree;
+    struct node *first;
+    struct node *second;
     int type;
     
     optimized = 0;
-    tree = evaluate_level_0(&type);
+    decision = 0;
+    tree = propagate_reuse(evaluate_level_0(&type));
     if (cast != 0) {
         if (to_type == TYPE_8 && (type & MAIN_TYPE) == TYPE_16) {
             tree = node_create(N_REDUCE16, 0, tree, NULL);
@@ -1136,7 +2143,6 @@ int evaluate_expression(int cast, int to_type, int label)
             temp = tree;
             tree = temp->left;
             temp->left = NULL;
-            node_delete(temp);
             type = TYPE_8;
         }
     }
@@ -1144,19 +2150,29 @@ int evaluate_expression(int cast, int to_type, int label)
         if (tree->value == 0) {
             sprintf(temp, INTERNAL_PREFIX "%d", label);
             generic_jump(temp);     /* Jump over */
+            decision = 2;
         } else {
             /* No code generated :) */
+            decision = 1;
         }
-        node_delete(tree);
         return type;
     }
     
     if (cast == 2)
         return type;
-    node_label(tree);
-    /*    node_visual(tree); */ /* Debugging */
-    node_generate(tree, label);
-    node_delete(tree);
+    if (label != 0)     /* The code after the jump knows the condition is true */
+        propagate_condition(tree);
+    
+    /*
+     ** Decision with AND/OR of comparisons, jump as soon as the result is known.
+     */
+    if (label != 0 && condition_split(tree, &first, &second)) {
+        compile_condition(tree, label, 0);
+        return type;
+    }
+    node_label(tree);
+    /*    node_visual(tree); */ /* Debugging */
+    node_generate(tree, label);
     if (label != 0 && !optimized) {
         if ((type & MAIN_TYPE) == TYPE_8) {
             generic_test_8();
@@ -1459,7 +2475,7 @@ struct node *evaluate_level_7(int *type)
         return node_create(N_NUM8, temp, NULL, NULL);
     }
     if (lex == C_NAME) {
-        if (strcmp(name, "INP") == 0) {
+        if (keyword == K_INP) {
             get_lex();
             if (lex != C_LPAREN) {
                 emit_error("missing left parenthesis in INP");
@@ -1478,8 +2494,9 @@ struct node *evaluate_level_7(int *type)
                 emit_warning("Ignoring INP (not supported in this platform)");
             return tree;
         }
-        if (strcmp(name, "PEEK") == 0) {
+        if (keyword == K_PEEK) {
             get_lex();
+            store_block++;  /* It can read any variable */
             if (lex != C_LPAREN) {
                 emit_error("missing left parenthesis in PEEK");
             }
@@ -1495,7 +2512,7 @@ struct node *evaluate_level_7(int *type)
             *type = TYPE_8;
             return tree;
         }
-        if (strcmp(name, "VPEEK") == 0) {
+        if (keyword == K_VPEEK) {
             if (machine == NES)
                 emit_error("VPEEK cannot be used in NES/Famicom");
             get_lex();
@@ -1514,7 +2531,7 @@ struct node *evaluate_level_7(int *type)
             *type = TYPE_8;
             return tree;
         }
-        if (strcmp(name, "ABS") == 0) {
+        if (keyword == K_ABS) {
             get_lex();
             if (lex != C_LPAREN)
                 emit_error("missing left parenthesis in ABS");
@@ -1530,7 +2547,7 @@ struct node *evaluate_level_7(int *type)
             *type = TYPE_16;    /* It is unsigned now */
             return tree;
         }
-        if (strcmp(name, "SGN") == 0) {
+        if (keyword == K_SGN) {
             get_lex();
             if (lex != C_LPAREN)
                 emit_error("missing left parenthesis in SGN");
@@ -1546,21 +2563,21 @@ struct node *evaluate_level_7(int *type)
             *type = TYPE_16 | TYPE_SIGNED;
             return tree;
         }
-        if (strcmp(name, "CONT") == 0 || strcmp(name, "CONT1") == 0 || strcmp(name, "CONT2") == 0) {
+        if (keyword == K_CONT || keyword == K_CONT1 || keyword == K_CONT2) {
             struct node *tree = NULL;
             int cont;
             
             *type = TYPE_8;
-            if (strcmp(name, "CONT1") == 0)
+            if (keyword == K_CONT1)
                 cont = 1;
-            else if (strcmp(name, "CONT2") == 0)
+            else if (keyword == K_CONT2)
                 cont = 2;
             else
                 cont = 0;
             get_lex();
             if (lex == C_PERIOD) {
                 get_lex();
-                if (strcmp(name, "SPINNER") == 0) {
+                if (keyword == K_SPINNER) {
                     if (machine != COLECOVISION && machine != COLECOVISION_SGM) {
                         emit_error("SPINNER is only available for Colecovision");
                         tree = node_create(N_NUM8, 0, NULL, NULL);
@@ -1575,7 +2592,7 @@ struct node *evaluate_level_7(int *type)
                     tree = node_create(N_EXTEND8S, 0, tree, NULL);
                     *type = TYPE_16;
                     spinner_used = 1;
-                } else if (strcmp(name, "KEY") == 0) {
+                } else if (keyword == K_KEY) {
                     if (cont == 1) {
                         tree = node_create(N_KEY1, 0, NULL, NULL);
                     } else if (cont == 2) {
@@ -1596,25 +2613,25 @@ struct node *evaluate_level_7(int *type)
                 }
                 if (lex != C_NAME) {
                     emit_error("CONT syntax error");
-                } else if (strcmp(name, "UP") == 0) {
+                } else if (keyword == K_UP) {
                     get_lex();
                     tree = node_create(N_AND8, 0, tree, node_create(N_NUM8, 1, NULL, NULL));
-                } else if (strcmp(name, "RIGHT") == 0) {
+                } else if (keyword == K_RIGHT) {
                     get_lex();
                     tree = node_create(N_AND8, 0, tree, node_create(N_NUM8, 2, NULL, NULL));
-                } else if (strcmp(name, "DOWN") == 0) {
+                } else if (keyword == K_DOWN) {
                     get_lex();
                     tree = node_create(N_AND8, 0, tree, node_create(N_NUM8, 4, NULL, NULL));
-                } else if (strcmp(name, "LEFT") == 0) {
+                } else if (keyword == K_LEFT) {
                     get_lex();
                     tree = node_create(N_AND8, 0, tree, node_create(N_NUM8, 8, NULL, NULL));
-                } else if (strcmp(name, "BUTTON") == 0) {
+                } else if (keyword == K_BUTTON) {
                     get_lex();
                     tree = node_create(N_AND8, 0, tree, node_create(N_NUM8, 0x40, NULL, NULL));
-                } else if (strcmp(name, "BUTTON2") == 0) {
+                } else if (keyword == K_BUTTON2) {
                     get_lex();
                     tree = node_create(N_AND8, 0, tree, node_create(N_NUM8, 0x80, NULL, NULL));
-                } else if (strcmp(name, "KEY") == 0 || strcmp(name, "SPINNER") == 0) {
+                } else if (keyword == K_KEY || keyword == K_SPINNER) {
                     get_lex();
                 } else {
                     emit_error("Wrong field for CONT");
@@ -1631,7 +2648,7 @@ struct node *evaluate_level_7(int *type)
             }
             return tree;
         }
-        if (strcmp(name, "RANDOM") == 0) {
+        if (keyword == K_RANDOM) {
             get_lex();
             if (lex == C_LPAREN) {
                 get_lex();
@@ -1649,13 +2666,13 @@ struct node *evaluate_level_7(int *type)
             *type = TYPE_16;
             return tree;
         }
-        if (strcmp(name, "FRAME") == 0) {
+        if (keyword == K_FRAME) {
             get_lex();
             tree = node_create(N_FRAME, 0, NULL, NULL);
             *type = TYPE_16;
             return tree;
         }
-        if (strcmp(name, "MUSIC") == 0) {
+        if (keyword == K_MUSIC) {
             int c;
             
             get_lex();
@@ -1667,13 +2684,13 @@ struct node *evaluate_level_7(int *type)
             if (lex != C_NAME) {
                 emit_error("syntax error in MUSIC");
                 c = 0;
-            } else if (strcmp(name, "PLAYING") == 0) {
+            } else if (keyword == K_PLAYING) {
                 get_lex();
                 c = 0;
-            } else if (strcmp(name, "FM_AVAILABLE") == 0 && (machine == MSX || machine == MSX2 || machine == SMS)) {
+            } else if (keyword == K_FM_AVAILABLE && (machine == MSX || machine == MSX2 || machine == SMS)) {
                 get_lex();
                 c = 1;
-            } else if (strcmp(name, "FM_ENABLED") == 0 && (machine == MSX || machine == MSX2 || machine == SMS)) {
+            } else if (keyword == K_FM_ENABLED && (machine == MSX || machine == MSX2 || machine == SMS)) {
                 get_lex();
                 c = 2;
             } else {
@@ -1684,14 +2701,14 @@ struct node *evaluate_level_7(int *type)
             *type = TYPE_8;
             return tree;
         }
-        if (strcmp(name, "VDP") == 0) {
+        if (keyword == K_VDP) {
             get_lex();
             if (lex != C_PERIOD) {
                 emit_error("missing period in VDP");
             } else {
                 get_lex();
             }
-            if (lex != C_NAME || strcmp(name, "STATUS") != 0) {
+            if (lex != C_NAME || keyword != K_STATUS) {
                 emit_error("only allowed VDP.STATUS");
             } else {
                 get_lex();
@@ -1700,19 +2717,20 @@ struct node *evaluate_level_7(int *type)
             *type = TYPE_8;
             return tree;
         }
-        if (strcmp(name, "NTSC") == 0) {
+        if (keyword == K_NTSC) {
             get_lex();
             tree = node_create(N_NTSC, 0, NULL, NULL);
             *type = TYPE_8;
             return tree;
         }
-        if (strcmp(name, "USR") == 0) {  /* Call to function written in assembler */
+        if (keyword == K_USR) {  /* Call to function written in assembler */
             get_lex();
+            propagate_reset();
             tree = process_usr(0);
             *type = TYPE_16;
             return tree;
         }
-        if (strcmp(name, "VARPTR") == 0) {  /* Access to variable/array/label address */
+        if (keyword == K_VARPTR) {  /* Access to variable/array/label address */
             *type = TYPE_16;
             get_lex();
             check_for_macro();
@@ -1779,12 +2797,13 @@ struct node *evaluate_level_7(int *type)
                     label->used = TYPE_8;
                 label->used |= LABEL_IS_VARIABLE;
             }
+            label->used |= LABEL_NOT_LOCAL | LABEL_BY_ADDRESS;  /* Its address can be used anywhere */
             get_lex();
             tree = node_create(N_ADDR, 0, NULL, NULL);
             tree->label = label;
             return tree;
         }
-        if (strcmp(name, "LEN") == 0) { /* Access to string length */
+        if (keyword == K_LEN) { /* Access to string length */
             int c;
             
             get_lex();
@@ -1806,7 +2825,7 @@ struct node *evaluate_level_7(int *type)
             *type = TYPE_16;
             return node_create(N_NUM16, c, NULL, NULL);
         }
-        if (strcmp(name, "POS") == 0) { /* Access to current screen position */
+        if (keyword == K_POS) { /* Access to current screen position */
             int type2;
             
             get_lex();
@@ -1815,7 +2834,6 @@ struct node *evaluate_level_7(int *type)
             else
                 get_lex();
             tree = evaluate_level_0(&type2);
-            node_delete(tree);
             if (lex != C_RPAREN)
                 emit_error("missing right parenthesis in POS");
             else
@@ -1841,6 +2859,7 @@ struct node *evaluate_level_7(int *type)
                 *type |= TYPE_SIGNED;
             label = array_search(name);
             if (label != NULL) {    /* Found array */
+                label_reference(label);
             } else {
                 label = label_search(name);
                 if (label != NULL) {
@@ -1907,8 +2926,14 @@ struct node *evaluate_level_7(int *type)
             label->used |= LABEL_IS_VARIABLE;
         }
         label->used |= LABEL_VAR_READ;
+        label_reference(label);
         *type |= label->used & MAIN_TYPE;
         get_lex();
+        if (propagate_known(label)) {
+            stats_rule("constant propagation");
+            return node_create((*type & MAIN_TYPE) == TYPE_8 ? N_NUM8 : N_NUM16, label->known, NULL, NULL);
+        }
+        label->store_block = 0;     /* The last assignment is used */
         if ((*type & MAIN_TYPE) == TYPE_8)
             tree = node_create(N_LOAD8, 0, NULL, NULL);
         else
@@ -1946,6 +2971,7 @@ struct node *process_usr(int is_call)
     struct label *function;
     int type2;
     
+    assembler_used = 1;
     if (lex != C_NAME) {
         if (is_call)
             emit_error("missing function name in CALL");
@@ -2136,6 +3162,10 @@ int replace_macro(void)
     lex = accumulated.definition[c].lex;
     value = accumulated.definition[c].value;
     strcpy(name, accumulated.definition[c].name);
+    keyword = K_NONE;
+    lex_symbol = NULL;
+    if (lex == C_NAME)
+        lex_classify();
     free(accumulated.definition[c].name);
     macro->in_use = 0;
     return 0;
@@ -2152,6 +3182,8 @@ void compile_assignment(int is_read)
     int type2;
     struct label *label;
     struct signedness *sign;
+    int start;
+    int removable;
     
     if (lex != C_NAME) {
         emit_error("name required for assignment");
@@ -2174,12 +3206,13 @@ void compile_assignment(int is_read)
             label = array_add(name);
             label->length = 10;
         }
+        label_reference(label);
         get_lex();
         if (lex != C_LPAREN)
             emit_error("missing left parenthesis in array access");
         else
             get_lex();
-        tree = evaluate_level_0(&type);
+        tree = propagate_reuse(evaluate_level_0(&type));
         if (lex != C_RPAREN)
             emit_error("missing right parenthesis in array access");
         else
@@ -2202,7 +3235,7 @@ void compile_assignment(int is_read)
                 return;
             }
             get_lex();
-            tree = evaluate_level_0(&type);
+            tree = propagate_reuse(evaluate_level_0(&type));
         }
         if ((type2 & MAIN_TYPE) == TYPE_16 && (type & MAIN_TYPE) == TYPE_8)
             tree = node_create((type & TYPE_SIGNED) ? N_EXTEND8S : N_EXTEND8, 0, tree, NULL);
@@ -2216,7 +3249,7 @@ void compile_assignment(int is_read)
         node_label(tree);
 /*        node_visual(tree); */ /* @@@ debugging */
         node_generate(tree, 0);
-        node_delete(tree);
+        propagate_forget(label, 1);
         return;
     }
     strcpy(assigned, name);
@@ -2243,6 +3276,7 @@ void compile_assignment(int is_read)
         label->used |= LABEL_IS_VARIABLE;
     }
     label->used |= LABEL_VAR_WRITE;
+    label_reference(label);
     type2 |= label->used & MAIN_TYPE;
     get_lex();
     if (is_read) {
@@ -2254,18 +3288,438 @@ void compile_assignment(int is_read)
             return;
         }
         get_lex();
-        tree = evaluate_level_0(&type);
+        tree = propagate_reuse(evaluate_level_0(&type));
     }
     if ((type2 & MAIN_TYPE) == TYPE_16 && (type & MAIN_TYPE) == TYPE_8)
         tree = node_create((type & TYPE_SIGNED) ? N_EXTEND8S : N_EXTEND8, 0, tree, NULL);
     else if ((type2 & MAIN_TYPE) == TYPE_8 && (type & MAIN_TYPE) == TYPE_16)
         tree = node_create(N_REDUCE16, 0, tree, NULL);
+    propagate_assign(label, tree);
     var = node_create(N_ADDR, 0, NULL, NULL);
     var->label = label_search(label->name);
     tree = node_create((type2 & MAIN_TYPE) == TYPE_8 ? N_ASSIGN8 : N_ASSIGN16, 0, tree, var);
     node_label(tree);
+    
+    /*
+     ** If the variable isn't read yet, process_write_only can remove
+     ** this assignment. The code after it cannot rely on its registers.
+     */
+    removable = !is_read && (label->used & (LABEL_VAR_READ | LABEL_BY_ADDRESS)) == 0
+        && !condition_has_effects(tree->left);
+    if (removable)
+        inst_mark(label->name);
+    start = inst_count;
     node_generate(tree, 0);
-    node_delete(tree);
+    if (removable) {
+        inst_mark(label->name);
+        generic_dump();
+        generic_reset();
+    }
+    propagate_store(label, start);
+}
+
+/*
+ ** Get the offset or length for DATA BYTE FILE
+ **
+ ** A plain number isn't limited to 16 bits, so it can reach anywhere in a big file.
+ */
+long compile_data_file_number(void)
+{
+    struct node *tree;
+    long number;
+    int type;
+    int c;
+    
+    c = lex_sneak_peek();
+    if (lex == C_NUM && (c == ',' || c == ':' || c == '\0')) {
+        number = value;
+        get_lex();
+        return number;
+    }
+    tree = evaluate_level_0(&type);
+    if (tree->type != N_NUM8 && tree->type != N_NUM16) {
+        emit_error("not a constant expression in DATA BYTE FILE");
+        number = 0;
+    } else {
+        number = tree->value;
+    }
+    return number;
+}
+
+/*
+ ** Compile DATA BYTE FILE "file"[,offset[,length]]
+ **
+ ** The binary file is copied directly as data bytes, without going
+ ** through the lexical analyzer.
+ */
+void compile_data_file(void)
+{
+    static char hex[] = "0123456789abcdef";
+    char file_name[MAX_LINE_SIZE];
+    char text[16 * 4 + 16];
+    unsigned char buffer[16];
+    FILE *data;
+    long offset;
+    long length;
+    long size;
+    char *p;
+    int bytes;
+    int c;
+    
+    if (lex != C_STRING) {
+        emit_error("missing file name in DATA BYTE FILE");
+        return;
+    }
+    memcpy(file_name, name, name_size);
+    file_name[name_size] = '\0';
+    get_lex();
+    offset = 0;
+    length = -1;    /* Up to the end of the file */
+    if (lex == C_COMMA) {
+        get_lex();
+        offset = compile_data_file_number();
+        if (lex == C_COMMA) {
+            get_lex();
+            length = compile_data_file_number();
+        }
+    }
+    if (offset < 0 || length < -1) {
+        emit_error("negative offset or length in DATA BYTE FILE");
+        return;
+    }
+    data = fopen(file_name, "rb");
+    if (data == NULL) {
+        emit_error("DATA BYTE FILE not successful");
+        return;
+    }
+    fseek(data, 0, SEEK_END);
+    size = ftell(data);
+    if (offset > size) {
+        emit_error("offset outside of file in DATA BYTE FILE");
+        fclose(data);
+        return;
+    }
+    if (length == -1)
+        length = size - offset;
+    if (offset + length > size) {
+        emit_error("DATA BYTE FILE goes beyond the end of file");
+        length = size - offset;
+    }
+    fseek(data, offset, SEEK_SET);
+    while (length > 0) {
+        if (length > (long) sizeof(buffer))
+            bytes = sizeof(buffer);
+        else
+            bytes = (int) length;
+        bytes = (int) fread(buffer, 1, bytes, data);
+        if (bytes == 0)
+            break;
+        length -= bytes;
+        p = text;
+        for (c = 0; c < bytes; c++) {
+            if (c == 0) {
+                if (target == CPU_9900) {
+                    strcpy(p, "\tbyte ");
+                    p += 6;
+                } else {
+                    strcpy(p, "\tDB ");
+                    p += 4;
+                }
+            } else {
+                *p++ = ',';
+            }
+            *p++ = (target == CPU_9900) ? '>' : '$';
+            *p++ = hex[buffer[c] >> 4];
+            *p++ = hex[buffer[c] & 0x0f];
+        }
+        *p++ = '\n';
+        *p = '\0';
+        inst_printf("%s", text);
+    }
+    fclose(data);
+}
+
+/*
+ ** Add a CASE range to the SELECT CASE pieces, without the values
+ ** already taken by previous CASE (the first one wins).
+ */
+void select_add(int min, int max, int label)
+{
+    struct select_case *piece;
+    int c;
+    
+    for (c = 0; c < select_total_pieces; c++) {
+        piece = &select_pieces[c];
+        if (max < piece->min || min > piece->max)
+            continue;
+        if (min < piece->min)
+            select_add(min, piece->min - 1, label);
+        if (max > piece->max)
+            select_add(piece->max + 1, max, label);
+        return;
+    }
+    if (select_total_pieces == select_size_pieces) {
+        select_size_pieces = select_size_pieces * 2 + 16;
+        select_pieces = realloc(select_pieces, select_size_pieces * sizeof(struct select_case));
+        if (select_pieces == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    select_pieces[select_total_pieces].min = min;
+    select_pieces[select_total_pieces].max = max;
+    select_pieces[select_total_pieces].label = label;
+    select_total_pieces++;
+}
+
+/*
+ ** Compare two SELECT CASE pieces for sorting.
+ */
+static int select_compare(const void *a, const void *b)
+{
+    return ((struct select_case *) a)->min - ((struct select_case *) b)->min;
+}
+
+/*
+ ** Kind of test for a piece when the value is known to be inside low-high
+ */
+enum select_test select_test(struct select_case *piece, int low, int high)
+{
+    if (piece->min <= low && piece->max >= high)
+        return SELECT_JUMP;
+    if (piece->max == 0)
+        return SELECT_ZERO;
+    if (piece->min <= low || piece->max >= high)
+        return SELECT_BOUND;
+    if (piece->min == piece->max)
+        return SELECT_EQUAL;
+    return SELECT_RANGE;
+}
+
+/*
+ ** Cost of comparing each piece in turn.
+ */
+void select_cost_linear(struct select_case *pieces, int total, int bits16, int low, int high, struct select_cost *cost)
+{
+    enum select_test test;
+    int path;
+    int cycles;
+    int bytes;
+    int c;
+    
+    cost->method = DISPATCH_LINEAR;
+    cost->cycles = 0;
+    cost->outcomes = 0;
+    cost->bytes = 0;
+    path = 0;
+    for (c = 0; c < total; c++) {
+        test = select_test(&pieces[c], low, high);
+        generic_select_cost(test, bits16, &cycles, &bytes);
+        path += cycles;
+        cost->cycles += path;
+        cost->outcomes++;
+        cost->bytes += bytes;
+        if (test == SELECT_JUMP)
+            return;
+    }
+    generic_select_cost(SELECT_JUMP, bits16, &cycles, &bytes);
+    path += cycles;
+    cost->cycles += path;
+    cost->outcomes++;
+    cost->bytes += bytes;
+}
+
+/*
+ ** Find the cheapest dispatch for the sorted pieces from first to
+ ** last (exclusive) when the value is known to be inside low-high.
+ **
+ ** Every outcome is taken as equally likely, so the score is the
+ ** average cycles plus the bytes, weighted by the outcomes of the
+ ** whole SELECT CASE to keep it additive between subtrees.
+ */
+void select_cost(int first, int last, int bits16, int low, int high, int weight, struct select_cost *best)
+{
+    struct select_cost left;
+    struct select_cost right;
+    int cycles;
+    int bytes;
+    int entries;
+    int middle;
+    
+    select_cost_linear(select_pieces + first, last - first, bits16, low, high, best);
+    
+    /*
+     ** A jump table costs the same for any case, but it needs an entry per value.
+     */
+    entries = select_pieces[last - 1].max - select_pieces[first].min + 1;
+    if (last - first >= 2 && entries <= ((target == CPU_6502) ? 128 : 256)) {
+        generic_select_cost(SELECT_TABLE, bits16, &cycles, &bytes);
+        left.method = DISPATCH_TABLE;
+        left.outcomes = last - first + 1;
+        left.cycles = cycles * left.outcomes;
+        generic_select_cost(SELECT_ENTRY, bits16, &cycles, &bytes);
+        left.bytes = bytes * entries;
+        generic_select_cost(SELECT_TABLE, bits16, &cycles, &bytes);
+        left.bytes += bytes;
+        if (left.cycles + left.bytes * weight < best->cycles + best->bytes * weight)
+            *best = left;
+    }
+    
+    /*
+     ** Split by half, the lower half is reached by a single comparison.
+     ** A single value at the split is tested with the same comparison.
+     */
+    if (last - first >= 3) {
+        middle = (first + last) / 2;
+        select_cost(first, middle, bits16, low, select_pieces[middle].min - 1, weight, &left);
+        if (select_pieces[middle].min == select_pieces[middle].max) {
+            select_cost(middle + 1, last, bits16, select_pieces[middle].min + 1, high, weight, &right);
+            generic_select_cost(SELECT_SPLIT, bits16, &cycles, &bytes);
+            right.outcomes++;
+            right.cycles += cycles * right.outcomes;
+            right.bytes += bytes;
+        } else {
+            select_cost(middle, last, bits16, select_pieces[middle].min, high, weight, &right);
+        }
+        generic_select_cost(SELECT_BELOW, bits16, &cycles, &bytes);
+        right.method = DISPATCH_TREE;
+        right.outcomes += left.outcomes;
+        right.cycles += left.cycles + cycles * right.outcomes;
+        right.bytes += left.bytes + bytes;
+        if (right.cycles + right.bytes * weight < best->cycles + best->bytes * weight)
+            *best = right;
+    }
+}
+
+/*
+ ** Generate the cheapest dispatch for the sorted pieces.
+ */
+void select_emit(int first, int last, int bits16, int low, int high, int weight, int outside)
+{
+    struct select_cost best;
+    struct select_case *piece;
+    int middle;
+    int entries;
+    int *labels;
+    int c;
+    int d;
+    char label[MAX_LINE_SIZE];
+    char equal[MAX_LINE_SIZE];
+    
+    select_cost(first, last, bits16, low, high, weight, &best);
+    if (best.method == DISPATCH_TABLE) {
+        entries = select_pieces[last - 1].max - select_pieces[first].min + 1;
+        labels = malloc(entries * sizeof(int));
+        if (labels == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        for (c = 0; c < entries; c++)
+            labels[c] = outside;
+        for (c = first; c < last; c++) {
+            for (d = select_pieces[c].min; d <= select_pieces[c].max; d++)
+                labels[d - select_pieces[first].min] = select_pieces[c].label;
+        }
+        sprintf(label, INTERNAL_PREFIX "%d", outside);
+        generic_select_table(bits16, select_pieces[first].min, entries, labels, label);
+        free(labels);
+        return;
+    }
+    if (best.method == DISPATCH_TREE) {
+        middle = (first + last) / 2;
+        sprintf(label, INTERNAL_PREFIX "%d", next_local);
+        c = next_local++;
+        piece = &select_pieces[middle];
+        if (piece->min == piece->max) {
+            sprintf(equal, INTERNAL_PREFIX "%d", piece->label);
+            generic_select_split(bits16, piece->min, label, equal);
+            select_emit(middle + 1, last, bits16, piece->min + 1, high, weight, outside);
+        } else {
+            generic_select_below(bits16, piece->min, label);
+            select_emit(middle, last, bits16, piece->min, high, weight, outside);
+        }
+        sprintf(label, INTERNAL_PREFIX "%d", c);
+        generic_label(label);
+        select_emit(first, middle, bits16, low, select_pieces[middle].min - 1, weight, outside);
+        return;
+    }
+    for (c = first; c < last; c++) {
+        piece = &select_pieces[c];
+        sprintf(label, INTERNAL_PREFIX "%d", piece->label);
+        if (select_test(piece, low, high) == SELECT_JUMP) {
+            generic_jump(label);
+            return;
+        }
+        generic_select_range(bits16, piece->min <= low ? 0 : piece->min,
+                             piece->max >= high ? (bits16 ? 65535 : 255) : piece->max, label);
+    }
+    sprintf(label, INTERNAL_PREFIX "%d", outside);
+    generic_jump(label);
+}
+
+/*
+ ** Generate the dispatch of SELECT CASE, once all the CASE ranges are
+ ** known it is moved to the start of the SELECT CASE.
+ **
+ ** The CASE can be tested in the source order, by binary search,
+ ** with a jump table, or a mix of the last two, whatever costs less
+ ** for the target processor.
+ */
+void compile_select_dispatch(struct loop *loop)
+{
+    struct select_cost linear;
+    struct select_cost best;
+    int bits16;
+    int start;
+    int high;
+    int outside;
+    int weight;
+    int c;
+    int d;
+    char label[MAX_LINE_SIZE];
+    
+    bits16 = (loop->var[0] & MAIN_TYPE) == TYPE_16;
+    high = bits16 ? 65535 : 255;
+    outside = loop->label_else != 0 ? loop->label_else : loop->label_exit;
+    generic_dump();
+    generic_reset();
+    start = inst_count;
+    if (loop->total_cases > 0) {
+        select_total_pieces = 0;
+        for (c = 0; c < loop->total_cases; c++)
+            select_add(loop->cases[c].min, loop->cases[c].max, loop->cases[c].label);
+        weight = select_total_pieces + 1;
+        select_cost_linear(select_pieces, select_total_pieces, bits16, 0, high, &linear);
+        
+        /*
+         ** Sort the pieces and join the neighbors going to the same CASE.
+         ** The source order is kept only for the linear dispatch.
+         */
+        qsort(select_pieces, select_total_pieces, sizeof(struct select_case), select_compare);
+        d = 0;
+        for (c = 1; c < select_total_pieces; c++) {
+            if (select_pieces[c].label == select_pieces[d].label && select_pieces[c].min == select_pieces[d].max + 1) {
+                select_pieces[d].max = select_pieces[c].max;
+            } else {
+                select_pieces[++d] = select_pieces[c];
+            }
+        }
+        select_total_pieces = d + 1;
+        select_cost(0, select_total_pieces, bits16, 0, high, weight, &best);
+        if (best.cycles + best.bytes * weight < linear.cycles + linear.bytes * weight) {
+            select_emit(0, select_total_pieces, bits16, 0, high, weight, outside);
+        } else {
+            for (c = 0; c < loop->total_cases; c++) {
+                sprintf(label, INTERNAL_PREFIX "%d", loop->cases[c].label);
+                generic_select_range(bits16, loop->cases[c].min, loop->cases[c].max, label);
+            }
+            sprintf(label, INTERNAL_PREFIX "%d", outside);
+            generic_jump(label);
+        }
+    }
+    generic_dump();
+    inst_move(loop->dispatch, start);
+    generic_reset();
 }
 
 /*
@@ -2277,1733 +3731,1935 @@ void compile_statement(int check_for_else)
     int type;
     
     while (1) {
+        STATS_COUNT(STATS_STATEMENTS);
         if (lex == C_NAME) {
             last_is_return = 0;
+            if (!propagate_keeps(keyword))
+                propagate_reset();
+            else if (keyword == K_IF || keyword == K_ELSEIF)
+                store_block++;
           
             /*
              ** CVBasic core language
              */
-            if (strcmp(name, "GOTO") == 0) {
-                get_lex();
-                if (lex != C_NAME) {
-                    emit_error("bad syntax for GOTO");
-                } else {
-                    label = label_search(name);
-                    if (label == NULL) {
-                        label = label_add(name);
-                    }
-                    label->used |= LABEL_USED;
-                    label->used |= LABEL_CALLED_BY_GOTO;
-                    strcpy(temp, LABEL_PREFIX);
-                    strcat(temp, name);
-                    generic_jump(temp);
+            switch (keyword) {
+                case K_GOTO:
                     get_lex();
-                }
-            } else if (strcmp(name, "GOSUB") == 0) {
-                get_lex();
-                if (lex != C_NAME) {
-                    emit_error("bad syntax for GOSUB");
-                } else {
-                    label = label_search(name);
-                    if (label == NULL) {
-                        label = label_add(name);
+                    if (lex != C_NAME) {
+                        emit_error("bad syntax for GOTO");
+                    } else {
+                        label = label_search(name);
+                        if (label == NULL) {
+                            label = label_add(name);
+                        }
+                        label->used |= LABEL_USED;
+                        label->used |= LABEL_CALLED_BY_GOTO;
+                        procedure_flow(label, 1);
+                        strcpy(temp, LABEL_PREFIX);
+                        strcat(temp, name);
+                        generic_jump(temp);
+                        get_lex();
                     }
-                    label->used |= LABEL_USED;
-                    label->used |= LABEL_CALLED_BY_GOSUB;
-                    strcpy(temp, LABEL_PREFIX);
-                    strcat(temp, name);
-                    generic_call(temp);
-                    get_lex();
-                }
-            } else if (strcmp(name, "RETURN") == 0) {
-                get_lex();
-                generic_return();
-                last_is_return = 1;
-            } else if (strcmp(name, "IF") == 0) {
-                int type;
-                int label;
-                int there_is_else;
-                int label2;
-                struct loop *new_loop;
-                int block;
-                
-                get_lex();
-                label = next_local++;
-                type = evaluate_expression(0, 0, label);
-                if (lex == C_NAME && strcmp(name, "GOTO") == 0) {
-                    compile_statement(FALSE);
-                    block = 0;
-                } else if (lex != C_NAME || strcmp(name, "THEN") != 0) {
-                    emit_error("missing THEN in IF");
-                    block = 0;
-                } else {
+                    break;
+                case K_GOSUB:
                     get_lex();
-                    if (lex == C_END) {
-                        block = 1;
-                        new_loop = malloc(sizeof(struct loop));
-                        if (new_loop == NULL) {
-                            fprintf(stderr, "out of memory\n");
-                            exit(EXIT_FAILURE);
-                        }
-                        new_loop->type = NESTED_IF;
-                        new_loop->step = NULL;
-                        new_loop->final = NULL;
-                        new_loop->var[0] = 0;
-                        new_loop->label_loop = label;
-                        new_loop->label_exit = 0;
-                        new_loop->next = loops;
-                        loops = new_loop;
+                    if (lex != C_NAME) {
+                        emit_error("bad syntax for GOSUB");
                     } else {
-                        compile_statement(TRUE);
-                        block = 0;
+                        label = label_search(name);
+                        if (label == NULL) {
+                            label = label_add(name);
+                        }
+                        label->used |= LABEL_USED;
+                        label->used |= LABEL_CALLED_BY_GOSUB;
+                        procedure_flow(label, 0);
+                        strcpy(temp, LABEL_PREFIX);
+                        strcat(temp, name);
+                        generic_call(temp);
+                        get_lex();
                     }
-                }
-                if (block) {
-                    last_is_return = 0;
                     break;
-                }
-                if (lex == C_NAME && strcmp(name, "ELSE") == 0) {
-                    there_is_else = 1;
+                case K_RETURN:
                     get_lex();
-                    label2 = next_local++;
-                    sprintf(temp, INTERNAL_PREFIX "%d", label2);
-                    generic_jump(temp);
-                } else {
-                    there_is_else = 0;
-                    label2 = 0;
-                }
-                sprintf(temp, INTERNAL_PREFIX "%d", label);
-                generic_label(temp);
-                if (there_is_else) {
-                    compile_statement(TRUE);
-                    sprintf(temp, INTERNAL_PREFIX "%d", label2);
-                    generic_label(temp);
-                }
-                last_is_return = 0;
-            } else if (strcmp(name, "ELSEIF") == 0) {
-                int type;
+                    generic_return();
+                    last_is_return = 1;
+                    break;
+                case K_IF: {
+                    int type;
+                    int label;
+                    int there_is_else;
+                    int label2;
+                    struct loop *new_loop;
+                    int block;
+                    int start;
+                    int known;
                 
-                get_lex();
-                if (loops == NULL) {
-                    emit_error("ELSEIF without IF");
-                } else if (loops->type != NESTED_IF || loops->label_loop == 0) {
-                    emit_error("bad nested ELSEIF");
-                } else {
-                    if (loops->var[0] != 1) {
-                        loops->label_exit = next_local++;
-                        loops->var[0] = 1;
-                    }
-                    sprintf(temp, INTERNAL_PREFIX "%d", loops->label_exit);
-                    generic_jump(temp);
-                    sprintf(temp, INTERNAL_PREFIX "%d", loops->label_loop);
-                    generic_label(temp);
-                    loops->label_loop = next_local++;
-                    type = evaluate_expression(0, 0, loops->label_loop);
-                    if (lex == C_NAME && strcmp(name, "GOTO") == 0) {
+                    get_lex();
+                    label = next_local++;
+                    start = inst_count;
+                    type = evaluate_expression(0, 0, label);
+                    known = decision;
+                    if (known == 2)
+                        unreachable_start(start);
+                    if (lex == C_NAME && keyword == K_GOTO) {
                         compile_statement(FALSE);
+                        block = 0;
                     } else if (lex != C_NAME || strcmp(name, "THEN") != 0) {
-                        emit_error("missing THEN in ELSEIF");
+                        emit_error("missing THEN in IF");
+                        block = 0;
                     } else {
                         get_lex();
+                        if (lex == C_END) {
+                            block = 1;
+                            new_loop = malloc(sizeof(struct loop));
+                            if (new_loop == NULL) {
+                                fprintf(stderr, "out of memory\n");
+                                exit(EXIT_FAILURE);
+                            }
+                            new_loop->type = NESTED_IF;
+                            new_loop->step = NULL;
+                            new_loop->final = NULL;
+                            new_loop->var[0] = 0;
+                            new_loop->label_loop = label;
+                            new_loop->label_exit = 0;
+                            new_loop->dead = (known == 2) ? start : -1;
+                            new_loop->taken = (known == 1);
+                            new_loop->next = loops;
+                            loops = new_loop;
+                        } else {
+                            compile_statement(TRUE);
+                            block = 0;
+                        }
                     }
-                }
-                if (lex == C_END)
-                    break;
-                continue;
-            } else if (strcmp(name, "ELSE") == 0) {
-                if (check_for_else)
-                    break;
-                get_lex();
-                if (loops == NULL) {
-                    emit_error("ELSE without IF");
-                } else if (loops->type != NESTED_IF) {
-                    emit_error("bad nested ELSE");
-                } else if (loops->label_loop == 0) {
-                    emit_error("more than one ELSE");
-                } else {
-                    if (loops->var[0] != 1) {
-                        loops->label_exit = next_local++;
-                        loops->var[0] = 1;
+                    if (block) {
+                        last_is_return = 0;
+                        return;
                     }
-                    sprintf(temp, INTERNAL_PREFIX "%d", loops->label_exit);
-                    generic_jump(temp);
-                    sprintf(temp, INTERNAL_PREFIX "%d", loops->label_loop);
+                    if (lex == C_NAME && keyword == K_ELSE) {
+                        there_is_else = 1;
+                        get_lex();
+                        label2 = next_local++;
+                        if (known == 1)
+                            start = unreachable_start(inst_count);
+                        sprintf(temp, INTERNAL_PREFIX "%d", label2);
+                        generic_jump(temp);
+                    } else {
+                        there_is_else = 0;
+                        label2 = 0;
+                    }
+                    if (known == 2)
+                        unreachable_end(start);
+                    sprintf(temp, INTERNAL_PREFIX "%d", label);
                     generic_label(temp);
-                    loops->label_loop = 0;
-                }
-                if (lex == C_END)
+                    if (there_is_else) {
+                        compile_statement(TRUE);
+                        if (known == 1)
+                            unreachable_end(start);
+                        sprintf(temp, INTERNAL_PREFIX "%d", label2);
+                        generic_label(temp);
+                    }
+                    last_is_return = 0;
                     break;
-                continue;
-            } else if (strcmp(name, "END") == 0) {
-                struct loop *popping;
+                }
+                case K_ELSEIF: {
+                    int type;
+                    int start;
                 
-                get_lex();
-                if (lex == C_NAME && strcmp(name, "IF") == 0) {
                     get_lex();
-                    if (loops == NULL || loops->type != NESTED_IF) {
-                        emit_error("Bad nested END IF");
+                    if (loops == NULL) {
+                        emit_error("ELSEIF without IF");
+                    } else if (loops->type != NESTED_IF || loops->label_loop == 0) {
+                        emit_error("bad nested ELSEIF");
                     } else {
-                        if (loops->var[0] == 1) {
-                            sprintf(temp, INTERNAL_PREFIX "%d", loops->label_exit);
-                            generic_label(temp);
+                        if (loops->var[0] != 1) {
+                            loops->label_exit = next_local++;
+                            loops->var[0] = 1;
                         }
-                        if (loops->label_loop != 0) {
-                            sprintf(temp, INTERNAL_PREFIX "%d", loops->label_loop);
-                            generic_label(temp);
+                        if (loops->taken && loops->dead < 0)
+                            loops->dead = unreachable_start(inst_count);
+                        sprintf(temp, INTERNAL_PREFIX "%d", loops->label_exit);
+                        generic_jump(temp);
+                        if (!loops->taken && loops->dead >= 0) {
+                            unreachable_end(loops->dead);
+                            loops->dead = -1;
+                        }
+                        sprintf(temp, INTERNAL_PREFIX "%d", loops->label_loop);
+                        generic_label(temp);
+                        loops->label_loop = next_local++;
+                        start = inst_count;
+                        type = evaluate_expression(0, 0, loops->label_loop);
+                        if (!loops->taken) {
+                            if (decision == 2)
+                                loops->dead = unreachable_start(start);
+                            else if (decision == 1)
+                                loops->taken = 1;
+                        }
+                        if (lex == C_NAME && keyword == K_GOTO) {
+                            compile_statement(FALSE);
+                        } else if (lex != C_NAME || strcmp(name, "THEN") != 0) {
+                            emit_error("missing THEN in ELSEIF");
+                        } else {
+                            get_lex();
                         }
-                        popping = loops;
-                        loops = loops->next;
-                        free(popping);
                     }
-                } else if (lex == C_NAME && strcmp(name, "SELECT") == 0) {
+                    if (lex == C_END)
+                        return;
+                    continue;
+                }
+                case K_ELSE:
+                    if (check_for_else)
+                        return;
                     get_lex();
-                    if (loops == NULL || loops->type != NESTED_SELECT) {
-                        emit_error("Bad nested END SELECT");
+                    if (loops == NULL) {
+                        emit_error("ELSE without IF");
+                    } else if (loops->type != NESTED_IF) {
+                        emit_error("bad nested ELSE");
+                    } else if (loops->label_loop == 0) {
+                        emit_error("more than one ELSE");
                     } else {
-                        if (loops->label_loop != 0) {
-                            sprintf(temp, INTERNAL_PREFIX "%d", loops->label_loop);
-                            generic_label(temp);
+                        if (loops->var[0] != 1) {
+                            loops->label_exit = next_local++;
+                            loops->var[0] = 1;
                         }
+                        if (loops->taken && loops->dead < 0)
+                            loops->dead = unreachable_start(inst_count);
                         sprintf(temp, INTERNAL_PREFIX "%d", loops->label_exit);
+                        generic_jump(temp);
+                        if (!loops->taken && loops->dead >= 0) {
+                            unreachable_end(loops->dead);
+                            loops->dead = -1;
+                        }
+                        sprintf(temp, INTERNAL_PREFIX "%d", loops->label_loop);
                         generic_label(temp);
-                        popping = loops;
-                        loops = loops->next;
-                        free(popping);
+                        loops->label_loop = 0;
                     }
-                } else {
-                    emit_error("wrong END");
-                }
-            } else if (strcmp(name, "FOR") == 0) {
-                struct label *label;
-                struct loop *new_loop;
-                int label_loop;
-                struct node *final = NULL;
-                struct node *step = NULL;
-                struct node *var;
-                int positive;
-                int type;
-                int type_var;
-                enum node_type comparison;
-                struct signedness *sign;
-                
-                get_lex();
-                compile_assignment(0);
+                    if (lex == C_END)
+                        return;
+                    continue;
+                case K_END: {
+                    struct loop *popping;
                 
-                /* Avoid unnecessary warnings */
-                label = label_search(assigned);
-                if (label != NULL && (label->used & LABEL_IS_VARIABLE) != 0)
-                    label->used |= LABEL_VAR_READ;
-                
-                new_loop = malloc(sizeof(struct loop) + strlen(assigned) + 1);
-                if (new_loop == NULL) {
-                    fprintf(stderr, "Out of memory\n");
-                    exit(EXIT_FAILURE);
-                }
-                strcpy(new_loop->var, assigned);
-                if (assigned[0] == '#')
-                    type_var = TYPE_16;
-                else
-                    type_var = TYPE_8;
-                sign = signed_search(assigned);
-                if (sign != NULL && sign->sign == 1)
-                    type_var |= TYPE_SIGNED;
-                label_loop = next_local++;
-                sprintf(temp, INTERNAL_PREFIX "%d", label_loop);
-                generic_label(temp);
-                if (lex != C_NAME || strcmp(name, "TO") != 0) {
-                    emit_error("missing TO in FOR");
-                } else {
                     get_lex();
-                    final = evaluate_level_0(&type);
-                    if ((type_var & MAIN_TYPE) == TYPE_16 && (type & MAIN_TYPE) == TYPE_8)
-                        final = node_create((type & TYPE_SIGNED) ? N_EXTEND8S : N_EXTEND8, 0, final, NULL);
-                    else if ((type_var & MAIN_TYPE) == TYPE_8 && (type & MAIN_TYPE) == TYPE_16)
-                        final = node_create(N_REDUCE16, 0, final, NULL);
-                    positive = 2;
-                    var = node_create((type_var & MAIN_TYPE) == TYPE_16 ? N_LOAD16 : N_LOAD8, 0, NULL, NULL);
-                    var->label = label_search(new_loop->var);
-                    if (lex == C_NAME && strcmp(name, "STEP") == 0) {
+                    if (lex == C_NAME && keyword == K_IF) {
                         get_lex();
-                        if (lex == C_MINUS) {
-                            get_lex();
-                            positive = 0;
+                        if (loops == NULL || loops->type != NESTED_IF) {
+                            emit_error("Bad nested END IF");
+                        } else {
+                            if (loops->dead >= 0)
+                                unreachable_end(loops->dead);
+                            if (loops->var[0] == 1) {
+                                sprintf(temp, INTERNAL_PREFIX "%d", loops->label_exit);
+                                generic_label(temp);
+                            }
+                            if (loops->label_loop != 0) {
+                                sprintf(temp, INTERNAL_PREFIX "%d", loops->label_loop);
+                                generic_label(temp);
+                            }
+                            popping = loops;
+                            loops = loops->next;
+                            free(popping);
+                        }
+                    } else if (lex == C_NAME && keyword == K_SELECT) {
+                        get_lex();
+                        if (loops == NULL || loops->type != NESTED_SELECT) {
+                            emit_error("Bad nested END SELECT");
+                        } else {
+                            sprintf(temp, INTERNAL_PREFIX "%d", loops->label_exit);
+                            generic_label(temp);
+                            compile_select_dispatch(loops);
+                            free(loops->cases);
+                            popping = loops;
+                            loops = loops->next;
+                            free(popping);
                         }
-                        step = evaluate_level_0(&type);
-                        if ((type_var & MAIN_TYPE) == TYPE_16 && (type & MAIN_TYPE) == TYPE_8)
-                            step = node_create((type & TYPE_SIGNED) ? N_EXTEND8S : N_EXTEND8, 0, step, NULL);
-                        else if ((type_var & MAIN_TYPE) == TYPE_8 && (type & MAIN_TYPE) == TYPE_16)
-                            step = node_create(N_REDUCE16, 0, step, NULL);
-                        if ((step->type == N_NUM8 && step->value == 1)
-                         || (step->type == N_NUM16 && step->value == 1))
-                            positive |= 1;
                     } else {
-                        step = node_create((type_var & MAIN_TYPE) == TYPE_16 ? N_NUM16 : N_NUM8, 1, NULL, NULL);
-                        positive |= 1;
+                        emit_error("wrong END");
                     }
-                    if ((positive & 2) == 0) {  /* Negative step */
-                        step = node_create((type_var & MAIN_TYPE) == TYPE_16 ? N_MINUS16 : N_MINUS8, 0, var, step);
-                    } else {    /* Positive step */
-                        step = node_create((type_var & MAIN_TYPE) == TYPE_16 ? N_PLUS16 : N_PLUS8, 0, var, step);
+                    break;
+                }
+                case K_FOR: {
+                    struct label *label;
+                    struct loop *new_loop;
+                    int label_loop;
+                    struct node *final = NULL;
+                    struct node *step = NULL;
+                    struct node *var;
+                    int positive;
+                    int type;
+                    int type_var;
+                    enum node_type comparison;
+                    struct signedness *sign;
+                    int low;
+                    int high;
+                    int limit;
+                
+                    get_lex();
+                    compile_assignment(0);
+                
+                    /* Avoid unnecessary warnings */
+                    label = label_search(assigned);
+                    if (label != NULL && (label->used & LABEL_IS_VARIABLE) != 0)
+                        label->used |= LABEL_VAR_READ;
+                    if (label == NULL || !propagate_range(label, &low, &high))
+                        high = 0xffff;
+                
+                    new_loop = malloc(sizeof(struct loop) + strlen(assigned) + 1);
+                    if (new_loop == NULL) {
+                        fprintf(stderr, "Out of memory\n");
+                        exit(EXIT_FAILURE);
                     }
-                    var = node_create(N_ADDR, 0, NULL, NULL);
-                    var->label = label_search(new_loop->var);
-                    step = node_create((type_var & MAIN_TYPE) == TYPE_16 ? N_ASSIGN16 : N_ASSIGN8, 0, step, var);
-                    var = node_create((type_var & MAIN_TYPE) == TYPE_16 ? N_LOAD16 : N_LOAD8, 0, NULL, NULL);
-                    var->label = label_search(new_loop->var);
-                    if ((type_var & MAIN_TYPE) == TYPE_16) {
-                        if (type_var & TYPE_SIGNED) {
-                            if (final->type == N_NUM16 && final->value == 0x8000 && (positive & 1) != 0) {
-                                final->value = 0x7fff;
-                                comparison = N_EQUAL16;
-                            } else {
-                                comparison = (positive & 2) ? N_GREATER16S : N_LESS16S;
+                    strcpy(new_loop->var, assigned);
+                    if (assigned[0] == '#')
+                        type_var = TYPE_16;
+                    else
+                        type_var = TYPE_8;
+                    sign = signed_search(assigned);
+                    if (sign != NULL && sign->sign == 1)
+                        type_var |= TYPE_SIGNED;
+                    label_loop = next_local++;
+                    generic_dump();
+                    new_loop->body = inst_count;
+                    sprintf(temp, INTERNAL_PREFIX "%d", label_loop);
+                    generic_label(temp);
+                    if (lex != C_NAME || strcmp(name, "TO") != 0) {
+                        emit_error("missing TO in FOR");
+                    } else {
+                        get_lex();
+                        final = evaluate_level_0(&type);
+                        if ((type_var & MAIN_TYPE) == TYPE_16 && (type & MAIN_TYPE) == TYPE_8)
+                            final = node_create((type & TYPE_SIGNED) ? N_EXTEND8S : N_EXTEND8, 0, final, NULL);
+                        else if ((type_var & MAIN_TYPE) == TYPE_8 && (type & MAIN_TYPE) == TYPE_16)
+                            final = node_create(N_REDUCE16, 0, final, NULL);
+                        positive = 2;
+                        var = node_create((type_var & MAIN_TYPE) == TYPE_16 ? N_LOAD16 : N_LOAD8, 0, NULL, NULL);
+                        var->label = label_search(new_loop->var);
+                        if (lex == C_NAME && strcmp(name, "STEP") == 0) {
+                            get_lex();
+                            if (lex == C_MINUS) {
+                                get_lex();
+                                positive = 0;
                             }
+                            step = evaluate_level_0(&type);
+                            if ((type_var & MAIN_TYPE) == TYPE_16 && (type & MAIN_TYPE) == TYPE_8)
+                                step = node_create((type & TYPE_SIGNED) ? N_EXTEND8S : N_EXTEND8, 0, step, NULL);
+                            else if ((type_var & MAIN_TYPE) == TYPE_8 && (type & MAIN_TYPE) == TYPE_16)
+                                step = node_create(N_REDUCE16, 0, step, NULL);
+                            if ((step->type == N_NUM8 && step->value == 1)
+                             || (step->type == N_NUM16 && step->value == 1))
+                                positive |= 1;
                         } else {
-                            if (final->type == N_NUM16 && final->value == 0x0000 && (positive & 1) != 0) {
-                                final->value = 0xffff;
-                                comparison = N_EQUAL16;
-                            } else {
-                                comparison = (positive & 2) ? N_GREATER16 : N_LESS16;
-                            }
+                            step = node_create((type_var & MAIN_TYPE) == TYPE_16 ? N_NUM16 : N_NUM8, 1, NULL, NULL);
+                            positive |= 1;
                         }
-                    } else {
-                        if (type_var & TYPE_SIGNED) {
-                            if (final->type == N_NUM8 && final->value == 0x80 && (positive & 1) != 0) {
-                                final->value = 0x7f;
-                                comparison = N_EQUAL8;
+                        if ((positive & 2) == 0) {  /* Negative step */
+                            step = node_create((type_var & MAIN_TYPE) == TYPE_16 ? N_MINUS16 : N_MINUS8, 0, var, step);
+                        } else {    /* Positive step */
+                            step = node_create((type_var & MAIN_TYPE) == TYPE_16 ? N_PLUS16 : N_PLUS8, 0, var, step);
+                        }
+                        var = node_create(N_ADDR, 0, NULL, NULL);
+                        var->label = label_search(new_loop->var);
+                        step = node_create((type_var & MAIN_TYPE) == TYPE_16 ? N_ASSIGN16 : N_ASSIGN8, 0, step, var);
+                        var = node_create((type_var & MAIN_TYPE) == TYPE_16 ? N_LOAD16 : N_LOAD8, 0, NULL, NULL);
+                        var->label = label_search(new_loop->var);
+                        if ((type_var & MAIN_TYPE) == TYPE_16) {
+                            if (type_var & TYPE_SIGNED) {
+                                if (final->type == N_NUM16 && final->value == 0x8000 && (positive & 1) != 0) {
+                                    final->value = 0x7fff;
+                                    comparison = N_EQUAL16;
+                                } else {
+                                    comparison = (positive & 2) ? N_GREATER16S : N_LESS16S;
+                                }
                             } else {
-                                comparison = (positive & 2) ? N_GREATER8S : N_LESS8S;
+                                if (final->type == N_NUM16 && final->value == 0x0000 && (positive & 1) != 0) {
+                                    final->value = 0xffff;
+                                    comparison = N_EQUAL16;
+                                } else {
+                                    comparison = (positive & 2) ? N_GREATER16 : N_LESS16;
+                                }
                             }
                         } else {
-                            if (final->type == N_NUM8 && final->value == 0x00 && (positive & 1) != 0) {
-                                final->value = 0xff;
-                                comparison = N_EQUAL8;
+                            if (type_var & TYPE_SIGNED) {
+                                if (final->type == N_NUM8 && final->value == 0x80 && (positive & 1) != 0) {
+                                    final->value = 0x7f;
+                                    comparison = N_EQUAL8;
+                                } else {
+                                    comparison = (positive & 2) ? N_GREATER8S : N_LESS8S;
+                                }
                             } else {
-                                comparison = (positive & 2) ? N_GREATER8 : N_LESS8;
+                                if (final->type == N_NUM8 && final->value == 0x00 && (positive & 1) != 0) {
+                                    final->value = 0xff;
+                                    comparison = N_EQUAL8;
+                                } else {
+                                    comparison = (positive & 2) ? N_GREATER8 : N_LESS8;
+                                }
                             }
                         }
+                        limit = (final->type == N_NUM8 || final->type == N_NUM16) ? final->value : -1;
+                        final = node_create(comparison, 0, var, final);
+                        
+                        /*
+                         ** At the top of the loop the counter has the start value,
+                         ** or it passed the comparison with the limit.
+                         */
+                        if ((comparison == N_GREATER8 || comparison == N_GREATER16) && limit >= 0 && var->label != NULL)
+                            propagate_bound(var->label, 0, (high > limit) ? high : limit);
                     }
-                    final = node_create(comparison, 0, var, final);
+                    new_loop->type = NESTED_FOR;
+                    new_loop->step = step;
+                    new_loop->final = final;
+                    new_loop->node_base = node_arena_keep();   /* step and final are used by NEXT */
+                    new_loop->label_loop = label_loop;
+                    new_loop->label_exit = 0;
+                    new_loop->next = loops;
+                    loops = new_loop;
+                    label = label_search(new_loop->var);
+                    if (label != NULL) {    /* Step and comparison in NEXT */
+                        label_reference(label);
+                        label_reference(label);
+                    }
+                    break;
                 }
-                new_loop->type = NESTED_FOR;
-                new_loop->step = step;
-                new_loop->final = final;
-                new_loop->label_loop = label_loop;
-                new_loop->label_exit = 0;
-                new_loop->next = loops;
-                loops = new_loop;
-            } else if (strcmp(name, "NEXT") == 0) {
-                struct loop *popping;
+                case K_NEXT: {
+                    struct loop *popping;
                 
-                get_lex();
-                if (loops == NULL) {
-                    emit_error("NEXT without FOR");
-                } else {
-                    struct node *final = loops->final;
-                    struct node *step = loops->step;
-                    int label_loop = loops->label_loop;
-                    int label_exit = loops->label_exit;
-                    
-                    if (loops->type != NESTED_FOR) {
-                        emit_error("bad nested NEXT");
-                        if (lex == C_NAME)
-                            get_lex();
+                    get_lex();
+                    if (loops == NULL) {
+                        emit_error("NEXT without FOR");
                     } else {
-                        if (lex == C_NAME) {
-                            if (strcmp(name, loops->var) != 0)
-                                emit_error("bad nested NEXT");
-                            get_lex();
-                        }
-                        node_label(step);
-                        node_generate(step, 0);
-                        if (final != NULL) {
-                            optimized = 0;
-                            node_label(final);
-                            node_generate(final, label_loop);
-                            if (!optimized) {
-                                generic_test_8();
+                        struct node *final = loops->final;
+                        struct node *step = loops->step;
+                        int label_loop = loops->label_loop;
+                        int label_exit = loops->label_exit;
+                        int counter;
+                        int increment;
+                        int added;
+                        char variable[MAX_LINE_SIZE];
+                        char exit_label[MAX_LINE_SIZE];
+                    
+                        if (loops->type != NESTED_FOR) {
+                            emit_error("bad nested NEXT");
+                            if (lex == C_NAME)
+                                get_lex();
+                        } else {
+                            if (lex == C_NAME) {
+                                if (strcmp(name, loops->var) != 0)
+                                    emit_error("bad nested NEXT");
+                                get_lex();
+                            }
+                            
+                            sprintf(variable, LABEL_PREFIX "%s", loops->var);
+                            if (label_exit != 0)
+                                sprintf(exit_label, INTERNAL_PREFIX "%d", label_exit);
+                            
+                            /*
+                             ** Arrays indexed by a 8-bit counter with a constant step can
+                             ** use a pointer that advances with the counter
+                             */
+                            if (final != NULL && (final->type == N_GREATEREQUAL8 || final->type == N_LESS8)
+                             && final->right->type == N_NUM8 && step->type == N_ASSIGN8
+                             && (step->left->type == N_PLUS8 || step->left->type == N_MINUS8)
+                             && step->left->right->type == N_NUM8 && step->left->right->value != 0
+                             && (final->type == N_GREATEREQUAL8) == (step->left->type == N_PLUS8)) {
+                                increment = step->left->right->value;
+                                if (final->type == N_GREATEREQUAL8 ? final->right->value - 1 + increment <= 255
+                                                                   : final->right->value >= increment) {   /* The counter doesn't wrap around */
+                                    generic_dump();
+                                    added = generic_for_pointer(loops->body, variable,
+                                                                final->type == N_GREATEREQUAL8 ? increment : -increment,
+                                                                label_exit != 0 ? exit_label : NULL);
+                                    if (added) {
+                                        loops->body += added;
+                                        loop_pointer = 1;
+                                    }
+                                }
+                            }
+                            
+                            /*
+                             ** A 8-bit counter going by 1 to a constant can stay in a register
+                             */
+                            counter = 0;
+                            if (final != NULL && (final->type == N_GREATEREQUAL8 || final->type == N_LESS8)
+                             && final->right->type == N_NUM8 && step->type == N_ASSIGN8
+                             && (step->left->type == N_PLUS8 || step->left->type == N_MINUS8)
+                             && step->left->right->type == N_NUM8 && step->left->right->value == 1
+                             && (final->type == N_GREATEREQUAL8) == (step->left->type == N_PLUS8)) {
+                                generic_dump();
                                 sprintf(temp, INTERNAL_PREFIX "%d", label_loop);
-                                generic_jump_zero(temp);
+                                counter = generic_for_register(loops->body, variable, final->type == N_GREATEREQUAL8,
+                                                               final->right->value, temp, label_exit != 0 ? exit_label : NULL);
                             }
-                            node_delete(final);
-                        }
-                        node_delete(step);
-                        if (label_exit != 0) {
-                            sprintf(temp, INTERNAL_PREFIX "%d", label_exit);
-                            generic_label(temp);
+                            if (!counter) {
+                                node_label(step);
+                                node_generate(step, 0);
+                                if (final != NULL) {
+                                    optimized = 0;
+                                    node_label(final);
+                                    node_generate(final, label_loop);
+                                    if (!optimized) {
+                                        generic_test_8();
+                                        sprintf(temp, INTERNAL_PREFIX "%d", label_loop);
+                                        generic_jump_zero(temp);
+                                    }
+                                }
+                            }
+                            if (label_exit != 0) {
+                                sprintf(temp, INTERNAL_PREFIX "%d", label_exit);
+                                generic_label(temp);
+                            }
+                            if (counter)
+                                generic_for_store(variable);
+                            popping = loops;
+                            loops = loops->next;
+                            node_arena_release(popping->node_base);
+                            free(popping);
                         }
-                        popping = loops;
-                        loops = loops->next;
-                        free(popping);
                     }
+                    break;
                 }
-            } else if (strcmp(name, "WHILE") == 0) {
-                int label_loop;
-                int label_exit;
-                int type;
-                struct loop *new_loop;
-                
-                get_lex();
-                label_loop = next_local++;
-                label_exit = next_local++;
-                sprintf(temp, INTERNAL_PREFIX "%d", label_loop);
-                generic_label(temp);
-                type = evaluate_expression(0, 0, label_exit);
-                new_loop = malloc(sizeof(struct loop));
-                if (new_loop == NULL) {
-                    fprintf(stderr, "Out of memory\n");
-                    exit(EXIT_FAILURE);
-                }
-                new_loop->type = NESTED_WHILE;
-                new_loop->step = NULL;
-                new_loop->final = NULL;
-                new_loop->var[0] = '\0';
-                new_loop->label_loop = label_loop;
-                new_loop->label_exit = label_exit;
-                new_loop->next = loops;
-                loops = new_loop;
-            } else if (strcmp(name, "WEND") == 0) {
-                struct loop *popping;
+                case K_WHILE: {
+                    int label_loop;
+                    int label_exit;
+                    int type;
+                    struct loop *new_loop;
                 
-                get_lex();
-                if (loops == NULL) {
-                    emit_error("WEND without WHILE");
-                } else if (loops->type != NESTED_WHILE) {
-                    emit_error("bad nested WEND");
-                } else {
-                    sprintf(temp, INTERNAL_PREFIX "%d", loops->label_loop);
-                    generic_jump(temp);
-                    sprintf(temp, INTERNAL_PREFIX "%d", loops->label_exit);
+                    get_lex();
+                    label_loop = next_local++;
+                    label_exit = next_local++;
+                    sprintf(temp, INTERNAL_PREFIX "%d", label_loop);
                     generic_label(temp);
-                    popping = loops;
-                    loops = loops->next;
-                    free(popping);
+                    type = evaluate_expression(0, 0, label_exit);
+                    new_loop = malloc(sizeof(struct loop));
+                    if (new_loop == NULL) {
+                        fprintf(stderr, "Out of memory\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    new_loop->type = NESTED_WHILE;
+                    new_loop->step = NULL;
+                    new_loop->final = NULL;
+                    new_loop->var[0] = '\0';
+                    new_loop->label_loop = label_loop;
+                    new_loop->label_exit = label_exit;
+                    new_loop->next = loops;
+                    loops = new_loop;
+                    break;
                 }
-            } else if (strcmp(name, "DO") == 0) {
-                int label_loop;
-                int label_exit;
-                int type;
-                struct loop *new_loop;
+                case K_WEND: {
+                    struct loop *popping;
                 
-                get_lex();
-                label_loop = next_local++;
-                label_exit = next_local++;
-                sprintf(temp, INTERNAL_PREFIX "%d", label_loop);
-                generic_label(temp);
-                new_loop = malloc(sizeof(struct loop));
-                if (new_loop == NULL) {
-                    fprintf(stderr, "Out of memory\n");
-                    exit(EXIT_FAILURE);
-                }
-                if (lex == C_NAME && strcmp(name, "WHILE") == 0) {
-                    get_lex();
-                    type = evaluate_expression(0, 0, label_exit);
-                    new_loop->var[0] = '1'; /* Uses exit label */
-                    new_loop->type = NESTED_DO;     /* Condition at top */
-                } else if (lex == C_NAME && strcmp(name, "UNTIL") == 0) {
-                    int label_temp = next_local++;
-                    
                     get_lex();
-                    type = evaluate_expression(0, 0, label_temp);
-                    /* Let optimizer to solve this =P */
-                    sprintf(temp, INTERNAL_PREFIX "%d", label_exit);
-                    generic_jump(temp);
-                    sprintf(temp, INTERNAL_PREFIX "%d", label_temp);
-                    generic_label(temp);
-                    new_loop->var[0] = '1'; /* Uses exit label */
-                    new_loop->type = NESTED_DO;  /* Condition at top */
-                } else {
-                    new_loop->var[0] = '\0'; /* Doesn't use exit label (yet) */
-                    new_loop->type = NESTED_DO_LOOP;  /* Condition at bottom */
+                    if (loops == NULL) {
+                        emit_error("WEND without WHILE");
+                    } else if (loops->type != NESTED_WHILE) {
+                        emit_error("bad nested WEND");
+                    } else {
+                        sprintf(temp, INTERNAL_PREFIX "%d", loops->label_loop);
+                        generic_jump(temp);
+                        sprintf(temp, INTERNAL_PREFIX "%d", loops->label_exit);
+                        generic_label(temp);
+                        popping = loops;
+                        loops = loops->next;
+                        free(popping);
+                    }
+                    break;
                 }
-                new_loop->step = NULL;
-                new_loop->final = NULL;
-                new_loop->label_loop = label_loop;
-                new_loop->label_exit = label_exit;
-                new_loop->next = loops;
-                loops = new_loop;
-            } else if (strcmp(name, "LOOP") == 0) {
-                struct loop *popping;
+                case K_DO: {
+                    int label_loop;
+                    int label_exit;
+                    int type;
+                    struct loop *new_loop;
                 
-                get_lex();
-                if (loops == NULL) {
-                    emit_error("LOOP without DO");
-                } else if (loops->type == NESTED_DO) {
-                    sprintf(temp, INTERNAL_PREFIX "%d", loops->label_loop);
-                    generic_jump(temp);
-                    sprintf(temp, INTERNAL_PREFIX "%d", loops->label_exit);
+                    get_lex();
+                    label_loop = next_local++;
+                    label_exit = next_local++;
+                    sprintf(temp, INTERNAL_PREFIX "%d", label_loop);
                     generic_label(temp);
-                    popping = loops;
-                    loops = loops->next;
-                    free(popping);
-                } else if (loops->type == NESTED_DO_LOOP) {
-                    int type;
-                    
-                    if (lex == C_NAME && strcmp(name, "WHILE") == 0) {
+                    new_loop = malloc(sizeof(struct loop));
+                    if (new_loop == NULL) {
+                        fprintf(stderr, "Out of memory\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    if (lex == C_NAME && keyword == K_WHILE) {
+                        get_lex();
+                        type = evaluate_expression(0, 0, label_exit);
+                        new_loop->var[0] = '1'; /* Uses exit label */
+                        new_loop->type = NESTED_DO;     /* Condition at top */
+                    } else if (lex == C_NAME && strcmp(name, "UNTIL") == 0) {
                         int label_temp = next_local++;
-                        
+                    
                         get_lex();
                         type = evaluate_expression(0, 0, label_temp);
                         /* Let optimizer to solve this =P */
-                        sprintf(temp, INTERNAL_PREFIX "%d", loops->label_loop);
+                        sprintf(temp, INTERNAL_PREFIX "%d", label_exit);
                         generic_jump(temp);
                         sprintf(temp, INTERNAL_PREFIX "%d", label_temp);
                         generic_label(temp);
-                    } else if (lex == C_NAME && strcmp(name, "UNTIL") == 0) {
-                        get_lex();
-                        type = evaluate_expression(0, 0, loops->label_loop);
+                        new_loop->var[0] = '1'; /* Uses exit label */
+                        new_loop->type = NESTED_DO;  /* Condition at top */
                     } else {
-                        emit_error("LOOP without condition");
+                        new_loop->var[0] = '\0'; /* Doesn't use exit label (yet) */
+                        new_loop->type = NESTED_DO_LOOP;  /* Condition at bottom */
                     }
-                    if (loops->var[0] == '1') {  /* Uses exit label? */
-                        sprintf(temp, INTERNAL_PREFIX "%d", loops->label_exit);
-                        generic_label(temp);
-                    }
-                    popping = loops;
-                    loops = loops->next;
-                    free(popping);
-                } else {
-                    emit_error("bad nested LOOP");
+                    new_loop->step = NULL;
+                    new_loop->final = NULL;
+                    new_loop->label_loop = label_loop;
+                    new_loop->label_exit = label_exit;
+                    new_loop->next = loops;
+                    loops = new_loop;
+                    break;
                 }
-            } else if (strcmp(name, "SELECT") == 0) {
-                int label_exit;
-                int type;
-                struct loop *new_loop;
-                struct node *tree;
+                case K_LOOP: {
+                    struct loop *popping;
                 
-                get_lex();
-                label_exit = next_local++;
-                new_loop = malloc(sizeof(struct loop));
-                if (new_loop == NULL) {
-                    fprintf(stderr, "Out of memory\n");
-                    exit(EXIT_FAILURE);
-                }
-                new_loop->type = NESTED_SELECT;
-                if (lex == C_NAME && strcmp(name, "CASE") == 0) {
                     get_lex();
-                    
-                    optimized = 0;
-                    tree = evaluate_level_0(&type);
-                    if (type & TYPE_SIGNED) {
-                        if ((type & MAIN_TYPE) == TYPE_8)
-                            tree = node_create(N_XOR8, 0, tree, node_create(N_NUM8, 0x80, NULL, NULL));
-                        else
-                            tree = node_create(N_XOR16, 0, tree, node_create(N_NUM16, 0x8000, NULL, NULL));
-                    }
-                    node_label(tree);
-                    /*    node_visual(tree); */ /* Debugging */
-                    node_generate(tree, 0);
-                    node_delete(tree);
-                    new_loop->var[0] = type & (MAIN_TYPE | TYPE_SIGNED); /* Type of data */
-                } else {
-                    emit_error("missing CASE after SELECT");
-                    new_loop->var[0] = TYPE_8;
-                }
-                new_loop->step = NULL;
-                new_loop->final = NULL;
-                new_loop->label_loop = 0;
-                new_loop->label_exit = label_exit;
-                new_loop->next = loops;
-                loops = new_loop;
-            } else if (strcmp(name, "CASE") == 0) {
-                get_lex();
-                if (loops == NULL || loops->type != NESTED_SELECT) {
-                    emit_error("CASE without SELECT CASE");
-                } else {
-                    if (loops->label_loop != 0) {
-                        sprintf(temp, INTERNAL_PREFIX "%d", loops->label_exit);
-                        generic_jump(temp);
+                    if (loops == NULL) {
+                        emit_error("LOOP without DO");
+                    } else if (loops->type == NESTED_DO) {
                         sprintf(temp, INTERNAL_PREFIX "%d", loops->label_loop);
+                        generic_jump(temp);
+                        sprintf(temp, INTERNAL_PREFIX "%d", loops->label_exit);
                         generic_label(temp);
-                    }
-                    if (lex == C_NAME && strcmp(name, "ELSE") == 0) {
-                        get_lex();
-                        if (loops->label_loop == 0) {
-                            emit_error("More than one CASE ELSE");
+                        popping = loops;
+                        loops = loops->next;
+                        free(popping);
+                    } else if (loops->type == NESTED_DO_LOOP) {
+                        int type;
+                    
+                        if (lex == C_NAME && keyword == K_WHILE) {
+                            int label_temp = next_local++;
+                        
+                            get_lex();
+                            type = evaluate_expression(0, 0, label_temp);
+                            /* Let optimizer to solve this =P */
+                            sprintf(temp, INTERNAL_PREFIX "%d", loops->label_loop);
+                            generic_jump(temp);
+                            sprintf(temp, INTERNAL_PREFIX "%d", label_temp);
+                            generic_label(temp);
+                        } else if (lex == C_NAME && strcmp(name, "UNTIL") == 0) {
+                            get_lex();
+                            type = evaluate_expression(0, 0, loops->label_loop);
                         } else {
-                            loops->label_loop = 0;
+                            emit_error("LOOP without condition");
+                        }
+                        if (loops->var[0] == '1') {  /* Uses exit label? */
+                            sprintf(temp, INTERNAL_PREFIX "%d", loops->label_exit);
+                            generic_label(temp);
                         }
+                        popping = loops;
+                        loops = loops->next;
+                        free(popping);
                     } else {
-                        struct node *tree;
-                        int type;
-                        int min;
-                        int max;
-                        
+                        emit_error("bad nested LOOP");
+                    }
+                    break;
+                }
+                case K_SELECT: {
+                    int label_exit;
+                    int type;
+                    struct loop *new_loop;
+                    struct node *tree;
+                
+                    get_lex();
+                    label_exit = next_local++;
+                    new_loop = malloc(sizeof(struct loop));
+                    if (new_loop == NULL) {
+                        fprintf(stderr, "Out of memory\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    new_loop->type = NESTED_SELECT;
+                    if (lex == C_NAME && keyword == K_CASE) {
+                        get_lex();
+                    
                         optimized = 0;
                         tree = evaluate_level_0(&type);
-                        if ((loops->var[0] & MAIN_TYPE) == TYPE_8 && (type & MAIN_TYPE) == TYPE_16) {
-                            tree = node_create(N_REDUCE16, 0, tree, NULL);
-                            type = TYPE_8;
-                        } else if ((loops->var[0] & MAIN_TYPE) == TYPE_16 && (type & MAIN_TYPE) == TYPE_8) {
-                            tree = node_create((type & TYPE_SIGNED) ? N_EXTEND8S : N_EXTEND8, 0, tree, NULL);
-                            type = TYPE_16;
+                        if (type & TYPE_SIGNED) {
+                            if ((type & MAIN_TYPE) == TYPE_8)
+                                tree = node_create(N_XOR8, 0, tree, node_create(N_NUM8, 0x80, NULL, NULL));
+                            else
+                                tree = node_create(N_XOR16, 0, tree, node_create(N_NUM16, 0x8000, NULL, NULL));
                         }
-                        if (tree->type != N_NUM8 && tree->type != N_NUM16) {
-                            emit_error("Not a constant expression in CASE");
-                            min = 0;
-                        } else {
-                            min = tree->value;
+                        node_label(tree);
+                        /*    node_visual(tree); */ /* Debugging */
+                        node_generate(tree, 0);
+                        new_loop->var[0] = type & (MAIN_TYPE | TYPE_SIGNED); /* Type of data */
+                    } else {
+                        emit_error("missing CASE after SELECT");
+                        new_loop->var[0] = TYPE_8;
+                    }
+                    generic_dump();
+                    new_loop->dispatch = inst_count;
+                    new_loop->cases = NULL;
+                    new_loop->total_cases = 0;
+                    new_loop->label_else = 0;
+                    new_loop->step = NULL;
+                    new_loop->final = NULL;
+                    new_loop->label_loop = 0;
+                    new_loop->label_exit = label_exit;
+                    new_loop->next = loops;
+                    loops = new_loop;
+                    break;
+                }
+                case K_CASE:
+                    get_lex();
+                    if (loops == NULL || loops->type != NESTED_SELECT) {
+                        emit_error("CASE without SELECT CASE");
+                    } else {
+                        int label;
+                        
+                        if (loops->total_cases > 0 || loops->label_else != 0) {
+                            sprintf(temp, INTERNAL_PREFIX "%d", loops->label_exit);
+                            generic_jump(temp);
                         }
-                        max = min;
-                        node_delete(tree);
-                        if (lex == C_NAME && strcmp(name, "TO") == 0) {
+                        label = next_local++;
+                        sprintf(temp, INTERNAL_PREFIX "%d", label);
+                        generic_label(temp);
+                        if (lex == C_NAME && keyword == K_ELSE) {
                             get_lex();
+                            if (loops->label_else != 0) {
+                                emit_error("More than one CASE ELSE");
+                            } else {
+                                loops->label_else = label;
+                            }
+                        } else {
+                            struct node *tree;
+                            int type;
+                            int min;
+                            int max;
+                        
                             optimized = 0;
                             tree = evaluate_level_0(&type);
-                            if (loops->var[0] == TYPE_8 && (type & MAIN_TYPE) == TYPE_16) {
+                            if ((loops->var[0] & MAIN_TYPE) == TYPE_8 && (type & MAIN_TYPE) == TYPE_16) {
                                 tree = node_create(N_REDUCE16, 0, tree, NULL);
                                 type = TYPE_8;
-                            } else if (loops->var[0] == TYPE_16 && (type & MAIN_TYPE) == TYPE_8) {
+                            } else if ((loops->var[0] & MAIN_TYPE) == TYPE_16 && (type & MAIN_TYPE) == TYPE_8) {
                                 tree = node_create((type & TYPE_SIGNED) ? N_EXTEND8S : N_EXTEND8, 0, tree, NULL);
                                 type = TYPE_16;
                             }
                             if (tree->type != N_NUM8 && tree->type != N_NUM16) {
-                                emit_error("Not a constant expression in CASE TO");
+                                emit_error("Not a constant expression in CASE");
+                                min = 0;
                             } else {
-                                max = tree->value;
+                                min = tree->value;
                             }
-                            node_delete(tree);
-                        }
-                        if (loops->var[0] == (TYPE_8 | TYPE_SIGNED)) {
-                            min ^= 0x80;
-                            max ^= 0x80;
-                        } else if (loops->var[0] == (TYPE_16 | TYPE_SIGNED)) {
-                            min ^= 0x8000;
-                            max ^= 0x8000;
-                        }
-                        if (min > max) {
-                            emit_error("Maximum range of CASE is lesser than minimum");
+                            max = min;
+                            if (lex == C_NAME && strcmp(name, "TO") == 0) {
+                                get_lex();
+                                optimized = 0;
+                                tree = evaluate_level_0(&type);
+                                if (loops->var[0] == TYPE_8 && (type & MAIN_TYPE) == TYPE_16) {
+                                    tree = node_create(N_REDUCE16, 0, tree, NULL);
+                                    type = TYPE_8;
+                                } else if (loops->var[0] == TYPE_16 && (type & MAIN_TYPE) == TYPE_8) {
+                                    tree = node_create((type & TYPE_SIGNED) ? N_EXTEND8S : N_EXTEND8, 0, tree, NULL);
+                                    type = TYPE_16;
+                                }
+                                if (tree->type != N_NUM8 && tree->type != N_NUM16) {
+                                    emit_error("Not a constant expression in CASE TO");
+                                } else {
+                                    max = tree->value;
+                                }
+                            }
+                            if (loops->var[0] == (TYPE_8 | TYPE_SIGNED)) {
+                                min ^= 0x80;
+                                max ^= 0x80;
+                            } else if (loops->var[0] == (TYPE_16 | TYPE_SIGNED)) {
+                                min ^= 0x8000;
+                                max ^= 0x8000;
+                            }
+                            if (min > max) {
+                                emit_error("Maximum range of CASE is lesser than minimum");
+                                max = min;
+                            }
+                            loops->cases = realloc(loops->cases, (loops->total_cases + 1) * sizeof(struct select_case));
+                            if (loops->cases == NULL) {
+                                fprintf(stderr, "Out of memory\n");
+                                exit(EXIT_FAILURE);
+                            }
+                            loops->cases[loops->total_cases].min = min;
+                            loops->cases[loops->total_cases].max = max;
+                            loops->cases[loops->total_cases].label = label;
+                            loops->total_cases++;
                         }
-                        loops->label_loop = next_local++;
-                        sprintf(temp, INTERNAL_PREFIX "%d", loops->label_loop);
-                        if (type == TYPE_8)
-                            generic_comparison_8bit(min, max, temp);
-                        else
-                            generic_comparison_16bit(min, max, temp);
                     }
-                }
-            } else if (strcmp(name, "EXIT") == 0) {
-                struct loop *loop_explorer;
+                    break;
+                case K_EXIT: {
+                    struct loop *loop_explorer;
                 
-                get_lex();
+                    get_lex();
                 
-                /* Avoid IF blocks */
-                loop_explorer = loops;
-                while (loop_explorer != NULL) {
-                    if (loop_explorer->type != NESTED_IF)
-                        break;
-                    loop_explorer = loop_explorer->next;
+                    /* Avoid IF blocks */
+                    loop_explorer = loops;
+                    while (loop_explorer != NULL) {
+                        if (loop_explorer->type != NESTED_IF)
+                            break;
+                        loop_explorer = loop_explorer->next;
+                    }
+                    if (loops == NULL || loop_explorer == NULL) {
+                        emit_error("nowhere to EXIT");
+                    } else {
+                        if (lex != C_NAME) {
+                            emit_error("missing type of EXIT, WHILE/FOR/DO");
+                        } else if (keyword == K_FOR) {
+                            get_lex();
+                            if (loop_explorer->type != NESTED_FOR) {
+                                emit_error("EXIT FOR without FOR");
+                            } else {
+                                if (loop_explorer->label_exit == 0)
+                                    loop_explorer->label_exit = next_local++;
+                                sprintf(temp, INTERNAL_PREFIX "%d", loop_explorer->label_exit);
+                                generic_jump(temp);
+                            }
+                        } else if (keyword == K_WHILE) {
+                            get_lex();
+                            if (loop_explorer->type != NESTED_WHILE) {
+                                emit_error("EXIT WHILE without WHILE");
+                            } else {
+                                sprintf(temp, INTERNAL_PREFIX "%d", loop_explorer->label_exit);
+                                generic_jump(temp);
+                            }
+                        } else if (keyword == K_DO) {
+                            get_lex();
+                            if (loop_explorer->type != NESTED_DO && loop_explorer->type != NESTED_DO_LOOP) {
+                                emit_error("EXIT DO without DO");
+                            } else {
+                                loop_explorer->var[0] = '1';
+                                sprintf(temp, INTERNAL_PREFIX "%d", loop_explorer->label_exit);
+                                generic_jump(temp);
+                            }
+                        } else if (keyword == K_SELECT) {
+                            get_lex();
+                            if (loop_explorer->type != NESTED_SELECT) {
+                                emit_error("EXIT SELECT without SELECT");
+                            } else {
+                                sprintf(temp, INTERNAL_PREFIX "%d", loop_explorer->label_exit);
+                                generic_jump(temp);
+                            }
+                        } else {
+                            emit_error("only supported EXIT WHILE/FOR/DO/SELECT");
+                            get_lex();
+                        }
+                    }
+                    break;
                 }
-                if (loops == NULL || loop_explorer == NULL) {
-                    emit_error("nowhere to EXIT");
-                } else {
+                case K_REM:
+                    line_pos = line_size;
+                    get_lex();
+                    break;
+                case K_RESTORE:
+                    get_lex();
                     if (lex != C_NAME) {
-                        emit_error("missing type of EXIT, WHILE/FOR/DO");
-                    } else if (strcmp(name, "FOR") == 0) {
-                        get_lex();
-                        if (loop_explorer->type != NESTED_FOR) {
-                            emit_error("EXIT FOR without FOR");
-                        } else {
-                            if (loop_explorer->label_exit == 0)
-                                loop_explorer->label_exit = next_local++;
-                            sprintf(temp, INTERNAL_PREFIX "%d", loop_explorer->label_exit);
-                            generic_jump(temp);
+                        emit_error("bad syntax for RESTORE");
+                    } else {
+                        label = label_search(name);
+                        if (label == NULL) {
+                            label = label_add(name);
                         }
-                    } else if (strcmp(name, "WHILE") == 0) {
-                        get_lex();
-                        if (loop_explorer->type != NESTED_WHILE) {
-                            emit_error("EXIT WHILE without WHILE");
+                        if (target == CPU_6502) {
+                            strcpy(temp, "#" LABEL_PREFIX);
+                            strcat(temp, name);
+                            cpu6502_1op("LDA", temp);
+                            strcat(temp, ">>8");
+                            cpu6502_1op("LDY", temp);
+                            cpu6502_1op("STA", "read_pointer");
+                            cpu6502_1op("STY", "read_pointer+1");
+                        } else if (target == CPU_9900) {
+                            strcpy(temp, LABEL_PREFIX);
+                            strcat(temp, name);
+                            cpu9900_2op("li", "r0", temp);
+                            cpu9900_2op("mov", "r0", "@read_pointer");
                         } else {
-                            sprintf(temp, INTERNAL_PREFIX "%d", loop_explorer->label_exit);
-                            generic_jump(temp);
+                            strcpy(temp, LABEL_PREFIX);
+                            strcat(temp, name);
+                            cpuz80_2op("LD", "HL", temp);
+                            cpuz80_2op("LD", "(read_pointer)", "HL");
                         }
-                    } else if (strcmp(name, "DO") == 0) {
                         get_lex();
-                        if (loop_explorer->type != NESTED_DO && loop_explorer->type != NESTED_DO_LOOP) {
-                            emit_error("EXIT DO without DO");
-                        } else {
-                            loop_explorer->var[0] = '1';
-                            sprintf(temp, INTERNAL_PREFIX "%d", loop_explorer->label_exit);
-                            generic_jump(temp);
-                        }
-                    } else if (strcmp(name, "SELECT") == 0) {
+                    }
+                    break;
+                case K_READ: {
+                    int c;
+                
+                    get_lex();
+                    if (lex == C_NAME && strcmp(name, "BYTE") == 0) {
                         get_lex();
-                        if (loop_explorer->type != NESTED_SELECT) {
-                            emit_error("EXIT SELECT without SELECT");
-                        } else {
-                            sprintf(temp, INTERNAL_PREFIX "%d", loop_explorer->label_exit);
-                            generic_jump(temp);
-                        }
+                        c = 2;
                     } else {
-                        emit_error("only supported EXIT WHILE/FOR/DO/SELECT");
-                        get_lex();
-                    }
-                }
-            } else if (strcmp(name, "REM") == 0) {
-                line_pos = line_size;
-                get_lex();
-            } else if (strcmp(name, "RESTORE") == 0) {
-                get_lex();
-                if (lex != C_NAME) {
-                    emit_error("bad syntax for RESTORE");
-                } else {
-                    label = label_search(name);
-                    if (label == NULL) {
-                        label = label_add(name);
+                        c = 1;
                     }
-                    if (target == CPU_6502) {
-                        sprintf(temp, "#" LABEL_PREFIX "%s", name);
-                        cpu6502_1op("LDA", temp);
-                        strcat(temp, ">>8");
-                        cpu6502_1op("LDY", temp);
-                        cpu6502_1op("STA", "read_pointer");
-                        cpu6502_1op("STY", "read_pointer+1");
-                    } else if (target == CPU_9900) {
-                        sprintf(temp, LABEL_PREFIX "%s", name);
-                        cpu9900_2op("li", "r0", temp);
-                        cpu9900_2op("mov", "r0", "@read_pointer");
-                    } else {
-                        sprintf(temp, LABEL_PREFIX "%s", name);
-                        cpuz80_2op("LD", "HL", temp);
-                        cpuz80_2op("LD", "(read_pointer)", "HL");
+                    while (1) {
+                        compile_assignment(c);
+                        if (lex != C_COMMA)
+                            break;
+                        get_lex();
                     }
-                    get_lex();
+                    break;
                 }
-            } else if (strcmp(name, "READ") == 0) {
-                int c;
+                case K_DATA: {
+                    struct node *tree;
+                    int c = 0;
                 
-                get_lex();
-                if (lex == C_NAME && strcmp(name, "BYTE") == 0) {
-                    get_lex();
-                    c = 2;
-                } else {
-                    c = 1;
-                }
-                while (1) {
-                    compile_assignment(c);
-                    if (lex != C_COMMA)
-                        break;
+                    generic_dump();
                     get_lex();
-                }
-            } else if (strcmp(name, "DATA") == 0) {
-                struct node *tree;
-                int c = 0;
-                
-                generic_dump();
-                get_lex();
-                if (lex == C_NAME && strcmp(name, "BYTE") == 0) {
-                    int d;
+                    if (lex == C_NAME && strcmp(name, "BYTE") == 0) {
+                        int d;
                     
-                    get_lex();
-                    while (1) {
-                        if (lex == C_STRING) {
-                            for (d = 0; d < name_size; d++) {
+                        get_lex();
+                        if (lex == C_NAME && strcmp(name, "FILE") == 0 && lex_sneak_peek() == '"') {
+                            get_lex();
+                            compile_data_file();
+                            break;
+                        }
+                        while (1) {
+                            if (lex == C_STRING) {
+                                for (d = 0; d < name_size; d++) {
+                                    if (c == 0) {
+                                        if (target == CPU_9900) {
+                                            inst_printf("\tbyte ");
+                                        } else {
+                                            inst_printf("\tDB ");
+                                        }
+                                    } else {
+                                        inst_printf(",");
+                                    }
+                                    if (target == CPU_9900) {
+                                        inst_printf(">%02x", name[d] & 0xff);
+                                    } else {
+                                        inst_printf("$%02x", name[d] & 0xff);
+                                    }
+                                    if (c == 7) {
+                                        inst_printf("\n");
+                                        c = 0;
+                                    } else {
+                                        c++;
+                                    }
+                                }
+                                get_lex();
+                            } else {
+                                tree = evaluate_level_0(&type);
+                                if (tree->type != N_NUM8 && tree->type != N_NUM16) {
+                                    emit_error("not a constant expression in CONST");
+                                } else {
+                                    value = tree->value;
+                                }
+                                tree = NULL;
                                 if (c == 0) {
                                     if (target == CPU_9900) {
-                                        fprintf(output, "\tbyte ");
+                                        inst_printf("\tbyte ");
                                     } else {
-                                        fprintf(output, "\tDB ");
+                                        inst_printf("\tDB ");
                                     }
                                 } else {
-                                    fprintf(output, ",");
+                                    inst_printf(",");
                                 }
                                 if (target == CPU_9900) {
-                                    fprintf(output, ">%02x", name[d] & 0xff);
+                                    inst_printf(">%02x", value & 0xff);
                                 } else {
-                                    fprintf(output, "$%02x", name[d] & 0xff);
+                                    inst_printf("$%02x", value & 0xff);
                                 }
                                 if (c == 7) {
-                                    fprintf(output, "\n");
+                                    inst_printf("\n");
                                     c = 0;
                                 } else {
                                     c++;
                                 }
                             }
+                            if (lex != C_COMMA)
+                                break;
                             get_lex();
-                        } else {
-                            tree = evaluate_level_0(&type);
-                            if (tree->type != N_NUM8 && tree->type != N_NUM16) {
-                                emit_error("not a constant expression in CONST");
-                            } else {
-                                value = tree->value;
-                            }
-                            node_delete(tree);
-                            tree = NULL;
-                            if (c == 0) {
-                                if (target == CPU_9900) {
-                                    fprintf(output, "\tbyte ");
-                                } else {
-                                    fprintf(output, "\tDB ");
-                                }
-                            } else {
-                                fprintf(output, ",");
-                            }
-                            if (target == CPU_9900) {
-                                fprintf(output, ">%02x", value & 0xff);
-                            } else {
-                                fprintf(output, "$%02x", value & 0xff);
-                            }
-                            if (c == 7) {
-                                fprintf(output, "\n");
-                                c = 0;
-                            } else {
-                                c++;
-                            }
                         }
-                        if (lex != C_COMMA)
-                            break;
-                        get_lex();
-                    }
-                    if (c) {
-                        fprintf(output, "\n");
-                    }
-                } else {
-                    while (1) {
-                        if (lex == C_NAME && strcmp(name, "VARPTR") == 0) {  /* Access to variable/array/label address */
-                            int type2;
+                        if (c) {
+                            inst_printf("\n");
+                        }
+                    } else {
+                        while (1) {
+                            if (lex == C_NAME && keyword == K_VARPTR) {  /* Access to variable/array/label address */
+                                int type2;
                             
-                            get_lex();
-                            check_for_macro();
-                            if (lex != C_NAME) {
-                                emit_error("missing variable name for VARPTR");
-                            } else {
-                                if (lex_sneak_peek() == '(') {  /* Indexed access */
-                                    struct node *tree;
-                                    int index;
-                                    struct label *label;
+                                get_lex();
+                                check_for_macro();
+                                if (lex != C_NAME) {
+                                    emit_error("missing variable name for VARPTR");
+                                } else {
+                                    if (lex_sneak_peek() == '(') {  /* Indexed access */
+                                        struct node *tree;
+                                        int index;
+                                        struct label *label;
                                     
-                                    label = array_search(name);
-                                    if (label != NULL) {    /* Found array */
-                                    } else {
-                                        label = label_search(name);
-                                        if (label != NULL) {
-                                            if (label->used & LABEL_IS_VARIABLE) {
-                                                emit_error("using array but not defined");
-                                            }
+                                        label = array_search(name);
+                                        if (label != NULL) {    /* Found array */
                                         } else {
-                                            label = label_add(name);
+                                            label = label_search(name);
+                                            if (label != NULL) {
+                                                if (label->used & LABEL_IS_VARIABLE) {
+                                                    emit_error("using array but not defined");
+                                                }
+                                            } else {
+                                                label = label_add(name);
+                                            }
                                         }
-                                    }
-                                    get_lex();
-                                    if (lex != C_LPAREN)
-                                        emit_error("missing left parenthesis in array access");
-                                    else
-                                        get_lex();
-                                    tree = evaluate_level_0(&type2);
-                                    if (tree->type != N_NUM8 && tree->type != N_NUM16) {
-                                        index = 0;
-                                        emit_error("not a constant expression in array access");
-                                    } else {
-                                        index = tree->value;
-                                    }
-                                    if (lex != C_RPAREN)
-                                        emit_error("missing right parenthesis in array access");
-                                    else
                                         get_lex();
-                                    if (c == 0) {
-                                        if (target == CPU_9900) {
-                                            fprintf(output, "\tdata ");
+                                        if (lex != C_LPAREN)
+                                            emit_error("missing left parenthesis in array access");
+                                        else
+                                            get_lex();
+                                        tree = evaluate_level_0(&type2);
+                                        if (tree->type != N_NUM8 && tree->type != N_NUM16) {
+                                            index = 0;
+                                            emit_error("not a constant expression in array access");
                                         } else {
-                                            fprintf(output, "\tDW ");
-                                        }
-                                    } else {
-                                        fprintf(output, ",");
-                                    }
-                                    strcpy(assigned, label->name);
-                                    if (target == CPU_9900) {
-                                        char *p = assigned;
-                                        
-                                        while (*p) {
-                                            if (*p == '#')
-                                                *p = '_';
-                                            p++;
-                                        }
-                                    }
-                                    fprintf(output, "%s%s+%d", label->length ? ARRAY_PREFIX : LABEL_PREFIX, assigned, label->name[0] == '#' ? index * 2 : index);
-                                    if (c == 7) {
-                                        fprintf(output, "\n");
-                                        c = 0;
-                                    } else {
-                                        c++;
-                                    }
-                                    node_delete(tree);
-                                    tree = NULL;
-                                } else {
-                                    if (constant_search(name) != NULL) {
-                                        emit_error("constants doesn't have address for VARPTR");
-                                        get_lex();
-                                    } else {
-                                        label = label_search(name);
-                                        if (label != NULL && (label->used & LABEL_IS_VARIABLE) == 0) {
-                                            char buffer[MAX_LINE_SIZE];
-                                            
-                                            sprintf(buffer, "variable name '%s' already defined with other purpose", name);
-                                            emit_error(buffer);
-                                            label = NULL;
+                                            index = tree->value;
                                         }
-                                        if (label == NULL) {
-                                            check_for_explicit(name);
-                                            label = label_add(name);
-                                            if (name[0] == '#')
-                                                label->used = TYPE_16;
-                                            else
-                                                label->used = TYPE_8;
-                                            label->used |= LABEL_IS_VARIABLE;
-                                        }
-                                        get_lex();
+                                        if (lex != C_RPAREN)
+                                            emit_error("missing right parenthesis in array access");
+                                        else
+                                            get_lex();
                                         if (c == 0) {
                                             if (target == CPU_9900) {
-                                                fprintf(output, "\tdata ");
+                                                inst_printf("\tdata ");
                                             } else {
-                                                fprintf(output, "\tDW ");
+                                                inst_printf("\tDW ");
                                             }
                                         } else {
-                                            fprintf(output, ",");
+                                            inst_printf(",");
                                         }
                                         strcpy(assigned, label->name);
                                         if (target == CPU_9900) {
                                             char *p = assigned;
-                                            
+                                        
                                             while (*p) {
                                                 if (*p == '#')
                                                     *p = '_';
                                                 p++;
                                             }
                                         }
-                                        fprintf(output, "%s%s", LABEL_PREFIX, assigned);
+                                        inst_printf("%s%s+%d", label->length ? ARRAY_PREFIX : LABEL_PREFIX, assigned, label->name[0] == '#' ? index * 2 : index);
                                         if (c == 7) {
-                                            fprintf(output, "\n");
+                                            inst_printf("\n");
                                             c = 0;
                                         } else {
                                             c++;
                                         }
+                                        tree = NULL;
+                                    } else {
+                                        if (constant_search(name) != NULL) {
+                                            emit_error("constants doesn't have address for VARPTR");
+                                            get_lex();
+                                        } else {
+                                            label = label_search(name);
+                                            if (label != NULL && (label->used & LABEL_IS_VARIABLE) == 0) {
+                                                char buffer[MAX_LINE_SIZE];
+                                            
+                                                sprintf(buffer, "variable name '%s' already defined with other purpose", name);
+                                                emit_error(buffer);
+                                                label = NULL;
+                                            }
+                                            if (label == NULL) {
+                                                check_for_explicit(name);
+                                                label = label_add(name);
+                                                if (name[0] == '#')
+                                                    label->used = TYPE_16;
+                                                else
+                                                    label->used = TYPE_8;
+                                                label->used |= LABEL_IS_VARIABLE;
+                                            }
+                                            label->used |= LABEL_NOT_LOCAL | LABEL_BY_ADDRESS;
+                                            get_lex();
+                                            if (c == 0) {
+                                                if (target == CPU_9900) {
+                                                    inst_printf("\tdata ");
+                                                } else {
+                                                    inst_printf("\tDW ");
+                                                }
+                                            } else {
+                                                inst_printf(",");
+                                            }
+                                            strcpy(assigned, label->name);
+                                            if (target == CPU_9900) {
+                                                char *p = assigned;
+                                            
+                                                while (*p) {
+                                                    if (*p == '#')
+                                                        *p = '_';
+                                                    p++;
+                                                }
+                                            }
+                                            inst_printf("%s%s", LABEL_PREFIX, assigned);
+                                            if (c == 7) {
+                                                inst_printf("\n");
+                                                c = 0;
+                                            } else {
+                                                c++;
+                                            }
+                                        }
                                     }
                                 }
-                            }
-                        } else {
-                            tree = evaluate_level_0(&type);
-                            if (tree->type != N_NUM8 && tree->type != N_NUM16) {
-                                emit_error("not a constant expression in CONST");
                             } else {
-                                value = tree->value;
-                            }
-                            node_delete(tree);
-                            tree = NULL;
-                            if (c == 0) {
+                                tree = evaluate_level_0(&type);
+                                if (tree->type != N_NUM8 && tree->type != N_NUM16) {
+                                    emit_error("not a constant expression in CONST");
+                                } else {
+                                    value = tree->value;
+                                }
+                                tree = NULL;
+                                if (c == 0) {
+                                    if (target == CPU_9900) {
+                                        inst_printf("\tdata ");
+                                    } else {
+                                        inst_printf("\tDW ");
+                                    }
+                                } else {
+                                    inst_printf(",");
+                                }
                                 if (target == CPU_9900) {
-                                    fprintf(output, "\tdata ");
+                                    inst_printf(">%04x", value & 0xffff);
                                 } else {
-                                    fprintf(output, "\tDW ");
+                                    inst_printf("$%04x", value & 0xffff);
+                                }
+                                if (c == 7) {
+                                    inst_printf("\n");
+                                    c = 0;
+                                } else {
+                                    c++;
                                 }
-                            } else {
-                                fprintf(output, ",");
-                            }
-                            if (target == CPU_9900) {
-                                fprintf(output, ">%04x", value & 0xffff);
-                            } else {
-                                fprintf(output, "$%04x", value & 0xffff);
-                            }
-                            if (c == 7) {
-                                fprintf(output, "\n");
-                                c = 0;
-                            } else {
-                                c++;
                             }
+                            if (lex != C_COMMA)
+                                break;
+                            get_lex();
+                        }
+                        if (c) {
+                            inst_printf("\n");
+                        }
+                    }
+                    break;
+                }
+                case K_SIGNED: {
+                    struct signedness *c;
+                
+                    get_lex();
+                    while (1) {
+                        if (lex != C_NAME) {
+                            emit_error("missing name in SIGNED");
+                            break;
                         }
+                        c = signed_search(name);
+                        if (c != NULL) {
+                            emit_error("variable already SIGNED/UNSIGNED");
+                        } else {
+                            c = signed_add(name);
+                        }
+                        c->sign = 1;
+                        get_lex();
                         if (lex != C_COMMA)
                             break;
                         get_lex();
                     }
-                    if (c) {
-                        fprintf(output, "\n");
-                    }
+                    break;
                 }
-            } else if (strcmp(name, "SIGNED") == 0) {
-                struct signedness *c;
+                case K_UNSIGNED: {
+                    struct signedness *c;
                 
-                get_lex();
-                while (1) {
-                    if (lex != C_NAME) {
-                        emit_error("missing name in SIGNED");
-                        break;
-                    }
-                    c = signed_search(name);
-                    if (c != NULL) {
-                        emit_error("variable already SIGNED/UNSIGNED");
-                    } else {
-                        c = signed_add(name);
-                    }
-                    c->sign = 1;
-                    get_lex();
-                    if (lex != C_COMMA)
-                        break;
                     get_lex();
+                    while (1) {
+                        if (lex != C_NAME) {
+                            emit_error("missing name in UNSIGNED");
+                            break;
+                        }
+                        c = signed_search(name);
+                        if (c != NULL) {
+                            emit_error("variable already SIGNED/UNSIGNED");
+                        } else {
+                            c = signed_add(name);
+                        }
+                        c->sign = 2;
+                        get_lex();
+                        if (lex != C_COMMA)
+                            break;
+                        get_lex();
+                    }
+                    break;
                 }
-            } else if (strcmp(name, "UNSIGNED") == 0) {
-                struct signedness *c;
+                case K_CONST: {
+                    struct constant *c;
                 
-                get_lex();
-                while (1) {
+                    get_lex();
                     if (lex != C_NAME) {
-                        emit_error("missing name in UNSIGNED");
-                        break;
+                        emit_error("name required for constant assignment");
+                        return;
                     }
-                    c = signed_search(name);
+                    c = constant_search(name);
                     if (c != NULL) {
-                        emit_error("variable already SIGNED/UNSIGNED");
+                        emit_error("constant redefined");
                     } else {
-                        c = signed_add(name);
+                        c = constant_add(name);
                     }
-                    c->sign = 2;
-                    get_lex();
-                    if (lex != C_COMMA)
-                        break;
-                    get_lex();
-                }
-            } else if (strcmp(name, "CONST") == 0) {
-                struct constant *c;
-                
-                get_lex();
-                if (lex != C_NAME) {
-                    emit_error("name required for constant assignment");
-                    return;
-                }
-                c = constant_search(name);
-                if (c != NULL) {
-                    emit_error("constant redefined");
-                } else {
-                    c = constant_add(name);
-                }
-                strcpy(assigned, name);;
-                get_lex();
-                if (lex != C_EQUAL) {
-                    emit_error("required '=' for constant assignment");
-                } else {
-                    struct node *tree;
-                    int type;
-                    
+                    strcpy(assigned, name);;
                     get_lex();
-                    tree = evaluate_level_0(&type);
-                    if (tree->type != N_NUM8 && tree->type != N_NUM16) {
-                        emit_error("not a constant expression in CONST");
+                    if (lex != C_EQUAL) {
+                        emit_error("required '=' for constant assignment");
                     } else {
-                        c->value = tree->value;
-                    }
-                    if (target == CPU_Z80 || target == CPU_6502) {
-                        sprintf(temp, CONST_PREFIX "%s:\tequ $%04x", assigned, c->value);
-                        fprintf(output, "%s\n", temp);
-                    } else if (target == CPU_9900) {
-                        sprintf(temp, CONST_PREFIX "%s\tequ >%04x", assigned, c->value);
-                        cpu9900_label(temp);    /* Hack */
-                    }
-                    node_delete(tree);
-                    tree = NULL;
-                }
-            } else if (strcmp(name, "DIM") == 0) {
-                char array[MAX_LINE_SIZE];
-                struct label *new_array;
-                struct node *tree;
-                int type;
-                int c;
-                
-                while (1) {
-                    get_lex();
-                    if (lex != C_NAME) {
-                        emit_error("missing name in DIM");
-                        break;
-                    }
-                    strcpy(array, name);
-                    get_lex();
-                    if (lex == C_LPAREN) {
+                        struct node *tree;
+                        int type;
+                    
                         get_lex();
                         tree = evaluate_level_0(&type);
                         if (tree->type != N_NUM8 && tree->type != N_NUM16) {
-                            emit_error("not a constant expression in DIM");
-                            c = 10;
+                            emit_error("not a constant expression in CONST");
                         } else {
-                            c = tree->value;
+                            c->value = tree->value;
                         }
-                        node_delete(tree);
-                        if (lex != C_RPAREN) {
-                            emit_error("missing right parenthesis in DIM");
-                        } else {
-                            get_lex();
+                        if (target == CPU_Z80 || target == CPU_6502) {
+                            sprintf(temp, CONST_PREFIX "%s:\tequ $%04x", assigned, c->value);
+                            inst_printf("%s\n", temp);
+                        } else if (target == CPU_9900) {
+                            sprintf(temp, CONST_PREFIX "%s\tequ >%04x", assigned, c->value);
+                            cpu9900_label(temp);    /* Hack */
                         }
-                        new_array = array_search(array);
-                        if (new_array != NULL) {
-                            emit_error("array already defined");
-                        } else {
-                            new_array = array_add(array);
-                            new_array->length = c;
-                        }
-                    } else {
-                        label = label_add(array);
-                        if (array[0] == '#')
-                            label->used = TYPE_16;
-                        else
-                            label->used = TYPE_8;
-                        label->used |= LABEL_IS_VARIABLE;
+                        tree = NULL;
                     }
-                    if (lex != C_COMMA)
-                        break;
+                    break;
                 }
-            } else if (strcmp(name, "ON") == 0) {
-                struct label *label;
-                int table;
-                int c;
-                int max_value;
-                int gosub;
-                int fast;
-                struct label *options[256];
-                int new_label;
-                int type;
+                case K_DIM: {
+                    char array[MAX_LINE_SIZE];
+                    struct label *new_array;
+                    struct node *tree;
+                    int type;
+                    int c;
                 
-                get_lex();
-                if (lex == C_NAME && strcmp(name, "FRAME") == 0) {  /* Frame-driven games */
-                    get_lex();
-                    if (lex != C_NAME || strcmp(name, "GOSUB") != 0) {
-                        emit_error("Bad syntax for ON FRAME GOSUB");
-                    }
-                    get_lex();
-                    if (lex != C_NAME) {
-                        emit_error("Missing label for ON FRAME GOSUB");
-                    }
-                    if (frame_drive != NULL) {
-                        emit_error("More than one ON FRAME GOSUB");
-                    }
-                    label = label_search(name);
-                    if (label == NULL) {
-                        label = label_add(name);
-                    }
-                    label->used |= LABEL_USED;
-                    label->used |= LABEL_CALLED_BY_GOSUB;
-                    frame_drive = label;
-                    get_lex();
-                } else {
-                    type = evaluate_expression(0, 0, 0);
-                    fast = 0;
-                    if (lex == C_NAME && strcmp(name, "FAST") == 0) {
-                        get_lex();
-                        fast = 1;
-                    }
-                    gosub = 0;
-                    if (lex != C_NAME || (strcmp(name, "GOTO") != 0 && strcmp(name, "GOSUB") != 0)) {
-                        emit_error("required GOTO or GOSUB after ON");
-                    } else if (strcmp(name, "GOTO") == 0) {
-                        get_lex();
-                    } else if (strcmp(name, "GOSUB") == 0) {
-                        get_lex();
-                        gosub = 1;
-                    }
-                    max_value = 0;
                     while (1) {
-                        if (max_value == sizeof(options) / sizeof(struct label *)) {
-                            emit_error("too many options for ON statement");
-                            max_value--;
+                        get_lex();
+                        if (lex != C_NAME) {
+                            emit_error("missing name in DIM");
+                            break;
                         }
-                        if (lex == C_NAME) {
-                            label = label_search(name);
-                            if (label == NULL) {
-                                label = label_add(name);
+                        strcpy(array, name);
+                        get_lex();
+                        if (lex == C_LPAREN) {
+                            get_lex();
+                            tree = evaluate_level_0(&type);
+                            if (tree->type != N_NUM8 && tree->type != N_NUM16) {
+                                emit_error("not a constant expression in DIM");
+                                c = 10;
+                            } else {
+                                c = tree->value;
                             }
-                            label->used |= LABEL_USED;
-                            if (gosub != 0) {
-                                label->used |= LABEL_CALLED_BY_GOSUB;
+                            if (lex != C_RPAREN) {
+                                emit_error("missing right parenthesis in DIM");
                             } else {
-                                label->used |= LABEL_CALLED_BY_GOTO;
+                                get_lex();
+                            }
+                            new_array = array_search(array);
+                            if (new_array != NULL) {
+                                emit_error("array already defined");
+                            } else {
+                                new_array = array_add(array);
+                                new_array->length = c;
                             }
-                            options[max_value++] = label;
-                            get_lex();
                         } else {
-                            options[max_value++] = NULL;
+                            label = label_add(array);
+                            if (array[0] == '#')
+                                label->used = TYPE_16;
+                            else
+                                label->used = TYPE_8;
+                            label->used |= LABEL_IS_VARIABLE;
                         }
                         if (lex != C_COMMA)
                             break;
-                        get_lex();
                     }
-                    table = next_local++;
-                    new_label = next_local++;
-                    if (fast == 0) {
-                        if (target == CPU_6502) {
-                            if ((type & MAIN_TYPE) == TYPE_8) {
-                                cpu6502_1op("STA", "temp");
-                                cpu6502_1op("LDY", "#0");
-                                cpu6502_1op("STY", "temp+1");
-                                sprintf(temp, "#%d", max_value);
-                                cpu6502_1op("CMP", temp);
+                    break;
+                }
+                case K_ON: {
+                    struct label *label;
+                    int table;
+                    int c;
+                    int max_value;
+                    int gosub;
+                    int fast;
+                    struct label *options[256];
+                    int new_label;
+                    int type;
+                
+                    get_lex();
+                    if (lex == C_NAME && keyword == K_FRAME) {  /* Frame-driven games */
+                        get_lex();
+                        if (lex != C_NAME || keyword != K_GOSUB) {
+                            emit_error("Bad syntax for ON FRAME GOSUB");
+                        }
+                        get_lex();
+                        if (lex != C_NAME) {
+                            emit_error("Missing label for ON FRAME GOSUB");
+                        }
+                        if (frame_drive != NULL) {
+                            emit_error("More than one ON FRAME GOSUB");
+                        }
+                        label = label_search(name);
+                        if (label == NULL) {
+                            label = label_add(name);
+                        }
+                        label->used |= LABEL_USED;
+                        label->used |= LABEL_CALLED_BY_GOSUB;
+                        frame_drive = label;
+                        get_lex();
+                    } else {
+                        type = evaluate_expression(0, 0, 0);
+                        fast = 0;
+                        if (lex == C_NAME && strcmp(name, "FAST") == 0) {
+                            get_lex();
+                            fast = 1;
+                        }
+                        gosub = 0;
+                        if (lex != C_NAME || (keyword != K_GOTO && keyword != K_GOSUB)) {
+                            emit_error("required GOTO or GOSUB after ON");
+                        } else if (keyword == K_GOTO) {
+                            get_lex();
+                        } else if (keyword == K_GOSUB) {
+                            get_lex();
+                            gosub = 1;
+                        }
+                        max_value = 0;
+                        while (1) {
+                            if (max_value == sizeof(options) / sizeof(struct label *)) {
+                                emit_error("too many options for ON statement");
+                                max_value--;
+                            }
+                            if (lex == C_NAME) {
+                                label = label_search(name);
+                                if (label == NULL) {
+                                    label = label_add(name);
+                                }
+                                label->used |= LABEL_USED;
+                                if (gosub != 0) {
+                                    label->used |= LABEL_CALLED_BY_GOSUB;
+                                } else {
+                                    label->used |= LABEL_CALLED_BY_GOTO;
+                                }
+                                procedure_flow(label, !gosub);
+                                options[max_value++] = label;
+                                get_lex();
                             } else {
-                                cpu6502_1op("STA", "temp");
-                                cpu6502_1op("STY", "temp+1");
-                                sprintf(temp, "#%d", max_value);
-                                cpu6502_1op("LDA", "temp");
-                                cpu6502_noop("SEC");
-                                cpu6502_1op("SBC", temp);
-                                cpu6502_1op("LDA", "temp+1");
-                                strcat(temp, ">>8");
-                                cpu6502_1op("SBC", temp);
+                                options[max_value++] = NULL;
                             }
-                            sprintf(temp, INTERNAL_PREFIX "%d", new_label);
-                            cpu6502_1op("BCS.L", temp);
-                        } else if (target == CPU_9900) {
-                            if ((type & MAIN_TYPE) == TYPE_8) {
-                                sprintf(temp, "%d   ; %d*256", max_value*256, max_value);
-                                cpu9900_2op("ci", "r0", temp);
+                            if (lex != C_COMMA)
+                                break;
+                            get_lex();
+                        }
+                        table = next_local++;
+                        new_label = next_local++;
+                        if (fast == 0) {
+                            if (target == CPU_6502) {
+                                if ((type & MAIN_TYPE) == TYPE_8) {
+                                    cpu6502_1op("STA", "temp");
+                                    cpu6502_1op("LDY", "#0");
+                                    cpu6502_1op("STY", "temp+1");
+                                    sprintf(temp, "#%d", max_value);
+                                    cpu6502_1op("CMP", temp);
+                                } else {
+                                    cpu6502_1op("STA", "temp");
+                                    cpu6502_1op("STY", "temp+1");
+                                    sprintf(temp, "#%d", max_value);
+                                    cpu6502_1op("LDA", "temp");
+                                    cpu6502_noop("SEC");
+                                    cpu6502_1op("SBC", temp);
+                                    cpu6502_1op("LDA", "temp+1");
+                                    strcat(temp, ">>8");
+                                    cpu6502_1op("SBC", temp);
+                                }
+                                sprintf(temp, INTERNAL_PREFIX "%d", new_label);
+                                cpu6502_1op("BCS.L", temp);
+                            } else if (target == CPU_9900) {
+                                if ((type & MAIN_TYPE) == TYPE_8) {
+                                    sprintf(temp, "%d   ; %d*256", max_value*256, max_value);
+                                    cpu9900_2op("ci", "r0", temp);
+                                } else {
+                                    sprintf(temp, "%d", max_value);
+                                    cpu9900_2op("ci", "r0", temp);
+                                }
+                                sprintf(temp, "@" INTERNAL_PREFIX "%d", new_label);
+                                sprintf(temp + 100, INTERNAL_PREFIX "%d", next_local++);
+                                cpu9900_1op("jl", temp + 100);
+                                cpu9900_1op("b", temp);
+                                cpu9900_label(temp + 100);
                             } else {
-                                sprintf(temp, "%d", max_value);
-                                cpu9900_2op("ci", "r0", temp);
+                                if ((type & MAIN_TYPE) == TYPE_8) {
+                                    sprintf(temp, "%d", max_value);
+                                    cpuz80_1op("CP", temp);
+                                } else {
+                                    sprintf(temp, "%d", max_value);
+                                    cpuz80_2op("LD", "DE", temp);
+                                    cpuz80_1op("OR", "A");
+                                    cpuz80_2op("SBC", "HL", "DE");
+                                    cpuz80_2op("ADD", "HL", "DE");
+                                }
+                                sprintf(temp, INTERNAL_PREFIX "%d", new_label);
+                                cpuz80_2op("JP", "NC", temp);
                             }
-                            sprintf(temp, "@" INTERNAL_PREFIX "%d", new_label);
-                            sprintf(temp + 100, INTERNAL_PREFIX "%d", next_local++);
-                            cpu9900_1op("jl", temp + 100);
-                            cpu9900_1op("b", temp);
-                            cpu9900_label(temp + 100);
-                        } else {
-                            if ((type & MAIN_TYPE) == TYPE_8) {
-                                sprintf(temp, "%d", max_value);
-                                cpuz80_1op("CP", temp);
+                        }
+                        if (gosub) {
+                            if (target == CPU_6502) {
+                                sprintf(temp, "#(" INTERNAL_PREFIX "%d-1)>>8", new_label);
+                                cpu6502_1op("LDA", temp);
+                                cpu6502_noop("PHA");
+                                sprintf(temp, "#" INTERNAL_PREFIX "%d-1", new_label);
+                                cpu6502_1op("LDA", temp);
+                                cpu6502_noop("PHA");
+                            } else if (target == CPU_9900) {
+                                sprintf(temp, INTERNAL_PREFIX "%d", new_label);
+                                cpu9900_2op("li", "r1", temp);
+                                cpu9900_1op("dect", "r10");   /* stack manipulation */
+                                cpu9900_2op("mov", "r1", "*r10");
                             } else {
-                                sprintf(temp, "%d", max_value);
+                                sprintf(temp, INTERNAL_PREFIX "%d", new_label);
                                 cpuz80_2op("LD", "DE", temp);
-                                cpuz80_1op("OR", "A");
-                                cpuz80_2op("SBC", "HL", "DE");
-                                cpuz80_2op("ADD", "HL", "DE");
+                                cpuz80_1op("PUSH", "DE");
                             }
-                            sprintf(temp, INTERNAL_PREFIX "%d", new_label);
-                            cpuz80_2op("JP", "NC", temp);
                         }
-                    }
-                    if (gosub) {
                         if (target == CPU_6502) {
-                            sprintf(temp, "#(" INTERNAL_PREFIX "%d-1)>>8", new_label);
-                            cpu6502_1op("LDA", temp);
-                            cpu6502_noop("PHA");
-                            sprintf(temp, "#" INTERNAL_PREFIX "%d-1", new_label);
-                            cpu6502_1op("LDA", temp);
-                            cpu6502_noop("PHA");
+                            cpu6502_1op("LDA", "temp");
+                            cpu6502_1op("ASL", "A");
+                            cpu6502_1op("ROL", "temp+1");
+                            cpu6502_noop("CLC");
+                            sprintf(temp, "#" INTERNAL_PREFIX "%d", table);
+                            cpu6502_1op("ADC", temp);
+                            cpu6502_1op("STA", "temp");
+                            cpu6502_1op("LDA", "temp+1");
+                            strcat(temp, ">>8");
+                            cpu6502_1op("ADC", temp);
+                            cpu6502_1op("STA", "temp+1");
+                            cpu6502_1op("LDY", "#0");
+                            cpu6502_1op("LDA", "(temp),Y");
+                            cpu6502_1op("STA", "temp2");
+                            cpu6502_noop("INY");
+                            cpu6502_1op("LDA", "(temp),Y");
+                            cpu6502_1op("STA", "temp2+1");
+                            cpu6502_1op("JMP", "(temp2)");
                         } else if (target == CPU_9900) {
-                            sprintf(temp, INTERNAL_PREFIX "%d", new_label);
-                            cpu9900_2op("li", "r1", temp);
-                            cpu9900_1op("dect", "r10");   /* stack manipulation */
-                            cpu9900_2op("mov", "r1", "*r10");
+                            if ((type & MAIN_TYPE) == TYPE_8) {
+                                cpu9900_2op("srl", "r0", "8");
+                            }
+                            cpu9900_2op("sla", "r0", "1");
+                            cpu9900_2op("mov", "r0", "r1");
+                            sprintf(temp, "@" INTERNAL_PREFIX "%d(r1)", table);
+                            cpu9900_2op("mov", temp, "r0");
+                            cpu9900_1op("b", "*r0");
                         } else {
-                            sprintf(temp, INTERNAL_PREFIX "%d", new_label);
+                            if ((type & MAIN_TYPE) == TYPE_8) {
+                                cpuz80_2op("LD", "L", "A");
+                                if (type & TYPE_SIGNED) {
+                                    cpuz80_noop("RLA");
+                                    cpuz80_2op("SBC", "A", "A");
+                                    cpuz80_2op("LD", "H", "A");
+                                } else {
+                                    cpuz80_2op("LD", "H", "0");
+                                }
+                            }
+                            cpuz80_2op("ADD", "HL", "HL");
+                            sprintf(temp, INTERNAL_PREFIX "%d", table);
                             cpuz80_2op("LD", "DE", temp);
-                            cpuz80_1op("PUSH", "DE");
-                        }
-                    }
-                    if (target == CPU_6502) {
-                        cpu6502_1op("LDA", "temp");
-                        cpu6502_1op("ASL", "A");
-                        cpu6502_1op("ROL", "temp+1");
-                        cpu6502_noop("CLC");
-                        sprintf(temp, "#" INTERNAL_PREFIX "%d", table);
-                        cpu6502_1op("ADC", temp);
-                        cpu6502_1op("STA", "temp");
-                        cpu6502_1op("LDA", "temp+1");
-                        strcat(temp, ">>8");
-                        cpu6502_1op("ADC", temp);
-                        cpu6502_1op("STA", "temp+1");
-                        cpu6502_1op("LDY", "#0");
-                        cpu6502_1op("LDA", "(temp),Y");
-                        cpu6502_1op("STA", "temp2");
-                        cpu6502_noop("INY");
-                        cpu6502_1op("LDA", "(temp),Y");
-                        cpu6502_1op("STA", "temp2+1");
-                        cpu6502_1op("JMP", "(temp2)");
-                    } else if (target == CPU_9900) {
-                        if ((type & MAIN_TYPE) == TYPE_8) {
-                            cpu9900_2op("srl", "r0", "8");
-                        }
-                        cpu9900_2op("sla", "r0", "1");
-                        cpu9900_2op("mov", "r0", "r1");
-                        sprintf(temp, "@" INTERNAL_PREFIX "%d(r1)", table);
-                        cpu9900_2op("mov", temp, "r0");
-                        cpu9900_1op("b", "*r0");
-                    } else {
-                        if ((type & MAIN_TYPE) == TYPE_8) {
+                            cpuz80_2op("ADD", "HL", "DE");
+                            cpuz80_2op("LD", "A", "(HL)");
+                            cpuz80_1op("INC", "HL");
+                            cpuz80_2op("LD", "H", "(HL)");
                             cpuz80_2op("LD", "L", "A");
-                            if (type & TYPE_SIGNED) {
-                                cpuz80_noop("RLA");
-                                cpuz80_2op("SBC", "A", "A");
-                                cpuz80_2op("LD", "H", "A");
-                            } else {
-                                cpuz80_2op("LD", "H", "0");
-                            }
+                            cpuz80_1op("JP", "(HL)");
                         }
-                        cpuz80_2op("ADD", "HL", "HL");
                         sprintf(temp, INTERNAL_PREFIX "%d", table);
-                        cpuz80_2op("LD", "DE", temp);
-                        cpuz80_2op("ADD", "HL", "DE");
-                        cpuz80_2op("LD", "A", "(HL)");
-                        cpuz80_1op("INC", "HL");
-                        cpuz80_2op("LD", "H", "(HL)");
-                        cpuz80_2op("LD", "L", "A");
-                        cpuz80_1op("JP", "(HL)");
-                    }
-                    sprintf(temp, INTERNAL_PREFIX "%d", table);
-                    generic_label(temp);
-                    for (c = 0; c < max_value; c++) {
-                        if (options[c] != NULL) {
-                            sprintf(temp, LABEL_PREFIX "%s", options[c]->name);
-                        } else {
-                            sprintf(temp, INTERNAL_PREFIX "%d", new_label);
+                        generic_label(temp);
+                        for (c = 0; c < max_value; c++) {
+                            if (options[c] != NULL) {
+                                sprintf(temp, LABEL_PREFIX "%s", options[c]->name);
+                            } else {
+                                sprintf(temp, INTERNAL_PREFIX "%d", new_label);
+                            }
+                            if (target == CPU_6502)
+                                cpu6502_1op("DW", temp);
+                            else if (target == CPU_9900)
+                                cpu9900_1op("data", temp);
+                            else
+                                cpuz80_1op("DW", temp);
                         }
-                        if (target == CPU_6502)
-                            cpu6502_1op("DW", temp);
-                        else if (target == CPU_9900)
-                            cpu9900_1op("data", temp);
-                        else
-                            cpuz80_1op("DW", temp);
+                        sprintf(temp, INTERNAL_PREFIX "%d", new_label);
+                        generic_label(temp);
                     }
-                    sprintf(temp, INTERNAL_PREFIX "%d", new_label);
-                    generic_label(temp);
+                    break;
                 }
-            } else if (strcmp(name, "OPTION") == 0) {
-                get_lex();
-                if (lex != C_NAME) {
-                    emit_error("required name after OPTION");
-                } else if (strcmp(name, "EXPLICIT") == 0) {
+                case K_OPTION:
                     get_lex();
-                    if (lex == C_NAME && strcmp(name, "ON") == 0) {
-                        get_lex();
-                        option_explicit = 1;
-                    } else if (lex == C_NAME && strcmp(name, "OFF") == 0) {
-                        get_lex();
-                        option_explicit = 0;
-                    } else {
-                        option_explicit = 1;
-                    }
-                } else if (strcmp(name, "WARNINGS") == 0) {
-                    get_lex();
-                    if (lex == C_NAME && strcmp(name, "ON") == 0) {
+                    if (lex != C_NAME) {
+                        emit_error("required name after OPTION");
+                    } else if (strcmp(name, "EXPLICIT") == 0) {
                         get_lex();
-                        option_warnings = 1;
-                    } else if (lex == C_NAME && strcmp(name, "OFF") == 0) {
+                        if (lex == C_NAME && keyword == K_ON) {
+                            get_lex();
+                            option_explicit = 1;
+                        } else if (lex == C_NAME && strcmp(name, "OFF") == 0) {
+                            get_lex();
+                            option_explicit = 0;
+                        } else {
+                            option_explicit = 1;
+                        }
+                    } else if (strcmp(name, "WARNINGS") == 0) {
                         get_lex();
-                        option_warnings = 0;
-                    } else {
-                        emit_error("missing ON/OFF in OPTION WARNINGS");
-                    }
-                } else if (strcmp(name, "FM") == 0) {
-                    if (machine != MSX && machine != MSX2 && machine != SMS)
-                        emit_warning("OPTION FM only works for MSX/MSX2/SMS");
-                    get_lex();
-                    if (lex == C_NAME && strcmp(name, "ON") == 0) {
+                        if (lex == C_NAME && keyword == K_ON) {
+                            get_lex();
+                            option_warnings = 1;
+                        } else if (lex == C_NAME && strcmp(name, "OFF") == 0) {
+                            get_lex();
+                            option_warnings = 0;
+                        } else {
+                            emit_error("missing ON/OFF in OPTION WARNINGS");
+                        }
+                    } else if (strcmp(name, "FM") == 0) {
+                        if (machine != MSX && machine != MSX2 && machine != SMS)
+                            emit_warning("OPTION FM only works for MSX/MSX2/SMS");
                         get_lex();
-                        option_fm = 1;
-                    } else if (lex == C_NAME && strcmp(name, "OFF") == 0) {
+                        if (lex == C_NAME && keyword == K_ON) {
+                            get_lex();
+                            option_fm = 1;
+                        } else if (lex == C_NAME && strcmp(name, "OFF") == 0) {
+                            get_lex();
+                            option_fm = 0;
+                        } else {
+                            emit_error("missing ON/OFF in OPTION FM");
+                        }
+                    } else if (strcmp(name, "SCRATCHPAD") == 0) {
+                        if (machine != TI994A)
+                            emit_warning("OPTION SCRATCHPAD only works for TI-99/4A");
                         get_lex();
-                        option_fm = 0;
+                        if (lex != C_NAME) {
+                            emit_error("missing PROCEDURE name in OPTION SCRATCHPAD");
+                        } else {
+                            strcpy(scratchpad_name, name);
+                            get_lex();
+                        }
                     } else {
-                        emit_error("missing ON/OFF in OPTION FM");
+                        emit_error("non-recognized OPTION");
                     }
-                } else {
-                    emit_error("non-recognized OPTION");
-                }
-            } else if (strcmp(name, "DEF") == 0) {     /* Function definition (macro in CVBasic) */
-                char function[MAX_LINE_SIZE];
-                int total_arguments;
-                char *arguments[32];
-                struct macro *macro;
-                int c;
+                    break;
+                case K_DEF: { /* Function definition (macro in CVBasic) */
+                    char function[MAX_LINE_SIZE];
+                    int total_arguments;
+                    char *arguments[32];
+                    struct macro *macro;
+                    int c;
                 
-                get_lex();
-                if (lex != C_NAME || strcmp(name, "FN") != 0) {
-                    emit_error("syntax error for DEF FN");
-                } else {
                     get_lex();
-                    if (lex != C_NAME) {
-                        emit_error("missing function name for DEF FN");
-                    } else if (macro_search(name) != NULL) {
-                        emit_error("DEF FN name already defined");
+                    if (lex != C_NAME || strcmp(name, "FN") != 0) {
+                        emit_error("syntax error for DEF FN");
                     } else {
-                        strcpy(function, name);
                         get_lex();
-                        total_arguments = 0;
-                        if (lex == C_LPAREN) {
+                        if (lex != C_NAME) {
+                            emit_error("missing function name for DEF FN");
+                        } else if (macro_search(name) != NULL) {
+                            emit_error("DEF FN name already defined");
+                        } else {
+                            strcpy(function, name);
                             get_lex();
-                            while (1) {
-                                if (lex != C_NAME) {
-                                    emit_error("syntax error in argument list for DEF FN");
-                                    break;
-                                }
-                                if (total_arguments == 32) {
-                                    emit_error("More than 32 arguments in DEF FN");
-                                    break;
-                                }
-                                arguments[total_arguments] = malloc(strlen(name) + 1);
-                                if (arguments[total_arguments] == NULL) {
-                                    emit_error("Out of memory in DEF FN");
-                                    break;
-                                }
-                                strcpy(arguments[total_arguments], name);
-                                total_arguments++;
+                            total_arguments = 0;
+                            if (lex == C_LPAREN) {
                                 get_lex();
-                                if (lex == C_COMMA) {
-                                    get_lex();
-                                } else if (lex == C_RPAREN) {
+                                while (1) {
+                                    if (lex != C_NAME) {
+                                        emit_error("syntax error in argument list for DEF FN");
+                                        break;
+                                    }
+                                    if (total_arguments == 32) {
+                                        emit_error("More than 32 arguments in DEF FN");
+                                        break;
+                                    }
+                                    arguments[total_arguments] = malloc(strlen(name) + 1);
+                                    if (arguments[total_arguments] == NULL) {
+                                        emit_error("Out of memory in DEF FN");
+                                        break;
+                                    }
+                                    strcpy(arguments[total_arguments], name);
+                                    total_arguments++;
                                     get_lex();
-                                    break;
-                                } else {
-                                    emit_error("syntax error in argument list for DEF FN");
-                                    break;
+                                    if (lex == C_COMMA) {
+                                        get_lex();
+                                    } else if (lex == C_RPAREN) {
+                                        get_lex();
+                                        break;
+                                    } else {
+                                        emit_error("syntax error in argument list for DEF FN");
+                                        break;
+                                    }
                                 }
                             }
-                        }
-                        macro = macro_add(function);
-                        macro->total_arguments = total_arguments;
-                        if (lex != C_EQUAL) {
-                            emit_error("missing = in DEF FN");
-                        } else {
-                            get_lex();
-                            while (lex != C_END) {
-                                if (lex == C_ERR) {
-                                    emit_error("bad syntax inside DEF FN replacement text");
-                                    break;
-                                }
-                                if (lex == C_NAME) {
-                                    for (c = 0; c < total_arguments; c++) {
-                                        if (strcmp(arguments[c], name) == 0)
-                                            break;
+                            macro = macro_add(function);
+                            macro->total_arguments = total_arguments;
+                            if (lex != C_EQUAL) {
+                                emit_error("missing = in DEF FN");
+                            } else {
+                                get_lex();
+                                while (lex != C_END) {
+                                    if (lex == C_ERR) {
+                                        emit_error("bad syntax inside DEF FN replacement text");
+                                        break;
                                     }
-                                    if (c < total_arguments) {
-                                        lex = C_ERR;
-                                        value = c;
-                                        name[0] = '\0';
+                                    if (lex == C_NAME) {
+                                        for (c = 0; c < total_arguments; c++) {
+                                            if (strcmp(arguments[c], name) == 0)
+                                                break;
+                                        }
+                                        if (c < total_arguments) {
+                                            lex = C_ERR;
+                                            value = c;
+                                            name[0] = '\0';
+                                            lex_symbol = NULL;
+                                        }
                                     }
-                                }
-                                if (macro->length >= macro->max_length) {
-                                    macro->definition = realloc(macro->definition, (macro->max_length + 1) * 2 * sizeof(struct macro_def));
-                                    if (macro->definition == NULL) {
+                                    if (macro->length >= macro->max_length) {
+                                        macro->definition = realloc(macro->definition, (macro->max_length + 1) * 2 * sizeof(struct macro_def));
+                                        if (macro->definition == NULL) {
+                                            emit_error("Out of memory in DEF FN");
+                                            break;
+                                        }
+                                        macro->max_length = (macro->max_length + 1) * 2;
+                                    }
+                                    macro->definition[macro->length].lex = lex;
+                                    if (lex == C_STRING)
+                                        value = name_size;
+                                    macro->definition[macro->length].value = value;
+                                    if (lex == C_STRING)
+                                        macro->definition[macro->length].name = malloc(name_size + 1);
+                                    else
+                                        macro->definition[macro->length].name = malloc(strlen(name) + 1);
+                                    if (macro->definition[macro->length].name == NULL) {
                                         emit_error("Out of memory in DEF FN");
                                         break;
                                     }
-                                    macro->max_length = (macro->max_length + 1) * 2;
-                                }
-                                macro->definition[macro->length].lex = lex;
-                                if (lex == C_STRING)
-                                    value = name_size;
-                                macro->definition[macro->length].value = value;
-                                if (lex == C_STRING)
-                                    macro->definition[macro->length].name = malloc(name_size + 1);
-                                else
-                                    macro->definition[macro->length].name = malloc(strlen(name) + 1);
-                                if (macro->definition[macro->length].name == NULL) {
-                                    emit_error("Out of memory in DEF FN");
-                                    break;
-                                }
-                                if (lex == C_STRING) {
-                                    if (value)
-                                        memcpy(macro->definition[macro->length].name, name, value);
-                                } else {
-                                    strcpy(macro->definition[macro->length].name, name);
+                                    if (lex == C_STRING) {
+                                        if (value)
+                                            memcpy(macro->definition[macro->length].name, name, value);
+                                    } else {
+                                        strcpy(macro->definition[macro->length].name, name);
+                                    }
+                                    macro->length++;
+                                    get_lex();
                                 }
-                                macro->length++;
-                                get_lex();
                             }
                         }
                     }
-                }
 
-            /*
-             ** Non-portable language
-             */
-            } else if (strcmp(name, "POKE") == 0) {
-                struct node *address;
-                struct node *value;
-                
-                get_lex();
-                address = evaluate_save_expression(1, TYPE_16);
-                if (lex == C_COMMA)
-                    get_lex();
-                else
-                    emit_error("missing comma in POKE");
-                value = evaluate_save_expression(1, TYPE_8);
-                if (target == CPU_6502) {
-                    node_generate(value, 0);
-                    cpu6502_noop("PHA");
-                    node_generate(address, 0);
-                    cpu6502_1op("STA", "temp");
-                    cpu6502_1op("STY", "temp+1");
-                    cpu6502_noop("PLA");
-                    cpu6502_1op("LDY", "#0");
-                    cpu6502_1op("STA", "(temp),Y");
-                } else if (target == CPU_9900) {
-                    node_generate(value, 0);
-                    cpu9900_1op("dect", "r10");
-                    cpu9900_2op("mov", "r0", "*r10");
-                    node_generate(address, 0);
-                    cpu9900_2op("mov", "*r10+", "r1");
-                    cpu9900_2op("movb","r1","*r0");
-                } else {
-                    if ((value->regs & REG_HL) == 0) {
-                        node_generate(address, 0);
-                        node_generate(value, 0);
-                    } else if ((address->regs & REG_A) == 0) {
-                        node_generate(value, 0);
-                        node_generate(address, 0);
-                    } else {
-                        node_generate(address, 0);
-                        cpuz80_1op("PUSH", "HL");
-                        node_generate(value, 0);
-                        cpuz80_1op("POP", "HL");
-                    }
-                    cpuz80_2op("LD", "(HL)", "A");
+                /*
+                 ** Non-portable language
+                 */
+                    break;
                 }
-                node_delete(address);
-                node_delete(value);
-            } else if (strcmp(name, "VPOKE") == 0) {
-                struct node *address;
-                struct node *value;
+                case K_POKE: {
+                    struct node *address;
+                    struct node *value;
                 
-                get_lex();
-                address = evaluate_save_expression(1, TYPE_16);
-                if (lex == C_COMMA)
                     get_lex();
-                else
-                    emit_error("missing comma in VPOKE");
-                value = evaluate_save_expression(1, TYPE_8);
-                if (target == CPU_6502) {
-                    if (machine == NES) {
+                    address = evaluate_save_expression(1, TYPE_16);
+                    if (lex == C_COMMA)
+                        get_lex();
+                    else
+                        emit_error("missing comma in POKE");
+                    value = evaluate_save_expression(1, TYPE_8);
+                    if (target == CPU_6502) {
                         node_generate(value, 0);
                         cpu6502_noop("PHA");
                         node_generate(address, 0);
                         cpu6502_1op("STA", "temp");
                         cpu6502_1op("STY", "temp+1");
                         cpu6502_noop("PLA");
-                        cpu6502_noop("TAX");
-                        cpu6502_1op("LDA", "temp");
-                        cpu6502_1op("JSR", "WRTVRM");
-                    } else {
-                        node_generate(value, 0);
-                        cpu6502_noop("PHA");
-                        node_generate(address, 0);
-                        cpu6502_1op("STA", "temp");
-                        cpu6502_1op("STY", "temp+1");
-                        cpu6502_noop("PLA");
-                        cpu6502_noop("TAX");
-                        cpu6502_1op("LDA", "temp");
-                        generic_interrupt_disable();
-                        cpu6502_1op("JSR", "WRTVRM");
-                        generic_interrupt_enable();
-                    }
-                } else if (target == CPU_9900) {
-                    node_generate(value, 0);
-                    cpu9900_1op("dect", "r10");
-                    cpu9900_2op("mov", "r0", "*r10");
-                    node_generate(address, 0);
-                    cpu9900_2op("mov", "*r10+", "r2");
-                    generic_interrupt_disable();
-                    cpu9900_1op("bl","@JSR");
-                    cpu9900_1op("data", "WRTVRM");
-                    generic_interrupt_enable();
-                } else {
-                    if ((value->regs & REG_HL) == 0) {
-                        node_generate(address, 0);
-                        node_generate(value, 0);
-                    } else if ((address->regs & REG_A) == 0) {
+                        cpu6502_1op("LDY", "#0");
+                        cpu6502_1op("STA", "(temp),Y");
+                    } else if (target == CPU_9900) {
                         node_generate(value, 0);
+                        cpu9900_1op("dect", "r10");
+                        cpu9900_2op("mov", "r0", "*r10");
                         node_generate(address, 0);
+                        cpu9900_2op("mov", "*r10+", "r1");
+                        cpu9900_2op("movb","r1","*r0");
                     } else {
-                        node_generate(address, 0);
-                        cpuz80_1op("PUSH", "HL");
-                        node_generate(value, 0);
-                        cpuz80_1op("POP", "HL");
+                        if ((value->regs & REG_HL) == 0) {
+                            node_generate(address, 0);
+                            node_generate(value, 0);
+                        } else if ((address->regs & REG_A) == 0) {
+                            node_generate(value, 0);
+                            node_generate(address, 0);
+                        } else {
+                            node_generate(address, 0);
+                            cpuz80_1op("PUSH", "HL");
+                            node_generate(value, 0);
+                            cpuz80_1op("POP", "HL");
+                        }
+                        cpuz80_2op("LD", "(HL)", "A");
                     }
-                    generic_interrupt_disable();
-                    cpuz80_1op("CALL", "WRTVRM");
-                    generic_interrupt_enable();
-                }
-                node_delete(address);
-                node_delete(value);
-            } else if (strcmp(name, "CLS") == 0) {
-                get_lex();
-                generic_call("cls");
-            } else if (strcmp(name, "WAIT") == 0) {
-                get_lex();
-                if (machine == SORD || machine == EINSTEIN || machine == CREATIVISION || machine == NES || machine == TI994A) {
-                    generic_call("wait");
-                } else if (machine == COLECOVISION || machine == COLECOVISION_SGM) {
-                    cpuz80_noop("DB $76+COLECO_SPINNER*$59");   /* HALT or RST $08 */
-                } else {
-                    cpuz80_noop("HALT");
+                    break;
                 }
-            } else if (strcmp(name, "OUT") == 0) {
-                struct node *port;
-                struct node *value;
+                case K_VPOKE: {
+                    struct node *address;
+                    struct node *value;
                 
-                get_lex();
-                port = evaluate_save_expression(1, TYPE_8);
-                if (lex == C_COMMA)
                     get_lex();
-                else
-                    emit_error("missing comma in OUT");
-                value = evaluate_save_expression(1, TYPE_8);
-                if (target == CPU_6502) {
-                    emit_warning("Ignoring OUT (not supported for 6502)");
-                } else if (target == CPU_9900) {
-                    /*
-                     ** We don't have ports (though we could map this to CRU)
-                     ** however, since it seems OUT is the CVBasic way to directly
-                     ** access the sound chip, we'll check for OUT $FF and map that
-                     ** over.
-                     */
-                    if (port->type == N_NUM8 && port->value == 0xff) {
+                    address = evaluate_save_expression(1, TYPE_16);
+                    if (lex == C_COMMA)
+                        get_lex();
+                    else
+                        emit_error("missing comma in VPOKE");
+                    value = evaluate_save_expression(1, TYPE_8);
+                    if (target == CPU_6502) {
+                        if (machine == NES) {
+                            node_generate(value, 0);
+                            cpu6502_noop("PHA");
+                            node_generate(address, 0);
+                            cpu6502_1op("STA", "temp");
+                            cpu6502_1op("STY", "temp+1");
+                            cpu6502_noop("PLA");
+                            cpu6502_noop("TAX");
+                            cpu6502_1op("LDA", "temp");
+                            cpu6502_1op("JSR", "WRTVRM");
+                        } else {
+                            node_generate(value, 0);
+                            cpu6502_noop("PHA");
+                            node_generate(address, 0);
+                            cpu6502_1op("STA", "temp");
+                            cpu6502_1op("STY", "temp+1");
+                            cpu6502_noop("PLA");
+                            cpu6502_noop("TAX");
+                            cpu6502_1op("LDA", "temp");
+                            generic_interrupt_disable();
+                            cpu6502_1op("JSR", "WRTVRM");
+                            generic_interrupt_enable();
+                        }
+                    } else if (target == CPU_9900) {
                         node_generate(value, 0);
-                        cpu9900_2op("movb", "r0", "@SOUND");
+                        cpu9900_1op("dect", "r10");
+                        cpu9900_2op("mov", "r0", "*r10");
+                        node_generate(address, 0);
+                        cpu9900_2op("mov", "*r10+", "r2");
+                        generic_interrupt_disable();
+                        cpu9900_1op("bl","@JSR");
+                        cpu9900_1op("data", "WRTVRM");
+                        generic_interrupt_enable();
                     } else {
-                        emit_warning("OUT to $ff for audio is the only supported use.");
+                        if ((value->regs & REG_HL) == 0) {
+                            node_generate(address, 0);
+                            node_generate(value, 0);
+                        } else if ((address->regs & REG_A) == 0) {
+                            node_generate(value, 0);
+                            node_generate(address, 0);
+                        } else {
+                            node_generate(address, 0);
+                            cpuz80_1op("PUSH", "HL");
+                            node_generate(value, 0);
+                            cpuz80_1op("POP", "HL");
+                        }
+                        generic_interrupt_disable();
+                        cpuz80_1op("CALL", "WRTVRM");
+                        generic_interrupt_enable();
                     }
-                } else {
-                    node_generate(port, 0);
-                    cpuz80_2op("LD", "C", "A");
-                    if ((value->regs & REG_C) == 0) {
-                        node_generate(value, 0);
+                    break;
+                }
+                case K_CLS:
+                    get_lex();
+                    generic_call("cls");
+                    break;
+                case K_WAIT:
+                    get_lex();
+                    if (machine == SORD || machine == EINSTEIN || machine == CREATIVISION || machine == NES || machine == TI994A) {
+                        generic_call("wait");
+                    } else if (machine == COLECOVISION || machine == COLECOVISION_SGM) {
+                        cpuz80_noop("DB $76+COLECO_SPINNER*$59");   /* HALT or RST $08 */
                     } else {
-                        cpuz80_1op("PUSH", "BC");
-                        node_generate(value, 0);
-                        cpuz80_1op("POP", "BC");
+                        cpuz80_noop("HALT");
                     }
-                    cpuz80_2op("OUT", "(C)", "A");
-                }
-                node_delete(port);
-                node_delete(value);
-            } else if (strcmp(name, "PRINT") == 0) {
-                int label;
-                int label2;
-                int c;
-                int start;
-                int cursor_value;
-                int cursor_pos;
-                struct node *tree;
+                    break;
+                case K_OUT: {
+                    struct node *port;
+                    struct node *value;
                 
-                get_lex();
-                label2 = 0;
-                start = 1;
-                cursor_value = 0;
-                cursor_pos = 0;
-                if (lex == C_NAME && strcmp(name, "AT") == 0) {
                     get_lex();
-                    tree = evaluate_save_expression(1, TYPE_16);
-                    if (machine == SMS) {
-                        tree = node_create(N_MUL16, 0, tree, node_create(N_NUM16, 2, NULL, NULL));
-                    }
+                    port = evaluate_save_expression(1, TYPE_8);
+                    if (lex == C_COMMA)
+                        get_lex();
+                    else
+                        emit_error("missing comma in OUT");
+                    value = evaluate_save_expression(1, TYPE_8);
                     if (target == CPU_6502) {
-                        if (tree->type == N_NUM16) {
-                            cursor_value = 2;
-                            cursor_pos = tree->value;
+                        emit_warning("Ignoring OUT (not supported for 6502)");
+                    } else if (target == CPU_9900) {
+                        /*
+                         ** We don't have ports (though we could map this to CRU)
+                         ** however, since it seems OUT is the CVBasic way to directly
+                         ** access the sound chip, we'll check for OUT $FF and map that
+                         ** over.
+                         */
+                        if (port->type == N_NUM8 && port->value == 0xff) {
+                            node_generate(value, 0);
+                            cpu9900_2op("movb", "r0", "@SOUND");
                         } else {
-                            node_generate(tree, 0);
-                            cursor_value = 1;
+                            emit_warning("OUT to $ff for audio is the only supported use.");
                         }
-                    } else if (target == CPU_9900) {
-                        node_generate(tree, 0);
-                        cpu9900_2op("mov", "r0", "@cursor");
                     } else {
-                        node_generate(tree, 0);
-                        cpuz80_2op("LD", "(cursor)", "HL");
+                        node_generate(port, 0);
+                        cpuz80_2op("LD", "C", "A");
+                        if ((value->regs & REG_C) == 0) {
+                            node_generate(value, 0);
+                        } else {
+                            cpuz80_1op("PUSH", "BC");
+                            node_generate(value, 0);
+                            cpuz80_1op("POP", "BC");
+                        }
+                        cpuz80_2op("OUT", "(C)", "A");
                     }
-                    start = 0;
+                    break;
                 }
-                while (1) {
-                    if (!start) {
-                        if (lex != C_COMMA) {
-                            if (target == CPU_6502) {
-                                if (cursor_value) {
-                                    if (cursor_value == 2) {
-                                        sprintf(temp, "#%d", cursor_pos & 0xff);
-                                        cpu6502_1op("LDA", temp);
-                                        sprintf(temp, "#%d", cursor_pos >> 8);
-                                        cpu6502_1op("LDY", temp);
+                case K_PRINT: {
+                    int label;
+                    int label2;
+                    int c;
+                    int start;
+                    int cursor_value;
+                    int cursor_pos;
+                    struct node *tree;
+                
+                    get_lex();
+                    label2 = 0;
+                    start = 1;
+                    cursor_value = 0;
+                    cursor_pos = 0;
+                    if (lex == C_NAME && strcmp(name, "AT") == 0) {
+                        get_lex();
+                        tree = evaluate_save_expression(1, TYPE_16);
+                        if (machine == SMS) {
+                            tree = node_create(N_MUL16, 0, tree, node_create(N_NUM16, 2, NULL, NULL));
+                        }
+                        if (target == CPU_6502) {
+                            if (tree->type == N_NUM16) {
+                                cursor_value = 2;
+                                cursor_pos = tree->value;
+                            } else {
+                                node_generate(tree, 0);
+                                cursor_value = 1;
+                            }
+                        } else if (target == CPU_9900) {
+                            node_generate(tree, 0);
+                            cpu9900_2op("mov", "r0", "@cursor");
+                        } else {
+                            node_generate(tree, 0);
+                            cpuz80_2op("LD", "(cursor)", "HL");
+                        }
+                        start = 0;
+                    }
+                    while (1) {
+                        if (!start) {
+                            if (lex != C_COMMA) {
+                                if (target == CPU_6502) {
+                                    if (cursor_value) {
+                                        if (cursor_value == 2) {
+                                            sprintf(temp, "#%d", cursor_pos & 0xff);
+                                            cpu6502_1op("LDA", temp);
+                                            sprintf(temp, "#%d", cursor_pos >> 8);
+                                            cpu6502_1op("LDY", temp);
+                                        }
+                                        cpu6502_1op("STA", "cursor");
+                                        cpu6502_1op("STY", "cursor+1");
                                     }
-                                    cpu6502_1op("STA", "cursor");
-                                    cpu6502_1op("STY", "cursor+1");
                                 }
+                                break;
                             }
-                            break;
+                            get_lex();
                         }
-                        get_lex();
-                    }
-                    start = 0;
-                    if (lex == C_STRING) {
-                        if (name_size) {
-                            if (target == CPU_6502) {
-                                if (cursor_value) {
-                                    if (cursor_value == 2) {
-                                        generic_call("print_string_cursor_constant");
-                                        generic_dump();
-                                        fprintf(output, "\tDB $%02x,$%02x,$%02x\n", cursor_pos & 0xff, (cursor_pos >> 8) & 0xff, name_size);
+                        start = 0;
+                        if (lex == C_STRING) {
+                            if (name_size) {
+                                if (target == CPU_6502) {
+                                    if (cursor_value) {
+                                        if (cursor_value == 2) {
+                                            generic_call("print_string_cursor_constant");
+                                            generic_dump();
+                                            inst_printf("\tDB $%02x,$%02x,$%02x\n", cursor_pos & 0xff, (cursor_pos >> 8) & 0xff, name_size);
+                                        } else {
+                                            generic_call("print_string_cursor");
+                                            generic_dump();
+                                            inst_printf("\tDB $%02x\n", name_size);
+                                        }
                                     } else {
-                                        generic_call("print_string_cursor");
+                                        generic_call("print_string");
                                         generic_dump();
-                                        fprintf(output, "\tDB $%02x\n", name_size);
+                                        inst_printf("\tDB $%02x\n", name_size);
                                     }
+                                } else if (target == CPU_9900) {
+                                    label = next_local++;
+                                    label2 = next_local++;
+                                    sprintf(temp, INTERNAL_PREFIX "%d", label);
+                                    cpu9900_2op("li","r2",temp);
+                                    sprintf(temp, "%d", name_size);
+                                    cpu9900_2op("li","r3",temp);    /* yes, as 16 bit */
+                                    generic_call("print_string");
+                                    sprintf(temp, INTERNAL_PREFIX "%d", label2);
+                                    generic_jump(temp);
+                                    sprintf(temp, INTERNAL_PREFIX "%d", label);
+                                    generic_label(temp);
+                                    generic_dump();
                                 } else {
+                                    label = next_local++;
+                                    label2 = next_local++;
+                                    sprintf(temp, INTERNAL_PREFIX "%d", label);
+                                    cpuz80_2op("LD", "HL", temp);
+                                    sprintf(temp, "%d", name_size);
+                                    cpuz80_2op("LD", "A", temp);
                                     generic_call("print_string");
+                                    sprintf(temp, INTERNAL_PREFIX "%d", label2);
+                                    if (name_size < 126)
+                                        generic_jump_short(temp);
+                                    else
+                                        generic_jump(temp);
+                                    sprintf(temp, INTERNAL_PREFIX "%d", label);
+                                    generic_label(temp);
                                     generic_dump();
-                                    fprintf(output, "\tDB $%02x\n", name_size);
                                 }
-                            } else if (target == CPU_9900) {
-                                label = next_local++;
-                                label2 = next_local++;
-                                sprintf(temp, INTERNAL_PREFIX "%d", label);
-                                cpu9900_2op("li","r2",temp);
-                                sprintf(temp, "%d", name_size);
-                                cpu9900_2op("li","r3",temp);    /* yes, as 16 bit */
-                                generic_call("print_string");
-                                sprintf(temp, INTERNAL_PREFIX "%d", label2);
-                                generic_jump(temp);
-                                sprintf(temp, INTERNAL_PREFIX "%d", label);
-                                generic_label(temp);
-                                generic_dump();
-                            } else {
-                                label = next_local++;
-                                label2 = next_local++;
-                                sprintf(temp, INTERNAL_PREFIX "%d", label);
-                                cpuz80_2op("LD", "HL", temp);
-                                sprintf(temp, "%d", name_size);
-                                cpuz80_2op("LD", "A", temp);
-                                generic_call("print_string");
-                                sprintf(temp, INTERNAL_PREFIX "%d", label2);
-                                if (name_size < 126)
-                                    generic_jump_short(temp);
-                                else
-                                    generic_jump(temp);
-                                sprintf(temp, INTERNAL_PREFIX "%d", label);
-                                generic_label(temp);
-                                generic_dump();
-                            }
-                            for (c = 0; c < name_size; c++) {
-                                if ((c & 7) == 0) {
+                                for (c = 0; c < name_size; c++) {
+                                    if ((c & 7) == 0) {
+                                        if (target == CPU_9900) {
+                                            inst_printf("\tbyte ");
+                                        } else {
+                                            inst_printf("\tDB ");
+                                        }
+                                    }
                                     if (target == CPU_9900) {
-                                        fprintf(output, "\tbyte ");
+                                        inst_printf(">%02x", name[c] & 0xff);
+                                    } else {
+                                        inst_printf("$%02x", name[c] & 0xff);
+                                    }
+                                    if ((c & 7) == 7 || c + 1 == name_size) {
+                                        inst_printf("\n");
                                     } else {
-                                        fprintf(output, "\tDB ");
+                                        inst_printf(",");
                                     }
                                 }
+
                                 if (target == CPU_9900) {
-                                    fprintf(output, ">%02x", name[c] & 0xff);
-                                } else {
-                                    fprintf(output, "$%02x", name[c] & 0xff);
-                                }
-                                if ((c & 7) == 7 || c + 1 == name_size) {
-                                    fprintf(output, "\n");
-                                } else {
-                                    fprintf(output, ",");
+                                    inst_printf("\teven\n");
+                                    sprintf(temp, INTERNAL_PREFIX "%d", label2);
+                                    generic_label(temp);
                                 }
-                            }
-
-                            if (target == CPU_9900) {
-                                fprintf(output, "\teven\n");
-                                sprintf(temp, INTERNAL_PREFIX "%d", label2);
-                                generic_label(temp);
-                            }
 
-                            if (target == CPU_Z80) {
-                                sprintf(temp, INTERNAL_PREFIX "%d", label2);
-                                generic_label(temp);
+                                if (target == CPU_Z80) {
+                                    sprintf(temp, INTERNAL_PREFIX "%d", label2);
+                                    generic_label(temp);
+                                }
+                            } else {
+                                if (target == CPU_6502) {
+                                    if (cursor_value) {
+                                        if (cursor_value == 2) {
+                                            sprintf(temp, "#%d", cursor_pos & 0xff);
+                                            cpu6502_1op("LDA", temp);
+                                            sprintf(temp, "#%d", cursor_pos >> 8);
+                                            cpu6502_1op("LDY", temp);
+                                        }
+                                        cpu6502_1op("STA", "cursor");
+                                        cpu6502_1op("STY", "cursor+1");
+                                    }
+                                }
                             }
-                        } else {
+                            get_lex();
+                        } else if (lex == C_LESS || lex == C_NOTEQUAL) {
+                            int format = 0;
+                            int size = 1;
+                        
                             if (target == CPU_6502) {
                                 if (cursor_value) {
                                     if (cursor_value == 2) {
@@ -4016,283 +5672,155 @@ void compile_statement(int check_for_else)
                                     cpu6502_1op("STY", "cursor+1");
                                 }
                             }
-                        }
-                        get_lex();
-                    } else if (lex == C_LESS || lex == C_NOTEQUAL) {
-                        int format = 0;
-                        int size = 1;
-                        
-                        if (target == CPU_6502) {
-                            if (cursor_value) {
-                                if (cursor_value == 2) {
-                                    sprintf(temp, "#%d", cursor_pos & 0xff);
-                                    cpu6502_1op("LDA", temp);
-                                    sprintf(temp, "#%d", cursor_pos >> 8);
-                                    cpu6502_1op("LDY", temp);
-                                }
-                                cpu6502_1op("STA", "cursor");
-                                cpu6502_1op("STY", "cursor+1");
-                            }
-                        }
-                        if (lex == C_NOTEQUAL) {    /* IntyBASIC compatibility */
-                            get_lex();
-                        } else {
-                            get_lex();
-                            if (lex == C_PERIOD) {
+                            if (lex == C_NOTEQUAL) {    /* IntyBASIC compatibility */
                                 get_lex();
-                                format = 1;
-                                if (lex != C_NUM) {
-                                    emit_error("missing size for number");
-                                } else {
-                                    size = value;
+                            } else {
+                                get_lex();
+                                if (lex == C_PERIOD) {
                                     get_lex();
+                                    format = 1;
+                                    if (lex != C_NUM) {
+                                        emit_error("missing size for number");
+                                    } else {
+                                        size = value;
+                                        get_lex();
+                                    }
+                                } else if (lex == C_NUM) {
+                                    format = 2;
+                                    if (lex != C_NUM) {
+                                        emit_error("missing size for number");
+                                    } else {
+                                        size = value;
+                                        get_lex();
+                                    }
                                 }
-                            } else if (lex == C_NUM) {
-                                format = 2;
-                                if (lex != C_NUM) {
-                                    emit_error("missing size for number");
-                                } else {
-                                    size = value;
+                                if (lex == C_GREATER)
                                     get_lex();
-                                }
-                            }
-                            if (lex == C_GREATER)
-                                get_lex();
-                            else
-                                emit_error("missing > in PRINT for number");
-                        }
-                        if (size < 1)
-                            size = 1;
-                        if (size > 5)
-                            size = 5;
-                        type = evaluate_expression(1, TYPE_16, 0);
-                        if (target == CPU_6502) {
-                            if (format == 0) {
-                                cpu6502_1op("JSR", "print_number");
-                            } else if (format == 1) {
-                                generic_interrupt_disable();
-                                cpu6502_1op("LDX", "#2");
-                                cpu6502_1op("STX", "temp");
-                                cpu6502_1op("LDX", "#32");
-                                cpu6502_1op("STX", "temp+1");
-                                sprintf(temp, "print_number%d", size);
-                                cpu6502_1op("JSR", temp);
-                            } else if (format == 2) {
-                                generic_interrupt_disable();
-                                cpu6502_1op("LDX", "#2");
-                                cpu6502_1op("STX", "temp");
-                                cpu6502_1op("LDX", "#48");
-                                cpu6502_1op("STX", "temp+1");
-                                sprintf(temp, "print_number%d", size);
-                                cpu6502_1op("JSR", temp);
+                                else
+                                    emit_error("missing > in PRINT for number");
                             }
-                        } else if (target == CPU_9900) {
-                            cpu9900_2op("mov", "r0", "r3");
-                            if (format == 0) {
-                                cpu9900_1op("bl", "@JSR");
-                                cpu9900_1op("data", "print_number");
-                            } else if (format == 1) {
-                                generic_interrupt_disable();
-                                cpu9900_2op("li", "r5", ">0220");
-                                sprintf(temp, "print_number%d", size);
-                                cpu9900_1op("bl", "@JSR");
-                                cpu9900_1op("data", temp);
-                            } else if (format == 2) {
-                                generic_interrupt_disable();
-                                cpu9900_2op("li", "r5", ">0230");
-                                sprintf(temp, "print_number%d", size);
-                                cpu9900_1op("bl", "@JSR");
-                                cpu9900_1op("data", temp);
+                            if (size < 1)
+                                size = 1;
+                            if (size > 5)
+                                size = 5;
+                            type = evaluate_expression(1, TYPE_16, 0);
+                            if (target == CPU_6502) {
+                                if (format == 0) {
+                                    cpu6502_1op("JSR", "print_number");
+                                } else if (format == 1) {
+                                    generic_interrupt_disable();
+                                    cpu6502_1op("LDX", "#2");
+                                    cpu6502_1op("STX", "temp");
+                                    cpu6502_1op("LDX", "#32");
+                                    cpu6502_1op("STX", "temp+1");
+                                    sprintf(temp, "print_number%d", size);
+                                    cpu6502_1op("JSR", temp);
+                                } else if (format == 2) {
+                                    generic_interrupt_disable();
+                                    cpu6502_1op("LDX", "#2");
+                                    cpu6502_1op("STX", "temp");
+                                    cpu6502_1op("LDX", "#48");
+                                    cpu6502_1op("STX", "temp+1");
+                                    sprintf(temp, "print_number%d", size);
+                                    cpu6502_1op("JSR", temp);
+                                }
+                            } else if (target == CPU_9900) {
+                                cpu9900_2op("mov", "r0", "r3");
+                                if (format == 0) {
+                                    cpu9900_1op("bl", "@JSR");
+                                    cpu9900_1op("data", "print_number");
+                                } else if (format == 1) {
+                                    generic_interrupt_disable();
+                                    cpu9900_2op("li", "r5", ">0220");
+                                    sprintf(temp, "print_number%d", size);
+                                    cpu9900_1op("bl", "@JSR");
+                                    cpu9900_1op("data", temp);
+                                } else if (format == 2) {
+                                    generic_interrupt_disable();
+                                    cpu9900_2op("li", "r5", ">0230");
+                                    sprintf(temp, "print_number%d", size);
+                                    cpu9900_1op("bl", "@JSR");
+                                    cpu9900_1op("data", temp);
+                                }
+                            } else {
+                                if (format == 0) {
+                                    cpuz80_1op("CALL", "print_number");
+                                } else if (format == 1) {
+                                    generic_interrupt_disable();
+                                    cpuz80_2op("LD", "BC", "$0220");
+                                    sprintf(temp, "print_number%d", size);
+                                    cpuz80_1op("CALL", temp);
+                                } else if (format == 2) {
+                                    generic_interrupt_disable();
+                                    cpuz80_2op("LD", "BC", "$0230");
+                                    sprintf(temp, "print_number%d", size);
+                                    cpuz80_1op("CALL", temp);
+                                }
                             }
                         } else {
-                            if (format == 0) {
-                                cpuz80_1op("CALL", "print_number");
-                            } else if (format == 1) {
-                                generic_interrupt_disable();
-                                cpuz80_2op("LD", "BC", "$0220");
-                                sprintf(temp, "print_number%d", size);
-                                cpuz80_1op("CALL", temp);
-                            } else if (format == 2) {
-                                generic_interrupt_disable();
-                                cpuz80_2op("LD", "BC", "$0230");
-                                sprintf(temp, "print_number%d", size);
-                                cpuz80_1op("CALL", temp);
-                            }
-                        }
-                    } else {
-                        if (target == CPU_6502) {
-                            if (cursor_value) {
-                                if (cursor_value == 2) {
-                                    sprintf(temp, "#%d", cursor_pos & 0xff);
-                                    cpu6502_1op("LDA", temp);
-                                    sprintf(temp, "#%d", cursor_pos >> 8);
-                                    cpu6502_1op("LDY", temp);
+                            if (target == CPU_6502) {
+                                if (cursor_value) {
+                                    if (cursor_value == 2) {
+                                        sprintf(temp, "#%d", cursor_pos & 0xff);
+                                        cpu6502_1op("LDA", temp);
+                                        sprintf(temp, "#%d", cursor_pos >> 8);
+                                        cpu6502_1op("LDY", temp);
+                                    }
+                                    cpu6502_1op("STA", "cursor");
+                                    cpu6502_1op("STY", "cursor+1");
                                 }
-                                cpu6502_1op("STA", "cursor");
-                                cpu6502_1op("STY", "cursor+1");
                             }
-                        }
-                        if (lex == C_NAME && strcmp(name, "CHR$") == 0) {
-                            get_lex();
-                            if (lex != C_LPAREN)
-                                emit_error("syntax error in CHR$");
-                            else
-                                get_lex();
-                            type = evaluate_expression(1, TYPE_8, 0);
-                            if (lex != C_RPAREN)
-                                emit_error("syntax error in CHR$");
-                            else
+                            if (lex == C_NAME && strcmp(name, "CHR$") == 0) {
                                 get_lex();
-                            if (target == CPU_6502) {
-                                cpu6502_noop("TAX");
-                            } else if (target == CPU_9900) {
-                                cpu9900_2op("mov", "r0", "r2");
-                                cpu9900_1op("swpb", "r2");
+                                if (lex != C_LPAREN)
+                                    emit_error("syntax error in CHR$");
+                                else
+                                    get_lex();
+                                type = evaluate_expression(1, TYPE_8, 0);
+                                if (lex != C_RPAREN)
+                                    emit_error("syntax error in CHR$");
+                                else
+                                    get_lex();
+                                if (target == CPU_6502) {
+                                    cpu6502_noop("TAX");
+                                } else if (target == CPU_9900) {
+                                    cpu9900_2op("mov", "r0", "r2");
+                                    cpu9900_1op("swpb", "r2");
+                                }
+                                generic_interrupt_disable();
+                                generic_call("print_char");
+                                generic_interrupt_enable();
+                            } else {
+                                type = evaluate_expression(1, TYPE_16, 0);
+                                if (target == CPU_9900)
+                                    cpu9900_2op("mov", "r0", "r3");
+                                generic_call("print_number");
                             }
-                            generic_interrupt_disable();
-                            generic_call("print_char");
-                            generic_interrupt_enable();
-                        } else {
-                            type = evaluate_expression(1, TYPE_16, 0);
-                            if (target == CPU_9900)
-                                cpu9900_2op("mov", "r0", "r3");
-                            generic_call("print_number");
                         }
+                        cursor_value = 0;
                     }
-                    cursor_value = 0;
+                    break;
                 }
-            } else if (strcmp(name, "DEFINE") == 0) {
-                int pletter = 0;
-                int vram_read = 0;
+                case K_DEFINE: {
+                    int pletter = 0;
+                    int vram_read = 0;
                 
-                get_lex();
-                if (machine == NES) {
-                    emit_error("DEFINE isn't implemented for NES");
-                    break;
-                }
-                if (lex != C_NAME) {
-                    emit_error("syntax error in DEFINE");
-                } else if (strcmp(name, "SPRITE") == 0) {
                     get_lex();
-                    if (lex == C_NAME && strcmp(name, "COLOR") == 0 && machine == MSX2) {
-                        struct node *length;
-                        struct node *source = NULL;
-                        
+                    if (machine == NES) {
+                        emit_error("DEFINE isn't implemented for NES");
+                        return;
+                    }
+                    if (lex != C_NAME) {
+                        emit_error("syntax error in DEFINE");
+                    } else if (keyword == K_SPRITE) {
                         get_lex();
-                        type = evaluate_expression(1, TYPE_16, 0);  /* sprite number */
-                        cpuz80_1op("PUSH", "HL");
-                        if (lex == C_COMMA)
-                            get_lex();
-                        else
-                            emit_error("missing comma in DEFINE");
-                        length = evaluate_save_expression(1, TYPE_8);   /* count */
-                        if (lex == C_COMMA)
-                            get_lex();
-                        else
-                            emit_error("missing comma in DEFINE");
-                        if (lex != C_NAME) {
-                            emit_error("missing label in DEFINE");
-                        } else if (strcmp(name, "VARPTR") == 0) {
-                            source = evaluate_save_expression(1, TYPE_16);  /* CPU address (variable) */
-                            node_generate(length, 0);
-                            if ((source->regs & REG_A) != 0)
-                                cpuz80_1op("PUSH", "AF");
-                            node_generate(source, 0);
-                            if ((source->regs & REG_A) != 0)
-                                cpuz80_1op("POP", "AF");
-                        } else {
-                            node_generate(length, 0);   /* CPU address (immediate) */
-                            strcpy(temp, LABEL_PREFIX);
-                            strcat(temp, name);
-                            cpuz80_2op("LD", "HL", temp);
-                            get_lex();
-                        }
-                        generic_call("define_sprite_color");
-                        node_delete(length);
-                        node_delete(source);
-                    } else {
-                        if (lex == C_NAME && strcmp(name, "PLETTER") == 0) {
-                            pletter = 1;
-                            get_lex();
-                        }
-                        if (pletter) {
-                            type = evaluate_expression(1, TYPE_16, 0);
-                            if (target == CPU_6502) {
-                                cpu6502_1op("ASL", "A");
-                                cpu6502_1op("ASL", "A");
-                                cpu6502_1op("LDY", "#7");
-                                cpu6502_1op("STY", "pointer+1");
-                                cpu6502_1op("ASL", "A");
-                                cpu6502_1op("ROL", "pointer+1");
-                                cpu6502_1op("ASL", "A");
-                                cpu6502_1op("ROL", "pointer+1");
-                                cpu6502_1op("ASL", "A");
-                                cpu6502_1op("ROL", "pointer+1");
-                                cpu6502_1op("STA", "pointer");
-                            } else if (target == CPU_9900) {
-                                cpu9900_2op("mov","r0","r4");
-                                cpu9900_2op("sla","r4","5");
-                                cpu9900_2op("ai","r4",">3800");
-                            } else {
-                                cpuz80_2op("ADD", "HL", "HL");
-                                cpuz80_2op("ADD", "HL", "HL");
-                                if (machine == SMS)
-                                    cpuz80_2op("SET", "1", "H");
-                                else
-                                    cpuz80_2op("LD", "H", "$07");
-                                cpuz80_2op("ADD", "HL", "HL");
-                                cpuz80_2op("ADD", "HL", "HL");
-                                cpuz80_2op("ADD", "HL", "HL");
-                                if (machine == SMS)
-                                    cpuz80_2op("ADD", "HL", "HL");
-                                cpuz80_2op("EX", "DE", "HL");
-                            }
-                            if (lex == C_COMMA)
-                                get_lex();
-                            else
-                                emit_error("missing comma in DEFINE");
-                            type = evaluate_expression(2, TYPE_8, 0);
-                            if (lex == C_COMMA)
-                                get_lex();
-                            else
-                                emit_error("missing comma in DEFINE");
-                            if (lex != C_NAME) {
-                                emit_error("missing label in DEFINE");
-                            } else {
-                                if (target == CPU_6502) {
-                                    strcpy(temp, "#" LABEL_PREFIX);
-                                    strcat(temp, name);
-                                    cpu6502_1op("LDA", temp);
-                                    strcat(temp, ">>8");
-                                    cpu6502_1op("LDY", temp);
-                                    cpu6502_1op("STA", "temp");
-                                    cpu6502_1op("STY", "temp+1");
-                                } else if (target == CPU_9900) {
-                                    strcpy(temp, LABEL_PREFIX);
-                                    strcat(temp, name);
-                                    cpu9900_2op("li", "r2", temp);
-                                    cpu9900_2op("mov","r4","r1");
-                                } else {
-                                    strcpy(temp, LABEL_PREFIX);
-                                    strcat(temp, name);
-                                    cpuz80_2op("LD", "HL", temp);
-                                }
-                                get_lex();
-                            }
-                            generic_call("unpack");
-                            compression_used = 1;
-                        } else {
+                        if (lex == C_NAME && strcmp(name, "COLOR") == 0 && machine == MSX2) {
                             struct node *length;
                             struct node *source = NULL;
-                            
+                        
+                            get_lex();
                             type = evaluate_expression(1, TYPE_16, 0);  /* sprite number */
-                            if (target == CPU_6502) {
-                                cpu6502_1op("STA", "pointer");
-                            } else if (target == CPU_9900) {
-                                cpu9900_2op("mov","r0","r4");
-                            } else {
-                                cpuz80_1op("PUSH", "HL");
-                            }
+                            cpuz80_1op("PUSH", "HL");
                             if (lex == C_COMMA)
                                 get_lex();
                             else
@@ -4304,2155 +5832,2311 @@ void compile_statement(int check_for_else)
                                 emit_error("missing comma in DEFINE");
                             if (lex != C_NAME) {
                                 emit_error("missing label in DEFINE");
-                            } else if (strcmp(name, "VARPTR") == 0) {
+                            } else if (keyword == K_VARPTR) {
                                 source = evaluate_save_expression(1, TYPE_16);  /* CPU address (variable) */
                                 node_generate(length, 0);
+                                if ((source->regs & REG_A) != 0)
+                                    cpuz80_1op("PUSH", "AF");
+                                node_generate(source, 0);
+                                if ((source->regs & REG_A) != 0)
+                                    cpuz80_1op("POP", "AF");
+                            } else {
+                                node_generate(length, 0);   /* CPU address (immediate) */
+                                strcpy(temp, LABEL_PREFIX);
+                                strcat(temp, name);
+                                cpuz80_2op("LD", "HL", temp);
+                                get_lex();
+                            }
+                            generic_call("define_sprite_color");
+                        } else {
+                            if (lex == C_NAME && strcmp(name, "PLETTER") == 0) {
+                                pletter = 1;
+                                get_lex();
+                            }
+                            if (pletter) {
+                                type = evaluate_expression(1, TYPE_16, 0);
                                 if (target == CPU_6502) {
-                                    cpu6502_noop("PHA");
-                                    node_generate(source, 0);
-                                    cpu6502_1op("STA", "temp");
-                                    cpu6502_1op("STY", "temp+1");
-                                    cpu6502_noop("PLA");
+                                    cpu6502_1op("ASL", "A");
+                                    cpu6502_1op("ASL", "A");
+                                    cpu6502_1op("LDY", "#7");
+                                    cpu6502_1op("STY", "pointer+1");
+                                    cpu6502_1op("ASL", "A");
+                                    cpu6502_1op("ROL", "pointer+1");
+                                    cpu6502_1op("ASL", "A");
+                                    cpu6502_1op("ROL", "pointer+1");
+                                    cpu6502_1op("ASL", "A");
+                                    cpu6502_1op("ROL", "pointer+1");
+                                    cpu6502_1op("STA", "pointer");
                                 } else if (target == CPU_9900) {
-                                    cpu9900_2op("mov","r0","r5");
-                                    node_generate(source, 0);
+                                    cpu9900_2op("mov","r0","r4");
+                                    cpu9900_2op("sla","r4","5");
+                                    cpu9900_2op("ai","r4",">3800");
                                 } else {
-                                    if ((source->regs & REG_A) != 0)
-                                        cpuz80_1op("PUSH", "AF");
-                                    node_generate(source, 0);
-                                    if ((source->regs & REG_A) != 0)
-                                        cpuz80_1op("POP", "AF");
+                                    cpuz80_2op("ADD", "HL", "HL");
+                                    cpuz80_2op("ADD", "HL", "HL");
+                                    if (machine == SMS)
+                                        cpuz80_2op("SET", "1", "H");
+                                    else
+                                        cpuz80_2op("LD", "H", "$07");
+                                    cpuz80_2op("ADD", "HL", "HL");
+                                    cpuz80_2op("ADD", "HL", "HL");
+                                    cpuz80_2op("ADD", "HL", "HL");
+                                    if (machine == SMS)
+                                        cpuz80_2op("ADD", "HL", "HL");
+                                    cpuz80_2op("EX", "DE", "HL");
+                                }
+                                if (lex == C_COMMA)
+                                    get_lex();
+                                else
+                                    emit_error("missing comma in DEFINE");
+                                type = evaluate_expression(2, TYPE_8, 0);
+                                if (lex == C_COMMA)
+                                    get_lex();
+                                else
+                                    emit_error("missing comma in DEFINE");
+                                if (lex != C_NAME) {
+                                    emit_error("missing label in DEFINE");
+                                } else {
+                                    if (target == CPU_6502) {
+                                        strcpy(temp, "#" LABEL_PREFIX);
+                                        strcat(temp, name);
+                                        cpu6502_1op("LDA", temp);
+                                        strcat(temp, ">>8");
+                                        cpu6502_1op("LDY", temp);
+                                        cpu6502_1op("STA", "temp");
+                                        cpu6502_1op("STY", "temp+1");
+                                    } else if (target == CPU_9900) {
+                                        strcpy(temp, LABEL_PREFIX);
+                                        strcat(temp, name);
+                                        cpu9900_2op("li", "r2", temp);
+                                        cpu9900_2op("mov","r4","r1");
+                                    } else {
+                                        strcpy(temp, LABEL_PREFIX);
+                                        strcat(temp, name);
+                                        cpuz80_2op("LD", "HL", temp);
+                                    }
+                                    get_lex();
                                 }
+                                generic_call("unpack");
+                                compression_used = 1;
                             } else {
-                                node_generate(length, 0);   /* CPU address (immediate) */
+                                struct node *length;
+                                struct node *source = NULL;
+                            
+                                type = evaluate_expression(1, TYPE_16, 0);  /* sprite number */
                                 if (target == CPU_6502) {
-                                    cpu6502_noop("PHA");
-                                    strcpy(temp, "#" LABEL_PREFIX);
-                                    strcat(temp, name);
-                                    cpu6502_1op("LDA", temp);
-                                    cpu6502_1op("STA", "temp");
-                                    strcat(temp, ">>8");
-                                    cpu6502_1op("LDA", temp);
-                                    cpu6502_1op("STA", "temp+1");
-                                    cpu6502_noop("PLA");
+                                    cpu6502_1op("STA", "pointer");
                                 } else if (target == CPU_9900) {
-                                    cpu9900_2op("mov","r0","r5");
-                                    strcpy(temp, LABEL_PREFIX);
-                                    strcat(temp, name);
-                                    cpu9900_2op("li","r0",temp);
+                                    cpu9900_2op("mov","r0","r4");
                                 } else {
-                                    strcpy(temp, LABEL_PREFIX);
-                                    strcat(temp, name);
-                                    cpuz80_2op("LD", "HL", temp);
+                                    cpuz80_1op("PUSH", "HL");
                                 }
-                                get_lex();
+                                if (lex == C_COMMA)
+                                    get_lex();
+                                else
+                                    emit_error("missing comma in DEFINE");
+                                length = evaluate_save_expression(1, TYPE_8);   /* count */
+                                if (lex == C_COMMA)
+                                    get_lex();
+                                else
+                                    emit_error("missing comma in DEFINE");
+                                if (lex != C_NAME) {
+                                    emit_error("missing label in DEFINE");
+                                } else if (keyword == K_VARPTR) {
+                                    source = evaluate_save_expression(1, TYPE_16);  /* CPU address (variable) */
+                                    node_generate(length, 0);
+                                    if (target == CPU_6502) {
+                                        cpu6502_noop("PHA");
+                                        node_generate(source, 0);
+                                        cpu6502_1op("STA", "temp");
+                                        cpu6502_1op("STY", "temp+1");
+                                        cpu6502_noop("PLA");
+                                    } else if (target == CPU_9900) {
+                                        cpu9900_2op("mov","r0","r5");
+                                        node_generate(source, 0);
+                                    } else {
+                                        if ((source->regs & REG_A) != 0)
+                                            cpuz80_1op("PUSH", "AF");
+                                        node_generate(source, 0);
+                                        if ((source->regs & REG_A) != 0)
+                                            cpuz80_1op("POP", "AF");
+                                    }
+                                } else {
+                                    node_generate(length, 0);   /* CPU address (immediate) */
+                                    if (target == CPU_6502) {
+                                        cpu6502_noop("PHA");
+                                        strcpy(temp, "#" LABEL_PREFIX);
+                                        strcat(temp, name);
+                                        cpu6502_1op("LDA", temp);
+                                        cpu6502_1op("STA", "temp");
+                                        strcat(temp, ">>8");
+                                        cpu6502_1op("LDA", temp);
+                                        cpu6502_1op("STA", "temp+1");
+                                        cpu6502_noop("PLA");
+                                    } else if (target == CPU_9900) {
+                                        cpu9900_2op("mov","r0","r5");
+                                        strcpy(temp, LABEL_PREFIX);
+                                        strcat(temp, name);
+                                        cpu9900_2op("li","r0",temp);
+                                    } else {
+                                        strcpy(temp, LABEL_PREFIX);
+                                        strcat(temp, name);
+                                        cpuz80_2op("LD", "HL", temp);
+                                    }
+                                    get_lex();
+                                }
+                                generic_call("define_sprite");
                             }
-                            generic_call("define_sprite");
-                            node_delete(length);
-                            node_delete(source);
                         }
-                    }
-                } else if (strcmp(name, "CHAR") == 0 || strcmp(name, "COLOR") == 0) {
-                    int color;
-                    struct node *length;
-                    struct node *source = NULL;
+                    } else if (strcmp(name, "CHAR") == 0 || strcmp(name, "COLOR") == 0) {
+                        int color;
+                        struct node *length;
+                        struct node *source = NULL;
                     
-                    if (strcmp(name, "COLOR") == 0)
-                        color = 1;
-                    else
-                        color = 0;
-                    get_lex();
-                    if (lex == C_NAME && strcmp(name, "PLETTER") == 0) {
-                        pletter = 1;
-                        get_lex();
-                    }
-                    type = evaluate_expression(1, TYPE_16, 0);
-                    if (target == CPU_6502) {
-                        cpu6502_1op("STA", "pointer");
-                    } else if (target == CPU_9900) {
-                        /* char in r4, data in r0, count in r5 */
-                        cpu9900_2op("mov","r0","r4");
-                    } else {
-                        cpuz80_1op("PUSH", "HL");
-                    }
-                    if (lex == C_COMMA)
-                        get_lex();
-                    else
-                        emit_error("missing comma in DEFINE");
-                    length = evaluate_save_expression(1, TYPE_8);
-                    if (lex == C_COMMA)
+                        if (strcmp(name, "COLOR") == 0)
+                            color = 1;
+                        else
+                            color = 0;
                         get_lex();
-                    else
-                        emit_error("missing comma in DEFINE");
-                    if (lex != C_NAME) {
-                        emit_error("missing label in DEFINE");
-                    } else if (!pletter && strcmp(name, "VARPTR") == 0) {
-                        source = evaluate_save_expression(1, TYPE_16);
-                        node_generate(length, 0);
-                        if (target == CPU_6502) {
-                            cpu6502_noop("PHA");
-                            node_generate(source, 0);
-                            cpu6502_1op("STA", "temp");
-                            cpu6502_1op("STY", "temp+1");
-                            cpu6502_noop("PLA");
-                        } else if (target == CPU_9900) {
-                            /* char in r4, data in r0, count in r5 */
-                            cpu9900_2op("mov","r0","r5");
-                            node_generate(source, 0);
-                        } else {
-                            if ((source->regs & REG_A) != 0)
-                                cpuz80_1op("PUSH", "AF");
-                            node_generate(source, 0);
-                            if ((source->regs & REG_A) != 0)
-                                cpuz80_1op("POP", "AF");
+                        if (lex == C_NAME && strcmp(name, "PLETTER") == 0) {
+                            pletter = 1;
+                            get_lex();
                         }
-                    } else {
-                        node_generate(length, 0);
+                        type = evaluate_expression(1, TYPE_16, 0);
                         if (target == CPU_6502) {
-                            cpu6502_noop("PHA");
-                            strcpy(temp, "#" LABEL_PREFIX);
-                            strcat(temp, name);
-                            cpu6502_1op("LDA", temp);
-                            cpu6502_1op("STA", "temp");
-                            strcat(temp, ">>8");
-                            cpu6502_1op("LDA", temp);
-                            cpu6502_1op("STA", "temp+1");
-                            cpu6502_noop("PLA");
+                            cpu6502_1op("STA", "pointer");
                         } else if (target == CPU_9900) {
                             /* char in r4, data in r0, count in r5 */
-                            cpu9900_2op("mov","r0","r5");
-                            strcpy(temp, LABEL_PREFIX);
-                            strcat(temp, name);
-                            cpu9900_2op("li","r0",temp);
+                            cpu9900_2op("mov","r0","r4");
                         } else {
-                            strcpy(temp, LABEL_PREFIX);
-                            strcat(temp, name);
-                            cpuz80_2op("LD", "HL", temp);
+                            cpuz80_1op("PUSH", "HL");
                         }
-                        get_lex();
-                    }
-                    if (pletter) {
-                        generic_call(color ? "define_color_unpack" : "define_char_unpack");
-                        compression_used = 1;
-                    } else {
-                        generic_call(color ? "define_color" : "define_char");
-                    }
-                    node_delete(length);
-                    node_delete(source);
-                } else if (strcmp(name, "VRAM") == 0) {
-                    struct node *source;
-                    struct node *target2;
-                    struct node *length;
-                    
-                    get_lex();
-                    if (lex == C_NAME && strcmp(name, "PLETTER") == 0) {
-                        pletter = 1;
-                        get_lex();
-                    } else if (lex == C_NAME && strcmp(name, "READ") == 0) {
-                        vram_read = 1;
-                        get_lex();
-                    }
-                    target2 = evaluate_save_expression(1, TYPE_16);
-                    if (lex == C_COMMA)
-                        get_lex();
-                    else
-                        emit_error("missing comma in DEFINE");
-                    length = evaluate_save_expression(1, TYPE_16);
-                    if (lex == C_COMMA)
-                        get_lex();
-                    else
-                        emit_error("missing comma in DEFINE");
-                    if (lex != C_NAME) {
-                        emit_error("missing label in DEFINE");
-                        source = NULL;
-                    } else if (!pletter && strcmp(name, "VARPTR") == 0) {
-                        source = evaluate_save_expression(1, TYPE_16);
-                        if (target == CPU_6502) {
-                            node_generate(target2, 0);
-                            cpu6502_1op("STA", "pointer");
-                            cpu6502_1op("STY", "pointer+1");
-                            node_generate(length, 0);
-                            cpu6502_noop("PHA");
-                            cpu6502_noop("TYA");
-                            cpu6502_noop("PHA");
-                            node_generate(source, 0);
-                            cpu6502_1op("STA", "temp");
-                            cpu6502_1op("STY", "temp+1");
-                            cpu6502_noop("PLA");
-                            cpu6502_1op("STA", "temp2+1");
-                            cpu6502_noop("PLA");
-                            cpu6502_1op("STA", "temp2");
-                        } else if (target == CPU_9900) {
-                            node_generate(target2, 0);
-                            cpu9900_2op("mov","r0","r4");   /* save it off, cause we need it at the end in r0 */
-                            node_generate(length, 0);
-                            cpu9900_2op("mov","r0","r5");
-                            node_generate(source, 0);
-                        } else {
+                        if (lex == C_COMMA)
+                            get_lex();
+                        else
+                            emit_error("missing comma in DEFINE");
+                        length = evaluate_save_expression(1, TYPE_8);
+                        if (lex == C_COMMA)
+                            get_lex();
+                        else
+                            emit_error("missing comma in DEFINE");
+                        if (lex != C_NAME) {
+                            emit_error("missing label in DEFINE");
+                        } else if (!pletter && keyword == K_VARPTR) {
+                            source = evaluate_save_expression(1, TYPE_16);
                             node_generate(length, 0);
-                            if (((target2->regs | source->regs) & REG_BC) == 0) {
-                                cpuz80_2op("LD", "B", "H");
-                                cpuz80_2op("LD", "C", "L");
-                            } else {
-                                cpuz80_1op("PUSH", "HL");
-                            }
-                            node_generate(target2, 0);
-                            if ((source->regs & REG_DE) == 0) {
-                                cpuz80_2op("EX", "DE", "HL");
+                            if (target == CPU_6502) {
+                                cpu6502_noop("PHA");
+                                node_generate(source, 0);
+                                cpu6502_1op("STA", "temp");
+                                cpu6502_1op("STY", "temp+1");
+                                cpu6502_noop("PLA");
+                            } else if (target == CPU_9900) {
+                                /* char in r4, data in r0, count in r5 */
+                                cpu9900_2op("mov","r0","r5");
                                 node_generate(source, 0);
                             } else {
-                                cpuz80_1op("PUSH", "HL");
+                                if ((source->regs & REG_A) != 0)
+                                    cpuz80_1op("PUSH", "AF");
                                 node_generate(source, 0);
-                                cpuz80_1op("POP", "DE");
+                                if ((source->regs & REG_A) != 0)
+                                    cpuz80_1op("POP", "AF");
                             }
-                            if (((target2->regs | source->regs) & REG_BC) != 0)
-                                cpuz80_1op("POP", "BC");
+                        } else {
+                            node_generate(length, 0);
+                            if (target == CPU_6502) {
+                                cpu6502_noop("PHA");
+                                strcpy(temp, "#" LABEL_PREFIX);
+                                strcat(temp, name);
+                                cpu6502_1op("LDA", temp);
+                                cpu6502_1op("STA", "temp");
+                                strcat(temp, ">>8");
+                                cpu6502_1op("LDA", temp);
+                                cpu6502_1op("STA", "temp+1");
+                                cpu6502_noop("PLA");
+                            } else if (target == CPU_9900) {
+                                /* char in r4, data in r0, count in r5 */
+                                cpu9900_2op("mov","r0","r5");
+                                strcpy(temp, LABEL_PREFIX);
+                                strcat(temp, name);
+                                cpu9900_2op("li","r0",temp);
+                            } else {
+                                strcpy(temp, LABEL_PREFIX);
+                                strcat(temp, name);
+                                cpuz80_2op("LD", "HL", temp);
+                            }
+                            get_lex();
                         }
-                    } else {
-                        source = NULL;
-                        if (target == CPU_6502) {
-                            if (!pletter) {
+                        if (pletter) {
+                            generic_call(color ? "define_color_unpack" : "define_char_unpack");
+                            compression_used = 1;
+                        } else {
+                            generic_call(color ? "define_color" : "define_char");
+                        }
+                    } else if (strcmp(name, "VRAM") == 0) {
+                        struct node *source;
+                        struct node *target2;
+                        struct node *length;
+                    
+                        get_lex();
+                        if (lex == C_NAME && strcmp(name, "PLETTER") == 0) {
+                            pletter = 1;
+                            get_lex();
+                        } else if (lex == C_NAME && keyword == K_READ) {
+                            vram_read = 1;
+                            get_lex();
+                        }
+                        target2 = evaluate_save_expression(1, TYPE_16);
+                        if (lex == C_COMMA)
+                            get_lex();
+                        else
+                            emit_error("missing comma in DEFINE");
+                        length = evaluate_save_expression(1, TYPE_16);
+                        if (lex == C_COMMA)
+                            get_lex();
+                        else
+                            emit_error("missing comma in DEFINE");
+                        if (lex != C_NAME) {
+                            emit_error("missing label in DEFINE");
+                            source = NULL;
+                        } else if (!pletter && keyword == K_VARPTR) {
+                            source = evaluate_save_expression(1, TYPE_16);
+                            if (target == CPU_6502) {
+                                node_generate(target2, 0);
+                                cpu6502_1op("STA", "pointer");
+                                cpu6502_1op("STY", "pointer+1");
                                 node_generate(length, 0);
                                 cpu6502_noop("PHA");
                                 cpu6502_noop("TYA");
                                 cpu6502_noop("PHA");
-                            }
-                        } else if (target == CPU_9900) {
-                            if (!pletter) {
+                                node_generate(source, 0);
+                                cpu6502_1op("STA", "temp");
+                                cpu6502_1op("STY", "temp+1");
+                                cpu6502_noop("PLA");
+                                cpu6502_1op("STA", "temp2+1");
+                                cpu6502_noop("PLA");
+                                cpu6502_1op("STA", "temp2");
+                            } else if (target == CPU_9900) {
+                                node_generate(target2, 0);
+                                cpu9900_2op("mov","r0","r4");   /* save it off, cause we need it at the end in r0 */
                                 node_generate(length, 0);
                                 cpu9900_2op("mov","r0","r5");
-                            }
-                        } else {
-                            if (!pletter) {
+                                node_generate(source, 0);
+                            } else {
                                 node_generate(length, 0);
-                                if ((target2->regs & REG_BC) == 0) {
+                                if (((target2->regs | source->regs) & REG_BC) == 0) {
                                     cpuz80_2op("LD", "B", "H");
                                     cpuz80_2op("LD", "C", "L");
                                 } else {
                                     cpuz80_1op("PUSH", "HL");
                                 }
+                                node_generate(target2, 0);
+                                if ((source->regs & REG_DE) == 0) {
+                                    cpuz80_2op("EX", "DE", "HL");
+                                    node_generate(source, 0);
+                                } else {
+                                    cpuz80_1op("PUSH", "HL");
+                                    node_generate(source, 0);
+                                    cpuz80_1op("POP", "DE");
+                                }
+                                if (((target2->regs | source->regs) & REG_BC) != 0)
+                                    cpuz80_1op("POP", "BC");
+                            }
+                        } else {
+                            source = NULL;
+                            if (target == CPU_6502) {
+                                if (!pletter) {
+                                    node_generate(length, 0);
+                                    cpu6502_noop("PHA");
+                                    cpu6502_noop("TYA");
+                                    cpu6502_noop("PHA");
+                                }
+                            } else if (target == CPU_9900) {
+                                if (!pletter) {
+                                    node_generate(length, 0);
+                                    cpu9900_2op("mov","r0","r5");
+                                }
+                            } else {
+                                if (!pletter) {
+                                    node_generate(length, 0);
+                                    if ((target2->regs & REG_BC) == 0) {
+                                        cpuz80_2op("LD", "B", "H");
+                                        cpuz80_2op("LD", "C", "L");
+                                    } else {
+                                        cpuz80_1op("PUSH", "HL");
+                                    }
+                                }
+                            }
+                            node_generate(target2, 0);
+                            if (target == CPU_6502) {
+                                cpu6502_1op("STA", "pointer");
+                                cpu6502_1op("STY", "pointer+1");
+                                strcpy(temp, "#" LABEL_PREFIX);
+                                strcat(temp, name);
+                                cpu6502_1op("LDA", temp);
+                                strcat(temp, ">>8");
+                                cpu6502_1op("LDY", temp);
+                                cpu6502_1op("STA", "temp");
+                                cpu6502_1op("STY", "temp+1");
+                                if (!pletter) {
+                                    cpu6502_noop("PLA");
+                                    cpu6502_1op("STA", "temp2+1");
+                                    cpu6502_noop("PLA");
+                                    cpu6502_1op("STA", "temp2");
+                                }
+                            } else if (target == CPU_9900) {
+                                cpu9900_2op("mov","r0","r4");
+                                strcpy(temp, LABEL_PREFIX);
+                                strcat(temp, name);
+                                cpu9900_2op("li","r0",temp);
+                            } else {
+                                cpuz80_2op("EX", "DE", "HL");
+                                strcpy(temp, LABEL_PREFIX);
+                                strcat(temp, name);
+                                cpuz80_2op("LD", "HL", temp);
+                                if (!pletter) {
+                                    if ((target2->regs & REG_BC) != 0)
+                                        cpuz80_1op("POP", "BC");
+                                }
                             }
+                            get_lex();
                         }
-                        node_generate(target2, 0);
-                        if (target == CPU_6502) {
-                            cpu6502_1op("STA", "pointer");
-                            cpu6502_1op("STY", "pointer+1");
-                            strcpy(temp, "#" LABEL_PREFIX);
-                            strcat(temp, name);
-                            cpu6502_1op("LDA", temp);
-                            strcat(temp, ">>8");
-                            cpu6502_1op("LDY", temp);
-                            cpu6502_1op("STA", "temp");
-                            cpu6502_1op("STY", "temp+1");
-                            if (!pletter) {
-                                cpu6502_noop("PLA");
-                                cpu6502_1op("STA", "temp2+1");
-                                cpu6502_noop("PLA");
-                                cpu6502_1op("STA", "temp2");
+                        if (pletter) {
+                            if (target == CPU_9900) {
+                                cpu9900_2op("mov","r0","r2");
+                                cpu9900_2op("mov","r4","r1");
                             }
-                        } else if (target == CPU_9900) {
-                            cpu9900_2op("mov","r0","r4");
-                            strcpy(temp, LABEL_PREFIX);
-                            strcat(temp, name);
-                            cpu9900_2op("li","r0",temp);
+                            generic_call("unpack");
+                            compression_used = 1;
                         } else {
-                            cpuz80_2op("EX", "DE", "HL");
-                            strcpy(temp, LABEL_PREFIX);
-                            strcat(temp, name);
-                            cpuz80_2op("LD", "HL", temp);
-                            if (!pletter) {
-                                if ((target2->regs & REG_BC) != 0)
-                                    cpuz80_1op("POP", "BC");
+                            if (target == CPU_9900) {
+                                cpu9900_2op("mov","r0","r2");
+                                cpu9900_2op("mov","r5","r3");
+                                cpu9900_2op("mov","r4","r0");
                             }
+                            generic_interrupt_disable();
+                            if (vram_read) {
+                                generic_call("LDIRMV");
+                            } else {
+                                generic_call("LDIRVM");
+                            }
+                            generic_interrupt_enable();
                         }
-                        get_lex();
-                    }
-                    if (pletter) {
-                        if (target == CPU_9900) {
-                            cpu9900_2op("mov","r0","r2");
-                            cpu9900_2op("mov","r4","r1");
-                        }
-                        generic_call("unpack");
-                        compression_used = 1;
                     } else {
-                        if (target == CPU_9900) {
-                            cpu9900_2op("mov","r0","r2");
-                            cpu9900_2op("mov","r5","r3");
-                            cpu9900_2op("mov","r4","r0");
-                        }
-                        generic_interrupt_disable();
-                        if (vram_read) {
-                            generic_call("LDIRMV");
-                        } else {
-                            generic_call("LDIRVM");
-                        }
-                        generic_interrupt_enable();
+                        emit_error("syntax error in DEFINE");
                     }
-                    node_delete(length);
-                    node_delete(target2);
-                    node_delete(source);
-                } else {
-                    emit_error("syntax error in DEFINE");
+                    break;
                 }
-            } else if (strcmp(name, "SPRITE") == 0) {
-                get_lex();
-                if (lex == C_NAME && strcmp(name, "FLICKER") == 0) {
+                case K_SPRITE:
                     get_lex();
-                    if (lex == C_NAME && strcmp(name, "ON") == 0) {
-                        if (target == CPU_6502) {
-                            cpu6502_1op("LDA", "mode");
-                            cpu6502_1op("AND", "#251");
-                            cpu6502_1op("STA", "mode");
-                        } else if (target == CPU_9900) {
-                            cpu9900_2op("li", "r0", ">0400");
-                            cpu9900_2op("szcb", "r0", "@mode");
+                    if (lex == C_NAME && strcmp(name, "FLICKER") == 0) {
+                        get_lex();
+                        if (lex == C_NAME && keyword == K_ON) {
+                            if (target == CPU_6502) {
+                                cpu6502_1op("LDA", "mode");
+                                cpu6502_1op("AND", "#251");
+                                cpu6502_1op("STA", "mode");
+                            } else if (target == CPU_9900) {
+                                cpu9900_2op("li", "r0", ">0400");
+                                cpu9900_2op("szcb", "r0", "@mode");
+                            } else {
+                                cpuz80_2op("LD", "HL", "mode");
+                                cpuz80_2op("RES", "2", "(HL)");
+                            }
+                            get_lex();
+                        } else if (lex == C_NAME && strcmp(name, "OFF") == 0) {
+                            if (target == CPU_6502) {
+                                cpu6502_1op("LDA", "mode");
+                                cpu6502_1op("ORA", "#4");
+                                cpu6502_1op("STA", "mode");
+                            } else if (target == CPU_9900) {
+                                cpu9900_2op("li", "r0", ">0400");
+                                cpu9900_2op("socb", "r0", "@mode");
+                            } else {
+                                cpuz80_2op("LD", "HL", "mode");
+                                cpuz80_2op("SET", "2", "(HL)");
+                            }
+                            get_lex();
                         } else {
-                            cpuz80_2op("LD", "HL", "mode");
-                            cpuz80_2op("RES", "2", "(HL)");
+                            emit_error("only allowed SPRITE FLICKER ON/OFF");
                         }
-                        get_lex();
-                    } else if (lex == C_NAME && strcmp(name, "OFF") == 0) {
+                    } else {
+                        type = evaluate_expression(1, TYPE_8, 0);
+                        if (target == CPU_6502)
+                            cpu6502_noop("PHA");
+                        else if (target == CPU_9900)
+                            cpu9900_2op("mov","r0","r4");
+                        else
+                            cpuz80_1op("PUSH", "AF");
+                        if (lex == C_COMMA)
+                            get_lex();
+                        else
+                            emit_error("missing comma in SPRITE");
+                        type = evaluate_expression(1, TYPE_8, 0);
+                        if (target == CPU_6502)
+                            cpu6502_1op("STA", "sprite_data");
+                        else if (target == CPU_9900)
+                            cpu9900_2op("movb","r0","r5");
+                        else
+                            cpuz80_1op("PUSH", "AF");
+                        if (lex == C_COMMA)
+                            get_lex();
+                        else
+                            emit_error("missing comma in SPRITE");
+                        type = evaluate_expression(1, TYPE_8, 0);
                         if (target == CPU_6502) {
-                            cpu6502_1op("LDA", "mode");
-                            cpu6502_1op("ORA", "#4");
-                            cpu6502_1op("STA", "mode");
+                            if (machine == NES)
+                                cpu6502_1op("STA", "sprite_data+3");
+                            else
+                                cpu6502_1op("STA", "sprite_data+1");
                         } else if (target == CPU_9900) {
-                            cpu9900_2op("li", "r0", ">0400");
-                            cpu9900_2op("socb", "r0", "@mode");
+                            cpu9900_2op("movb","r0","r6");
                         } else {
-                            cpuz80_2op("LD", "HL", "mode");
-                            cpuz80_2op("SET", "2", "(HL)");
+                            cpuz80_1op("PUSH", "AF");
                         }
-                        get_lex();
-                    } else {
-                        emit_error("only allowed SPRITE FLICKER ON/OFF");
-                    }
-                } else {
-                    type = evaluate_expression(1, TYPE_8, 0);
-                    if (target == CPU_6502)
-                        cpu6502_noop("PHA");
-                    else if (target == CPU_9900)
-                        cpu9900_2op("mov","r0","r4");
-                    else
-                        cpuz80_1op("PUSH", "AF");
-                    if (lex == C_COMMA)
-                        get_lex();
-                    else
-                        emit_error("missing comma in SPRITE");
-                    type = evaluate_expression(1, TYPE_8, 0);
-                    if (target == CPU_6502)
-                        cpu6502_1op("STA", "sprite_data");
-                    else if (target == CPU_9900)
-                        cpu9900_2op("movb","r0","r5");
-                    else
-                        cpuz80_1op("PUSH", "AF");
-                    if (lex == C_COMMA)
-                        get_lex();
-                    else
-                        emit_error("missing comma in SPRITE");
-                    type = evaluate_expression(1, TYPE_8, 0);
-                    if (target == CPU_6502) {
-                        if (machine == NES)
-                            cpu6502_1op("STA", "sprite_data+3");
+                        if (lex == C_COMMA)
+                            get_lex();
                         else
-                            cpu6502_1op("STA", "sprite_data+1");
-                    } else if (target == CPU_9900) {
-                        cpu9900_2op("movb","r0","r6");
-                    } else {
-                        cpuz80_1op("PUSH", "AF");
-                    }
-                    if (lex == C_COMMA)
-                        get_lex();
-                    else
-                        emit_error("missing comma in SPRITE");
-                    type = evaluate_expression(1, TYPE_8, 0);
-                    if (machine == MSX2 && lex != C_COMMA) {
-                        generic_call("update_sprite2");
-                    } else {
-                        if (machine != SMS) {
-                            if (target == CPU_6502) {
-                                if (machine == NES)
-                                    cpu6502_1op("STA", "sprite_data+1");
+                            emit_error("missing comma in SPRITE");
+                        type = evaluate_expression(1, TYPE_8, 0);
+                        if (machine == MSX2 && lex != C_COMMA) {
+                            generic_call("update_sprite2");
+                        } else {
+                            if (machine != SMS) {
+                                if (target == CPU_6502) {
+                                    if (machine == NES)
+                                        cpu6502_1op("STA", "sprite_data+1");
+                                    else
+                                        cpu6502_1op("STA", "sprite_data+2");
+                                } else if (target == CPU_9900)
+                                    cpu9900_2op("movb","r0","r7");
                                 else
-                                    cpu6502_1op("STA", "sprite_data+2");
-                            } else if (target == CPU_9900)
-                                cpu9900_2op("movb","r0","r7");
-                            else
-                                cpuz80_1op("PUSH", "AF");
-                            if (lex == C_COMMA)
-                                get_lex();
-                            else
-                                emit_error("missing comma in SPRITE");
-                            type = evaluate_expression(1, TYPE_8, 0);
-                            if (target == CPU_6502) {
-                                if (machine == NES)
-                                    cpu6502_1op("STA", "sprite_data+2");
+                                    cpuz80_1op("PUSH", "AF");
+                                if (lex == C_COMMA)
+                                    get_lex();
                                 else
-                                    cpu6502_1op("STA", "sprite_data+3");
-                                cpu6502_noop("PLA");
+                                    emit_error("missing comma in SPRITE");
+                                type = evaluate_expression(1, TYPE_8, 0);
+                                if (target == CPU_6502) {
+                                    if (machine == NES)
+                                        cpu6502_1op("STA", "sprite_data+2");
+                                    else
+                                        cpu6502_1op("STA", "sprite_data+3");
+                                    cpu6502_noop("PLA");
+                                }
                             }
+                            generic_call("update_sprite");
                         }
-                        generic_call("update_sprite");
                     }
-                }
-            } else if (strcmp(name, "BITMAP") == 0) {
-                generic_dump();
-                get_lex();
-                if (lex != C_STRING ) {
-                    emit_error("syntax error in BITMAP");
-                } else if (name_size == 16) {   /* 16x16 sprites */
-                    int c;
+                    break;
+                case K_BITMAP:
+                    generic_dump();
+                    get_lex();
+                    if (lex != C_STRING ) {
+                        emit_error("syntax error in BITMAP");
+                    } else if (name_size == 16) {   /* 16x16 sprites */
+                        int c;
                     
-                    if (machine == NES) {
-                        int first_time = 1;
+                        if (machine == NES) {
+                            int first_time = 1;
                         
-                        for (c = 0; c < 16; c++) {
-                            if (name[c] != 0x30 && name[c] != 0x5f   /* 0 and _ */
-                                && name[c] != 0x20 && name[c] != 0x2e) {  /* space and . */
-                                int d;
+                            for (c = 0; c < 16; c++) {
+                                if (name[c] != 0x30 && name[c] != 0x5f   /* 0 and _ */
+                                    && name[c] != 0x20 && name[c] != 0x2e) {  /* space and . */
+                                    int d;
                                 
-                                if (name[c] >= '0' && name[c] <= '3') {
-                                    d = name[c] - 0x30;
-                                } else {
-                                    if (first_time) {
-                                        emit_warning("only 0-3 can be used in BITMAP");
-                                        first_time = 0;
+                                    if (name[c] >= '0' && name[c] <= '3') {
+                                        d = name[c] - 0x30;
+                                    } else {
+                                        if (first_time) {
+                                            emit_warning("only 0-3 can be used in BITMAP");
+                                            first_time = 0;
+                                        }
+                                        d = 0;
+                                    }
+                                    if (c < 8) {
+                                        value |= ((d & 1) << 7) >> c;
+                                        value |= ((d & 2) << 6) >> c << 8;
+                                    } else {
+                                        value |= ((d & 1) << 7) >> (c & 7) << 16;
+                                        value |= ((d & 2) << 6) >> (c & 7) << 24;
                                     }
-                                    d = 0;
-                                }
-                                if (c < 8) {
-                                    value |= ((d & 1) << 7) >> c;
-                                    value |= ((d & 2) << 6) >> c << 8;
-                                } else {
-                                    value |= ((d & 1) << 7) >> (c & 7) << 16;
-                                    value |= ((d & 2) << 6) >> (c & 7) << 24;
                                 }
                             }
-                        }
-                        get_lex();
-                        if (current_chrrom == -1) {
-                            emit_error("BITMAP used without choosing CHRROM table");
-                        } else if (chrrom_pointer + 48 >= CHRROM_PAGE) {
-                            emit_error("More than 512 patterns");
-                        } else {
-                            c = current_chrrom * CHRROM_PAGE + chrrom_pointer;
-                            chrrom_data[c] = value;
-                            chrrom_data[c + 8] = value >> 8;
-                            chrrom_data[c + 32] = value >> 16;
-                            chrrom_data[c + 40] = value >> 24;
-                            chrrom_pointer++;
-                            if ((chrrom_pointer & 7) == 0)
-                                chrrom_pointer += 8;
-                            if ((chrrom_pointer & 31) == 0)
-                                chrrom_pointer += 32;
-                        }
-                    } else if (machine == SMS) {
-                        int first_time = 1;
+                            get_lex();
+                            if (current_chrrom == -1) {
+                                emit_error("BITMAP used without choosing CHRROM table");
+                            } else if (chrrom_pointer + 48 >= CHRROM_PAGE) {
+                                emit_error("More than 512 patterns");
+                            } else {
+                                c = current_chrrom * CHRROM_PAGE + chrrom_pointer;
+                                chrrom_data[c] = value;
+                                chrrom_data[c + 8] = value >> 8;
+                                chrrom_data[c + 32] = value >> 16;
+                                chrrom_data[c + 40] = value >> 24;
+                                chrrom_pointer++;
+                                if ((chrrom_pointer & 7) == 0)
+                                    chrrom_pointer += 8;
+                                if ((chrrom_pointer & 31) == 0)
+                                    chrrom_pointer += 32;
+                            }
+                        } else if (machine == SMS) {
+                            int first_time = 1;
                         
-                        value = 0;
-                        for (c = 0; c < 8; c++) {
-                            if (name[c] != 0x30 && name[c] != 0x5f   /* 0 and _ */
-                                && name[c] != 0x20 && name[c] != 0x2e) {  /* space and . */
-                                int d;
+                            value = 0;
+                            for (c = 0; c < 8; c++) {
+                                if (name[c] != 0x30 && name[c] != 0x5f   /* 0 and _ */
+                                    && name[c] != 0x20 && name[c] != 0x2e) {  /* space and . */
+                                    int d;
                                 
-                                if (isxdigit(name[c])) {
-                                    d = toupper(name[c]) - 0x30;
-                                    if (d > 9)
-                                        d -= 7;
-                                } else {
-                                    if (first_time) {
-                                        emit_warning("invalid hexadecimal value in BITMAP");
-                                        first_time = 0;
+                                    if (isxdigit(name[c])) {
+                                        d = toupper(name[c]) - 0x30;
+                                        if (d > 9)
+                                            d -= 7;
+                                    } else {
+                                        if (first_time) {
+                                            emit_warning("invalid hexadecimal value in BITMAP");
+                                            first_time = 0;
+                                        }
+                                        d = 0;
                                     }
-                                    d = 0;
+                                    value |= ((d & 1) << 7) >> c;
+                                    value |= ((d & 2) << 6) >> c << 8;
+                                    value |= ((d & 4) << 5) >> c << 16;
+                                    value |= ((d & 8) << 4) >> c << 24;
                                 }
-                                value |= ((d & 1) << 7) >> c;
-                                value |= ((d & 2) << 6) >> c << 8;
-                                value |= ((d & 4) << 5) >> c << 16;
-                                value |= ((d & 8) << 4) >> c << 24;
                             }
-                        }
-                        bitmap[bitmap_byte + 0] = value;
-                        bitmap[bitmap_byte + 1] = value >> 8;
-                        bitmap[bitmap_byte + 2] = value >> 16;
-                        bitmap[bitmap_byte + 3] = value >> 24;
-                        value = 0;
-                        for (c = 0; c < 8; c++) {
-                            if (name[8 + c] != 0x30 && name[8 + c] != 0x5f   /* 0 and _ */
-                                && name[8 + c] != 0x20 && name[8 + c] != 0x2e) {  /* space and . */
-                                int d;
+                            bitmap[bitmap_byte + 0] = value;
+                            bitmap[bitmap_byte + 1] = value >> 8;
+                            bitmap[bitmap_byte + 2] = value >> 16;
+                            bitmap[bitmap_byte + 3] = value >> 24;
+                            value = 0;
+                            for (c = 0; c < 8; c++) {
+                                if (name[8 + c] != 0x30 && name[8 + c] != 0x5f   /* 0 and _ */
+                                    && name[8 + c] != 0x20 && name[8 + c] != 0x2e) {  /* space and . */
+                                    int d;
                                 
-                                if (isxdigit(name[8 + c])) {
-                                    d = toupper(name[8 + c]) - 0x30;
-                                    if (d > 9)
-                                        d -= 7;
-                                } else {
-                                    if (first_time) {
-                                        emit_warning("invalid hexadecimal value in BITMAP");
-                                        first_time = 0;
+                                    if (isxdigit(name[8 + c])) {
+                                        d = toupper(name[8 + c]) - 0x30;
+                                        if (d > 9)
+                                            d -= 7;
+                                    } else {
+                                        if (first_time) {
+                                            emit_warning("invalid hexadecimal value in BITMAP");
+                                            first_time = 0;
+                                        }
+                                        d = 0;
                                     }
-                                    d = 0;
+                                    value |= ((d & 1) << 7) >> c;
+                                    value |= ((d & 2) << 6) >> c << 8;
+                                    value |= ((d & 4) << 5) >> c << 16;
+                                    value |= ((d & 8) << 4) >> c << 24;
                                 }
-                                value |= ((d & 1) << 7) >> c;
-                                value |= ((d & 2) << 6) >> c << 8;
-                                value |= ((d & 4) << 5) >> c << 16;
-                                value |= ((d & 8) << 4) >> c << 24;
                             }
-                        }
-                        get_lex();
-                        bitmap[bitmap_byte + 64] = value;
-                        bitmap[bitmap_byte + 65] = value >> 8;
-                        bitmap[bitmap_byte + 66] = value >> 16;
-                        bitmap[bitmap_byte + 67] = value >> 24;
-                        bitmap_byte += 4;
-                        if (bitmap_byte == 64) {
-                            bitmap_byte = 0;
-                            for (c = 0; c < 128; c += 8) {
-                                sprintf(temp, "\tDB $%02x,$%02x,$%02x,$%02x,$%02x,$%02x,$%02x,$%02x\n",
-                                        bitmap[c], bitmap[c + 1], bitmap[c + 2], bitmap[c + 3],
-                                        bitmap[c + 4], bitmap[c + 5], bitmap[c + 6], bitmap[c + 7]);
-                                fprintf(output, "%s", temp);
-                            }
-                        }
-                    } else {
-                        value = 0;
-                        for (c = 0; c < 16; c++) {
-                            if (name[c] != 0x30 && name[c] != 0x5f   /* 0 and _ */
-                                && name[c] != 0x20 && name[c] != 0x2e)  /* space and . */
-                                value |= 0x8000 >> c;
-                        }
-                        get_lex();
-                        bitmap[bitmap_byte] = value >> 8;
-                        bitmap[bitmap_byte + 16] = value;
-                        bitmap_byte++;
-                        if (bitmap_byte >= 16) {
-                            bitmap_byte = 0;
-                            for (c = 0; c < 32; c += 8) {
-                                if (target == CPU_9900) {
-                                    sprintf(temp, "\tbyte >%02x,>%02x,>%02x,>%02x,>%02x,>%02x,>%02x,>%02x\n",
-                                            bitmap[c], bitmap[c + 1], bitmap[c + 2], bitmap[c + 3],
-                                            bitmap[c + 4], bitmap[c + 5], bitmap[c + 6], bitmap[c + 7]);
-                                } else {
+                            get_lex();
+                            bitmap[bitmap_byte + 64] = value;
+                            bitmap[bitmap_byte + 65] = value >> 8;
+                            bitmap[bitmap_byte + 66] = value >> 16;
+                            bitmap[bitmap_byte + 67] = value >> 24;
+                            bitmap_byte += 4;
+                            if (bitmap_byte == 64) {
+                                bitmap_byte = 0;
+                                for (c = 0; c < 128; c += 8) {
                                     sprintf(temp, "\tDB $%02x,$%02x,$%02x,$%02x,$%02x,$%02x,$%02x,$%02x\n",
                                             bitmap[c], bitmap[c + 1], bitmap[c + 2], bitmap[c + 3],
                                             bitmap[c + 4], bitmap[c + 5], bitmap[c + 6], bitmap[c + 7]);
+                                    inst_printf("%s", temp);
+                                }
+                            }
+                        } else {
+                            value = 0;
+                            for (c = 0; c < 16; c++) {
+                                if (name[c] != 0x30 && name[c] != 0x5f   /* 0 and _ */
+                                    && name[c] != 0x20 && name[c] != 0x2e)  /* space and . */
+                                    value |= 0x8000 >> c;
+                            }
+                            get_lex();
+                            bitmap[bitmap_byte] = value >> 8;
+                            bitmap[bitmap_byte + 16] = value;
+                            bitmap_byte++;
+                            if (bitmap_byte >= 16) {
+                                bitmap_byte = 0;
+                                for (c = 0; c < 32; c += 8) {
+                                    if (target == CPU_9900) {
+                                        sprintf(temp, "\tbyte >%02x,>%02x,>%02x,>%02x,>%02x,>%02x,>%02x,>%02x\n",
+                                                bitmap[c], bitmap[c + 1], bitmap[c + 2], bitmap[c + 3],
+                                                bitmap[c + 4], bitmap[c + 5], bitmap[c + 6], bitmap[c + 7]);
+                                    } else {
+                                        sprintf(temp, "\tDB $%02x,$%02x,$%02x,$%02x,$%02x,$%02x,$%02x,$%02x\n",
+                                                bitmap[c], bitmap[c + 1], bitmap[c + 2], bitmap[c + 3],
+                                                bitmap[c + 4], bitmap[c + 5], bitmap[c + 6], bitmap[c + 7]);
+                                    }
+                                    inst_printf("%s", temp);
                                 }
-                                fprintf(output, "%s", temp);
                             }
                         }
-                    }
-                } else if (name_size == 8) {
-                    int c;
+                    } else if (name_size == 8) {
+                        int c;
                     
-                    value = 0;
-                    if (machine == NES) {
-                        int first_time = 1;
+                        value = 0;
+                        if (machine == NES) {
+                            int first_time = 1;
                         
-                        for (c = 0; c < 8; c++) {
-                            if (name[c] != 0x30 && name[c] != 0x5f   /* 0 and _ */
-                                && name[c] != 0x20 && name[c] != 0x2e) {  /* space and . */
-                                int d;
+                            for (c = 0; c < 8; c++) {
+                                if (name[c] != 0x30 && name[c] != 0x5f   /* 0 and _ */
+                                    && name[c] != 0x20 && name[c] != 0x2e) {  /* space and . */
+                                    int d;
                                 
-                                if (name[c] >= '0' && name[c] <= '3') {
-                                    d = name[c] - 0x30;
-                                } else {
-                                    if (first_time) {
-                                        emit_warning("only 0-3 can be used in BITMAP");
-                                        first_time = 0;
+                                    if (name[c] >= '0' && name[c] <= '3') {
+                                        d = name[c] - 0x30;
+                                    } else {
+                                        if (first_time) {
+                                            emit_warning("only 0-3 can be used in BITMAP");
+                                            first_time = 0;
+                                        }
+                                        d = 0;
                                     }
-                                    d = 0;
+                                    value |= ((d & 1) << 7) >> c;
+                                    value |= ((d & 2) << 6) >> c << 8;
                                 }
-                                value |= ((d & 1) << 7) >> c;
-                                value |= ((d & 2) << 6) >> c << 8;
                             }
-                        }
-                        get_lex();
-                        if (current_chrrom == -1) {
-                            emit_error("BITMAP used without choosing CHRROM table");
-                        } else if (chrrom_pointer == 8192) {
-                            emit_error("More than 512 patterns");
-                        } else {
-                            chrrom_data[current_chrrom * CHRROM_PAGE + chrrom_pointer] = value;
-                            chrrom_data[current_chrrom * CHRROM_PAGE + chrrom_pointer + 8] = value >> 8;
-                            chrrom_pointer++;
-                            if ((chrrom_pointer & 7) == 0)
-                                chrrom_pointer += 8;
-                        }
-                    } else if (machine == SMS) {
-                        int first_time = 1;
+                            get_lex();
+                            if (current_chrrom == -1) {
+                                emit_error("BITMAP used without choosing CHRROM table");
+                            } else if (chrrom_pointer == 8192) {
+                                emit_error("More than 512 patterns");
+                            } else {
+                                chrrom_data[current_chrrom * CHRROM_PAGE + chrrom_pointer] = value;
+                                chrrom_data[current_chrrom * CHRROM_PAGE + chrrom_pointer + 8] = value >> 8;
+                                chrrom_pointer++;
+                                if ((chrrom_pointer & 7) == 0)
+                                    chrrom_pointer += 8;
+                            }
+                        } else if (machine == SMS) {
+                            int first_time = 1;
                         
-                        for (c = 0; c < 8; c++) {
-                            if (name[c] != 0x30 && name[c] != 0x5f   /* 0 and _ */
-                                && name[c] != 0x20 && name[c] != 0x2e) {  /* space and . */
-                                int d;
-
-                                if (isxdigit(name[c])) {
-                                    d = toupper(name[c]) - 0x30;
-                                    if (d > 9)
-                                        d -= 7;
-                                } else {
-                                    if (first_time) {
-                                        emit_warning("invalid hexadecimal value in BITMAP");
-                                        first_time = 0;
+                            for (c = 0; c < 8; c++) {
+                                if (name[c] != 0x30 && name[c] != 0x5f   /* 0 and _ */
+                                    && name[c] != 0x20 && name[c] != 0x2e) {  /* space and . */
+                                    int d;
+
+                                    if (isxdigit(name[c])) {
+                                        d = toupper(name[c]) - 0x30;
+                                        if (d > 9)
+                                            d -= 7;
+                                    } else {
+                                        if (first_time) {
+                                            emit_warning("invalid hexadecimal value in BITMAP");
+                                            first_time = 0;
+                                        }
+                                        d = 0;
                                     }
-                                    d = 0;
+                                    value |= ((d & 1) << 7) >> c;
+                                    value |= ((d & 2) << 6) >> c << 8;
+                                    value |= ((d & 4) << 5) >> c << 16;
+                                    value |= ((d & 8) << 4) >> c << 24;
                                 }
-                                value |= ((d & 1) << 7) >> c;
-                                value |= ((d & 2) << 6) >> c << 8;
-                                value |= ((d & 4) << 5) >> c << 16;
-                                value |= ((d & 8) << 4) >> c << 24;
                             }
-                        }
-                        get_lex();
-                        bitmap[bitmap_byte++] = value;
-                        bitmap[bitmap_byte++] = value >> 8;
-                        bitmap[bitmap_byte++] = value >> 16;
-                        bitmap[bitmap_byte++] = value >> 24;
-                    } else {
-                        for (c = 0; c < 8; c++) {
-                            if (name[c] != 0x30 && name[c] != 0x5f   /* 0 and _ */
-                                && name[c] != 0x20 && name[c] != 0x2e)  /* space and . */
-                                value |= 0x80 >> c;
-                        }
-                        get_lex();
-                        bitmap[bitmap_byte] = value;
-                        bitmap_byte++;
-                    }
-                    if (bitmap_byte >= 8) {
-                        bitmap_byte = 0;
-                        c = 0;
-                        if (target == CPU_9900) {
-                            sprintf(temp, "\tbyte >%02x,>%02x,>%02x,>%02x,>%02x,>%02x,>%02x,>%02x\n",
-                                    bitmap[c], bitmap[c + 1], bitmap[c + 2], bitmap[c + 3],
-                                    bitmap[c + 4], bitmap[c + 5], bitmap[c + 6], bitmap[c + 7]);
+                            get_lex();
+                            bitmap[bitmap_byte++] = value;
+                            bitmap[bitmap_byte++] = value >> 8;
+                            bitmap[bitmap_byte++] = value >> 16;
+                            bitmap[bitmap_byte++] = value >> 24;
                         } else {
-                            sprintf(temp, "\tDB $%02x,$%02x,$%02x,$%02x,$%02x,$%02x,$%02x,$%02x\n",
-                                    bitmap[c], bitmap[c + 1], bitmap[c + 2], bitmap[c + 3],
-                                    bitmap[c + 4], bitmap[c + 5], bitmap[c + 6], bitmap[c + 7]);
+                            for (c = 0; c < 8; c++) {
+                                if (name[c] != 0x30 && name[c] != 0x5f   /* 0 and _ */
+                                    && name[c] != 0x20 && name[c] != 0x2e)  /* space and . */
+                                    value |= 0x80 >> c;
+                            }
+                            get_lex();
+                            bitmap[bitmap_byte] = value;
+                            bitmap_byte++;
                         }
-                        fprintf(output, "%s", temp);
-                    }
-                } else {
-                    emit_error("width error in BITMAP");
-                }
-            } else if (strcmp(name, "BORDER") == 0) {
-                int type;
-                
-                get_lex();
-                if (lex != C_COMMA) {
-                    type = evaluate_expression(1, TYPE_8, 0);
-                    if (target == CPU_6502) {
-                        if (machine == NES) {
-                            emit_warning("BORDER first argument ignored for NES/Famicom (use PALETTE 0)");
-                        } else {
-                            cpu6502_1op("LDX", "#7");
-                            generic_interrupt_disable();
-                            cpu6502_1op("JSR", "WRTVDP");
+                        if (bitmap_byte >= 8) {
+                            bitmap_byte = 0;
+                            c = 0;
+                            if (target == CPU_9900) {
+                                sprintf(temp, "\tbyte >%02x,>%02x,>%02x,>%02x,>%02x,>%02x,>%02x,>%02x\n",
+                                        bitmap[c], bitmap[c + 1], bitmap[c + 2], bitmap[c + 3],
+                                        bitmap[c + 4], bitmap[c + 5], bitmap[c + 6], bitmap[c + 7]);
+                            } else {
+                                sprintf(temp, "\tDB $%02x,$%02x,$%02x,$%02x,$%02x,$%02x,$%02x,$%02x\n",
+                                        bitmap[c], bitmap[c + 1], bitmap[c + 2], bitmap[c + 3],
+                                        bitmap[c + 4], bitmap[c + 5], bitmap[c + 6], bitmap[c + 7]);
+                            }
+                            inst_printf("%s", temp);
                         }
-                    } else if (target == CPU_9900) {
-                        /* this is just a lot faster inline than jumping through hoops... */
-                        cpu9900_2op("srl","r0","8");
-                        cpu9900_2op("ori","r0",">8700");
-                        cpu9900_1op("swpb","r0");
-                        generic_interrupt_disable();
-                        cpu9900_2op("movb","r0","@VDPWADR");
-                        cpu9900_1op("swpb","r0");
-                        cpu9900_2op("movb","r0","@VDPWADR");
                     } else {
-                        cpuz80_2op("LD", "B", "A");
-                        cpuz80_2op("LD", "C", "7");
-                        generic_interrupt_disable();
-                        cpuz80_1op("CALL", "WRTVDP");
-                    }
-                    generic_interrupt_enable();
-                }
-                if (lex == C_COMMA) {
-                    get_lex();
-                    type = evaluate_expression(1, TYPE_8, 0);
-                    if (machine != SMS && machine != NES && machine != MSX2) {
-                        emit_error("The 2nd BORDER argument only available for MSX2/SMS/NES/Famicom");
-                    } else if (machine == SMS) {
-                        cpuz80_1op("AND", "$07");
-                        cpuz80_1op("OR", "$20");
-                        cpuz80_noop("RRCA");
-                        cpuz80_noop("RRCA");
-                        cpuz80_noop("RRCA");
-                        cpuz80_2op("LD", "B", "A");
-                        cpuz80_2op("LD", "C", "0");
-                        generic_interrupt_disable();
-                        cpuz80_1op("CALL", "WRTVDP");
-                        generic_interrupt_enable();
-                    } else if (machine == MSX2) {
-                        cpuz80_1op("AND", "$03");
-                        cpuz80_2op("LD", "B", "A");
-                        cpuz80_2op("LD", "C", "25");
-                        generic_interrupt_disable();
-                        cpuz80_1op("CALL", "WRTVDP");
-                        generic_interrupt_enable();
-                    } else if (machine == NES) {
-                        cpu6502_1op("ASL", "A");
-                        cpu6502_1op("AND", "#$06");
-                        cpu6502_noop("PHA");
-                        cpu6502_1op("LDA", "ppu_mask");
-                        cpu6502_1op("AND", "#$f9");
-                        cpu6502_1op("STA", "ppu_mask");
-                        cpu6502_noop("PLA");
-                        cpu6502_1op("ORA", "ppu_mask");
-                        cpu6502_1op("STA", "ppu_mask");
+                        emit_error("width error in BITMAP");
                     }
-                }
-            } else if (strcmp(name, "SCROLL") == 0) {   /* Sega Master System / MSX2 / NES/Famicom */
-                int type;
+                    break;
+                case K_BORDER: {
+                    int type;
                 
-                get_lex();
-                if (machine != SMS && machine != NES && machine != MSX2)
-                    emit_error("SCROLL is only available for MSX2/SMS/NES/Famicom");
-                if (lex != C_COMMA) {
-                    if (machine == SMS) {
-                        type = evaluate_expression(1, TYPE_8, 0);
-                        cpuz80_2op("LD", "B", "A");
-                        cpuz80_2op("LD", "C", "8");
-                        generic_interrupt_disable();
-                        cpuz80_1op("CALL", "WRTVDP");
-                        generic_interrupt_enable();
-                    } else if (machine == MSX2) {
-                        type = evaluate_expression(1, TYPE_16, 0);
-                        cpuz80_2op("LD", "A", "L");
-                        cpuz80_1op("AND", "7");
-                        cpuz80_2op("LD", "B", "A");
-                        cpuz80_2op("LD", "C", "27");
-                        generic_interrupt_disable();
-                        cpuz80_1op("CALL", "WRTVDP");
-                        cpuz80_2op("LD", "A", "L");
-                        cpuz80_1op("SRL", "H");
-                        cpuz80_noop("RRA");
-                        cpuz80_noop("RRA");
-                        cpuz80_noop("RRA");
-                        cpuz80_1op("AND", "63");
-                        cpuz80_2op("LD", "B", "A");
-                        cpuz80_2op("LD", "C", "26");
-                        cpuz80_1op("CALL", "WRTVDP");
-                        generic_interrupt_enable();
-                    } else {
-                        type = evaluate_expression(1, TYPE_16, 0);
-                        cpu6502_1op("STA", "scroll_x");
-                        cpu6502_1op("STY", "scroll_x+1");
-                    }
-                }
-                if (lex == C_COMMA) {
                     get_lex();
-                    if (machine == SMS) {
+                    if (lex != C_COMMA) {
                         type = evaluate_expression(1, TYPE_8, 0);
-                        cpuz80_2op("LD", "B", "A");
-                        cpuz80_2op("LD", "C", "9");
-                        generic_interrupt_disable();
-                        cpuz80_1op("CALL", "WRTVDP");
+                        if (target == CPU_6502) {
+                            if (machine == NES) {
+                                emit_warning("BORDER first argument ignored for NES/Famicom (use PALETTE 0)");
+                            } else {
+                                cpu6502_1op("LDX", "#7");
+                                generic_interrupt_disable();
+                                cpu6502_1op("JSR", "WRTVDP");
+                            }
+                        } else if (target == CPU_9900) {
+                            /* this is just a lot faster inline than jumping through hoops... */
+                            cpu9900_2op("srl","r0","8");
+                            cpu9900_2op("ori","r0",">8700");
+                            cpu9900_1op("swpb","r0");
+                            generic_interrupt_disable();
+                            cpu9900_2op("movb","r0","@VDPWADR");
+                            cpu9900_1op("swpb","r0");
+                            cpu9900_2op("movb","r0","@VDPWADR");
+                        } else {
+                            cpuz80_2op("LD", "B", "A");
+                            cpuz80_2op("LD", "C", "7");
+                            generic_interrupt_disable();
+                            cpuz80_1op("CALL", "WRTVDP");
+                        }
                         generic_interrupt_enable();
-                    } else if (machine == MSX2) {
+                    }
+                    if (lex == C_COMMA) {
+                        get_lex();
                         type = evaluate_expression(1, TYPE_8, 0);
-                        cpuz80_2op("LD", "B", "A");
-                        cpuz80_2op("LD", "C", "23");
-                        generic_interrupt_disable();
-                        cpuz80_1op("CALL", "WRTVDP");
-                        generic_interrupt_enable();
-                    } else {
-                        type = evaluate_expression(1, TYPE_16, 0);
-                        cpu6502_1op("STA", "scroll_y");
-                        cpu6502_1op("STY", "scroll_y+1");
+                        if (machine != SMS && machine != NES && machine != MSX2) {
+                            emit_error("The 2nd BORDER argument only available for MSX2/SMS/NES/Famicom");
+                        } else if (machine == SMS) {
+                            cpuz80_1op("AND", "$07");
+                            cpuz80_1op("OR", "$20");
+                            cpuz80_noop("RRCA");
+                            cpuz80_noop("RRCA");
+                            cpuz80_noop("RRCA");
+                            cpuz80_2op("LD", "B", "A");
+                            cpuz80_2op("LD", "C", "0");
+                            generic_interrupt_disable();
+                            cpuz80_1op("CALL", "WRTVDP");
+                            generic_interrupt_enable();
+                        } else if (machine == MSX2) {
+                            cpuz80_1op("AND", "$03");
+                            cpuz80_2op("LD", "B", "A");
+                            cpuz80_2op("LD", "C", "25");
+                            generic_interrupt_disable();
+                            cpuz80_1op("CALL", "WRTVDP");
+                            generic_interrupt_enable();
+                        } else if (machine == NES) {
+                            cpu6502_1op("ASL", "A");
+                            cpu6502_1op("AND", "#$06");
+                            cpu6502_noop("PHA");
+                            cpu6502_1op("LDA", "ppu_mask");
+                            cpu6502_1op("AND", "#$f9");
+                            cpu6502_1op("STA", "ppu_mask");
+                            cpu6502_noop("PLA");
+                            cpu6502_1op("ORA", "ppu_mask");
+                            cpu6502_1op("STA", "ppu_mask");
+                        }
                     }
+                    break;
                 }
-            } else if (strcmp(name, "PALETTE") == 0) {  /* Sega Master System / NES / MSX2 */
-                int type;
-                struct node *source;
+                case K_SCROLL: { /* Sega Master System / MSX2 / NES/Famicom */
+                    int type;
                 
-                get_lex();
-                if (machine != SMS && machine != NES && machine != MSX && machine != MSX2)
-                    emit_error("PALETTE is only available on SMS/NES/Famicom/MSX/MSX2");
-                if (lex == C_NAME && strcmp(name, "LOAD") == 0) {
                     get_lex();
-                    if (lex != C_NAME) {
-                        emit_error("missing label in PALETTE LOAD");
-                    } else if (strcmp(name, "VARPTR") == 0) {
-                        source = evaluate_save_expression(1, TYPE_16);  /* CPU address (variable) */
-                        node_generate(source, 0);
-                        node_delete(source);
-                    } else {
-                        if (machine == SMS || machine == MSX2 || machine == MSX) {
-                            strcpy(temp, LABEL_PREFIX);
-                            strcat(temp, name);
-                            cpuz80_2op("LD", "HL", temp);
-                            generic_call("palette_load");
-                        } else if (machine == NES) {
-                            cpu6502_1op("LDA", "#0");
-                            cpu6502_1op("STA", "pointer");
-                            cpu6502_1op("LDA", "#63");
-                            cpu6502_1op("STA", "pointer+1");
-                            cpu6502_1op("LDA", "#32");
-                            cpu6502_1op("STA", "temp2");
-                            strcpy(temp, "#" LABEL_PREFIX);
-                            strcat(temp, name);
-                            cpu6502_1op("LDA", temp);
-                            cpu6502_1op("STA", "temp");
-                            strcat(temp, ">>8");
-                            cpu6502_1op("LDA", temp);
-                            cpu6502_1op("STA", "temp+1");
-                            cpu6502_1op("JSR", "LDIRVM");
+                    if (machine != SMS && machine != NES && machine != MSX2)
+                        emit_error("SCROLL is only available for MSX2/SMS/NES/Famicom");
+                    if (lex != C_COMMA) {
+                        if (machine == SMS) {
+                            type = evaluate_expression(1, TYPE_8, 0);
+                            cpuz80_2op("LD", "B", "A");
+                            cpuz80_2op("LD", "C", "8");
+                            generic_interrupt_disable();
+                            cpuz80_1op("CALL", "WRTVDP");
+                            generic_interrupt_enable();
+                        } else if (machine == MSX2) {
+                            type = evaluate_expression(1, TYPE_16, 0);
+                            cpuz80_2op("LD", "A", "L");
+                            cpuz80_1op("AND", "7");
+                            cpuz80_2op("LD", "B", "A");
+                            cpuz80_2op("LD", "C", "27");
+                            generic_interrupt_disable();
+                            cpuz80_1op("CALL", "WRTVDP");
+                            cpuz80_2op("LD", "A", "L");
+                            cpuz80_1op("SRL", "H");
+                            cpuz80_noop("RRA");
+                            cpuz80_noop("RRA");
+                            cpuz80_noop("RRA");
+                            cpuz80_1op("AND", "63");
+                            cpuz80_2op("LD", "B", "A");
+                            cpuz80_2op("LD", "C", "26");
+                            cpuz80_1op("CALL", "WRTVDP");
+                            generic_interrupt_enable();
+                        } else {
+                            type = evaluate_expression(1, TYPE_16, 0);
+                            cpu6502_1op("STA", "scroll_x");
+                            cpu6502_1op("STY", "scroll_x+1");
                         }
+                    }
+                    if (lex == C_COMMA) {
                         get_lex();
+                        if (machine == SMS) {
+                            type = evaluate_expression(1, TYPE_8, 0);
+                            cpuz80_2op("LD", "B", "A");
+                            cpuz80_2op("LD", "C", "9");
+                            generic_interrupt_disable();
+                            cpuz80_1op("CALL", "WRTVDP");
+                            generic_interrupt_enable();
+                        } else if (machine == MSX2) {
+                            type = evaluate_expression(1, TYPE_8, 0);
+                            cpuz80_2op("LD", "B", "A");
+                            cpuz80_2op("LD", "C", "23");
+                            generic_interrupt_disable();
+                            cpuz80_1op("CALL", "WRTVDP");
+                            generic_interrupt_enable();
+                        } else {
+                            type = evaluate_expression(1, TYPE_16, 0);
+                            cpu6502_1op("STA", "scroll_y");
+                            cpu6502_1op("STY", "scroll_y+1");
+                        }
                     }
-                } else if (lex == C_NAME && strcmp(name, "DEFAULT") == 0) {
+                    break;
+                }
+                case K_PALETTE: { /* Sega Master System / NES / MSX2 */
+                    int type;
+                    struct node *source;
+                
                     get_lex();
-                    if (machine != MSX2 && machine != SMS && machine != MSX)
-                        emit_error("PALETTE DEFAULT is only available in MSX2/SMS");
-                    generic_call("palette_default");
-                } else {
-                    type = evaluate_expression(1, TYPE_8, 0);
-                    if (machine == SMS) {
-                        generic_interrupt_disable();
-                        cpuz80_2op("LD", "L", "A");
-                        cpuz80_2op("LD", "H", "$C0");
-                        cpuz80_1op("CALL", "SETWRT");
-                    } else if (machine == NES) {
-                        cpu6502_1op("LDX", "ppu_pointer");
-                        cpu6502_1op("STA", "PPUBUF,X");
-                        cpu6502_1op("LDA", "#$7f");
-                        cpu6502_1op("STA", "PPUBUF+1,X");
-                    } else if (machine == MSX2 || machine == MSX) {
-                        generic_interrupt_disable();
-                        cpuz80_2op("LD", "B", "A");
-                        cpuz80_2op("LD", "C", "$10");
-                        if (machine == MSX) {
-                            cpuz80_2op("LD", "A", "($002d)");
-                            cpuz80_1op("OR", "A");  /* Detect MSX1 and jump to avoid */
-                            cpuz80_2op("JR", "Z", "$+5");
+                    if (machine != SMS && machine != NES && machine != MSX && machine != MSX2)
+                        emit_error("PALETTE is only available on SMS/NES/Famicom/MSX/MSX2");
+                    if (lex == C_NAME && strcmp(name, "LOAD") == 0) {
+                        get_lex();
+                        if (lex != C_NAME) {
+                            emit_error("missing label in PALETTE LOAD");
+                        } else if (keyword == K_VARPTR) {
+                            source = evaluate_save_expression(1, TYPE_16);  /* CPU address (variable) */
+                            node_generate(source, 0);
+                        } else {
+                            if (machine == SMS || machine == MSX2 || machine == MSX) {
+                                strcpy(temp, LABEL_PREFIX);
+                                strcat(temp, name);
+                                cpuz80_2op("LD", "HL", temp);
+                                generic_call("palette_load");
+                            } else if (machine == NES) {
+                                cpu6502_1op("LDA", "#0");
+                                cpu6502_1op("STA", "pointer");
+                                cpu6502_1op("LDA", "#63");
+                                cpu6502_1op("STA", "pointer+1");
+                                cpu6502_1op("LDA", "#32");
+                                cpu6502_1op("STA", "temp2");
+                                strcpy(temp, "#" LABEL_PREFIX);
+                                strcat(temp, name);
+                                cpu6502_1op("LDA", temp);
+                                cpu6502_1op("STA", "temp");
+                                strcat(temp, ">>8");
+                                cpu6502_1op("LDA", temp);
+                                cpu6502_1op("STA", "temp+1");
+                                cpu6502_1op("JSR", "LDIRVM");
+                            }
+                            get_lex();
                         }
-                        cpuz80_1op("CALL", "WRTVDP");
-                    }
-                    if (lex != C_COMMA)
-                        emit_error("missing comma in PALETTE");
-                    else
+                    } else if (lex == C_NAME && strcmp(name, "DEFAULT") == 0) {
                         get_lex();
-                    type = evaluate_expression(1, ((machine == MSX2 || machine == MSX) ? TYPE_16 : TYPE_8), 0);
-                    if (machine == SMS) {
-                        cpuz80_2op("OUT", "(VDP)", "A");
-                        generic_interrupt_enable();
-                    } else if (machine == NES) {
-                        cpu6502_1op("LDX", "ppu_pointer");
-                        cpu6502_1op("STA", "PPUBUF+2,X");
-                        cpu6502_noop("INX");
-                        cpu6502_noop("INX");
-                        cpu6502_noop("INX");
-                        cpu6502_1op("STX", "ppu_pointer");
-                    } else if (machine == MSX2 || machine == MSX) {
-                        if (machine == MSX) {
-                            cpuz80_2op("LD", "A", "($002d)");
-                            cpuz80_1op("OR", "A");  /* Detect MSX1 and jump to avoid */
-                            cpuz80_2op("JR", "Z", "$+8");
+                        if (machine != MSX2 && machine != SMS && machine != MSX)
+                            emit_error("PALETTE DEFAULT is only available in MSX2/SMS");
+                        generic_call("palette_default");
+                    } else {
+                        type = evaluate_expression(1, TYPE_8, 0);
+                        if (machine == SMS) {
+                            generic_interrupt_disable();
+                            cpuz80_2op("LD", "L", "A");
+                            cpuz80_2op("LD", "H", "$C0");
+                            cpuz80_1op("CALL", "SETWRT");
+                        } else if (machine == NES) {
+                            cpu6502_1op("LDX", "ppu_pointer");
+                            cpu6502_1op("STA", "PPUBUF,X");
+                            cpu6502_1op("LDA", "#$7f");
+                            cpu6502_1op("STA", "PPUBUF+1,X");
+                        } else if (machine == MSX2 || machine == MSX) {
+                            generic_interrupt_disable();
+                            cpuz80_2op("LD", "B", "A");
+                            cpuz80_2op("LD", "C", "$10");
+                            if (machine == MSX) {
+                                cpuz80_2op("LD", "A", "($002d)");
+                                cpuz80_1op("OR", "A");  /* Detect MSX1 and jump to avoid */
+                                cpuz80_2op("JR", "Z", "$+5");
+                            }
+                            cpuz80_1op("CALL", "WRTVDP");
+                        }
+                        if (lex != C_COMMA)
+                            emit_error("missing comma in PALETTE");
+                        else
+                            get_lex();
+                        type = evaluate_expression(1, ((machine == MSX2 || machine == MSX) ? TYPE_16 : TYPE_8), 0);
+                        if (machine == SMS) {
+                            cpuz80_2op("OUT", "(VDP)", "A");
+                            generic_interrupt_enable();
+                        } else if (machine == NES) {
+                            cpu6502_1op("LDX", "ppu_pointer");
+                            cpu6502_1op("STA", "PPUBUF+2,X");
+                            cpu6502_noop("INX");
+                            cpu6502_noop("INX");
+                            cpu6502_noop("INX");
+                            cpu6502_1op("STX", "ppu_pointer");
+                        } else if (machine == MSX2 || machine == MSX) {
+                            if (machine == MSX) {
+                                cpuz80_2op("LD", "A", "($002d)");
+                                cpuz80_1op("OR", "A");  /* Detect MSX1 and jump to avoid */
+                                cpuz80_2op("JR", "Z", "$+8");
+                            }
+                            cpuz80_2op("LD", "A", "L");
+                            cpuz80_2op("OUT", "(VDP+2)", "A");
+                            cpuz80_2op("LD", "A", "H");
+                            cpuz80_2op("OUT", "(VDP+2)", "A");
+                            generic_interrupt_enable();
                         }
-                        cpuz80_2op("LD", "A", "L");
-                        cpuz80_2op("OUT", "(VDP+2)", "A");
-                        cpuz80_2op("LD", "A", "H");
-                        cpuz80_2op("OUT", "(VDP+2)", "A");
-                        generic_interrupt_enable();
                     }
+                    break;
                 }
-            } else if (strcmp(name, "NAMETABLE") == 0) {    /* Select nametable arrangement */
-                int type;
-                struct node *tree;
-                int c;
-                
-                if (machine != NES)
-                    emit_error("CHRRAM is only allowed for NES/Famicom");
-                else if (bank_switching == 0)
-                    emit_error("It is required a BANK ROM sentence to enable CHRRAM");
-                get_lex();
-                tree = evaluate_level_0(&type);
-                if (tree->type != N_NUM8 && tree->type != N_NUM16) {
-                    emit_error("Not a constant expression in CHRRAM");
-                    c = 0;
-                } else {
-                    c = tree->value;
-                }
-                node_delete(tree);
-                if (c < 0 || c > 3)
-                    emit_error("NAMETABLE value outside of range 0-3");
-                nes_nametable = c;
-            } else if (strcmp(name, "CHRRAM") == 0) { /* Select CHRRAM */
-                int type;
-                struct node *tree;
-                int c;
-                
-                if (machine != NES)
-                    emit_error("CHRRAM is only allowed for NES/Famicom");
-                else if (bank_switching == 0)
-                    emit_error("It is required a BANK ROM sentence to enable CHRRAM");
-                get_lex();
-                tree = evaluate_level_0(&type);
-                if (tree->type != N_NUM8 && tree->type != N_NUM16) {
-                    emit_error("Not a constant expression in CHRRAM");
-                    c = 0;
-                } else {
-                    c = tree->value;
-                }
-                node_delete(tree);
-                if (c < 0 || c > 7)
-                    emit_error("CHRRAM value outside of range 0-7");
-                c = c << 5;
-                sprintf(temp, "#%d", c);
-                cpu6502_1op("LDA", temp);
-                cpu6502_1op("STA", "CHRRAM_BANK");
-            } else if (strcmp(name, "CHRROM") == 0) { /* Select CHRROM */
-                int type;
-                struct node *tree;
-                int c;
+                case K_NAMETABLE: { /* Select nametable arrangement */
+                    int type;
+                    struct node *tree;
+                    int c;
                 
-                if (machine != NES)
-                    emit_error("CHRROM is only allowed for NES/Famicom");
-                get_lex();
-                if (lex != C_NAME || strcmp(name, "PATTERN") != 0) {
+                    if (machine != NES)
+                        emit_error("CHRRAM is only allowed for NES/Famicom");
+                    else if (bank_switching == 0)
+                        emit_error("It is required a BANK ROM sentence to enable CHRRAM");
+                    get_lex();
                     tree = evaluate_level_0(&type);
                     if (tree->type != N_NUM8 && tree->type != N_NUM16) {
-                        emit_error("Not a constant expression in CHRROM");
+                        emit_error("Not a constant expression in CHRRAM");
                         c = 0;
                     } else {
                         c = tree->value;
                     }
-                    node_delete(tree);
-                    if (c + 1 > chrrom_size) {    /* Grow the CHRROM */
-                        unsigned char *p;
-                        
-                        p = realloc(chrrom_data, (c + 1) * CHRROM_PAGE);
-                        if (p == NULL) {
-                            emit_error("Not enough memory for CHRROM");
-                            break;
-                        }
-                        chrrom_data = p;
-                        /* Reset pixel data in new space */
-                        for (type = chrrom_size; type < c + 1; type++)
-                            reset_chrrom(chrrom_data + chrrom_size * CHRROM_PAGE);
-                        chrrom_size = c + 1;
-                    }
-                    current_chrrom = c;
-                    chrrom_pointer = 0;
+                    if (c < 0 || c > 3)
+                        emit_error("NAMETABLE value outside of range 0-3");
+                    nes_nametable = c;
+                    break;
                 }
-                if (lex == C_NAME && strcmp(name, "PATTERN") == 0) {
+                case K_CHRRAM: { /* Select CHRRAM */
+                    int type;
+                    struct node *tree;
+                    int c;
+                
+                    if (machine != NES)
+                        emit_error("CHRRAM is only allowed for NES/Famicom");
+                    else if (bank_switching == 0)
+                        emit_error("It is required a BANK ROM sentence to enable CHRRAM");
                     get_lex();
                     tree = evaluate_level_0(&type);
                     if (tree->type != N_NUM8 && tree->type != N_NUM16) {
-                        emit_error("Not a constant expression in CHRROM");
+                        emit_error("Not a constant expression in CHRRAM");
                         c = 0;
                     } else {
                         c = tree->value;
                     }
-                    node_delete(tree);
-                    if (c < 0 || c > 511) {
-                        emit_error("CHRROM PATTERN out of range 0-511");
-                        c = 0;
-                    }
-                    chrrom_pointer = c * 16;
-                }
-            } else if (strcmp(name, "MODE") == 0) {
-                get_lex();
-                if (lex != C_NUM || (value != 0 && value != 1 && value != 2 && value != 4)) {
-                    emit_error("bad syntax for MODE");
+                    if (c < 0 || c > 7)
+                        emit_error("CHRRAM value outside of range 0-7");
+                    c = c << 5;
+                    sprintf(temp, "#%d", c);
+                    cpu6502_1op("LDA", temp);
+                    cpu6502_1op("STA", "CHRRAM_BANK");
                     break;
                 }
-                get_lex();
-                if (value == 0) {
-                    if (machine == SMS)
-                        emit_warning("MODE 0 isn't upward compatible with Sega Genesis/Mega Drive");
-                    generic_call("mode_0");
-                }
-                if (value == 1) {
-                    if (machine == SMS)
-                        emit_warning("MODE 1 isn't upward compatible with Sega Genesis/Mega Drive");
-                    generic_call("mode_1");
-                }
-                if (value == 2) {
-                    if (machine == SMS)
-                        emit_warning("MODE 2 isn't upward compatible with Sega Genesis/Mega Drive");
-                    generic_call("mode_2");
-                }
-                if (value == 4) {
-                    if (machine != SMS && machine != MSX2)
-                        emit_error("MODE 4 not supported by this platform");
-                    generic_call("mode_4");
-                }
-            } else if (strcmp(name, "SCREEN") == 0) {  /* Copy screen */
-                struct label *array;
+                case K_CHRROM: { /* Select CHRROM */
+                    int type;
+                    struct node *tree;
+                    int c;
                 
-                get_lex();
-                if (lex != C_NAME) {
-                    emit_error("bad syntax for SCREEN");
-                    break;
-                }
-                if (strcmp(name, "ENABLE") == 0) {
+                    if (machine != NES)
+                        emit_error("CHRROM is only allowed for NES/Famicom");
                     get_lex();
-                    generic_call("ENASCR");
-                } else if (strcmp(name, "DISABLE") == 0) {
-                    get_lex();
-                    generic_call("DISSCR");
-                } else {
-                    array = array_search(name);
-                    if (array != NULL) {
-                        strcpy(assigned, ARRAY_PREFIX);
-                        strcat(assigned, name);
-                    } else {
-                        array = label_search(name);
-                        if (array == NULL) {
-                            array = label_add(name);
+                    if (lex != C_NAME || strcmp(name, "PATTERN") != 0) {
+                        tree = evaluate_level_0(&type);
+                        if (tree->type != N_NUM8 && tree->type != N_NUM16) {
+                            emit_error("Not a constant expression in CHRROM");
+                            c = 0;
+                        } else {
+                            c = tree->value;
                         }
-                        array->used |= LABEL_USED;
-                        strcpy(assigned, LABEL_PREFIX);
-                        strcat(assigned, name);
-                    }
-                    get_lex();
-                    if (lex == C_COMMA) {  /* There is a second argument? */
-                        struct node *final;
-                        struct node *addr;
-                        int type;
-                        int c;
+                        if (c + 1 > chrrom_size) {    /* Grow the CHRROM */
+                            unsigned char *p;
                         
+                            p = realloc(chrrom_data, (c + 1) * CHRROM_PAGE);
+                            if (p == NULL) {
+                                emit_error("Not enough memory for CHRROM");
+                                return;
+                            }
+                            chrrom_data = p;
+                            /* Reset pixel data in new space */
+                            for (type = chrrom_size; type < c + 1; type++)
+                                reset_chrrom(chrrom_data + chrrom_size * CHRROM_PAGE);
+                            chrrom_size = c + 1;
+                        }
+                        current_chrrom = c;
+                        chrrom_pointer = 0;
+                    }
+                    if (lex == C_NAME && strcmp(name, "PATTERN") == 0) {
                         get_lex();
-                        addr = node_create(N_ADDR, 0, NULL, NULL);
-                        addr->label = array;
-                        final = evaluate_level_0(&type);    /* Source offset */
-                        if ((type & MAIN_TYPE) == TYPE_8)
-                            final = node_create((type & TYPE_SIGNED) ? N_EXTEND8S : N_EXTEND8, 0, final, NULL);
-                        if (machine == SMS)
-                            final = node_create(N_MUL16, 0, final, node_create(N_NUM16, 2, NULL, NULL));
-                        final = node_create(N_PLUS16, 0, addr, final);
-                        node_label(final);
-                        node_generate(final, 0);
-                        node_delete(final);
-                        if (target == CPU_6502) {
-                            cpu6502_noop("PHA");
-                            cpu6502_noop("TYA");
-                            cpu6502_noop("PHA");
-                        } else if (target == CPU_9900) {
-                            cpu9900_2op("mov","r0","r9");
+                        tree = evaluate_level_0(&type);
+                        if (tree->type != N_NUM8 && tree->type != N_NUM16) {
+                            emit_error("Not a constant expression in CHRROM");
+                            c = 0;
                         } else {
-                            cpuz80_1op("PUSH", "HL");
+                            c = tree->value;
                         }
-                        if (lex != C_COMMA) {
-                            emit_error("missing comma after second parameter in SCREEN");
-                            break;
+                        if (c < 0 || c > 511) {
+                            emit_error("CHRROM PATTERN out of range 0-511");
+                            c = 0;
                         }
-                        get_lex();
-                        final = evaluate_level_0(&type);    /* Target offset */
-                        if ((type & MAIN_TYPE) == TYPE_8)
-                            final = node_create((type & TYPE_SIGNED) ? N_EXTEND8S : N_EXTEND8, 0, final, NULL);
+                        chrrom_pointer = c * 16;
+                    }
+                    break;
+                }
+                case K_MODE:
+                    get_lex();
+                    if (lex != C_NUM || (value != 0 && value != 1 && value != 2 && value != 4)) {
+                        emit_error("bad syntax for MODE");
+                        return;
+                    }
+                    get_lex();
+                    if (value == 0) {
                         if (machine == SMS)
-                            final = node_create(N_MUL16, 0, final, node_create(N_NUM16, 2, NULL, NULL));
+                            emit_warning("MODE 0 isn't upward compatible with Sega Genesis/Mega Drive");
+                        generic_call("mode_0");
+                    }
+                    if (value == 1) {
                         if (machine == SMS)
-                            c = 0x3800;
-                        else if (machine == NES)
-                            c = 0x2000;
-                        else
-                            c = 0x1800;
-                        final = node_create(N_PLUS16, 0, node_create(N_NUM16, c, NULL, NULL), final);
-                        node_label(final);
-                        node_generate(final, 0);
-                        node_delete(final);
-                        if (target == CPU_6502) {
-                            cpu6502_1op("STA", "pointer");
-                            cpu6502_1op("STY", "pointer+1");
-                        } else if (target == CPU_9900) {
-                            cpu9900_2op("mov","r0","r8");
-                        } else {
-                            cpuz80_1op("PUSH", "HL");
-                        }
-                        if (lex != C_COMMA) {
-                            emit_error("missing comma after third parameter in SCREEN");
-                            break;
-                        }
-                        get_lex();
-                        final = evaluate_level_0(&type);    /* Source/target Width */
-                        if ((type & MAIN_TYPE) == TYPE_16)
-                            final = node_create(N_REDUCE16, 0, final, NULL);
+                            emit_warning("MODE 1 isn't upward compatible with Sega Genesis/Mega Drive");
+                        generic_call("mode_1");
+                    }
+                    if (value == 2) {
                         if (machine == SMS)
-                            final = node_create(N_MUL8, 0, final, node_create(N_NUM8, 2, NULL, NULL));
-                        node_label(final);
-                        node_generate(final, 0);
-                        node_delete(final);
-                        if (target == CPU_6502) {
-                            cpu6502_noop("PHA");
-                        } else if (target == CPU_9900) {
-                            cpu9900_2op("mov","r0","r6");
+                            emit_warning("MODE 2 isn't upward compatible with Sega Genesis/Mega Drive");
+                        generic_call("mode_2");
+                    }
+                    if (value == 4) {
+                        if (machine != SMS && machine != MSX2)
+                            emit_error("MODE 4 not supported by this platform");
+                        generic_call("mode_4");
+                    }
+                    break;
+                case K_SCREEN: { /* Copy screen */
+                    struct label *array;
+                
+                    get_lex();
+                    if (lex != C_NAME) {
+                        emit_error("bad syntax for SCREEN");
+                        return;
+                    }
+                    if (strcmp(name, "ENABLE") == 0) {
+                        get_lex();
+                        generic_call("ENASCR");
+                    } else if (strcmp(name, "DISABLE") == 0) {
+                        get_lex();
+                        generic_call("DISSCR");
+                    } else {
+                        array = array_search(name);
+                        if (array != NULL) {
+                            strcpy(assigned, ARRAY_PREFIX);
+                            strcat(assigned, name);
                         } else {
-                            cpuz80_1op("PUSH", "AF");
-                        }
-                        if (lex != C_COMMA) {
-                            emit_error("missing comma after fourth parameter in SCREEN");
-                            break;
+                            array = label_search(name);
+                            if (array == NULL) {
+                                array = label_add(name);
+                            }
+                            array->used |= LABEL_USED;
+                            strcpy(assigned, LABEL_PREFIX);
+                            strcat(assigned, name);
                         }
                         get_lex();
-                        final = evaluate_level_0(&type);    /* Source/target height */
-                        if ((type & MAIN_TYPE) == TYPE_16)
-                            final = node_create(N_REDUCE16, 0, final, NULL);
-                        node_label(final);
-                        node_generate(final, 0);
-                        node_delete(final);
-                        if (lex == C_COMMA) {   /* Sixth argument for SCREEN (stride width) */
+                        if (lex == C_COMMA) {  /* There is a second argument? */
+                            struct node *final;
+                            struct node *addr;
+                            int type;
+                            int c;
+                        
+                            get_lex();
+                            addr = node_create(N_ADDR, 0, NULL, NULL);
+                            addr->label = array;
+                            final = evaluate_level_0(&type);    /* Source offset */
+                            if ((type & MAIN_TYPE) == TYPE_8)
+                                final = node_create((type & TYPE_SIGNED) ? N_EXTEND8S : N_EXTEND8, 0, final, NULL);
+                            if (machine == SMS)
+                                final = node_create(N_MUL16, 0, final, node_create(N_NUM16, 2, NULL, NULL));
+                            final = node_create(N_PLUS16, 0, addr, final);
+                            node_label(final);
+                            node_generate(final, 0);
                             if (target == CPU_6502) {
                                 cpu6502_noop("PHA");
+                                cpu6502_noop("TYA");
+                                cpu6502_noop("PHA");
                             } else if (target == CPU_9900) {
-                                cpu9900_2op("mov","r0","r4");
+                                cpu9900_2op("mov","r0","r9");
                             } else {
-                                cpuz80_1op("PUSH", "AF");
+                                cpuz80_1op("PUSH", "HL");
+                            }
+                            if (lex != C_COMMA) {
+                                emit_error("missing comma after second parameter in SCREEN");
+                                return;
                             }
                             get_lex();
-                            final = evaluate_level_0(&type);
+                            final = evaluate_level_0(&type);    /* Target offset */
+                            if ((type & MAIN_TYPE) == TYPE_8)
+                                final = node_create((type & TYPE_SIGNED) ? N_EXTEND8S : N_EXTEND8, 0, final, NULL);
+                            if (machine == SMS)
+                                final = node_create(N_MUL16, 0, final, node_create(N_NUM16, 2, NULL, NULL));
+                            if (machine == SMS)
+                                c = 0x3800;
+                            else if (machine == NES)
+                                c = 0x2000;
+                            else
+                                c = 0x1800;
+                            final = node_create(N_PLUS16, 0, node_create(N_NUM16, c, NULL, NULL), final);
+                            node_label(final);
+                            node_generate(final, 0);
                             if (target == CPU_6502) {
-                                if ((type & MAIN_TYPE) == TYPE_8)
-                                    final = node_create(N_EXTEND8, 0, final, NULL);
+                                cpu6502_1op("STA", "pointer");
+                                cpu6502_1op("STY", "pointer+1");
+                            } else if (target == CPU_9900) {
+                                cpu9900_2op("mov","r0","r8");
                             } else {
-                                if ((type & MAIN_TYPE) == TYPE_16)
-                                    final = node_create(N_REDUCE16, 0, final, NULL);
-                                if (machine == SMS)
-                                    final = node_create(N_MUL8, 0, final, node_create(N_NUM8, 2, NULL, NULL));
+                                cpuz80_1op("PUSH", "HL");
+                            }
+                            if (lex != C_COMMA) {
+                                emit_error("missing comma after third parameter in SCREEN");
+                                return;
                             }
+                            get_lex();
+                            final = evaluate_level_0(&type);    /* Source/target Width */
+                            if ((type & MAIN_TYPE) == TYPE_16)
+                                final = node_create(N_REDUCE16, 0, final, NULL);
+                            if (machine == SMS)
+                                final = node_create(N_MUL8, 0, final, node_create(N_NUM8, 2, NULL, NULL));
                             node_label(final);
                             node_generate(final, 0);
-                            node_delete(final);
                             if (target == CPU_6502) {
-                                cpu6502_noop("TAX");
-                                cpu6502_noop("PLA");
-                                cpu6502_1op("STA", "temp2+1");
-                                cpu6502_noop("PLA");
-                                cpu6502_1op("STA", "temp2");
+                                cpu6502_noop("PHA");
                             } else if (target == CPU_9900) {
-                                cpu9900_2op("mov","r0","r5");
+                                cpu9900_2op("mov","r0","r6");
+                            } else {
+                                cpuz80_1op("PUSH", "AF");
+                            }
+                            if (lex != C_COMMA) {
+                                emit_error("missing comma after fourth parameter in SCREEN");
+                                return;
+                            }
+                            get_lex();
+                            final = evaluate_level_0(&type);    /* Source/target height */
+                            if ((type & MAIN_TYPE) == TYPE_16)
+                                final = node_create(N_REDUCE16, 0, final, NULL);
+                            node_label(final);
+                            node_generate(final, 0);
+                            if (lex == C_COMMA) {   /* Sixth argument for SCREEN (stride width) */
+                                if (target == CPU_6502) {
+                                    cpu6502_noop("PHA");
+                                } else if (target == CPU_9900) {
+                                    cpu9900_2op("mov","r0","r4");
+                                } else {
+                                    cpuz80_1op("PUSH", "AF");
+                                }
+                                get_lex();
+                                final = evaluate_level_0(&type);
+                                if (target == CPU_6502) {
+                                    if ((type & MAIN_TYPE) == TYPE_8)
+                                        final = node_create(N_EXTEND8, 0, final, NULL);
+                                } else {
+                                    if ((type & MAIN_TYPE) == TYPE_16)
+                                        final = node_create(N_REDUCE16, 0, final, NULL);
+                                    if (machine == SMS)
+                                        final = node_create(N_MUL8, 0, final, node_create(N_NUM8, 2, NULL, NULL));
+                                }
+                                node_label(final);
+                                node_generate(final, 0);
+                                if (target == CPU_6502) {
+                                    cpu6502_noop("TAX");
+                                    cpu6502_noop("PLA");
+                                    cpu6502_1op("STA", "temp2+1");
+                                    cpu6502_noop("PLA");
+                                    cpu6502_1op("STA", "temp2");
+                                } else if (target == CPU_9900) {
+                                    cpu9900_2op("mov","r0","r5");
+                                }
+                            } else {
+                                if (target == CPU_6502) {
+                                    cpu6502_1op("STA", "temp2+1");
+                                    cpu6502_noop("PLA");
+                                    cpu6502_1op("STA", "temp2");
+                                    cpu6502_noop("TAX");    /* Copy previous width... */
+                                    cpu6502_1op("LDY", "#0");   /* ...as stride width */
+                                } else if (target == CPU_9900) {
+                                    cpu9900_2op("mov","r0","r4");
+                                    cpu9900_2op("mov","r6","r5");   /* copy width as stride width */
+                                } else {
+                                    cpuz80_2op("LD", "B", "A");
+                                    cpuz80_1op("POP", "AF");   /* Extract previous width */
+                                    cpuz80_1op("PUSH", "AF");  /* Save width */
+                                    cpuz80_1op("PUSH", "BC");  /* Save height */
+                                }
                             }
-                        } else {
                             if (target == CPU_6502) {
-                                cpu6502_1op("STA", "temp2+1");
                                 cpu6502_noop("PLA");
-                                cpu6502_1op("STA", "temp2");
-                                cpu6502_noop("TAX");    /* Copy previous width... */
-                                cpu6502_1op("LDY", "#0");   /* ...as stride width */
+                                cpu6502_1op("STA","temp+1");
+                                cpu6502_noop("PLA");
+                                cpu6502_1op("STA","temp");
+                            }   /* 9900 already covered */
+                            generic_call("CPYBLK");
+                        } else {
+                            if (target == CPU_6502) {
+                                if (machine == NES) {
+                                    sprintf(temp, "#%s", assigned);
+                                    cpu6502_1op("LDA", temp);
+                                    strcat(temp, ">>8");
+                                    cpu6502_1op("LDY", temp);
+                                    cpu6502_1op("STA", "temp");
+                                    cpu6502_1op("STY", "temp+1");
+                                    cpu6502_1op("LDA", "#$f0");
+                                    cpu6502_1op("LDY", "#0");
+                                    cpu6502_1op("STA", "temp2");
+                                    cpu6502_1op("STY", "temp2+1");
+                                    cpu6502_1op("LDA", "#$00");
+                                    cpu6502_1op("LDY", "#$20");
+                                    cpu6502_1op("STA", "pointer");
+                                    cpu6502_1op("STY", "pointer+1");
+                                    cpu6502_1op("JSR", "LDIRVM4");
+                                } else {
+                                    sprintf(temp, "#%s", assigned);
+                                    cpu6502_1op("LDA", temp);
+                                    strcat(temp, ">>8");
+                                    cpu6502_1op("LDY", temp);
+                                    cpu6502_1op("STA", "temp");
+                                    cpu6502_1op("STY", "temp+1");
+                                    cpu6502_1op("LDA", "#0");
+                                    cpu6502_1op("LDY", "#3");
+                                    cpu6502_1op("STA", "temp2");
+                                    cpu6502_1op("STY", "temp2+1");
+                                    cpu6502_1op("LDA", "#$00");
+                                    cpu6502_1op("LDY", "#$18");
+                                    cpu6502_1op("STA", "pointer");
+                                    cpu6502_1op("STY", "pointer+1");
+                                    generic_interrupt_disable();
+                                    cpu6502_1op("JSR", "LDIRVM");
+                                    generic_interrupt_enable();
+                                }
                             } else if (target == CPU_9900) {
-                                cpu9900_2op("mov","r0","r4");
-                                cpu9900_2op("mov","r6","r5");   /* copy width as stride width */
-                            } else {
-                                cpuz80_2op("LD", "B", "A");
-                                cpuz80_1op("POP", "AF");   /* Extract previous width */
-                                cpuz80_1op("PUSH", "AF");  /* Save width */
-                                cpuz80_1op("PUSH", "BC");  /* Save height */
-                            }
-                        }
-                        if (target == CPU_6502) {
-                            cpu6502_noop("PLA");
-                            cpu6502_1op("STA","temp+1");
-                            cpu6502_noop("PLA");
-                            cpu6502_1op("STA","temp");
-                        }   /* 9900 already covered */
-                        generic_call("CPYBLK");
-                    } else {
-                        if (target == CPU_6502) {
-                            if (machine == NES) {
-                                sprintf(temp, "#%s", assigned);
-                                cpu6502_1op("LDA", temp);
-                                strcat(temp, ">>8");
-                                cpu6502_1op("LDY", temp);
-                                cpu6502_1op("STA", "temp");
-                                cpu6502_1op("STY", "temp+1");
-                                cpu6502_1op("LDA", "#$f0");
-                                cpu6502_1op("LDY", "#0");
-                                cpu6502_1op("STA", "temp2");
-                                cpu6502_1op("STY", "temp2+1");
-                                cpu6502_1op("LDA", "#$00");
-                                cpu6502_1op("LDY", "#$20");
-                                cpu6502_1op("STA", "pointer");
-                                cpu6502_1op("STY", "pointer+1");
-                                cpu6502_1op("JSR", "LDIRVM4");
+                                cpu9900_2op("li","r0",">1800");
+                                cpu9900_2op("li","r2",assigned);
+                                cpu9900_2op("li","r3",">0300");
+                                generic_interrupt_disable();
+                                cpu9900_1op("bl","@jsr");
+                                cpu9900_1op("data","LDIRVM");
+                                generic_interrupt_enable();
                             } else {
-                                sprintf(temp, "#%s", assigned);
-                                cpu6502_1op("LDA", temp);
-                                strcat(temp, ">>8");
-                                cpu6502_1op("LDY", temp);
-                                cpu6502_1op("STA", "temp");
-                                cpu6502_1op("STY", "temp+1");
-                                cpu6502_1op("LDA", "#0");
-                                cpu6502_1op("LDY", "#3");
-                                cpu6502_1op("STA", "temp2");
-                                cpu6502_1op("STY", "temp2+1");
-                                cpu6502_1op("LDA", "#$00");
-                                cpu6502_1op("LDY", "#$18");
-                                cpu6502_1op("STA", "pointer");
-                                cpu6502_1op("STY", "pointer+1");
+                                cpuz80_2op("LD", "HL", assigned);
+                                cpuz80_2op("LD", "DE", (machine == SMS ? "$3800" : "$1800"));
+                                cpuz80_2op("LD", "BC", (machine == SMS ? "$0600" : "$0300"));
                                 generic_interrupt_disable();
-                                cpu6502_1op("JSR", "LDIRVM");
+                                cpuz80_1op("CALL", "LDIRVM");
                                 generic_interrupt_enable();
                             }
-                        } else if (target == CPU_9900) {
-                            cpu9900_2op("li","r0",">1800");
-                            cpu9900_2op("li","r2",assigned);
-                            cpu9900_2op("li","r3",">0300");
-                            generic_interrupt_disable();
-                            cpu9900_1op("bl","@jsr");
-                            cpu9900_1op("data","LDIRVM");
-                            generic_interrupt_enable();
-                        } else {
-                            cpuz80_2op("LD", "HL", assigned);
-                            cpuz80_2op("LD", "DE", (machine == SMS ? "$3800" : "$1800"));
-                            cpuz80_2op("LD", "BC", (machine == SMS ? "$0600" : "$0300"));
-                            generic_interrupt_disable();
-                            cpuz80_1op("CALL", "LDIRVM");
-                            generic_interrupt_enable();
                         }
                     }
-                }
-            } else if (strcmp(name, "PLAY") == 0) {
-                int c;
-                
-                get_lex();
-                if (lex != C_NAME) {
-                    emit_error("bad syntax for PLAY");
                     break;
                 }
-                music_used = 1;
-                if (strcmp(name, "OFF") == 0) {
-                    get_lex();
-                    if (target == CPU_6502) {
-                        cpu6502_1op("LDA", "#music_silence");
-                        cpu6502_1op("LDY", "#music_silence>>8");
-                    } else if (target == CPU_9900) {
-                        cpu9900_2op("li", "r0", "music_silence");
-                    } else {
-                        cpuz80_2op("LD", "HL", "music_silence");
-                    }
-                    generic_call("music_play");
-                } else if (strcmp(name, "NONE") == 0) {
+                case K_PLAY: {
+                    int c;
+                
                     get_lex();
-                    if (target == CPU_6502) {
-                        cpu6502_1op("LDA", "#0");
-                        cpu6502_1op("STA", "music_mode");
-                    } else if (target == CPU_9900) {
-                        cpu9900_1op("clr", "r0");
-                        cpu9900_2op("movb", "r0", "@music_mode");
-                    } else {
-                        cpuz80_1op("XOR", "A");
-                        cpuz80_2op("LD", "(music_mode)", "A");
+                    if (lex != C_NAME) {
+                        emit_error("bad syntax for PLAY");
+                        return;
                     }
-                } else if (strcmp(name, "SIMPLE") == 0) {
-                    get_lex();
-                    c = 3;
-                    if (lex == C_NAME && strcmp(name, "NO") == 0) {
+                    music_used = 1;
+                    if (strcmp(name, "OFF") == 0) {
                         get_lex();
-                        if (lex == C_NAME && strcmp(name, "DRUMS") == 0) {
-                            get_lex();
-                            c = 2;
+                        if (target == CPU_6502) {
+                            cpu6502_1op("LDA", "#music_silence");
+                            cpu6502_1op("LDY", "#music_silence>>8");
+                        } else if (target == CPU_9900) {
+                            cpu9900_2op("li", "r0", "music_silence");
                         } else {
-                            emit_error("only allowed PLAY SIMPLE NO DRUMS");
+                            cpuz80_2op("LD", "HL", "music_silence");
                         }
-                    }
-                    if (target == CPU_6502) {
-                        sprintf(temp, "#%d", c);
-                        cpu6502_1op("LDA", temp);
-                        cpu6502_1op("STA", "music_mode");
-                    } else if (target == CPU_9900) {
-                        sprintf(temp, "%d   ; %d*256", c*256, c);
-                        cpu9900_2op("li", "r0", temp);
-                        cpu9900_2op("movb", "r0", "@music_mode");
-                    } else {
-                        sprintf(temp, "%d", c);
-                        cpuz80_2op("LD", "A", temp);
-                        cpuz80_2op("LD", "(music_mode)", "A");
-                    }
-                } else if (strcmp(name, "FULL") == 0) {
-                    get_lex();
-                    c = 5;
-                    if (lex == C_NAME && strcmp(name, "NO") == 0) {
+                        generic_call("music_play");
+                    } else if (strcmp(name, "NONE") == 0) {
                         get_lex();
-                        if (lex == C_NAME && strcmp(name, "DRUMS") == 0) {
-                            get_lex();
-                            c = 4;
+                        if (target == CPU_6502) {
+                            cpu6502_1op("LDA", "#0");
+                            cpu6502_1op("STA", "music_mode");
+                        } else if (target == CPU_9900) {
+                            cpu9900_1op("clr", "r0");
+                            cpu9900_2op("movb", "r0", "@music_mode");
                         } else {
-                            emit_error("only allowed PLAY FULL NO DRUMS");
+                            cpuz80_1op("XOR", "A");
+                            cpuz80_2op("LD", "(music_mode)", "A");
                         }
-                    }
-                    if (target == CPU_6502) {
-                        sprintf(temp, "#%d", c);
-                        cpu6502_1op("LDA", temp);
-                        cpu6502_1op("STA", "music_mode");
-                    } else if (target == CPU_9900) {
-                        sprintf(temp, "%d   ; %d*256", c*256, c);
-                        cpu9900_2op("li", "r0", temp);
-                        cpu9900_2op("movb", "r0", "@music_mode");
-                    } else {
-                        sprintf(temp, "%d", c);
-                        cpuz80_2op("LD", "A", temp);
-                        cpuz80_2op("LD", "(music_mode)", "A");
-                    }
-                } else if (strcmp(name, "FM") == 0) {
-                    get_lex();
-                    if (machine != MSX && machine != MSX2 && machine != SMS)
-                        emit_warning("PLAY FM only allowed for MSX/MSX2/SMS");
-                    if (lex == C_NAME && strcmp(name, "ON") == 0) {
-                        get_lex();
-                        cpuz80_2op("LD", "A", "1");
-                        cpuz80_2op("LD", "(fm_enabled)", "A");
-                    } else if (lex == C_NAME && strcmp(name, "OFF") == 0) {
+                    } else if (strcmp(name, "SIMPLE") == 0) {
                         get_lex();
-                        cpuz80_1op("CALL", "turn_off_fm");
-                        cpuz80_1op("XOR", "A");
-                        cpuz80_2op("LD", "(fm_enabled)", "A");
-                    } else {
-                        emit_error("syntax error in PLAY FM");
-                    }
-                } else if (strcmp(name, "INSTRUMENT") == 0) {
-                    get_lex();
-                    if (machine != MSX && machine != MSX2 && machine != SMS)
-                        emit_warning("PLAY INSTRUMENT only allowed for MSX/MSX2/SMS");
-                    if (lex == C_NAME && strcmp(name, "VARPTR") == 0) {
-                        struct node *source = NULL;
-
-                        source = evaluate_save_expression(1, TYPE_16);  /* CPU address (variable) */
-                        node_generate(source, 0);
-                        cpuz80_1op("CALL", "program_fm");
-                        node_delete(source);
-                    } else {
-                        type = evaluate_expression(1, TYPE_8, 0);
-                        if (target == CPU_Z80)
-                            cpuz80_2op("LD", "(fm_inst)", "A");
-                        if (lex != C_COMMA)
-                            emit_error("missing comma");
-                        else
+                        c = 3;
+                        if (lex == C_NAME && strcmp(name, "NO") == 0) {
                             get_lex();
-                        type = evaluate_expression(1, TYPE_8, 0);
-                        if (target == CPU_Z80)
-                            cpuz80_2op("LD", "(fm_inst+1)", "A");
-                        if (lex != C_COMMA)
-                            emit_error("missing comma");
-                        else
-                            get_lex();
-                        type = evaluate_expression(1, TYPE_8, 0);
-                        if (target == CPU_Z80)
-                            cpuz80_2op("LD", "(fm_inst+2)", "A");
-                        if (lex != C_COMMA)
-                            emit_error("missing comma");
-                        else
-                            get_lex();
-                        type = evaluate_expression(1, TYPE_8, 0);
-                        if (target == CPU_Z80)
-                            cpuz80_2op("LD", "(fm_inst+3)", "A");
-                    }
-                } else {
-                    struct label *label;
-                    
-                    label = label_search(name);
-                    if (label == NULL) {
-                        label = label_add(name);
-                    }
-                    label->used |= LABEL_USED;
-                    if (target == CPU_6502) {
-                        strcpy(temp, "#" LABEL_PREFIX);
-                        strcat(temp, name);
-                        cpu6502_1op("LDA", temp);
-                        strcat(temp, ">>8");
-                        cpu6502_1op("LDY", temp);
-                    } else if (target == CPU_9900) {
-                        strcpy(temp, LABEL_PREFIX);
-                        strcat(temp, name);
-                        cpu9900_2op("li", "r0", temp);
-                    } else {
-                        strcpy(temp, LABEL_PREFIX);
-                        strcat(temp, name);
-                        cpuz80_2op("LD", "HL", temp);
-                    }
-                    generic_call("music_play");
-                    get_lex();
-                }
-            } else if (strcmp(name, "MUSIC") == 0) {
-                int arg;
-                static int previous[4];
-                unsigned int notes;
-                int note;
-                int c;
-                
-                generic_dump();
-                get_lex();
-                notes = 0;
-                arg = 0;
-                while (1) {
-                    if (lex != C_NAME && lex != C_MINUS) {
-                        emit_error("bad syntax for MUSIC");
-                        break;
-                    }
-                    if (lex == C_MINUS) {
-                        /* Nothing to do */
-                    } else if (arg == 0 && strcmp(name, "REPEAT") == 0) {
-                        get_lex();
-                        notes = 0xfd;
-                        break;
-                    } else if (arg == 0 && strcmp(name, "STOP") == 0) {
-                        get_lex();
-                        notes = 0xfe;
-                        break;
-                    } else if (arg == 3) {
-                        if (name[0] != 'M' || name[1] < '1' || name[1] > '3') {
-                            emit_error("bad syntax for drum in MUSIC");
-                            break;
-                        }
-                        notes |= (name[1] - '0') << ((arg & 3) * 8);
-                    } else if (strcmp(name, "S") == 0) {
-                        notes |= 0x3f << ((arg & 3) * 8);
-                    } else {
-                        notes |= previous[arg] << ((arg & 3) * 8);
-                        c = 0;
-                        switch (name[c++]) {
-                            case 'C': note = 0; break;
-                            case 'D': note = 2; break;
-                            case 'E': note = 4; break;
-                            case 'F': note = 5; break;
-                            case 'G': note = 7; break;
-                            case 'A': note = 9; break;
-                            case 'B': note = 11; break;
-                            default:
-                                note = 0;
-                                emit_error("bad syntax for note in MUSIC");
-                                break;
+                            if (lex == C_NAME && strcmp(name, "DRUMS") == 0) {
+                                get_lex();
+                                c = 2;
+                            } else {
+                                emit_error("only allowed PLAY SIMPLE NO DRUMS");
+                            }
                         }
-                        switch (name[c++]) {
-                            case '2': note += 0 * 12; break;
-                            case '3': note += 1 * 12; break;
-                            case '4': note += 2 * 12; break;
-                            case '5': note += 3 * 12; break;
-                            case '6': note += 4 * 12; break;
-                            case '7': if (note == 0) { note += 5 * 12; break; }
-                            default:
-                                emit_error("bad syntax for note in MUSIC");
-                                break;
+                        if (target == CPU_6502) {
+                            sprintf(temp, "#%d", c);
+                            cpu6502_1op("LDA", temp);
+                            cpu6502_1op("STA", "music_mode");
+                        } else if (target == CPU_9900) {
+                            sprintf(temp, "%d   ; %d*256", c*256, c);
+                            cpu9900_2op("li", "r0", temp);
+                            cpu9900_2op("movb", "r0", "@music_mode");
+                        } else {
+                            sprintf(temp, "%d", c);
+                            cpuz80_2op("LD", "A", temp);
+                            cpuz80_2op("LD", "(music_mode)", "A");
                         }
-                        note++;
-                        if (name[c] == '#') {
-                            note++;
-                            c++;
+                    } else if (strcmp(name, "FULL") == 0) {
+                        get_lex();
+                        c = 5;
+                        if (lex == C_NAME && strcmp(name, "NO") == 0) {
+                            get_lex();
+                            if (lex == C_NAME && strcmp(name, "DRUMS") == 0) {
+                                get_lex();
+                                c = 4;
+                            } else {
+                                emit_error("only allowed PLAY FULL NO DRUMS");
+                            }
                         }
-                        if (name[c] == 'W') {
-                            previous[arg] = 0x00;
-                            notes &= ~(0xc0 << ((arg & 3) * 8));
-                            notes |= previous[arg] << ((arg & 3) * 8);
-                        } else if (name[c] == 'X') {
-                            previous[arg] = 0x40;
-                            notes &= ~(0xc0 << ((arg & 3) * 8));
-                            notes |= previous[arg] << ((arg & 3) * 8);
-                        } else if (name[c] == 'Y') {
-                            previous[arg] = 0x80;
-                            notes &= ~(0xc0 << ((arg & 3) * 8));
-                            notes |= previous[arg] << ((arg & 3) * 8);
-                        } else if (name[c] == 'Z') {
-                            previous[arg] = 0xc0;
-                            notes &= ~(0xc0 << ((arg & 3) * 8));
-                            notes |= previous[arg] << ((arg & 3) * 8);
+                        if (target == CPU_6502) {
+                            sprintf(temp, "#%d", c);
+                            cpu6502_1op("LDA", temp);
+                            cpu6502_1op("STA", "music_mode");
+                        } else if (target == CPU_9900) {
+                            sprintf(temp, "%d   ; %d*256", c*256, c);
+                            cpu9900_2op("li", "r0", temp);
+                            cpu9900_2op("movb", "r0", "@music_mode");
+                        } else {
+                            sprintf(temp, "%d", c);
+                            cpuz80_2op("LD", "A", temp);
+                            cpuz80_2op("LD", "(music_mode)", "A");
                         }
-                        notes |= note << ((arg & 3) * 8);
-                    }
-                    get_lex();
-                    arg++;
-                    if (lex != C_COMMA)
-                        break;
-                    if (arg == 4) {
-                        emit_error("too many arguments for MUSIC");
-                        break;
-                    }
-                    get_lex();
-                }
-                if (target == CPU_9900) {
-                    fprintf(output, "\tbyte >%02x,>%02x,>%02x,>%02x\n", notes & 0xff, (notes >> 8) & 0xff, (notes >> 16) & 0xff, (notes >> 24) & 0xff);
-                } else {
-                    fprintf(output, "\tdb $%02x,$%02x,$%02x,$%02x\n", notes & 0xff, (notes >> 8) & 0xff, (notes >> 16) & 0xff, (notes >> 24) & 0xff);
-                }
-            } else if (strcmp(name, "SOUND") == 0) {
-                get_lex();
-                if (lex != C_NUM) {
-                    emit_error("syntax error in SOUND");
-                } else {
-                    if (value < 10 && machine == NES) {
-                        emit_warning("using SOUND 0-9 with NES/Famicom target");
-                    } else if (value >= 0 && value <= 4 && (machine == MSX || machine == MSX2 || machine == SVI || machine == EINSTEIN || machine == NABU)) {
-                        emit_warning("using SOUND 0-3 with AY-3-8910 target");
-                    } else if (value >= 5 && value <= 9 && machine != MSX && machine != MSX2 && machine != COLECOVISION_SGM && machine != SVI && machine != SORD && machine != MEMOTECH && machine != NABU) {
-                        emit_warning("using SOUND 5-9 with SN76489 target");
-                    }
-                    switch (value) {
-                        /* Sound handling for SN76489 */
-                        case 0:
+                    } else if (strcmp(name, "FM") == 0) {
+                        get_lex();
+                        if (machine != MSX && machine != MSX2 && machine != SMS)
+                            emit_warning("PLAY FM only allowed for MSX/MSX2/SMS");
+                        if (lex == C_NAME && keyword == K_ON) {
                             get_lex();
-                            if (lex != C_COMMA) {
-                                emit_error("missing comma in sound");
-                            } else {
-                                get_lex();
+                            if (target == CPU_Z80) {
+                                cpuz80_2op("LD", "A", "1");
+                                cpuz80_2op("LD", "(fm_enabled)", "A");
                             }
-                            if (lex != C_COMMA) {
-                                type = evaluate_expression(1, TYPE_16, 0);
-                                if (target == CPU_6502) {
-                                    cpu6502_1op("LDX", "#128");
-                                } else if (target == CPU_9900) {
-                                    cpu9900_2op("li", "r2", ">8000");
-                                } else {
-                                    cpuz80_2op("LD", "A", "$80");
-                                }
-                                generic_call("sn76489_freq");
+                        } else if (lex == C_NAME && strcmp(name, "OFF") == 0) {
+                            get_lex();
+                            if (target == CPU_Z80) {
+                                cpuz80_1op("CALL", "turn_off_fm");
+                                cpuz80_1op("XOR", "A");
+                                cpuz80_2op("LD", "(fm_enabled)", "A");
                             }
-                            if (lex == C_COMMA) {
+                        } else {
+                            emit_error("syntax error in PLAY FM");
+                        }
+                    } else if (strcmp(name, "INSTRUMENT") == 0) {
+                        get_lex();
+                        if (machine != MSX && machine != MSX2 && machine != SMS)
+                            emit_warning("PLAY INSTRUMENT only allowed for MSX/MSX2/SMS");
+                        if (lex == C_NAME && keyword == K_VARPTR) {
+                            struct node *source = NULL;
+
+                            source = evaluate_save_expression(1, TYPE_16);  /* CPU address (variable) */
+                            node_generate(source, 0);
+                            if (target == CPU_Z80)
+                                cpuz80_1op("CALL", "program_fm");
+                        } else {
+                            type = evaluate_expression(1, TYPE_8, 0);
+                            if (target == CPU_Z80)
+                                cpuz80_2op("LD", "(fm_inst)", "A");
+                            if (lex != C_COMMA)
+                                emit_error("missing comma");
+                            else
                                 get_lex();
-                                type = evaluate_expression(1, TYPE_8, 0);
-                                if (target == CPU_6502) {
-                                    cpu6502_1op("LDX", "#144");
-                                } else if (target == CPU_9900) {
-                                    cpu9900_2op("li", "r2", ">9000");
-                                } else {
-                                    cpuz80_2op("LD", "B", "$90");
-                                }
-                                generic_call("sn76489_vol");
-                            }
-                            break;
-                        case 1:
-                            get_lex();
-                            if (lex != C_COMMA) {
-                                emit_error("missing comma in sound");
-                            } else {
+                            type = evaluate_expression(1, TYPE_8, 0);
+                            if (target == CPU_Z80)
+                                cpuz80_2op("LD", "(fm_inst+1)", "A");
+                            if (lex != C_COMMA)
+                                emit_error("missing comma");
+                            else
                                 get_lex();
-                            }
-                            if (lex != C_COMMA) {
-                                type = evaluate_expression(1, TYPE_16, 0);
-                                if (target == CPU_6502) {
-                                    cpu6502_1op("LDX", "#160");
-                                } else if (target == CPU_9900) {
-                                    cpu9900_2op("li", "r2", ">a000");
-                                } else {
-                                    cpuz80_2op("LD", "A", "$a0");
-                                }
-                                generic_call("sn76489_freq");
-                            }
-                            if (lex == C_COMMA) {
+                            type = evaluate_expression(1, TYPE_8, 0);
+                            if (target == CPU_Z80)
+                                cpuz80_2op("LD", "(fm_inst+2)", "A");
+                            if (lex != C_COMMA)
+                                emit_error("missing comma");
+                            else
                                 get_lex();
-                                type = evaluate_expression(1, TYPE_8, 0);
-                                if (target == CPU_6502) {
-                                    cpu6502_1op("LDX", "#176");
-                                } else if (target == CPU_9900) {
-                                    cpu9900_2op("li", "r2", ">b000");
-                                } else {
-                                    cpuz80_2op("LD", "B", "$b0");
-                                }
-                                generic_call("sn76489_vol");
-                            }
+                            type = evaluate_expression(1, TYPE_8, 0);
+                            if (target == CPU_Z80)
+                                cpuz80_2op("LD", "(fm_inst+3)", "A");
+                        }
+                    } else {
+                        struct label *label;
+                    
+                        label = label_search(name);
+                        if (label == NULL) {
+                            label = label_add(name);
+                        }
+                        label->used |= LABEL_USED;
+                        if (target == CPU_6502) {
+                            strcpy(temp, "#" LABEL_PREFIX);
+                            strcat(temp, name);
+                            cpu6502_1op("LDA", temp);
+                            strcat(temp, ">>8");
+                            cpu6502_1op("LDY", temp);
+                        } else if (target == CPU_9900) {
+                            strcpy(temp, LABEL_PREFIX);
+                            strcat(temp, name);
+                            cpu9900_2op("li", "r0", temp);
+                        } else {
+                            strcpy(temp, LABEL_PREFIX);
+                            strcat(temp, name);
+                            cpuz80_2op("LD", "HL", temp);
+                        }
+                        generic_call("music_play");
+                        get_lex();
+                    }
+                    break;
+                }
+                case K_MUSIC: {
+                    int arg;
+                    static int previous[4];
+                    unsigned int notes;
+                    int note;
+                    int c;
+                
+                    generic_dump();
+                    get_lex();
+                    notes = 0;
+                    arg = 0;
+                    while (1) {
+                        if (lex != C_NAME && lex != C_MINUS) {
+                            emit_error("bad syntax for MUSIC");
+                            break;
+                        }
+                        if (lex == C_MINUS) {
+                            /* Nothing to do */
+                        } else if (arg == 0 && strcmp(name, "REPEAT") == 0) {
+                            get_lex();
+                            notes = 0xfd;
                             break;
-                        case 2:
+                        } else if (arg == 0 && strcmp(name, "STOP") == 0) {
                             get_lex();
-                            if (lex != C_COMMA) {
-                                emit_error("missing comma in sound");
-                            } else {
-                                get_lex();
+                            notes = 0xfe;
+                            break;
+                        } else if (arg == 3) {
+                            if (name[0] != 'M' || name[1] < '1' || name[1] > '3') {
+                                emit_error("bad syntax for drum in MUSIC");
+                                break;
                             }
-                            if (lex != C_COMMA) {
-                                type = evaluate_expression(1, TYPE_16, 0);
-                                if (target == CPU_6502) {
-                                    cpu6502_1op("LDX", "#192");
-                                } else if (target == CPU_9900) {
-                                    cpu9900_2op("li", "r2", ">c000");
-                                } else {
-                                    cpuz80_2op("LD", "A", "$c0");
-                                }
-                                generic_call("sn76489_freq");
+                            notes |= (name[1] - '0') << ((arg & 3) * 8);
+                        } else if (strcmp(name, "S") == 0) {
+                            notes |= 0x3f << ((arg & 3) * 8);
+                        } else {
+                            notes |= previous[arg] << ((arg & 3) * 8);
+                            c = 0;
+                            switch (name[c++]) {
+                                case 'C': note = 0; break;
+                                case 'D': note = 2; break;
+                                case 'E': note = 4; break;
+                                case 'F': note = 5; break;
+                                case 'G': note = 7; break;
+                                case 'A': note = 9; break;
+                                case 'B': note = 11; break;
+                                default:
+                                    note = 0;
+                                    emit_error("bad syntax for note in MUSIC");
+                                    break;
                             }
-                            if (lex == C_COMMA) {
-                                get_lex();
-                                type = evaluate_expression(1, TYPE_8, 0);
-                                if (target == CPU_6502) {
-                                    cpu6502_1op("LDX", "#208");
-                                } else if (target == CPU_9900) {
-                                    cpu9900_2op("li", "r2", ">d000");
-                                } else {
-                                    cpuz80_2op("LD", "B", "$d0");
-                                }
-                                generic_call("sn76489_vol");
+                            switch (name[c++]) {
+                                case '2': note += 0 * 12; break;
+                                case '3': note += 1 * 12; break;
+                                case '4': note += 2 * 12; break;
+                                case '5': note += 3 * 12; break;
+                                case '6': note += 4 * 12; break;
+                                case '7': if (note == 0) { note += 5 * 12; break; }
+                                default:
+                                    emit_error("bad syntax for note in MUSIC");
+                                    break;
                             }
-                            break;
-                        case 3:
-                            get_lex();
-                            if (lex != C_COMMA) {
-                                emit_error("missing comma in sound");
-                            } else {
-                                get_lex();
+                            note++;
+                            if (name[c] == '#') {
+                                note++;
+                                c++;
                             }
-                            if (lex != C_COMMA) {
-                                type = evaluate_expression(1, TYPE_8, 0);
-                                generic_call("sn76489_control");
+                            if (name[c] == 'W') {
+                                previous[arg] = 0x00;
+                                notes &= ~(0xc0 << ((arg & 3) * 8));
+                                notes |= previous[arg] << ((arg & 3) * 8);
+                            } else if (name[c] == 'X') {
+                                previous[arg] = 0x40;
+                                notes &= ~(0xc0 << ((arg & 3) * 8));
+                                notes |= previous[arg] << ((arg & 3) * 8);
+                            } else if (name[c] == 'Y') {
+                                previous[arg] = 0x80;
+                                notes &= ~(0xc0 << ((arg & 3) * 8));
+                                notes |= previous[arg] << ((arg & 3) * 8);
+                            } else if (name[c] == 'Z') {
+                                previous[arg] = 0xc0;
+                                notes &= ~(0xc0 << ((arg & 3) * 8));
+                                notes |= previous[arg] << ((arg & 3) * 8);
                             }
-                            if (lex == C_COMMA) {
+                            notes |= note << ((arg & 3) * 8);
+                        }
+                        get_lex();
+                        arg++;
+                        if (lex != C_COMMA)
+                            break;
+                        if (arg == 4) {
+                            emit_error("too many arguments for MUSIC");
+                            break;
+                        }
+                        get_lex();
+                    }
+                    if (target == CPU_9900) {
+                        inst_printf("\tbyte >%02x,>%02x,>%02x,>%02x\n", notes & 0xff, (notes >> 8) & 0xff, (notes >> 16) & 0xff, (notes >> 24) & 0xff);
+                    } else {
+                        inst_printf("\tdb $%02x,$%02x,$%02x,$%02x\n", notes & 0xff, (notes >> 8) & 0xff, (notes >> 16) & 0xff, (notes >> 24) & 0xff);
+                    }
+                    break;
+                }
+                case K_SOUND:
+                    get_lex();
+                    if (lex != C_NUM) {
+                        emit_error("syntax error in SOUND");
+                    } else {
+                        if (value < 10 && machine == NES) {
+                            emit_warning("using SOUND 0-9 with NES/Famicom target");
+                        } else if (value >= 0 && value <= 4 && (machine == MSX || machine == MSX2 || machine == SVI || machine == EINSTEIN || machine == NABU)) {
+                            emit_warning("using SOUND 0-3 with AY-3-8910 target");
+                        } else if (value >= 5 && value <= 9 && machine != MSX && machine != MSX2 && machine != COLECOVISION_SGM && machine != SVI && machine != SORD && machine != MEMOTECH && machine != NABU) {
+                            emit_warning("using SOUND 5-9 with SN76489 target");
+                        }
+                        switch (value) {
+                            /* Sound handling for SN76489 */
+                            case 0:
                                 get_lex();
-                                type = evaluate_expression(1, TYPE_8, 0);
-                                if (target == CPU_6502) {
-                                    cpu6502_1op("LDX", "#240");
-                                } else if (target == CPU_9900) {
-                                    cpu9900_2op("li", "r2", ">f000");
+                                if (lex != C_COMMA) {
+                                    emit_error("missing comma in sound");
                                 } else {
-                                    cpuz80_2op("LD", "B", "$f0");
+                                    get_lex();
                                 }
-                                generic_call("sn76489_vol");
-                            }
-                            break;
-                        /* Sound handling for AY-3-8910 */
-                        case 5:
-                            get_lex();
-                            if (lex != C_COMMA) {
-                                emit_error("missing comma in sound");
-                            } else {
+                                if (lex != C_COMMA) {
+                                    type = evaluate_expression(1, TYPE_16, 0);
+                                    if (target == CPU_6502) {
+                                        cpu6502_1op("LDX", "#128");
+                                    } else if (target == CPU_9900) {
+                                        cpu9900_2op("li", "r2", ">8000");
+                                    } else {
+                                        cpuz80_2op("LD", "A", "$80");
+                                    }
+                                    generic_call("sn76489_freq");
+                                }
+                                if (lex == C_COMMA) {
+                                    get_lex();
+                                    type = evaluate_expression(1, TYPE_8, 0);
+                                    if (target == CPU_6502) {
+                                        cpu6502_1op("LDX", "#144");
+                                    } else if (target == CPU_9900) {
+                                        cpu9900_2op("li", "r2", ">9000");
+                                    } else {
+                                        cpuz80_2op("LD", "B", "$90");
+                                    }
+                                    generic_call("sn76489_vol");
+                                }
+                                break;
+                            case 1:
                                 get_lex();
-                            }
-                            if (lex != C_COMMA) {
-                                type = evaluate_expression(1, TYPE_16, 0);
-                                if (target == CPU_6502) {
-                                    /* Nothing to do */
-                                } else if (target == CPU_9900) {
-                                    /* Nothing to do - could consider SID Blaster... */
+                                if (lex != C_COMMA) {
+                                    emit_error("missing comma in sound");
                                 } else {
-                                    cpuz80_2op("LD", "A", "$00");
-                                    cpuz80_1op("CALL", "ay3_freq");
+                                    get_lex();
                                 }
-                            }
-                            if (lex == C_COMMA) {
+                                if (lex != C_COMMA) {
+                                    type = evaluate_expression(1, TYPE_16, 0);
+                                    if (target == CPU_6502) {
+                                        cpu6502_1op("LDX", "#160");
+                                    } else if (target == CPU_9900) {
+                                        cpu9900_2op("li", "r2", ">a000");
+                                    } else {
+                                        cpuz80_2op("LD", "A", "$a0");
+                                    }
+                                    generic_call("sn76489_freq");
+                                }
+                                if (lex == C_COMMA) {
+                                    get_lex();
+                                    type = evaluate_expression(1, TYPE_8, 0);
+                                    if (target == CPU_6502) {
+                                        cpu6502_1op("LDX", "#176");
+                                    } else if (target == CPU_9900) {
+                                        cpu9900_2op("li", "r2", ">b000");
+                                    } else {
+                                        cpuz80_2op("LD", "B", "$b0");
+                                    }
+                                    generic_call("sn76489_vol");
+                                }
+                                break;
+                            case 2:
                                 get_lex();
-                                type = evaluate_expression(1, TYPE_8, 0);
-                                if (target == CPU_6502) {
-                                    /* Nothing to do */
-                                } else if (target == CPU_9900) {
-                                    /* Nothing to do - could consider SID Blaster... */
+                                if (lex != C_COMMA) {
+                                    emit_error("missing comma in sound");
                                 } else {
-                                    cpuz80_2op("LD", "B", "$08");
-                                    cpuz80_1op("CALL", "ay3_reg");
+                                    get_lex();
                                 }
-                            }
-                            break;
-                        case 6:
-                            get_lex();
-                            if (lex != C_COMMA) {
-                                emit_error("missing comma in sound");
-                            } else {
+                                if (lex != C_COMMA) {
+                                    type = evaluate_expression(1, TYPE_16, 0);
+                                    if (target == CPU_6502) {
+                                        cpu6502_1op("LDX", "#192");
+                                    } else if (target == CPU_9900) {
+                                        cpu9900_2op("li", "r2", ">c000");
+                                    } else {
+                                        cpuz80_2op("LD", "A", "$c0");
+                                    }
+                                    generic_call("sn76489_freq");
+                                }
+                                if (lex == C_COMMA) {
+                                    get_lex();
+                                    type = evaluate_expression(1, TYPE_8, 0);
+                                    if (target == CPU_6502) {
+                                        cpu6502_1op("LDX", "#208");
+                                    } else if (target == CPU_9900) {
+                                        cpu9900_2op("li", "r2", ">d000");
+                                    } else {
+                                        cpuz80_2op("LD", "B", "$d0");
+                                    }
+                                    generic_call("sn76489_vol");
+                                }
+                                break;
+                            case 3:
                                 get_lex();
-                            }
-                            if (lex != C_COMMA) {
-                                type = evaluate_expression(1, TYPE_16, 0);
-                                if (target == CPU_6502) {
-                                    /* Nothing to do */
-                                } else if (target == CPU_9900) {
-                                    /* Nothing to do - could consider SID Blaster... */
+                                if (lex != C_COMMA) {
+                                    emit_error("missing comma in sound");
                                 } else {
-                                    cpuz80_2op("LD", "A", "$02");
-                                    cpuz80_1op("CALL", "ay3_freq");
+                                    get_lex();
                                 }
-                            }
-                            if (lex == C_COMMA) {
+                                if (lex != C_COMMA) {
+                                    type = evaluate_expression(1, TYPE_8, 0);
+                                    generic_call("sn76489_control");
+                                }
+                                if (lex == C_COMMA) {
+                                    get_lex();
+                                    type = evaluate_expression(1, TYPE_8, 0);
+                                    if (target == CPU_6502) {
+                                        cpu6502_1op("LDX", "#240");
+                                    } else if (target == CPU_9900) {
+                                        cpu9900_2op("li", "r2", ">f000");
+                                    } else {
+                                        cpuz80_2op("LD", "B", "$f0");
+                                    }
+                                    generic_call("sn76489_vol");
+                                }
+                                break;
+                            /* Sound handling for AY-3-8910 */
+                            case 5:
                                 get_lex();
-                                type = evaluate_expression(1, TYPE_8, 0);
-                                if (target == CPU_6502) {
-                                    /* Nothing to do */
-                                } else if (target == CPU_9900) {
-                                    /* Nothing to do - could consider SID Blaster... */
+                                if (lex != C_COMMA) {
+                                    emit_error("missing comma in sound");
                                 } else {
-                                    cpuz80_2op("LD", "B", "$09");
-                                    cpuz80_1op("CALL", "ay3_reg");
+                                    get_lex();
                                 }
-                            }
-                            break;
-                        case 7:
-                            get_lex();
-                            if (lex != C_COMMA) {
-                                emit_error("missing comma in sound");
-                            } else {
+                                if (lex != C_COMMA) {
+                                    type = evaluate_expression(1, TYPE_16, 0);
+                                    if (target == CPU_6502) {
+                                        /* Nothing to do */
+                                    } else if (target == CPU_9900) {
+                                        /* Nothing to do - could consider SID Blaster... */
+                                    } else {
+                                        cpuz80_2op("LD", "A", "$00");
+                                        cpuz80_1op("CALL", "ay3_freq");
+                                    }
+                                }
+                                if (lex == C_COMMA) {
+                                    get_lex();
+                                    type = evaluate_expression(1, TYPE_8, 0);
+                                    if (target == CPU_6502) {
+                                        /* Nothing to do */
+                                    } else if (target == CPU_9900) {
+                                        /* Nothing to do - could consider SID Blaster... */
+                                    } else {
+                                        cpuz80_2op("LD", "B", "$08");
+                                        cpuz80_1op("CALL", "ay3_reg");
+                                    }
+                                }
+                                break;
+                            case 6:
                                 get_lex();
-                            }
-                            if (lex != C_COMMA) {
-                                type = evaluate_expression(1, TYPE_16, 0);
-                                if (target == CPU_6502) {
-                                    /* Nothing to do */
-                                } else if (target == CPU_9900) {
-                                    /* Nothing to do - could consider SID Blaster... */
+                                if (lex != C_COMMA) {
+                                    emit_error("missing comma in sound");
                                 } else {
-                                    cpuz80_2op("LD", "A", "$04");
-                                    cpuz80_1op("CALL", "ay3_freq");
+                                    get_lex();
                                 }
-                            }
-                            if (lex == C_COMMA) {
+                                if (lex != C_COMMA) {
+                                    type = evaluate_expression(1, TYPE_16, 0);
+                                    if (target == CPU_6502) {
+                                        /* Nothing to do */
+                                    } else if (target == CPU_9900) {
+                                        /* Nothing to do - could consider SID Blaster... */
+                                    } else {
+                                        cpuz80_2op("LD", "A", "$02");
+                                        cpuz80_1op("CALL", "ay3_freq");
+                                    }
+                                }
+                                if (lex == C_COMMA) {
+                                    get_lex();
+                                    type = evaluate_expression(1, TYPE_8, 0);
+                                    if (target == CPU_6502) {
+                                        /* Nothing to do */
+                                    } else if (target == CPU_9900) {
+                                        /* Nothing to do - could consider SID Blaster... */
+                                    } else {
+                                        cpuz80_2op("LD", "B", "$09");
+                                        cpuz80_1op("CALL", "ay3_reg");
+                                    }
+                                }
+                                break;
+                            case 7:
                                 get_lex();
-                                type = evaluate_expression(1, TYPE_8, 0);
-                                if (target == CPU_6502) {
-                                    /* Nothing to do */
-                                } else if (target == CPU_9900) {
-                                    /* Nothing to do - could consider SID Blaster... */
+                                if (lex != C_COMMA) {
+                                    emit_error("missing comma in sound");
                                 } else {
-                                    cpuz80_2op("LD", "B", "$0a");
-                                    cpuz80_1op("CALL", "ay3_reg");
+                                    get_lex();
                                 }
-                            }
-                            break;
-                        case 8:
-                            get_lex();
-                            if (lex != C_COMMA) {
-                                emit_error("missing comma in sound");
-                            } else {
+                                if (lex != C_COMMA) {
+                                    type = evaluate_expression(1, TYPE_16, 0);
+                                    if (target == CPU_6502) {
+                                        /* Nothing to do */
+                                    } else if (target == CPU_9900) {
+                                        /* Nothing to do - could consider SID Blaster... */
+                                    } else {
+                                        cpuz80_2op("LD", "A", "$04");
+                                        cpuz80_1op("CALL", "ay3_freq");
+                                    }
+                                }
+                                if (lex == C_COMMA) {
+                                    get_lex();
+                                    type = evaluate_expression(1, TYPE_8, 0);
+                                    if (target == CPU_6502) {
+                                        /* Nothing to do */
+                                    } else if (target == CPU_9900) {
+                                        /* Nothing to do - could consider SID Blaster... */
+                                    } else {
+                                        cpuz80_2op("LD", "B", "$0a");
+                                        cpuz80_1op("CALL", "ay3_reg");
+                                    }
+                                }
+                                break;
+                            case 8:
                                 get_lex();
-                            }
-                            if (lex != C_COMMA) {
-                                type = evaluate_expression(1, TYPE_16, 0);
-                                if (target == CPU_6502) {
-                                    /* Nothing to do */
-                                } else if (target == CPU_9900) {
-                                    /* Nothing to do */
+                                if (lex != C_COMMA) {
+                                    emit_error("missing comma in sound");
                                 } else {
-                                    cpuz80_2op("LD", "A", "$0b");
-                                    cpuz80_1op("CALL", "ay3_freq");
+                                    get_lex();
                                 }
-                            }
-                            if (lex == C_COMMA) {
+                                if (lex != C_COMMA) {
+                                    type = evaluate_expression(1, TYPE_16, 0);
+                                    if (target == CPU_6502) {
+                                        /* Nothing to do */
+                                    } else if (target == CPU_9900) {
+                                        /* Nothing to do */
+                                    } else {
+                                        cpuz80_2op("LD", "A", "$0b");
+                                        cpuz80_1op("CALL", "ay3_freq");
+                                    }
+                                }
+                                if (lex == C_COMMA) {
+                                    get_lex();
+                                    type = evaluate_expression(1, TYPE_8, 0);
+                                    if (target == CPU_6502) {
+                                        /* Nothing to do */
+                                    } else if (target == CPU_9900) {
+                                        /* Nothing to do */
+                                    } else {
+                                        cpuz80_2op("LD", "B", "$0d");
+                                        cpuz80_1op("CALL", "ay3_reg");
+                                    }
+                                }
+                                break;
+                            case 9:
                                 get_lex();
-                                type = evaluate_expression(1, TYPE_8, 0);
-                                if (target == CPU_6502) {
-                                    /* Nothing to do */
-                                } else if (target == CPU_9900) {
-                                    /* Nothing to do */
+                                if (lex != C_COMMA) {
+                                    emit_error("missing comma in sound");
                                 } else {
-                                    cpuz80_2op("LD", "B", "$0d");
-                                    cpuz80_1op("CALL", "ay3_reg");
+                                    get_lex();
                                 }
-                            }
-                            break;
-                        case 9:
-                            get_lex();
-                            if (lex != C_COMMA) {
-                                emit_error("missing comma in sound");
-                            } else {
+                                if (lex != C_COMMA) {
+                                    type = evaluate_expression(1, TYPE_8, 0);
+                                    if (target == CPU_6502) {
+                                        /* Nothing to do */
+                                    } else if (target == CPU_9900) {
+                                        /* Nothing to do */
+                                    } else {
+                                        cpuz80_2op("LD", "B", "$06");
+                                        cpuz80_1op("CALL", "ay3_reg");
+                                    }
+                                }
+                                if (lex == C_COMMA) {
+                                    get_lex();
+                                    type = evaluate_expression(1, TYPE_8, 0);
+                                    if (target == CPU_6502) {
+                                        /* Nothing to do */
+                                    } else if (target == CPU_9900) {
+                                        /* Nothing to do */
+                                    } else {
+                                        cpuz80_1op("AND", "$3f");
+                                        if (machine == EINSTEIN || machine == NABU) {
+                                            cpuz80_1op("OR", "$40");
+                                        } else {
+                                            /* Protect these MSX1/MSX2 machines! */
+                                            cpuz80_1op("OR", "$80");
+                                        }
+                                        cpuz80_2op("LD", "B", "$07");
+                                        cpuz80_1op("CALL", "ay3_reg");
+                                    }
+                                }
+                                break;
+                            /* Sound handling for NES */
+                            case 10:
                                 get_lex();
-                            }
-                            if (lex != C_COMMA) {
-                                type = evaluate_expression(1, TYPE_8, 0);
-                                if (target == CPU_6502) {
-                                    /* Nothing to do */
-                                } else if (target == CPU_9900) {
-                                    /* Nothing to do */
+                                if (lex != C_COMMA) {
+                                    emit_error("missing comma in sound");
                                 } else {
-                                    cpuz80_2op("LD", "B", "$06");
-                                    cpuz80_1op("CALL", "ay3_reg");
+                                    get_lex();
                                 }
-                            }
-                            if (lex == C_COMMA) {
+                                if (lex != C_COMMA) {
+                                    type = evaluate_expression(1, TYPE_16, 0);
+                                    if (machine == NES) {
+                                        cpu6502_1op("STA", "$4002");
+                                        cpu6502_1op("STY", "$4003");
+                                    }
+                                }
+                                if (lex == C_COMMA) {
+                                    get_lex();
+                                    type = evaluate_expression(1, TYPE_8, 0);
+                                    if (machine == NES) {
+                                        cpu6502_1op("STA", "$4000");
+                                    }
+                                }
+                                if (lex == C_COMMA) {
+                                    get_lex();
+                                    type = evaluate_expression(1, TYPE_8, 0);
+                                    if (machine == NES) {
+                                        cpu6502_1op("STA", "$4001");
+                                    }
+                                }
+                                break;
+                            case 11:
                                 get_lex();
-                                type = evaluate_expression(1, TYPE_8, 0);
-                                if (target == CPU_6502) {
-                                    /* Nothing to do */
-                                } else if (target == CPU_9900) {
-                                    /* Nothing to do */
+                                if (lex != C_COMMA) {
+                                    emit_error("missing comma in sound");
                                 } else {
-                                    cpuz80_1op("AND", "$3f");
-                                    if (machine == EINSTEIN || machine == NABU) {
-                                        cpuz80_1op("OR", "$40");
-                                    } else {
-                                        /* Protect these MSX1/MSX2 machines! */
-                                        cpuz80_1op("OR", "$80");
+                                    get_lex();
+                                }
+                                if (lex != C_COMMA) {
+                                    type = evaluate_expression(1, TYPE_16, 0);
+                                    if (machine == NES) {
+                                        cpu6502_1op("STA", "$4006");
+                                        cpu6502_1op("STY", "$4007");
                                     }
-                                    cpuz80_2op("LD", "B", "$07");
-                                    cpuz80_1op("CALL", "ay3_reg");
                                 }
-                            }
-                            break;
-                        /* Sound handling for NES */
-                        case 10:
-                            get_lex();
-                            if (lex != C_COMMA) {
-                                emit_error("missing comma in sound");
-                            } else {
-                                get_lex();
-                            }
-                            if (lex != C_COMMA) {
-                                type = evaluate_expression(1, TYPE_16, 0);
-                                if (machine == NES) {
-                                    cpu6502_1op("STA", "$4002");
-                                    cpu6502_1op("STY", "$4003");
+                                if (lex == C_COMMA) {
+                                    get_lex();
+                                    type = evaluate_expression(1, TYPE_8, 0);
+                                    if (machine == NES) {
+                                        cpu6502_1op("STA", "$4004");
+                                    }
                                 }
-                            }
-                            if (lex == C_COMMA) {
-                                get_lex();
-                                type = evaluate_expression(1, TYPE_8, 0);
-                                if (machine == NES) {
-                                    cpu6502_1op("STA", "$4000");
+                                if (lex == C_COMMA) {
+                                    get_lex();
+                                    type = evaluate_expression(1, TYPE_8, 0);
+                                    if (machine == NES) {
+                                        cpu6502_1op("STA", "$4005");
+                                    }
                                 }
-                            }
-                            if (lex == C_COMMA) {
+                                break;
+                            case 12:
                                 get_lex();
-                                type = evaluate_expression(1, TYPE_8, 0);
-                                if (machine == NES) {
-                                    cpu6502_1op("STA", "$4001");
+                                if (lex != C_COMMA) {
+                                    emit_error("missing comma in sound");
+                                } else {
+                                    get_lex();
                                 }
-                            }
-                            break;
-                        case 11:
-                            get_lex();
-                            if (lex != C_COMMA) {
-                                emit_error("missing comma in sound");
-                            } else {
-                                get_lex();
-                            }
-                            if (lex != C_COMMA) {
-                                type = evaluate_expression(1, TYPE_16, 0);
-                                if (machine == NES) {
-                                    cpu6502_1op("STA", "$4006");
-                                    cpu6502_1op("STY", "$4007");
+                                if (lex != C_COMMA) {
+                                    type = evaluate_expression(1, TYPE_16, 0);
+                                    if (machine == NES) {
+                                        cpu6502_1op("STA", "$400a");
+                                        cpu6502_1op("STY", "$400b");
+                                    }
                                 }
-                            }
-                            if (lex == C_COMMA) {
-                                get_lex();
-                                type = evaluate_expression(1, TYPE_8, 0);
-                                if (machine == NES) {
-                                    cpu6502_1op("STA", "$4004");
+                                if (lex == C_COMMA) {
+                                    get_lex();
+                                    type = evaluate_expression(1, TYPE_8, 0);
+                                    if (machine == NES) {
+                                        cpu6502_1op("STA", "$4008");
+                                    }
                                 }
-                            }
-                            if (lex == C_COMMA) {
+                                break;
+                            case 14:
                                 get_lex();
-                                type = evaluate_expression(1, TYPE_8, 0);
-                                if (machine == NES) {
-                                    cpu6502_1op("STA", "$4005");
+                                if (lex != C_COMMA) {
+                                    emit_error("missing comma in sound");
+                                } else {
+                                    get_lex();
                                 }
-                            }
-                            break;
-                        case 12:
-                            get_lex();
-                            if (lex != C_COMMA) {
-                                emit_error("missing comma in sound");
-                            } else {
-                                get_lex();
-                            }
-                            if (lex != C_COMMA) {
-                                type = evaluate_expression(1, TYPE_16, 0);
-                                if (machine == NES) {
-                                    cpu6502_1op("STA", "$400a");
-                                    cpu6502_1op("STY", "$400b");
+                                if (lex != C_COMMA) {
+                                    type = evaluate_expression(1, TYPE_16, 0);
+                                    if (machine == NES) {
+                                        cpu6502_1op("STA", "$400e");
+                                        cpu6502_1op("STY", "$400f");
+                                    }
                                 }
-                            }
-                            if (lex == C_COMMA) {
-                                get_lex();
-                                type = evaluate_expression(1, TYPE_8, 0);
-                                if (machine == NES) {
-                                    cpu6502_1op("STA", "$4008");
+                                if (lex == C_COMMA) {
+                                    get_lex();
+                                    type = evaluate_expression(1, TYPE_8, 0);
+                                    if (machine == NES) {
+                                        cpu6502_1op("STA", "$400c");
+                                    }
                                 }
-                            }
-                            break;
-                        case 14:
-                            get_lex();
-                            if (lex != C_COMMA) {
-                                emit_error("missing comma in sound");
-                            } else {
+                                break;
+                            case 15:
                                 get_lex();
-                            }
-                            if (lex != C_COMMA) {
-                                type = evaluate_expression(1, TYPE_16, 0);
-                                if (machine == NES) {
-                                    cpu6502_1op("STA", "$400e");
-                                    cpu6502_1op("STY", "$400f");
+                                if (lex != C_COMMA) {
+                                    emit_error("missing comma in sound");
+                                } else {
+                                    get_lex();
                                 }
-                            }
-                            if (lex == C_COMMA) {
-                                get_lex();
                                 type = evaluate_expression(1, TYPE_8, 0);
                                 if (machine == NES) {
-                                    cpu6502_1op("STA", "$400c");
+                                    cpu6502_1op("STA", "$4015");
                                 }
-                            }
-                            break;
-                        case 15:
-                            get_lex();
-                            if (lex != C_COMMA) {
-                                emit_error("missing comma in sound");
-                            } else {
-                                get_lex();
-                            }
-                            type = evaluate_expression(1, TYPE_8, 0);
-                            if (machine == NES) {
-                                cpu6502_1op("STA", "$4015");
-                            }
-                            break;
-                        default:
-                            emit_error("SOUND with unhandled channel number");
-                            break;
+                                break;
+                            default:
+                                emit_error("SOUND with unhandled channel number");
+                                break;
+                        }
                     }
-                }
-            } else if (strcmp(name, "CALL") == 0) {        /* Call assembly language */
-                struct node *tree;
+                    break;
+                case K_CALL: { /* Call assembly language */
+                    struct node *tree;
                 
-                get_lex();
-                tree = process_usr(1);
-                node_label(tree);
-                node_generate(tree, 0);
-                node_delete(tree);
-            } else if (strcmp(name, "ASM") == 0) {  /* ASM statement for inserting assembly code */
-                int c;
+                    get_lex();
+                    tree = process_usr(1);
+                    node_label(tree);
+                    node_generate(tree, 0);
+                    break;
+                }
+                case K_ASM: { /* ASM statement for inserting assembly code */
+                    int c;
                 
-                generic_dump();
-                c = line_pos;
-                while (c < line_size && isspace(line[c]))
-                    c++;
-                while (c < line_size && !isspace(line[c]))
-                    c++;
-                if (line[c - 1] == ':')
-                    lex_skip_spaces();
-                if (target == CPU_9900) {
-                    /* check for and remap INCBIN */
-                    if (strncmp(&line[line_pos]," INCBIN", 7) == 0) {
-                        memcpy(&line[line_pos],"  bcopy", 7);
+                    assembler_used = 1;
+                    generic_dump();
+                    c = line_pos;
+                    while (c < line_size && isspace(line[c]))
+                        c++;
+                    while (c < line_size && !isspace(line[c]))
+                        c++;
+                    if (line[c - 1] == ':')
+                        lex_skip_spaces();
+                    if (target == CPU_9900) {
+                        /* check for and remap INCBIN */
+                        if (strncmp(&line[line_pos]," INCBIN", 7) == 0) {
+                            memcpy(&line[line_pos],"  bcopy", 7);
+                        }
                     }
+                    inst_printf("%s\n", &line[line_pos]);
+                    line_pos = line_size;
+                    get_lex();
+                    break;
                 }
-                fprintf(output, "%s\n", &line[line_pos]);
-                line_pos = line_size;
-                get_lex();
-            } else if (strcmp(name, "BANK") == 0) {
-                get_lex();
-                if (lex == C_NAME && strcmp(name, "ROM") == 0) {
+                case K_BANK:
                     get_lex();
-                    if (lex != C_NUM) {
-                        emit_error("Bad syntax for BANK ROM");
-                    } else if (value != 128 && value != 256 && value != 512 && value != 1024) {
-                        /* TODO: TI can do 2MB as it stands, and 32MB with the scheme. But leaving at 1MB for now. */
-                        emit_error("BANK ROM not 128, 256, 512 or 1024");
+                    if (lex == C_NAME && strcmp(name, "ROM") == 0) {
                         get_lex();
-                    } else if (bank_switching != 0) {
-                        emit_error("BANK ROM used twice");
-                        get_lex();
-                    } else {
-                        if (machine == SVI || machine == SORD || machine == MEMOTECH || machine == CREATIVISION || machine == EINSTEIN || machine == PV2000) {
-                            emit_error("Bank-switching not supported with current platform");
-                        } else if (machine == NES && (value == 128 || value == 1024)) {
-                            emit_error("NES/Famicom only supports 256 or 512 k ROM size");
+                        if (lex != C_NUM) {
+                            emit_error("Bad syntax for BANK ROM");
+                        } else if (value != 128 && value != 256 && value != 512 && value != 1024) {
+                            /* TODO: TI can do 2MB as it stands, and 32MB with the scheme. But leaving at 1MB for now. */
+                            emit_error("BANK ROM not 128, 256, 512 or 1024");
+                            get_lex();
+                        } else if (bank_switching != 0) {
+                            emit_error("BANK ROM used twice");
+                            get_lex();
                         } else {
-                            bank_switching = 1;
-                            bank_rom_size = value;
-                            bank_current = 0;
+                            if (machine == SVI || machine == SORD || machine == MEMOTECH || machine == CREATIVISION || machine == EINSTEIN || machine == PV2000) {
+                                emit_error("Bank-switching not supported with current platform");
+                            } else if (machine == NES && (value == 128 || value == 1024)) {
+                                emit_error("NES/Famicom only supports 256 or 512 k ROM size");
+                            } else {
+                                bank_switching = 1;
+                                bank_rom_size = value;
+                                bank_current = 0;
+                            }
+                            get_lex();
                         }
-                        get_lex();
-                    }
-                } else if (lex == C_NAME && strcmp(name, "SELECT") == 0) {
-                    int c;
-                    struct node *tree;
-                    int type;
+                    } else if (lex == C_NAME && keyword == K_SELECT) {
+                        int c;
+                        struct node *tree;
+                        int type;
                     
-                    get_lex();
-                    tree = evaluate_level_0(&type);
-                    if (tree->type != N_NUM8 && tree->type != N_NUM16) {
-                        emit_error("not a constant expression in BANK SELECT");
-                        node_delete(tree);
-                        break;
-                    }
-                    c = tree->value;
-                    node_delete(tree);
-                    if (bank_switching == 0) {
-                        emit_error("Using BANK SELECT without BANK ROM");
-                    } else {
-                        if (machine == TI994A) {
-                            /* the TI needs to use 8k banks, so our masks are different */
-                            c += 2;   /* reserving 3 banks (0,1,2) for 'fixed' space */
-
-                            if (bank_rom_size == 128)
-                                c &= 0x0f;
-                            else if (bank_rom_size == 256)
-                                c &= 0x1f;
-                            else if (bank_rom_size == 512)
-                                c &= 0x3f;
-                            else
-                                c &= 0x7f;
-                            
-                            c = 0x6000+(c*2);   /* ROM address to poke */
-                            sprintf(temp, "@>%x", c);
-                            cpu9900_1op("clr", temp);
+                        get_lex();
+                        tree = evaluate_level_0(&type);
+                        if (tree->type != N_NUM8 && tree->type != N_NUM16) {
+                            emit_error("not a constant expression in BANK SELECT");
+                            return;
+                        }
+                        c = tree->value;
+                        if (bank_switching == 0) {
+                            emit_error("Using BANK SELECT without BANK ROM");
                         } else {
-                            if (machine == COLECOVISION || machine == COLECOVISION_SGM)
-                                c--;
-                            if (machine == NES) {
-                                c = (c & 0xe0) | ((c - 1) & 0x1f);
-                                if ((bank_rom_size == 256 && (c & 0x0f) >= 0x0d) || (bank_rom_size == 512 && (c & 0x1f) >= 0x1d)) {
-                                    emit_warning("Selecting bank reserved for CHRROM data");
-                                }
-                            } else {
+                            if (machine == TI994A) {
+                                /* the TI needs to use 8k banks, so our masks are different */
+                                c += 2;   /* reserving 3 banks (0,1,2) for 'fixed' space */
+
                                 if (bank_rom_size == 128)
-                                    c &= 0x07;
-                                else if (bank_rom_size == 256)
                                     c &= 0x0f;
-                                else if (bank_rom_size == 512)
+                                else if (bank_rom_size == 256)
                                     c &= 0x1f;
-                                else
+                                else if (bank_rom_size == 512)
                                     c &= 0x3f;
-                            }
-                            if (machine == SG1000 || machine == SMS) {
-                                sprintf(temp, "%d", c);
-                                cpuz80_2op("LD", "A", temp);
-                                cpuz80_2op("LD", "($fffe)", "A");
-                            } else if (machine == MSX || machine == MSX2) {
-                                if (bank_konami) {
-                                    sprintf(temp, "%d", c * 2);
-                                    cpuz80_noop("DI");
-                                    cpuz80_2op("LD", "A", temp);
-                                    cpuz80_2op("LD", "($8000)", "A");
-                                    cpuz80_1op("INC", "A");
-                                    cpuz80_2op("LD", "($a000)", "A");
-                                    cpuz80_noop("EI");
+                                else
+                                    c &= 0x7f;
+                            
+                                c = 0x6000+(c*2);   /* ROM address to poke */
+                                sprintf(temp, "@>%x", c);
+                                cpu9900_1op("clr", temp);
+                            } else {
+                                if (machine == COLECOVISION || machine == COLECOVISION_SGM)
+                                    c--;
+                                if (machine == NES) {
+                                    c = (c & 0xe0) | ((c - 1) & 0x1f);
+                                    if ((bank_rom_size == 256 && (c & 0x0f) >= 0x0d) || (bank_rom_size == 512 && (c & 0x1f) >= 0x1d)) {
+                                        emit_warning("Selecting bank reserved for CHRROM data");
+                                    }
                                 } else {
+                                    if (bank_rom_size == 128)
+                                        c &= 0x07;
+                                    else if (bank_rom_size == 256)
+                                        c &= 0x0f;
+                                    else if (bank_rom_size == 512)
+                                        c &= 0x1f;
+                                    else
+                                        c &= 0x3f;
+                                }
+                                if (machine == SG1000 || machine == SMS) {
                                     sprintf(temp, "%d", c);
                                     cpuz80_2op("LD", "A", temp);
-                                    cpuz80_2op("LD", "($7000)", "A");
+                                    cpuz80_2op("LD", "($fffe)", "A");
+                                } else if (machine == MSX || machine == MSX2) {
+                                    if (bank_konami) {
+                                        sprintf(temp, "%d", c * 2);
+                                        cpuz80_noop("DI");
+                                        cpuz80_2op("LD", "A", temp);
+                                        cpuz80_2op("LD", "($8000)", "A");
+                                        cpuz80_1op("INC", "A");
+                                        cpuz80_2op("LD", "($a000)", "A");
+                                        cpuz80_noop("EI");
+                                    } else {
+                                        sprintf(temp, "%d", c);
+                                        cpuz80_2op("LD", "A", temp);
+                                        cpuz80_2op("LD", "($7000)", "A");
+                                    }
+                                } else if (machine == NES) {
+                                    sprintf(temp, "#%d", c);
+                                    cpu6502_1op("LDA", temp);
+                                    cpu6502_1op("ORA", "CHRRAM_BANK");
+                                    cpu6502_1op("STA", "BANKSEL");
+                                } else {
+                                    if (bank_rom_size == 128)
+                                        c |= 0xfff8;
+                                    else if (bank_rom_size == 256)
+                                        c |= 0xfff0;
+                                    else if (bank_rom_size == 512)
+                                        c |= 0xffe0;
+                                    else
+                                        c |= 0xffc0;
+                                    sprintf(temp, "($%04x)", c);
+                                    cpuz80_2op("LD", "A", temp);
                                 }
-                            } else if (machine == NES) {
-                                sprintf(temp, "#%d", c);
-                                cpu6502_1op("LDA", temp);
-                                cpu6502_1op("ORA", "CHRRAM_BANK");
-                                cpu6502_1op("STA", "BANKSEL");
-                            } else {
-                                if (bank_rom_size == 128)
-                                    c |= 0xfff8;
-                                else if (bank_rom_size == 256)
-                                    c |= 0xfff0;
-                                else if (bank_rom_size == 512)
-                                    c |= 0xffe0;
-                                else
-                                    c |= 0xffc0;
-                                sprintf(temp, "($%04x)", c);
-                                cpuz80_2op("LD", "A", temp);
                             }
                         }
-                    }
-                } else {
-                    int c;
-                    int d;
-                    struct node *tree;
-                    int type;
-
-                    tree = evaluate_level_0(&type);
-                    if (tree->type != N_NUM8 && tree->type != N_NUM16) {
-                        emit_error("not a constant expression in BANK");
-                        node_delete(tree);
-                        break;
-                    }
-                    c = tree->value;
-                    node_delete(tree);
-                    if (bank_switching == 0) {
-                        emit_error("Using BANK without BANK ROM");
                     } else {
-                        d = c;
-                        if (machine == TI994A) {
-                            /* the TI needs to use 8k banks, so our masks are different */
-                            c += 2;   /* reserving 3 banks (0,1,2) for 'fixed' space */
-
-                            if (bank_rom_size == 128)
-                                c &= 0x0f;
-                            else if (bank_rom_size == 256)
-                                c &= 0x1f;
-                            else if (bank_rom_size == 512)
-                                c &= 0x3f;
-                            else
-                                c &= 0x7f;
-                            bank_finish();
-                            
-                            sprintf(temp, "%d", c);
-                            cpu9900_1op("bank", temp);
-                            cpu9900_empty();
+                        int c;
+                        int d;
+                        struct node *tree;
+                        int type;
+
+                        tree = evaluate_level_0(&type);
+                        if (tree->type != N_NUM8 && tree->type != N_NUM16) {
+                            emit_error("not a constant expression in BANK");
+                            return;
+                        }
+                        c = tree->value;
+                        if (bank_switching == 0) {
+                            emit_error("Using BANK without BANK ROM");
                         } else {
-                            if (machine == COLECOVISION || machine == COLECOVISION_SGM || machine == NES)
-                                c--;
-                            if (machine == TI994A)
+                            d = c;
+                            if (machine == TI994A) {
+                                /* the TI needs to use 8k banks, so our masks are different */
                                 c += 2;   /* reserving 3 banks (0,1,2) for 'fixed' space */
-                            if (bank_rom_size == 128)
-                                c &= 0x07;
-                            else if (bank_rom_size == 256)
-                                c &= 0x0f;
-                            else if (bank_rom_size == 512)
-                                c &= 0x1f;
-                            else
-                                c &= 0x3f;
-                            bank_finish();
-                            if (machine == NES) {
-                                if ((bank_rom_size == 256 && c >= 0x0d) || (bank_rom_size == 512 && c >= 0x1d)) {
-                                    emit_error("Using bank reserved for CHRROM data");
-                                }
-                                sprintf(temp, "$%05x", (c << 14) + 0x0010);
-                            } else {
-                                sprintf(temp, "$%05x", c << 14);
-                            }
-                            if (machine == SG1000 || machine == SMS) {
-                                cpuz80_1op("FORG", temp);
-                                cpuz80_1op("ORG", "$4000");
-                            } else if (machine == MSX || machine == MSX2) {
-                                cpuz80_1op("FORG", temp);
-                                cpuz80_1op("ORG", "$8000");
-                            } else if (machine == NES) {
-                                cpu6502_1op("FORG", temp);
-                                cpu6502_1op("ORG", "$8000");
+
+                                if (bank_rom_size == 128)
+                                    c &= 0x0f;
+                                else if (bank_rom_size == 256)
+                                    c &= 0x1f;
+                                else if (bank_rom_size == 512)
+                                    c &= 0x3f;
+                                else
+                                    c &= 0x7f;
+                                bank_finish();
+                            
+                                sprintf(temp, "%d", c);
+                                cpu9900_1op("bank", temp);
+                                cpu9900_empty();
                             } else {
-                                cpuz80_1op("FORG", temp);
-                                cpuz80_1op("ORG", "$c000");
+                                if (machine == COLECOVISION || machine == COLECOVISION_SGM || machine == NES)
+                                    c--;
+                                if (machine == TI994A)
+                                    c += 2;   /* reserving 3 banks (0,1,2) for 'fixed' space */
+                                if (bank_rom_size == 128)
+                                    c &= 0x07;
+                                else if (bank_rom_size == 256)
+                                    c &= 0x0f;
+                                else if (bank_rom_size == 512)
+                                    c &= 0x1f;
+                                else
+                                    c &= 0x3f;
+                                bank_finish();
+                                if (machine == NES) {
+                                    if ((bank_rom_size == 256 && c >= 0x0d) || (bank_rom_size == 512 && c >= 0x1d)) {
+                                        emit_error("Using bank reserved for CHRROM data");
+                                    }
+                                    sprintf(temp, "$%05x", (c << 14) + 0x0010);
+                                } else {
+                                    sprintf(temp, "$%05x", c << 14);
+                                }
+                                if (machine == SG1000 || machine == SMS) {
+                                    cpuz80_1op("FORG", temp);
+                                    cpuz80_1op("ORG", "$4000");
+                                } else if (machine == MSX || machine == MSX2) {
+                                    cpuz80_1op("FORG", temp);
+                                    cpuz80_1op("ORG", "$8000");
+                                } else if (machine == NES) {
+                                    cpu6502_1op("FORG", temp);
+                                    cpu6502_1op("ORG", "$8000");
+                                } else {
+                                    cpuz80_1op("FORG", temp);
+                                    cpuz80_1op("ORG", "$c000");
+                                }
+                                cpuz80_empty();
                             }
-                            cpuz80_empty();
+                            bank_current = d;
                         }
-                        bank_current = d;
                     }
-                }
-            } else if (strcmp(name, "VDP") == 0 && lex_sneak_peek() == '(') {   /* VDP pseudo-array */
-                int vdp_reg;
+                    break;
+                default:
+                if (keyword == K_VDP && lex_sneak_peek() == '(') {   /* VDP pseudo-array */
+                    int vdp_reg;
                 
-                get_lex();
-                if (lex != C_LPAREN)
-                    emit_error("Missing left parenthesis in VDP");
-                else
-                    get_lex();
-                if (lex != C_NUM) {
-                    emit_error("Not a constant in VDP");
-                    vdp_reg = 0;
-                } else {
-                    vdp_reg = value;
                     get_lex();
-                }
-                if (lex != C_RPAREN)
-                    emit_error("Missing right parenthesis in VDP");
-                else
-                    get_lex();
-                if (lex != C_EQUAL)
-                    emit_error("Missing equal sign in VDP");
-                else
-                    get_lex();
-                type = evaluate_expression(1, TYPE_8, 0);
-                if (target == CPU_6502) {
-                    if (machine == NES) {
-                        emit_error("VDP not supported for NES/Famicom");
+                    if (lex != C_LPAREN)
+                        emit_error("Missing left parenthesis in VDP");
+                    else
+                        get_lex();
+                    if (lex != C_NUM) {
+                        emit_error("Not a constant in VDP");
+                        vdp_reg = 0;
+                    } else {
+                        vdp_reg = value;
+                        get_lex();
+                    }
+                    if (lex != C_RPAREN)
+                        emit_error("Missing right parenthesis in VDP");
+                    else
+                        get_lex();
+                    if (lex != C_EQUAL)
+                        emit_error("Missing equal sign in VDP");
+                    else
+                        get_lex();
+                    type = evaluate_expression(1, TYPE_8, 0);
+                    if (target == CPU_6502) {
+                        if (machine == NES) {
+                            emit_error("VDP not supported for NES/Famicom");
+                        } else {
+                            sprintf(temp, "#%d", vdp_reg);
+                            cpu6502_1op("LDX", temp);
+                            generic_interrupt_disable();
+                            cpu6502_1op("JSR", "WRTVDP");
+                            generic_interrupt_enable();
+                        }
+                    } else if (target == CPU_9900) {
+                        /* Simpler to do inline */
+                        sprintf(temp, "%d   ; %d*256+0x8000", vdp_reg*256+0x8000, vdp_reg);
+                        cpu9900_2op("li", "r1", temp);
+                        cpu9900_2op("movb", "r0", "@VDPWADR");
+                        cpu9900_2op("movb", "r1", "@VDPWADR");
+                        /*
+                         ** only timing critical in scratchpad with register indirect addressing,
+                         ** even then probably safe on the 99/4A
+                         */
                     } else {
-                        sprintf(temp, "#%d", vdp_reg);
-                        cpu6502_1op("LDX", temp);
+                        cpuz80_2op("LD", "B", "A");
+                        sprintf(temp, "%d", vdp_reg);
+                        cpuz80_2op("LD", "C", temp);
                         generic_interrupt_disable();
-                        cpu6502_1op("JSR", "WRTVDP");
+                        cpuz80_1op("CALL", "WRTVDP");
                         generic_interrupt_enable();
                     }
-                } else if (target == CPU_9900) {
-                    /* Simpler to do inline */
-                    sprintf(temp, "%d   ; %d*256+0x8000", vdp_reg*256+0x8000, vdp_reg);
-                    cpu9900_2op("li", "r1", temp);
-                    cpu9900_2op("movb", "r0", "@VDPWADR");
-                    cpu9900_2op("movb", "r1", "@VDPWADR");
-                    /*
-                     ** only timing critical in scratchpad with register indirect addressing,
-                     ** even then probably safe on the 99/4A
-                     */
+                } else if (strcmp(name, "LOCAL") == 0 && (isalpha(lex_sneak_peek()) || lex_sneak_peek() == '#')) {
+                    if (inside_proc == NULL)
+                        emit_error("LOCAL outside of PROCEDURE");
+                    while (1) {
+                        get_lex();
+                        if (lex != C_NAME) {
+                            emit_error("missing name in LOCAL");
+                            break;
+                        }
+                        label = label_search(name);
+                        if (label != NULL && (label->used & LABEL_IS_VARIABLE) == 0) {
+                            char buffer[MAX_LINE_SIZE];
+                            
+                            sprintf(buffer, "variable name '%s' already defined with other purpose", name);
+                            emit_error(buffer);
+                        } else {
+                            if (label == NULL) {
+                                label = label_add(name);
+                                if (name[0] == '#')
+                                    label->used = TYPE_16;
+                                else
+                                    label->used = TYPE_8;
+                                label->used |= LABEL_IS_VARIABLE;
+                            }
+                            label->used |= LABEL_IS_LOCAL;
+                            label_scope(label);
+                        }
+                        get_lex();
+                        if (lex != C_COMMA)
+                            break;
+                    }
+                } else if (macro_search(name) != NULL) {  /* Function (macro) */
+                    if (!replace_macro()) {
+                        compile_statement(check_for_else);
+                        return;
+                    }
                 } else {
-                    cpuz80_2op("LD", "B", "A");
-                    sprintf(temp, "%d", vdp_reg);
-                    cpuz80_2op("LD", "C", temp);
-                    generic_interrupt_disable();
-                    cpuz80_1op("CALL", "WRTVDP");
-                    generic_interrupt_enable();
+                    compile_assignment(0);
                 }
-            } else if (macro_search(name) != NULL) {  /* Function (macro) */
-                if (!replace_macro()) {
-                    compile_statement(check_for_else);
-                    return;
-                }
-            } else {
-                compile_assignment(0);
+                    break;
             }
         } else {
             last_is_return = 0;
@@ -6478,6 +8162,7 @@ void compile_basic(void)
     current_line = 0;
     while (fgets(line, sizeof(line) - 1, input)) {
         current_line++;
+        STATS_COUNT(STATS_LINES);
 
         line_size = (int) strlen(line);
         if (line_size > 0 && line[line_size - 1] == '\n')
@@ -6485,8 +8170,7 @@ void compile_basic(void)
         if (line_size > 0 && line[line_size - 1] == '\r')
             line[--line_size] = '\0';
 
-        generic_dump();
-        fprintf(output, "\t; %s\n", line);
+        inst_comment(line);
         
         /* For debugging purposes */
 /*        fprintf(stderr, "%s\n", line);*/
@@ -6596,6 +8280,7 @@ void compile_basic(void)
 
             /* first build up the label into temp */
             label->used |= LABEL_DEFINED;
+            label->scope = inside_proc;
             strcpy(temp, LABEL_PREFIX);
             strcat(temp, name);
 
@@ -6605,93 +8290,727 @@ void compile_basic(void)
              */
             get_lex();
 
-            if (target == CPU_9900 && lex == C_NAME && strcmp(name, "PROCEDURE") == 0) {
+            if (target == CPU_9900 && lex == C_NAME && keyword == K_PROCEDURE) {
                 /*
                  ** code MUST be even aligned
                  ** this won't trigger for inline labels, but I don't
                  ** think inline labels can become misaligned?
                  */
                 cpu9900_noop("even");
+                
+                /*
+                 ** The PROCEDURE copied to the scratchpad is called there,
+                 ** its label is given to the copy in RAM.
+                 */
+                if (strcmp(label->name, scratchpad_name) == 0 && scratchpad_procedure == NULL) {
+                    if (bank_switching) {
+                        emit_warning("OPTION SCRATCHPAD doesn't work with bank switching");
+                    } else {
+                        inst_printf("%s\tequ scratchpad_run\n", temp);
+                        strcpy(temp, "scratchpad_code");
+                        scratchpad_procedure = label;
+                        scratchpad_start = inst_count;
+                    }
+                }
+            }
+
+            /* Now we can emit the label. Remember, we already get_lex'd */
+            generic_label(temp);
+            label_exists = 1;
+        }
+        if (lex == C_NAME) {
+            if (keyword == K_PROCEDURE) {
+                if (!label_exists)
+                    emit_error("PROCEDURE without label in same line");
+                else
+                    label->used |= LABEL_IS_PROCEDURE;
+                if (inside_proc)
+                    emit_error("starting PROCEDURE without ENDing previous PROCEDURE");
+                get_lex();
+                inside_proc = label;
+                label->scope = label;
+                last_is_return = 0;
+            } else if (keyword == K_END && lex_sneak_peek() != 'I' && lex_sneak_peek() != 'S') {  /* END (and not END IF) */
+                if (!inside_proc)
+                    emit_warning("END without PROCEDURE");
+                else if (loops != NULL)
+                    emit_error("Ending PROCEDURE with control block still open");
+                get_lex();
+                if (!last_is_return)
+                    generic_return();
+                if (inside_proc != NULL && inside_proc == scratchpad_procedure)
+                    scratchpad_close();
+                inside_proc = NULL;
+                last_is_return = 0;
+            } else if (keyword == K_INCLUDE) {
+                int quotes;
+                FILE *old_input = input;
+                int old_line = current_line;
+                char old_file[MAX_LINE_SIZE];
+
+                strcpy(old_file, current_file);
+                while (line_pos < line_size && isspace(line[line_pos]))
+                    line_pos++;
+                
+                /* Separate filename, admit use of quotes */
+                if (line_pos < line_size && line[line_pos] == '"') {
+                    quotes = 1;
+                    line_pos++;
+                } else {
+                    quotes = 0;
+                }
+                p = &path[0];
+                while (p < &path[4095] && line_pos < line_size) {
+                    if (quotes && line[line_pos] == '"')
+                        break;
+                    *p++ = line[line_pos++];
+                }
+                if (quotes) {
+                    if (line_pos >= line_size || line[line_pos] != '"')
+                        emit_error("missing quotes in INCLUDE");
+                    else
+                        line_pos++;
+                } else {
+                    while (p > &path[0] && isspace(*(p - 1)))
+                        p--;
+                }
+                *p = '\0';
+                strcpy(current_file, path);
+                input = fopen(path, "r");
+                if (input == NULL) {
+                    emit_error("INCLUDE not successful");
+                } else {
+                    compile_basic();
+                    fclose(input);
+                }
+                input = old_input;
+                current_line = old_line;
+                strcpy(current_file, old_file);
+                lex = C_END;
+            } else {
+                compile_statement(FALSE);
+            }
+        }
+        node_arena_reset();
+        if (lex != C_END)
+            emit_error("Extra characters");
+    }
+    generic_dump();
+}
+
+/*
+ ** Find the PROCEDURE index of a label
+ */
+static int procedure_index(struct label **list, int total, struct label *label)
+{
+    int c;
+    
+    for (c = 0; c < total; c++) {
+        if (list[c] == label)
+            return c;
+    }
+    return -1;
+}
+
+/*
+ ** Remove the assignments of variables never read (the stores, or
+ ** the whole code when it has no side effects). If nothing else
+ ** references them, they don't need RAM.
+ */
+void process_write_only(void)
+{
+    struct label *label;
+    char variable[MAX_LINE_SIZE];
+    char *p;
+    int c;
+    int d;
+    
+    if (assembler_used)     /* It can read any variable */
+        return;
+    for (c = 0; c < symbol_count; c++) {
+        for (label = symbol_list[c]->label; label != NULL; label = label->next) {
+            if ((label->used & (LABEL_IS_VARIABLE | LABEL_VAR_ACCESS | LABEL_BY_ADDRESS)) != (LABEL_IS_VARIABLE | LABEL_VAR_WRITE))
+                continue;
+            sprintf(variable, LABEL_PREFIX "%s", label->name);
+            for (d = 0; d < inst_count; d++) {
+                if (inst_is_mark(d, label->name)) {   /* The whole assignment */
+                    while (++d < inst_count && !inst_is_mark(d, label->name)) {
+                        if (inst_stream[d].type != INST_COMMENT)
+                            inst_delete(d);
+                    }
+                    stats_rule("write-only variable assignment");
+                } else if (generic_store(d, variable) != NULL) {
+                    inst_delete(d);
+                    stats_rule("write-only variable store");
+                }
+            }
+            if (target == CPU_9900) {
+                for (p = variable; *p; p++) {
+                    if (*p == '#')
+                        *p = '_';
+                }
+            }
+            if (!inst_referenced(inst_count, variable)) {
+                label->used |= LABEL_WRITE_ONLY;
+                label->used &= ~LABEL_IS_LOCAL;
+                write_only_reclaimed += ((label->used & MAIN_TYPE) == TYPE_16) ? 2 : 1;
+            }
+        }
+    }
+}
+
+/*
+ ** Let LOCAL variables share RAM when their PROCEDUREs cannot be
+ ** active at the same time, that is, when neither can reach the
+ ** other through GOSUB. It is a coloring of the interference graph,
+ ** with the first offset that doesn't collide with the variables
+ ** already placed.
+ **
+ ** A PROCEDURE jumping outside itself with GOTO (or entered by GOTO),
+ ** or reachable from ON FRAME GOSUB, keeps its variables apart.
+ */
+void process_overlay(void)
+{
+    struct label **procedures;
+    struct label **locals;
+    struct label *label;
+    char *reach;
+    int total_procedures;
+    int total_locals;
+    int size;
+    int from;
+    int to;
+    int a;
+    int b;
+    int c;
+    int d;
+    
+    total_procedures = 0;
+    total_locals = 0;
+    for (c = 0; c < symbol_count; c++) {
+        for (label = symbol_list[c]->label; label != NULL; label = label->next) {
+            if (label->used & LABEL_IS_PROCEDURE)
+                total_procedures++;
+            if (label->used & LABEL_IS_LOCAL)
+                total_locals++;
+        }
+    }
+    if (total_locals == 0)
+        return;
+    procedures = malloc(total_procedures * sizeof(struct label *) + 1);
+    locals = malloc(total_locals * sizeof(struct label *));
+    reach = calloc(total_procedures * total_procedures + 1, 1);
+    if (procedures == NULL || locals == NULL || reach == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    total_procedures = 0;
+    for (c = 0; c < symbol_count; c++) {
+        for (label = symbol_list[c]->label; label != NULL; label = label->next) {
+            if (label->used & LABEL_IS_PROCEDURE)
+                procedures[total_procedures++] = label;
+        }
+    }
+    
+    /*
+     ** The call graph, and its transitive closure. A PROCEDURE that
+     ** isn't safe reaches itself and everything else.
+     */
+    for (c = 0; c < total_flows; c++) {
+        from = procedure_index(procedures, total_procedures, flows[c].from);
+        to = procedure_index(procedures, total_procedures, flows[c].to->scope);
+        if (!flows[c].jump) {
+            if (from >= 0 && to >= 0)
+                reach[from * total_procedures + to] = 1;
+        } else if (from != to) {
+            if (from >= 0)
+                procedures[from]->used |= LABEL_NOT_LOCAL;
+            if (to >= 0)
+                procedures[to]->used |= LABEL_NOT_LOCAL;
+        }
+    }
+    for (d = 0; d < total_procedures; d++) {
+        for (a = 0; a < total_procedures; a++) {
+            if (!reach[a * total_procedures + d])
+                continue;
+            for (b = 0; b < total_procedures; b++) {
+                if (reach[d * total_procedures + b])
+                    reach[a * total_procedures + b] = 1;
+            }
+        }
+    }
+    from = procedure_index(procedures, total_procedures, frame_drive);
+    for (c = 0; c < total_procedures; c++) {
+        if (from >= 0 && (c == from || reach[from * total_procedures + c]))
+            procedures[c]->used |= LABEL_NOT_LOCAL;
+    }
+    
+    /*
+     ** The variables that can be overlaid, the biggest ones first.
+     */
+    total_locals = 0;
+    for (d = 2; d > 0; d--) {
+        for (c = 0; c < symbol_count; c++) {
+            for (label = symbol_list[c]->label; label != NULL; label = label->next) {
+                if ((label->used & LABEL_IS_LOCAL) == 0)
+                    continue;
+                if (((label->used & MAIN_TYPE) == TYPE_16 ? 2 : 1) != d)
+                    continue;
+                if ((label->used & LABEL_NOT_LOCAL) != 0 || label->scope == NULL || (label->scope->used & LABEL_NOT_LOCAL) != 0) {
+                    if (option_warnings && !isdigit(label->name[0]))   /* Not for temporaries */
+                        fprintf(stderr, "Warning: LOCAL variable '%s' cannot share RAM\n", label->name);
+                    continue;
+                }
+                locals[total_locals++] = label;
+            }
+        }
+    }
+    for (c = 0; c < total_locals; c++) {
+        size = ((locals[c]->used & MAIN_TYPE) == TYPE_16) ? 2 : 1;
+        from = procedure_index(procedures, total_procedures, locals[c]->scope);
+        locals[c]->offset = 0;
+        for (d = 0; d < c; d++) {
+            to = procedure_index(procedures, total_procedures, locals[d]->scope);
+            if (from != to && !reach[from * total_procedures + to] && !reach[to * total_procedures + from])
+                continue;
+            if (locals[d]->offset < locals[c]->offset + size &&
+                locals[c]->offset < locals[d]->offset + (((locals[d]->used & MAIN_TYPE) == TYPE_16) ? 2 : 1)) {
+                locals[c]->offset = (locals[d]->offset + (((locals[d]->used & MAIN_TYPE) == TYPE_16) ? 2 : 1) + size - 1) & -size;
+                d = -1;     /* Check again from the start */
+            }
+        }
+        locals[c]->used |= LABEL_IN_OVERLAY;
+        if (locals[c]->offset + size > overlay_size)
+            overlay_size = locals[c]->offset + size;
+        overlay_reclaimed += size;
+    }
+    overlay_reclaimed -= overlay_size;
+    free(reach);
+    free(locals);
+    free(procedures);
+}
+
+/*
+ ** Get the BASIC label of a label in the instruction stream (NULL for
+ ** the internal labels)
+ */
+static struct label *stack_label(char *name)
+{
+    char buffer[MAX_LINE_SIZE];
+    struct label *label;
+    
+    if (strcmp(name, "scratchpad_code") == 0)
+        return scratchpad_procedure;
+    if (memcmp(name, LABEL_PREFIX, strlen(LABEL_PREFIX)) != 0)
+        return NULL;
+    strcpy(buffer, name + strlen(LABEL_PREFIX));
+    if (buffer[0] != '\0' && buffer[strlen(buffer) - 1] == ':')
+        buffer[strlen(buffer) - 1] = '\0';
+    label = label_search(buffer);
+    if (label == NULL || (label->used & LABEL_IS_VARIABLE) != 0)
+        return NULL;
+    return label;
+}
+
+/*
+ ** Worst-case stack depth of the main program and the video interrupt.
+ **
+ ** The compiled code of each PROCEDURE is scanned for its pushes and
+ ** calls (the backend tells the stack effect of each instruction), and
+ ** the depths are propagated through the call graph. A recursive
+ ** GOSUB leaves the depth unbounded.
+ */
+void process_stack(int count)
+{
+    struct stack_call {
+        int from;       /* Region calling (0 for the main program) */
+        int to;         /* Region called */
+        int depth;      /* Stack used by the caller, plus the return address */
+    } *calls;
+    struct label **procedures;
+    struct label *label;
+    char *callee;
+    int *depth;
+    int total_procedures;
+    int total_calls;
+    int library;
+    int region;
+    int current;
+    int delta;
+    int changed;
+    int c;
+    int d;
+    
+    total_procedures = 0;
+    for (c = 0; c < symbol_count; c++) {
+        for (label = symbol_list[c]->label; label != NULL; label = label->next) {
+            if (label->used & LABEL_IS_PROCEDURE)
+                total_procedures++;
+        }
+    }
+    total_calls = total_flows;
+    for (c = 0; c < count; c++) {
+        generic_stack(c, &callee);
+        if (callee != NULL)
+            total_calls++;
+    }
+    procedures = malloc(total_procedures * sizeof(struct label *) + 1);
+    calls = malloc(total_calls * sizeof(struct stack_call) + 1);
+    depth = calloc(total_procedures + 1, sizeof(int));
+    if (procedures == NULL || calls == NULL || depth == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    total_procedures = 0;
+    for (c = 0; c < symbol_count; c++) {
+        for (label = symbol_list[c]->label; label != NULL; label = label->next) {
+            if (label->used & LABEL_IS_PROCEDURE)
+                procedures[total_procedures++] = label;
+        }
+    }
+    if (target == CPU_Z80)
+        library = STACK_LIBRARY_Z80;
+    else if (target == CPU_6502)
+        library = STACK_LIBRARY_6502;
+    else
+        library = 0;
+    
+    /*
+     ** The depth inside each region, and the calls between them. The
+     ** statements leave the stack as they found it, so the count restarts
+     ** at each source line. Each GOSUB is noted too, because ON GOSUB
+     ** jumps through a table.
+     */
+    total_calls = 0;
+    for (c = 0; c < total_flows; c++) {
+        if (flows[c].jump || (flows[c].to->used & LABEL_IS_PROCEDURE) == 0)
+            continue;
+        calls[total_calls].from = procedure_index(procedures, total_procedures, flows[c].from) + 1;
+        calls[total_calls].to = procedure_index(procedures, total_procedures, flows[c].to) + 1;
+        calls[total_calls].depth = 2;
+        total_calls++;
+    }
+    region = 0;
+    current = 0;
+    for (c = 0; c < count; c++) {
+        if (inst_stream[c].type == INST_COMMENT) {
+            current = 0;
+            continue;
+        }
+        if (inst_stream[c].type == INST_LABEL) {
+            label = stack_label(inst_string(inst_stream[c].text));
+            if (label != NULL) {
+                region = procedure_index(procedures, total_procedures, label->scope) + 1;
+                current = 0;
+            }
+            continue;
+        }
+        delta = generic_stack(c, &callee);
+        if (callee != NULL) {
+            label = stack_label(callee);
+            if (label != NULL && (label->used & LABEL_IS_PROCEDURE) != 0) {
+                calls[total_calls].from = region;
+                calls[total_calls].to = procedure_index(procedures, total_procedures, label) + 1;
+                calls[total_calls].depth = current + delta;
+                total_calls++;
+            } else if (delta > 0 && current + delta + library > depth[region]) {
+                depth[region] = current + delta + library;
+            }
+            continue;
+        }
+        current += delta;
+        if (current < 0)
+            current = 0;
+        if (current > depth[region])
+            depth[region] = current;
+    }
+    
+    /*
+     ** Propagate the depths to the callers. Each round adds at least
+     ** one level of the call graph, so more rounds than regions means
+     ** recursion.
+     */
+    d = 0;
+    do {
+        changed = 0;
+        for (c = 0; c < total_calls; c++) {
+            if (calls[c].depth + depth[calls[c].to] > depth[calls[c].from]) {
+                depth[calls[c].from] = calls[c].depth + depth[calls[c].to];
+                changed = 1;
+            }
+        }
+    } while (changed && ++d <= total_procedures + 1) ;
+    if (changed) {
+        stack_main = -1;
+        stack_interrupt = -1;
+    } else {
+        stack_main = depth[0];
+        if (target == CPU_Z80)
+            stack_interrupt = STACK_INTERRUPT_Z80;
+        else if (target == CPU_6502)
+            stack_interrupt = STACK_INTERRUPT_6502;
+        else
+            stack_interrupt = 0;
+        if (frame_drive != NULL) {
+            d = procedure_index(procedures, total_procedures, frame_drive);
+            stack_interrupt += 2 + (target != CPU_9900 && loop_pointer ? 2 : 0) + (d >= 0 ? depth[d + 1] : 0);
+        }
+    }
+    free(depth);
+    free(calls);
+    free(procedures);
+}
+
+/*
+ ** Place the 6502 variables and arrays. If they don't fit in the
+ ** zero page, it is given to the most used ones (references weighted
+ ** by loop nesting). Arrays are only reached by constant indexes in
+ ** zero page, so small ones count half. Everything else keeps the
+ ** program order.
+ */
+void process_variables_6502(int address)
+{
+    struct placement {
+        struct label *label;
+        int is_array;
+        int size;
+        int weight;
+        int address;
+    } *list;
+    struct label *label;
+    int total;
+    int count;
+    int needed;
+    int room;
+    int best;
+    int jump;
+    int overlay;
+    int c;
+    int d;
+    
+    count = 1;  /* The LOCAL overlay */
+    for (c = 0; c < symbol_count; c++) {
+        for (label = symbol_list[c]->label; label != NULL; label = label->next) {
+            if (label->used & LABEL_IS_VARIABLE)
+                count++;
+        }
+        for (label = symbol_list[c]->array; label != NULL; label = label->next)
+            count++;
+    }
+    list = malloc(count * sizeof(struct placement));
+    if (list == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    /*
+     ** Variables first, then arrays, as the other targets. The
+     ** overlay of LOCAL variables counts as a single variable.
+     */
+    count = 0;
+    needed = 0;
+    overlay = -1;
+    for (c = 0; c < symbol_count; c++) {
+        for (label = symbol_list[c]->label; label != NULL; label = label->next) {
+            if ((label->used & (LABEL_IS_VARIABLE | LABEL_WRITE_ONLY)) != LABEL_IS_VARIABLE)
+                continue;
+            if (label->used & LABEL_IN_OVERLAY) {
+                if (overlay == -1) {
+                    overlay = count;
+                    list[count].label = NULL;
+                    list[count].is_array = 0;
+                    list[count].size = overlay_size;
+                    list[count].weight = 0;
+                    list[count].address = -1;
+                    needed += overlay_size;
+                    count++;
+                }
+                if (list[overlay].weight < 0x10000000)
+                    list[overlay].weight += label->weight;
+                continue;
+            }
+            list[count].label = label;
+            list[count].is_array = 0;
+            list[count].size = (label->used & MAIN_TYPE) == TYPE_8 ? 1 : 2;
+            list[count].weight = label->weight;
+            list[count].address = -1;
+            needed += list[count].size;
+            count++;
+        }
+    }
+    for (c = 0; c < symbol_count; c++) {
+        for (label = symbol_list[c]->array; label != NULL; label = label->next) {
+            list[count].label = label;
+            list[count].is_array = 1;
+            list[count].size = (label->name[0] == '#' ? 2 : 1) * label->length;
+            list[count].weight = list[count].size <= 32 ? label->weight / 2 : -1;
+            list[count].address = -1;
+            needed += list[count].size;
+            count++;
+        }
+    }
+    
+    /*
+     ** Choose the zero page contents. If everything fits, the
+     ** program order is kept.
+     */
+    room = 0x0100 - address;
+    if (needed <= room) {
+        for (c = 0; c < count; c++)
+            list[c].address = 0;    /* Chosen */
+    } else {
+        while (1) {
+            best = -1;
+            for (c = 0; c < count; c++) {
+                if (list[c].address != -1 || list[c].weight < 0 || list[c].size > room)
+                    continue;
+                if (best == -1 || list[c].weight > list[best].weight)
+                    best = c;
+            }
+            if (best == -1)
+                break;
+            list[best].address = 0;     /* Chosen */
+            room -= list[best].size;
+        }
+    }
+    for (c = 0; c < count; c++) {
+        if (list[c].address == 0) {
+            list[c].address = address;
+            address += list[c].size;
+        } else {
+            list[c].address = -1;
+        }
+    }
+    total = address;
+    jump = (machine == NES) ? 0x0300 : 0x0200;
+    for (c = 0; c < count; c++) {
+        if (list[c].address != -1)
+            continue;
+        if (total < jump && total + list[c].size > 0x0140)
+            total = jump;
+        list[c].address = total;
+        total += list[c].size;
+    }
+    
+    for (c = 0; c < count; c++) {
+        if (c == overlay)
+            continue;
+        sprintf(temp, "%s%s:\tequ $%04x", list[c].is_array ? ARRAY_PREFIX : LABEL_PREFIX, list[c].label->name, list[c].address);
+        inst_printf("%s\n", temp);
+    }
+    if (overlay != -1) {
+        for (c = 0; c < symbol_count; c++) {
+            for (label = symbol_list[c]->label; label != NULL; label = label->next) {
+                if (label->used & LABEL_IN_OVERLAY) {
+                    sprintf(temp, LABEL_PREFIX "%s:\tequ $%04x", label->name, list[overlay].address + label->offset);
+                    inst_printf("%s\n", temp);
+                }
+            }
+        }
+    }
+    
+    /*
+     ** Placement report, zero page first.
+     */
+    if (stats_enabled && !option_stats_json) {
+        fprintf(stderr, "Variable placement for %s:\n", consoles[machine].canonical);
+        for (d = 0; d < 2; d++) {
+            for (c = 0; c < count; c++) {
+                if ((list[c].address + list[c].size <= 0x0100) != (d == 0))
+                    continue;
+                fprintf(stderr, "  $%04x %-24s %5d bytes %10d weight%s\n",
+                        list[c].address, c == overlay ? "(LOCAL variables)" : list[c].label->name, list[c].size,
+                        list[c].weight, d == 0 ? " (zero page)" : "");
             }
+        }
+    }
+    free(list);
+}
 
-            /* Now we can emit the label. Remember, we already get_lex'd */
-            generic_label(temp);
-            label_exists = 1;
+/*
+ ** Close the PROCEDURE copied into the TI-99/4A scratchpad, and check
+ ** that it fits.
+ */
+void scratchpad_close(void)
+{
+    char buffer[MAX_LINE_SIZE];
+    int size;
+    int c;
+    
+    cpu9900_noop("even");
+    cpu9900_label("scratchpad_end");
+    scratchpad_size = 0;
+    for (c = scratchpad_start; c < inst_count; c++) {
+        size = cpu9900_size(c);
+        if (size < 0) {
+            emit_error("PROCEDURE for the scratchpad contains data of unknown size");
+            return;
         }
-        if (lex == C_NAME) {
-            if (strcmp(name, "PROCEDURE") == 0) {
-                if (!label_exists)
-                    emit_error("PROCEDURE without label in same line");
-                else
-                    label->used |= LABEL_IS_PROCEDURE;
-                if (inside_proc)
-                    emit_error("starting PROCEDURE without ENDing previous PROCEDURE");
-                get_lex();
-                inside_proc = label;
-                last_is_return = 0;
-            } else if (strcmp(name, "END") == 0 && lex_sneak_peek() != 'I' && lex_sneak_peek() != 'S') {  /* END (and not END IF) */
-                if (!inside_proc)
-                    emit_warning("END without PROCEDURE");
-                else if (loops != NULL)
-                    emit_error("Ending PROCEDURE with control block still open");
-                get_lex();
-                if (!last_is_return)
-                    generic_return();
-                inside_proc = NULL;
-                last_is_return = 0;
-            } else if (strcmp(name, "INCLUDE") == 0) {
-                int quotes;
-                FILE *old_input = input;
-                int old_line = current_line;
-                char old_file[MAX_LINE_SIZE];
+        scratchpad_size += size;
+    }
+    if (scratchpad_size > SCRATCHPAD_CODE) {
+        sprintf(buffer, "PROCEDURE too big for the scratchpad (about %d bytes, %d available)", scratchpad_size, SCRATCHPAD_CODE);
+        emit_error(buffer);
+    }
+}
 
-                strcpy(old_file, current_file);
-                while (line_pos < line_size && isspace(line[line_pos]))
-                    line_pos++;
-                
-                /* Separate filename, admit use of quotes */
-                if (line_pos < line_size && line[line_pos] == '"') {
-                    quotes = 1;
-                    line_pos++;
-                } else {
-                    quotes = 0;
-                }
-                p = &path[0];
-                while (p < &path[4095] && line_pos < line_size) {
-                    if (quotes && line[line_pos] == '"')
-                        break;
-                    *p++ = line[line_pos++];
-                }
-                if (quotes) {
-                    if (line_pos >= line_size || line[line_pos] != '"')
-                        emit_error("missing quotes in INCLUDE");
-                    else
-                        line_pos++;
-                } else {
-                    while (p > &path[0] && isspace(*(p - 1)))
-                        p--;
-                }
-                *p = '\0';
-                strcpy(current_file, path);
-                input = fopen(path, "r");
-                if (input == NULL) {
-                    emit_error("INCLUDE not successful");
-                } else {
-                    compile_basic();
-                    fclose(input);
-                }
-                input = old_input;
-                current_line = old_line;
-                strcpy(current_file, old_file);
-                lex = C_END;
-            } else {
-                compile_statement(FALSE);
+/*
+ ** Place the most used 16-bit variables in the TI-99/4A scratchpad,
+ ** because it is on the 16-bit bus without wait states. The memory
+ ** expansion is on the 8-bit bus.
+ */
+void process_variables_9900(void)
+{
+    struct label *label;
+    struct label *best;
+    int base;
+    int room;
+    int c;
+    
+    base = SCRATCHPAD_RUNTIME;
+    if (music_used)
+        base += SCRATCHPAD_MUSIC;
+    if (bank_switching)
+        base += SCRATCHPAD_BANKS;
+    room = SCRATCHPAD_FREE - base;
+    while (room >= 2) {
+        best = NULL;
+        for (c = 0; c < symbol_count; c++) {
+            for (label = symbol_list[c]->label; label != NULL; label = label->next) {
+                if ((label->used & (LABEL_IS_VARIABLE | LABEL_IN_SCRATCHPAD | LABEL_IN_OVERLAY | LABEL_WRITE_ONLY | MAIN_TYPE)) != (LABEL_IS_VARIABLE | TYPE_16))
+                    continue;
+                if (best == NULL || label->weight > best->weight)
+                    best = label;
             }
         }
-        if (lex != C_END)
-            emit_error("Extra characters");
+        if (best == NULL)
+            break;
+        best->used |= LABEL_IN_SCRATCHPAD;
+        room -= 2;
     }
-    generic_dump();
+    
+    /*
+     ** Program order, after the runtime variables.
+     */
+    if (stats_enabled && !option_stats_json)
+        fprintf(stderr, "Scratchpad placement for %s:\n", consoles[machine].canonical);
+    room = 0;
+    for (c = 0; c < symbol_count; c++) {
+        for (label = symbol_list[c]->label; label != NULL; label = label->next) {
+            if ((label->used & LABEL_IN_SCRATCHPAD) == 0)
+                continue;
+            strcpy(temp, LABEL_PREFIX);
+            strcat(temp, label->name);
+            if (temp[strlen(LABEL_PREFIX)] == '#')
+                temp[strlen(LABEL_PREFIX)] = '_';
+            inst_printf("%s\tequ lastsp+%d\n", temp, room);
+            if (stats_enabled && !option_stats_json)
+                fprintf(stderr, "  >%04x %-24s %5d bytes %10d weight\n", 0x8340 + base + room, label->name, 2, label->weight);
+            room += 2;
+        }
+    }
+    if (stats_enabled && !option_stats_json && scratchpad_procedure != NULL)
+        fprintf(stderr, "  >8380 %-24s %5d bytes (PROCEDURE)\n", scratchpad_procedure->name, scratchpad_size);
 }
 
 /*
@@ -6707,8 +9026,33 @@ int process_variables(void)
     
     address = consoles[machine].base_ram; /* Only Creativision, NES and TI994A */
     bytes_used = 0;
-    for (c = 0; c < HASH_PRIME; c++) {
-        label = label_hash[c];
+    if (target == CPU_6502 && loop_pointer) {   /* Pointer for FOR loops in zero page */
+        sprintf(temp, "loop_pointer:\tequ $%04x", address);
+        inst_printf("%s\n", temp);
+        address += 2;
+        bytes_used += 2;
+    }
+    process_overlay();
+    if (target == CPU_6502)
+        process_variables_6502(address);
+    else if (target == CPU_9900)
+        process_variables_9900();
+    if (overlay_size > 0) {
+        if (target == CPU_6502) {
+            /* Placed by process_variables_6502() */
+        } else if (target == CPU_9900) {
+            cpu9900_noop("even");
+            cpu9900_label("ram_overlay:");
+            sprintf(temp, "%d", overlay_size);
+            cpu9900_1op("bss", temp);
+        } else {
+            sprintf(temp, "ram_overlay:\trb %d", overlay_size);
+            inst_printf("%s\n", temp);
+        }
+        bytes_used += overlay_size;
+    }
+    for (c = 0; c < symbol_count; c++) {
+        label = symbol_list[c]->label;
         while (label != NULL) {
             if ((label->used & (LABEL_CALLED_BY_GOTO & LABEL_IS_PROCEDURE)) == (LABEL_CALLED_BY_GOTO | LABEL_IS_PROCEDURE)) {
                 fprintf(stderr, "Error: PROCEDURE '%s' jumped in by GOTO\n", label->name);
@@ -6719,37 +9063,29 @@ int process_variables(void)
                 err_code = EXIT_FAILURE;
             }
             if (label->used & LABEL_IS_VARIABLE) {
-                if (target == CPU_6502) {
-                    if (machine == NES) {
-                        if ((label->used & MAIN_TYPE) == TYPE_8) {
-                            if (address < 0x0300 && address + 1 > 0x0140)
-                                address = 0x0300;
-                            sprintf(temp, "%s%s:\tequ $%04x", LABEL_PREFIX, label->name, address);
-                            address++;
-                            bytes_used++;
-                        } else {
-                            if (address < 0x0300 && address + 2 > 0x0140)
-                                address = 0x0300;
-                            sprintf(temp, "%s%s:\tequ $%04x", LABEL_PREFIX, label->name, address);
-                            address += 2;
-                            bytes_used += 2;
-                        }
+                if (label->used & LABEL_WRITE_ONLY) {
+                    /* Doesn't need RAM */
+                } else if (label->used & LABEL_IN_OVERLAY) {
+                    /* Counted by the overlay */
+                    if (target == CPU_6502) {
+                        /* Placed by process_variables_6502() */
+                    } else if (target == CPU_9900) {
+                        strcpy(temp, LABEL_PREFIX);
+                        strcat(temp, label->name);
+                        if (temp[strlen(LABEL_PREFIX)] == '#')
+                            temp[strlen(LABEL_PREFIX)] = '_';
+                        inst_printf("%s\tequ ram_overlay+%d\n", temp, label->offset);
                     } else {
-                        if ((label->used & MAIN_TYPE) == TYPE_8) {
-                            if (address < 0x0200 && address + 1 > 0x0140)
-                                address = 0x0200;
-                            sprintf(temp, "%s%s:\tequ $%04x", LABEL_PREFIX, label->name, address);
-                            address++;
-                            bytes_used++;
-                        } else {
-                            if (address < 0x0200 && address + 2 > 0x0140)
-                                address = 0x0200;
-                            sprintf(temp, "%s%s:\tequ $%04x", LABEL_PREFIX, label->name, address);
-                            address += 2;
-                            bytes_used += 2;
-                        }
+                        inst_printf(LABEL_PREFIX "%s:\tequ ram_overlay+%d\n", label->name, label->offset);
                     }
-                    fprintf(output, "%s\n", temp);
+                } else if (target == CPU_6502) {
+                    /* Placed by process_variables_6502() */
+                    if ((label->used & MAIN_TYPE) == TYPE_8)
+                        bytes_used++;
+                    else
+                        bytes_used += 2;
+                } else if (target == CPU_9900 && (label->used & LABEL_IN_SCRATCHPAD) != 0) {
+                    /* Placed by process_variables_9900() */
                 } else if (target == CPU_9900) {
                     /* using the cpu9900_xxop() functions to get the character remapping */
                     if ((label->used & MAIN_TYPE) == TYPE_16 && (bytes_used & 1) != 0) {
@@ -6779,7 +9115,7 @@ int process_variables(void)
                         strcat(temp, "rb 2");
                         bytes_used += 2;
                     }
-                    fprintf(output, "%s\n", temp);
+                    inst_printf("%s\n", temp);
                 }
                 
                 /* Warns of variables only read or only written */
@@ -6796,8 +9132,8 @@ int process_variables(void)
             label = label->next;
         }
     }
-    for (c = 0; c < HASH_PRIME; c++) {
-        label = array_hash[c];
+    for (c = 0; c < symbol_count; c++) {
+        label = symbol_list[c]->array;
         while (label != NULL) {
             if (label->name[0] == '#')
                 size = 2;
@@ -6805,16 +9141,7 @@ int process_variables(void)
                 size = 1;
             size *= label->length;
             if (target == CPU_6502) {
-                if (machine == NES) {
-                    if (address < 0x0300 && address + size > 0x0140)
-                        address = 0x0300;
-                } else {
-                    if (address < 0x0200 && address + size > 0x0140)
-                        address = 0x0200;
-                }
-                sprintf(temp, ARRAY_PREFIX "%s:\tequ $%04x", label->name, address);
-                address += size;
-                fprintf(output, "%s\n", temp);
+                /* Placed by process_variables_6502() */
             } else if (target == CPU_9900) {
                 if ((bytes_used & 1) != 0) {
                     cpu9900_noop("even");
@@ -6831,175 +9158,60 @@ int process_variables(void)
                 address += size;
             } else {
                 sprintf(temp, ARRAY_PREFIX "%s:\trb %d", label->name, size);
-                fprintf(output, "%s\n", temp);
+                inst_printf("%s\n", temp);
             }
             bytes_used += size;
             label = label->next;
         }
     }
-    fprintf(output, "ram_end:\n");
+    inst_printf("ram_end:\n");
     return bytes_used;
 }
 
 /*
  ** Main program
  */
-int main(int argc, char *argv[])
+/*
+ ** Reset the compiler state, so the program can be compiled for another target
+ */
+void compile_reset(void)
 {
-    FILE *prologue;
-    int c;
-    char *p;
-    char *p1;
-    int bytes_used;
-    int available_bytes;
-    time_t actual;
-    struct tm *date;
-    int extra_ram;
-    int small_rom;
-    int cpm_option;
-    int pencil;
-    char hex;
-    struct constant *machine_constant;
-    
-    actual = time(0);
-    date = localtime(&actual);
-
-    fprintf(stderr, "\nCVBasic compiler " VERSION "\n");
-    fprintf(stderr, "(c) 2024-2026 Oscar Toledo G. https://nanochess.org/\n\n");
-    
-    if (argc < 3) {
-        fprintf(stderr, "Usage:\n");
-        fprintf(stderr, "\n");
-        machine = COLECOVISION;
-        while (machine < TOTAL_TARGETS) {
-            if (machine == COLECOVISION)
-                fprintf(stderr, "    cvbasic [-DCONST=5] input.bas output.asm [library_path]\n");
-            else
-                fprintf(stderr, "    cvbasic --%s input.bas output.asm [library_path]\n", consoles[machine].name);
-            if (consoles[machine].options[0])
-                fprintf(stderr, "    cvbasic --%s %s input.bas output.asm [library_path]\n", consoles[machine].name, consoles[machine].options);
-            fprintf(stderr, "        %s\n",
-                    consoles[machine].description);
-            machine++;
-        }
-        fprintf(stderr, "\n");
-        fprintf(stderr, "    By default, it will generate assembler files for Colecovision.\n");
-        fprintf(stderr, "    The library_path argument is optional so you can provide a\n");
-        fprintf(stderr, "    path where the prologue and epilogue files are available.\n");
-#ifdef ASM_LIBRARY_PATH
-        fprintf(stderr, "    Default: '" DEFAULT_ASM_LIBRARY_PATH "'\n");
-#endif
-        fprintf(stderr, "\n");
-        fprintf(stderr, "    It will return a zero error code if compilation was\n");
-        fprintf(stderr, "    successful, or non-zero otherwise.\n\n");
-        fprintf(stderr, "Many thanks to acadiel, Albert, abeker, an3ss, aotta, artrag,\n");
-        fprintf(stderr, "atari2600land, carlsson, chalkyw64, CrazyBoss, drfloyd, gemintronic,\n");
-        fprintf(stderr, "Jess Ragan, Kamshaft, Kiwi, MADrigal, pixelboy, Revontuli, SiRioKD,\n");
-        fprintf(stderr, "Tarzilla, Tony Cruise, tursilion, unhuman, visrealm, wavemotion,\n");
-        fprintf(stderr, "and youki.\n");
-        fprintf(stderr, "\n");
-        exit(EXIT_FAILURE);
-    }
+    struct loop *loop;
     
-    /*
-     ** Select target machine.
-     */
-    c = 1;
-    if (argv[c][0] == '-' && argv[c][1] == '-') {
-        machine = COLECOVISION;
-        while (machine < TOTAL_TARGETS) {
-            p = &argv[c][2];
-            p1 = consoles[machine].name;
-            while (*p && tolower(*p) == tolower(*p1)) {
-                p++;
-                p1++;
-            }
-            if (*p == '\0' && *p1 == '\0')  /* Exact match */
-                break;
-            machine++;
-        }
-        if (machine == TOTAL_TARGETS) {
-            fprintf(stderr, "Unknown target: %s\n", argv[c]);
-            exit(EXIT_FAILURE);
-        }
-        target = consoles[machine].target;
-        c++;
-    } else {
-        machine = COLECOVISION;
-        target = CPU_Z80;
-    }
-    if (machine == PENCIL) {
-        machine = COLECOVISION;
-        target = CPU_Z80;
-        pencil = 1;
-    } else {
-        pencil = 0;
-    }
-    bytes_used = 0;
-
-    /*
-     ** Extra options.
-     */
-    extra_ram = 0;
-    if (argv[c][0] == '-' && tolower(argv[c][1]) == 'r' && tolower(argv[c][2]) == 'a' &&
-        tolower(argv[c][3]) == 'm' && argv[c][4] == '1' && argv[c][5] == '6' &&
-        argv[c][6] == '\0') {
-        c++;
-        if (machine == MSX || machine == MSX2) {
-            extra_ram = 8192;
-        } else {
-            fprintf(stderr, "-ram16 option only applies to MSX/MSX2.\n");
-            exit(EXIT_FAILURE + 1);
-        }
-    }
-    bank_konami = 0;
-    if (argv[c][0] == '-' && tolower(argv[c][1]) == 'k' && tolower(argv[c][2]) == 'o' &&
-        tolower(argv[c][3]) == 'n' && tolower(argv[c][4]) == 'a' && tolower(argv[c][5]) == 'm' && tolower(argv[c][6]) == 'i' &&
-        argv[c][7] == '\0') {
-        c++;
-        if (machine == MSX || machine == MSX2) {
-            bank_konami = 1;
-        } else {
-            fprintf(stderr, "-konami option only applies to MSX/MSX2.\n");
-            exit(EXIT_FAILURE + 1);
-        }
-    }
-    cpm_option = 0;
-    if (machine == EINSTEIN)
-        cpm_option = 1;     /* Forced */
-    if (argv[c][0] == '-' && tolower(argv[c][1]) == 'c' && tolower(argv[c][2]) == 'p' &&
-        tolower(argv[c][3]) == 'm' && argv[c][4] == '\0') {
-        c++;
-        if (machine == MEMOTECH || machine == NABU) {
-            cpm_option = 1;
-        } else {
-            fprintf(stderr, "-cpm option only applies to Memotech or NABU.\n");
-            exit(EXIT_FAILURE + 1);
-        }
+    symbol_reset();
+    while (accumulated.length > 0) {
+        accumulated.length--;
+        free(accumulated.definition[accumulated.length].name);
     }
-    small_rom = 0;
-    if (argv[c][0] == '-' && tolower(argv[c][1]) == 'r' && tolower(argv[c][2]) == 'o' &&
-        tolower(argv[c][3]) == 'm' && argv[c][4] == '1' && argv[c][5] == '6' &&
-        argv[c][6] == '\0') {
-        c++;
-        if (machine == CREATIVISION) {
-            small_rom = 1;
-        } else {
-            fprintf(stderr, "-rom16 option only applies to Creativision.\n");
-            exit(EXIT_FAILURE + 1);
-        }
+    while (loops != NULL) {
+        loop = loops;
+        loops = loop->next;
+        if (loop->type == NESTED_SELECT)
+            free(loop->cases);
+        free(loop);
     }
+    next_local = 1;
+    last_is_return = 0;
+    music_used = 0;
+    compression_used = 0;
+    spinner_used = 0;
+    bank_rom_size = 0;
+    bank_current = 0;
+    option_fm = 0;
+    bitmap_byte = 0;
+    global_label[0] = '\0';
+    node_arena_clear();
+    inst_reset();
+    generic_reset();
+    library_reset();
+}
 
-    /*
-     ** Create machine constant
-     */
-    machine_constant = constant_add(consoles[machine].constant);;
-    machine_constant->value = 1;
-
-    /*
-     ** Passed-in constants
-     */
-    while (argv[c][0] == '-' && tolower(argv[c][1]) == 'd') {
+/*
+ ** Define the constants passed in the command line
+ */
+void define_constants(int argc, char *argv[], int c)
+{
+    while (c < argc && argv[c][0] == '-' && tolower(argv[c][1]) == 'd') {
         int i = 1;
         char ch = 0;
         char *p = name;
@@ -7034,29 +9246,149 @@ int main(int argc, char *argv[])
         }
         c++;
     }
+}
+
+/*
+ ** Emit a constant for the assembler, it is also used for the
+ ** conditional assembly of the library
+ */
+void compile_equ(char *name, int value)
+{
+    fprintf(output, "%s:\tequ %d\n", name, value);
+    library_define(name, value);
+}
+
+/*
+ ** Call the FRAME GOSUB procedure from the video interrupt handler
+ */
+void compile_frame_drive(FILE *output)
+{
+    if (frame_drive == NULL)
+        return;
+    if (target == CPU_6502) {
+        if (loop_pointer) {
+            fprintf(output, "\tLDA loop_pointer\n");
+            fprintf(output, "\tPHA\n");
+            fprintf(output, "\tLDA loop_pointer+1\n");
+            fprintf(output, "\tPHA\n");
+        }
+        fprintf(output, "\tJSR " LABEL_PREFIX "%s\n", frame_drive->name);
+        if (loop_pointer) {
+            fprintf(output, "\tPLA\n");
+            fprintf(output, "\tSTA loop_pointer+1\n");
+            fprintf(output, "\tPLA\n");
+            fprintf(output, "\tSTA loop_pointer\n");
+        }
+    } else if (target == CPU_9900) {
+        char *p;
+        
+        /* To call compiled code, we need the stack pointer and we need to jsr it */
+        fprintf(output, "\tmov @>8314,r10\n");
+        fprintf(output, "\tbl @jsr\n");
+        strcpy(assigned, frame_drive->name);
+        p = assigned;
+        while (*p) {
+            if (*p == '#')
+                *p = '_';
+            p++;
+        }
+        fprintf(output, "\tdata " LABEL_PREFIX "%s\n", assigned);
+    } else {
+        if (loop_pointer)
+            fprintf(output, "\tPUSH IY\n");
+        fprintf(output, "\tCALL " LABEL_PREFIX "%s\n", frame_drive->name);
+        if (loop_pointer)
+            fprintf(output, "\tPOP IY\n");
+    }
+}
 
+/*
+ ** Compile the program for the current machine
+ */
+void compile_program(char *source, char *output_name, int argc, char *argv[], int first_define)
+{
+    int c;
+    int bytes_used;
+    int available_bytes;
+    int stack_reserved;
+    int body_count;
+    time_t actual;
+    struct tm *date;
+    int extra_ram;
+    int small_rom;
+    int cpm_option;
+    int pencil;
+    char hex;
+    struct constant *machine_constant;
+    
+    actual = time(0);
+    date = localtime(&actual);
+    
+    target = consoles[machine].target;
+    if (machine == PENCIL) {
+        machine = COLECOVISION;
+        target = CPU_Z80;
+        pencil = 1;
+    } else {
+        pencil = 0;
+    }
+    bytes_used = 0;
+    
+    extra_ram = 0;
+    if (option_ram16 && (machine == MSX || machine == MSX2))
+        extra_ram = 8192;
+    bank_konami = 0;
+    if (option_konami && (machine == MSX || machine == MSX2))
+        bank_konami = 1;
+    cpm_option = 0;
+    if (machine == EINSTEIN)
+        cpm_option = 1;     /* Forced */
+    if (option_cpm && (machine == MEMOTECH || machine == NABU))
+        cpm_option = 1;
+    small_rom = 0;
+    if (option_rom16 && machine == CREATIVISION)
+        small_rom = 1;
+    
+    compile_reset();
+    stats_reset();
+    
+    /*
+     ** Create machine constant
+     */
+    machine_constant = constant_add(consoles[machine].constant);
+    machine_constant->value = 1;
+    
+    /*
+     ** Passed-in constants
+     */
+    define_constants(argc, argv, first_define);
+    
     /*
-     ** Here is compiled the source code and generates a temporary assembler file.
+     ** Here is compiled the source code, it is kept in memory.
      */
-    strcpy(current_file, argv[c]);
+    strcpy(current_file, source);
     err_code = EXIT_SUCCESS;
     input = fopen(current_file, "r");
     if (input == NULL) {
         fprintf(stderr, "Couldn't open '%s' source file.\n", current_file);
         exit(EXIT_FAILURE + 1);
     }
-    c++;
 
-    output = fopen(TEMPORARY_ASSEMBLER, "w");
-    if (output == NULL) {
-        fprintf(stderr, "Couldn't open '%s' temporary file.\n", TEMPORARY_ASSEMBLER);
-        exit(EXIT_FAILURE + 1);
-    }
     bank_switching = 0;
     option_explicit = 0;
     option_warnings = 1;
     inside_proc = NULL;
     frame_drive = NULL;
+    loop_pointer = 0;
+    scratchpad_name[0] = '\0';
+    scratchpad_procedure = NULL;
+    scratchpad_size = 0;
+    total_flows = 0;
+    overlay_size = 0;
+    overlay_reclaimed = 0;
+    store_block = 1;
+    assembler_used = 0;
+    write_only_reclaimed = 0;
 
     current_chrrom = -1;  /* Only NES */
     chrrom_pointer = 0;   /* Only NES */
@@ -7064,6 +9396,7 @@ int main(int argc, char *argv[])
     chrrom_data = NULL;   /* Only NES */
     nes_nametable = 0;  /* Only NES */
 
+    stats_start(PHASE_PARSE);
     compile_basic();
     if (loops != NULL)
         emit_error("End of source with control block still open");
@@ -7071,35 +9404,30 @@ int main(int argc, char *argv[])
         emit_warning("End of source without ending PROCEDURE");
         if (!last_is_return)
             generic_return();
+        if (inside_proc == scratchpad_procedure)
+            scratchpad_close();
         inside_proc = 0;
         last_is_return = 0;
     }
     if (bank_switching)
         bank_finish();
+    stats_stop();
     fclose(input);
-    fclose(output);
+    process_write_only();
+    stats_start(PHASE_RELAX);
+    generic_relax();
+    stats_stop();
+    body_count = inst_count;    /* The compiled program stays in memory */
+    process_stack(body_count);
     
     /*
      ** Now build the real output (prologue + compiled program + epilogue)
      */
-    output = fopen(argv[c], "w");
+    output = fopen(output_name, "w");
     if (output == NULL) {
-        fprintf(stderr, "Couldn't open '%s' output file.\n", argv[2]);
+        fprintf(stderr, "Couldn't open '%s' output file.\n", output_name);
         exit(EXIT_FAILURE + 1);
     }
-    c++;
-    
-    if (c < argc) {
-        strcpy(library_path, argv[c]);
-        c++;
-	}
-#ifdef _WIN32
-	if (strlen(library_path) > 0 && library_path[strlen(library_path) - 1] != '\\')
-		strcat(library_path, "\\");
-#else
-	if (strlen(library_path) > 0 && library_path[strlen(library_path) - 1] != '/')
-		strcat(library_path, "/");
-#endif
     
     hex = '$';
     if (target == CPU_9900) {
@@ -7121,31 +9449,30 @@ int main(int argc, char *argv[])
     fprintf(output, "\n");
     
     fprintf(output, "\t; Created: %s\n", asctime(date));
-    fprintf(output, "COLECO:\tequ %d\n",
-            (machine == COLECOVISION || machine == COLECOVISION_SGM) ? 1 : 0);
-    fprintf(output, "SG1000:\tequ %d\n", (machine == SG1000) ? 1 : 0);
+    compile_equ("COLECO", (machine == COLECOVISION || machine == COLECOVISION_SGM) ? 1 : 0);
+    compile_equ("SG1000", (machine == SG1000) ? 1 : 0);
     if (machine == MSX)
         c = 1;
     else if (machine == MSX2)
         c = 2;
     else
         c = 0;
-    fprintf(output, "MSX:\tequ %d\n", c);
+    compile_equ("MSX", c);
     if (c) {
-        fprintf(output, "KONAMI:\tequ %d\n", bank_konami);
-    }
-    fprintf(output, "FM_SUPPORT:\tequ %d\n", option_fm);
-    fprintf(output, "SGM:\tequ %d\n", (machine == COLECOVISION_SGM) ? 1 : 0);
-    fprintf(output, "SVI:\tequ %d\n", (machine == SVI) ? 1 : 0);
-    fprintf(output, "SORD:\tequ %d\n", (machine == SORD) ? 1 : 0);
-    fprintf(output, "MEMOTECH:\tequ %d\n", (machine == MEMOTECH) ? 1 : 0);
-    fprintf(output, "EINSTEIN:\tequ %d\n", (machine == EINSTEIN) ? 1 : 0);
-    fprintf(output, "CPM:\tequ %d\n", cpm_option);
-    fprintf(output, "PENCIL:\tequ %d\n", pencil);
-    fprintf(output, "PV2000:\tequ %d\n", (machine == PV2000) ? 1 : 0);
-    fprintf(output, "TI99:\tequ %d\n", (machine == TI994A) ? 1 : 0);
-    fprintf(output, "NABU:\tequ %d\n", (machine == NABU) ? 1 : 0);
-    fprintf(output, "SMS:\tequ %d\n", (machine == SMS) ? 1 : 0);
+        compile_equ("KONAMI", bank_konami);
+    }
+    compile_equ("FM_SUPPORT", option_fm);
+    compile_equ("SGM", (machine == COLECOVISION_SGM) ? 1 : 0);
+    compile_equ("SVI", (machine == SVI) ? 1 : 0);
+    compile_equ("SORD", (machine == SORD) ? 1 : 0);
+    compile_equ("MEMOTECH", (machine == MEMOTECH) ? 1 : 0);
+    compile_equ("EINSTEIN", (machine == EINSTEIN) ? 1 : 0);
+    compile_equ("CPM", cpm_option);
+    compile_equ("PENCIL", pencil);
+    compile_equ("PV2000", (machine == PV2000) ? 1 : 0);
+    compile_equ("TI99", (machine == TI994A) ? 1 : 0);
+    compile_equ("NABU", (machine == NABU) ? 1 : 0);
+    compile_equ("SMS", (machine == SMS) ? 1 : 0);
     if (machine == NES) {
         if (bank_switching)
             fprintf(output, "NES_PRG_BANKS:\tequ %d\t; Each one 16K.\n", bank_rom_size / 16);
@@ -7155,11 +9482,13 @@ int main(int argc, char *argv[])
         fprintf(output, "NES_NAMETABLE:\tequ %d\n", (nes_nametable & 1) | ((nes_nametable & 2) << 2));
     }
     fprintf(output, "\n");
-    fprintf(output, "CVBASIC_MUSIC_PLAYER:\tequ %d\n", music_used);
-    fprintf(output, "CVBASIC_COMPRESSION:\tequ %d\n", compression_used);
-    fprintf(output, "CVBASIC_BANK_SWITCHING:\tequ %d\n", bank_switching);
-    fprintf(output, "CVBASIC_BANK_ROM_SIZE:\tequ %d\n", bank_rom_size);
-    fprintf(output, "COLECO_SPINNER:\tequ %d\n", spinner_used);
+    compile_equ("CVBASIC_MUSIC_PLAYER", music_used);
+    compile_equ("CVBASIC_COMPRESSION", compression_used);
+    compile_equ("CVBASIC_BANK_SWITCHING", bank_switching);
+    compile_equ("CVBASIC_BANK_ROM_SIZE", bank_rom_size);
+    if (target == CPU_9900)
+        compile_equ("CVBASIC_SCRATCHPAD_CODE", scratchpad_procedure != NULL);
+    compile_equ("COLECO_SPINNER", spinner_used);
     fprintf(output, "\n");
     fprintf(output, "BASE_RAM:\tequ %c%04x\t; Base of RAM\n", hex, consoles[machine].base_ram - extra_ram);
     fprintf(output, "RAM_SIZE:\tequ %c%04x\t; Base of RAM\n", hex, consoles[machine].memory_size + extra_ram);
@@ -7173,7 +9502,7 @@ int main(int argc, char *argv[])
         fprintf(output, "PSG:\tequ %c%02x\t; PSG port (write)\n", hex, consoles[machine].psg_port);
     }
     if (machine == CREATIVISION) {
-        fprintf(output, "SMALL_ROM:\tequ %d\n", small_rom);
+        compile_equ("SMALL_ROM", small_rom);
     }
 
     fprintf(output, "\n");
@@ -7186,6 +9515,7 @@ int main(int argc, char *argv[])
             fprintf(output, "\tforg $00000\n");
         }
     }
+    stats_start(PHASE_LIBRARY);
     strcpy(path, library_path);
     if (target == CPU_6502 && machine == CREATIVISION)
         strcat(path, "cvbasic_6502_prologue.asm");
@@ -7195,59 +9525,7 @@ int main(int argc, char *argv[])
         strcat(path, "cvbasic_9900_prologue.asm");
     else
         strcat(path, "cvbasic_prologue.asm");
-    prologue = fopen(path, "r");
-    if (prologue == NULL) {
-        fprintf(stderr, "Unable to open '%s'.\n", path);
-        exit(EXIT_FAILURE + 1);
-    }
-    while (fgets(line, sizeof(line) - 1, prologue)) {
-        p = line;
-        while (*p && isspace(*p))
-            p++;
-        if (memcmp(p, ";CVBASIC MARK DON'T CHANGE", 26) == 0) {  /* Location to replace */
-            if (frame_drive != NULL) {
-                if (target == CPU_6502)
-                    fprintf(output, "\tJSR " LABEL_PREFIX "%s\n", frame_drive->name);
-                else if (target == CPU_9900) {
-                    /* To call compiled code, we need the stack pointer and we need to jsr it */
-                    fprintf(output, "\tmov @>8314,r10\n");
-                    fprintf(output, "\tbl @jsr\n");
-                    strcpy(assigned, frame_drive->name);
-                    if (target == CPU_9900) {
-                        char *p = assigned;
-                        
-                        while (*p) {
-                            if (*p == '#')
-                                *p = '_';
-                            p++;
-                        }
-                    }
-                    fprintf(output, "\tdata " LABEL_PREFIX "%s\n", assigned);
-                }
-                else
-                    fprintf(output, "\tCALL " LABEL_PREFIX "%s\n", frame_drive->name);
-            }
-        } else {
-            fputs(line, output);
-        }
-    }
-    fclose(prologue);
-    
-    if (target == CPU_6502) {
-        bytes_used = process_variables();
-    }
-    
-    input = fopen(TEMPORARY_ASSEMBLER, "r");
-    if (input == NULL) {
-        fprintf(stderr, "Unable to reopen '%s'.\n", TEMPORARY_ASSEMBLER);
-        exit(EXIT_FAILURE + 1);
-    }
-    while (fgets(line, sizeof(line) - 1, input)) {
-        fputs(line, output);
-    }
-    fclose(input);
-    remove(TEMPORARY_ASSEMBLER);
-    
+    library_read(path, LIBRARY_PROLOGUE);
     strcpy(path, library_path);
     if (target == CPU_6502 && machine == CREATIVISION)
         strcat(path, "cvbasic_6502_epilogue.asm");
@@ -7257,18 +9535,38 @@ int main(int argc, char *argv[])
         strcat(path, "cvbasic_9900_epilogue.asm");
     else
         strcat(path, "cvbasic_epilogue.asm");
-    prologue = fopen(path, "r");
-    if (prologue == NULL) {
-        fprintf(stderr, "Unable to open '%s'.\n", path);
-        exit(EXIT_FAILURE + 1);
-    }
-    while (fgets(line, sizeof(line) - 1, prologue)) {
-        fputs(line, output);
+    library_read(path, LIBRARY_EPILOGUE);
+    
+    /*
+     ** Only the library routines used by the program are kept
+     */
+    library_link(body_count);
+    library_write(output, LIBRARY_PROLOGUE, compile_frame_drive);
+    stats_stop();
+    
+    if (target == CPU_6502) {
+        stats_start(PHASE_VARIABLES);
+        bytes_used = process_variables();
+        stats_stop();
+        stats_start(PHASE_OUTPUT);
+        inst_flush_from(output, body_count);
+        stats_stop();
     }
-    fclose(prologue);
+    stats_start(PHASE_OUTPUT);
+    inst_flush(output);
+    stats_stop();
+    
+    stats_start(PHASE_LIBRARY);
+    library_write(output, LIBRARY_EPILOGUE, compile_frame_drive);
+    stats_stop();
     
     if (target == CPU_Z80 || target == CPU_9900) {
+        stats_start(PHASE_VARIABLES);
         bytes_used = process_variables();
+        stats_stop();
+        stats_start(PHASE_OUTPUT);
+        inst_flush(output);
+        stats_stop();
     }
     
     /*
@@ -7296,19 +9594,24 @@ int main(int argc, char *argv[])
         }
         free(chrrom_data);
     }
+    stats_counter[STATS_OUTPUT_BYTES] = (int) ftell(output);
     fclose(output);
     
     /*
      ** Final reports
      */
+    if (option_tight_stack && stack_main >= 0)
+        stack_reserved = stack_main + stack_interrupt;
+    else
+        stack_reserved = STACK_RESERVED;
+    available_bytes = consoles[machine].memory_size + extra_ram;
     if (machine == MEMOTECH || machine == EINSTEIN || machine == NABU) {
         fprintf(stderr, "%d RAM bytes used for variables.\n", bytes_used);
     } else {
-        available_bytes = consoles[machine].memory_size + extra_ram;
         if (machine == SORD)    /* Because stack is set apart */
             available_bytes -= (music_used ? 33 : 0) + 146;
         else if (machine != COLECOVISION_SGM)
-            available_bytes -= 64 +                    /* Stack requirements */
+            available_bytes -= stack_reserved +        /* Stack requirements */
             (music_used ? 33 : 0) +     /* Music player requirements */
             146;                    /* Support variables */
         if (bytes_used > available_bytes) {
@@ -7317,7 +9620,282 @@ int main(int argc, char *argv[])
         }
         fprintf(stderr, "%d RAM bytes used of %d bytes available.\n", bytes_used, available_bytes);
     }
+    if (stack_main < 0) {
+        fprintf(stderr, "Stack depth unbounded (recursive GOSUB).\n");
+    } else if (machine == MEMOTECH || machine == EINSTEIN || machine == NABU || machine == SORD || machine == COLECOVISION_SGM) {
+        fprintf(stderr, "%d stack bytes in the worst case (%d main, %d video interrupt).\n",
+                stack_main + stack_interrupt, stack_main, stack_interrupt);
+    } else {
+        if (target == CPU_6502) {
+            c = (consoles[machine].stack & 0xff) + 1;   /* Stack page from STACK down to $0100 */
+            if (machine == NES)
+                c -= 0x80;      /* PPUBUF is at $0140-$017f */
+        } else if (target == CPU_9900) {
+            c = consoles[machine].stack - consoles[machine].base_ram - bytes_used;    /* R10 goes down to the variables */
+        } else {
+            c = available_bytes + stack_reserved - bytes_used;  /* RAM left for the stack */
+        }
+        if (stack_main + stack_interrupt > c)
+            fprintf(stderr, "Warning: ");
+        fprintf(stderr, "%d stack bytes in the worst case (%d main, %d video interrupt) of %d bytes free.\n",
+                stack_main + stack_interrupt, stack_main, stack_interrupt, c);
+    }
+    if (overlay_reclaimed > 0)
+        fprintf(stderr, "%d RAM bytes reclaimed by LOCAL variables.\n", overlay_reclaimed);
+    if (write_only_reclaimed > 0)
+        fprintf(stderr, "%d RAM bytes reclaimed by variables never read.\n", write_only_reclaimed);
+    if (library_removed_routines > 0)
+        fprintf(stderr, "%d unused library routines removed (about %d bytes).\n", library_removed_routines, library_removed_bytes);
+    if (stats_enabled) {
+        for (c = 0; c < symbol_count; c++) {
+            if (symbol_list[c]->label != NULL && (symbol_list[c]->label->used & LABEL_DEFINED) != 0)
+                STATS_COUNT(STATS_LABELS);
+        }
+        stats_counter[STATS_INTERNAL_LABELS] = next_local - 1;
+        stats_counter[STATS_SYMBOLS] = symbol_count;
+        stats_report(option_stats_json ? consoles[machine].name : consoles[machine].canonical, option_stats_json);
+    }
     fprintf(stderr, "Compilation finished for %s.\n\n", consoles[machine].canonical);
-    exit(err_code);
 }
 
+
+int main(int argc, char *argv[])
+{
+    int c;
+    int d;
+    char *p;
+    char *p1;
+    char *source;
+    char *output_name;
+    char target_name[4096];
+    int first_define;
+    int total_machines;
+    enum supported_machine machines[TOTAL_TARGETS];
+    int result;
+    
+    fprintf(stderr, "\nCVBasic compiler " VERSION "\n");
+    fprintf(stderr, "(c) 2024-2026 Oscar Toledo G. https://nanochess.org/\n\n");
+    
+    if (argc < 3) {
+        fprintf(stderr, "Usage:\n");
+        fprintf(stderr, "\n");
+        machine = COLECOVISION;
+        while (machine < TOTAL_TARGETS) {
+            if (machine == COLECOVISION)
+                fprintf(stderr, "    cvbasic [-DCONST=5] input.bas output.asm [library_path]\n");
+            else
+                fprintf(stderr, "    cvbasic --%s input.bas output.asm [library_path]\n", consoles[machine].name);
+            if (consoles[machine].options[0])
+                fprintf(stderr, "    cvbasic --%s %s input.bas output.asm [library_path]\n", consoles[machine].name, consoles[machine].options);
+            fprintf(stderr, "        %s\n",
+                    consoles[machine].description);
+            machine++;
+        }
+        fprintf(stderr, "    cvbasic --sms,nes,ti994a input.bas output.asm [library_path]\n");
+        fprintf(stderr, "        Compile for several targets (output_sms.asm, output_nes.asm, ...)\n");
+        fprintf(stderr, "    cvbasic --all input.bas output.asm [library_path]\n");
+        fprintf(stderr, "        Compile for all the targets\n");
+        fprintf(stderr, "\n");
+        fprintf(stderr, "    The -stats option (after the target options) shows compilation statistics,\n");
+        fprintf(stderr, "    and the variable placement for 6502 targets,\n");
+        fprintf(stderr, "    -stats=json writes them to the standard output as a JSON line.\n");
+        fprintf(stderr, "    The -nostrip option (after -stats) keeps the unused library routines.\n");
+        fprintf(stderr, "    The -tightstack option (after -nostrip) reserves for the stack only\n");
+        fprintf(stderr, "    the worst case found by the compiler, instead of 64 bytes.\n");
+        fprintf(stderr, "\n");
+        fprintf(stderr, "    By default, it will generate assembler files for Colecovision.\n");
+        fprintf(stderr, "    The library_path argument is optional so you can provide a\n");
+        fprintf(stderr, "    path where the prologue and epilogue files are available.\n");
+#ifdef ASM_LIBRARY_PATH
+        fprintf(stderr, "    Default: '" DEFAULT_ASM_LIBRARY_PATH "'\n");
+#endif
+        fprintf(stderr, "\n");
+        fprintf(stderr, "    It will return a zero error code if compilation was\n");
+        fprintf(stderr, "    successful, or non-zero otherwise.\n\n");
+        fprintf(stderr, "Many thanks to acadiel, Albert, abeker, an3ss, aotta, artrag,\n");
+        fprintf(stderr, "atari2600land, carlsson, chalkyw64, CrazyBoss, drfloyd, gemintronic,\n");
+        fprintf(stderr, "Jess Ragan, Kamshaft, Kiwi, MADrigal, pixelboy, Revontuli, SiRioKD,\n");
+        fprintf(stderr, "Tarzilla, Tony Cruise, tursilion, unhuman, visrealm, wavemotion,\n");
+        fprintf(stderr, "and youki.\n");
+        fprintf(stderr, "\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    /*
+     ** Select target machines.
+     */
+    c = 1;
+    total_machines = 0;
+    if (strcmp(argv[c], "--all") == 0) {
+        machine = COLECOVISION;
+        while (machine < TOTAL_TARGETS) {
+            machines[total_machines++] = machine;
+            machine++;
+        }
+        c++;
+    } else if (argv[c][0] == '-' && argv[c][1] == '-') {
+        p = &argv[c][2];
+        while (1) {
+            machine = COLECOVISION;
+            while (machine < TOTAL_TARGETS) {
+                p1 = consoles[machine].name;
+                d = 0;
+                while (p[d] && p[d] != ',' && tolower(p[d]) == tolower(*p1)) {
+                    d++;
+                    p1++;
+                }
+                if ((p[d] == '\0' || p[d] == ',') && *p1 == '\0')  /* Exact match */
+                    break;
+                machine++;
+            }
+            if (machine == TOTAL_TARGETS) {
+                fprintf(stderr, "Unknown target: %s\n", argv[c]);
+                exit(EXIT_FAILURE);
+            }
+            if (total_machines < TOTAL_TARGETS)
+                machines[total_machines++] = machine;
+            p += d;
+            if (*p != ',')
+                break;
+            p++;
+        }
+        c++;
+    } else {
+        machines[total_machines++] = COLECOVISION;
+    }
+
+    /*
+     ** Extra options.
+     */
+    option_ram16 = 0;
+    if (argv[c][0] == '-' && tolower(argv[c][1]) == 'r' && tolower(argv[c][2]) == 'a' &&
+        tolower(argv[c][3]) == 'm' && argv[c][4] == '1' && argv[c][5] == '6' &&
+        argv[c][6] == '\0') {
+        c++;
+        for (d = 0; d < total_machines; d++) {
+            if (machines[d] == MSX || machines[d] == MSX2)
+                option_ram16 = 1;
+        }
+        if (!option_ram16) {
+            fprintf(stderr, "-ram16 option only applies to MSX/MSX2.\n");
+            exit(EXIT_FAILURE + 1);
+        }
+    }
+    option_konami = 0;
+    if (argv[c][0] == '-' && tolower(argv[c][1]) == 'k' && tolower(argv[c][2]) == 'o' &&
+        tolower(argv[c][3]) == 'n' && tolower(argv[c][4]) == 'a' && tolower(argv[c][5]) == 'm' && tolower(argv[c][6]) == 'i' &&
+        argv[c][7] == '\0') {
+        c++;
+        for (d = 0; d < total_machines; d++) {
+            if (machines[d] == MSX || machines[d] == MSX2)
+                option_konami = 1;
+        }
+        if (!option_konami) {
+            fprintf(stderr, "-konami option only applies to MSX/MSX2.\n");
+            exit(EXIT_FAILURE + 1);
+        }
+    }
+    option_cpm = 0;
+    if (argv[c][0] == '-' && tolower(argv[c][1]) == 'c' && tolower(argv[c][2]) == 'p' &&
+        tolower(argv[c][3]) == 'm' && argv[c][4] == '\0') {
+        c++;
+        for (d = 0; d < total_machines; d++) {
+            if (machines[d] == MEMOTECH || machines[d] == NABU)
+                option_cpm = 1;
+        }
+        if (!option_cpm) {
+            fprintf(stderr, "-cpm option only applies to Memotech or NABU.\n");
+            exit(EXIT_FAILURE + 1);
+        }
+    }
+    option_rom16 = 0;
+    if (argv[c][0] == '-' && tolower(argv[c][1]) == 'r' && tolower(argv[c][2]) == 'o' &&
+        tolower(argv[c][3]) == 'm' && argv[c][4] == '1' && argv[c][5] == '6' &&
+        argv[c][6] == '\0') {
+        c++;
+        for (d = 0; d < total_machines; d++) {
+            if (machines[d] == CREATIVISION)
+                option_rom16 = 1;
+        }
+        if (!option_rom16) {
+            fprintf(stderr, "-rom16 option only applies to Creativision.\n");
+            exit(EXIT_FAILURE + 1);
+        }
+    }
+    stats_enabled = 0;
+    option_stats_json = 0;
+    if (strcmp(argv[c], "-stats") == 0 || strcmp(argv[c], "--stats") == 0) {
+        c++;
+        stats_enabled = 1;
+    } else if (strcmp(argv[c], "-stats=json") == 0 || strcmp(argv[c], "--stats=json") == 0) {
+        c++;
+        stats_enabled = 1;
+        option_stats_json = 1;
+    }
+    library_strip = 1;
+    if (strcmp(argv[c], "-nostrip") == 0) {
+        c++;
+        library_strip = 0;
+    }
+    option_tight_stack = 0;
+    if (strcmp(argv[c], "-tightstack") == 0) {
+        c++;
+        option_tight_stack = 1;
+    }
+    
+    /*
+     ** Passed-in constants (processed for each target)
+     */
+    first_define = c;
+    while (c < argc && argv[c][0] == '-' && tolower(argv[c][1]) == 'd')
+        c++;
+    if (c + 1 >= argc) {
+        fprintf(stderr, "Missing input or output file.\n");
+        exit(EXIT_FAILURE + 1);
+    }
+    source = argv[c++];
+    output_name = argv[c++];
+    if (c < argc) {
+        strcpy(library_path, argv[c]);
+        c++;
+    }
+#ifdef _WIN32
+    if (strlen(library_path) > 0 && library_path[strlen(library_path) - 1] != '\\')
+        strcat(library_path, "\\");
+#else
+    if (strlen(library_path) > 0 && library_path[strlen(library_path) - 1] != '/')
+        strcat(library_path, "/");
+#endif
+
+    /*
+     ** Compile for each target.
+     */
+    result = EXIT_SUCCESS;
+    for (d = 0; d < total_machines; d++) {
+        machine = machines[d];
+        if (total_machines == 1) {
+            strcpy(target_name, output_name);
+        } else {
+            
+            /*
+             ** Insert the target name before the extension: game.asm -> game_sms.asm
+             */
+            p = strrchr(output_name, '.');
+            if (p == NULL || strchr(p, '/') != NULL || strchr(p, '\\') != NULL)
+                p = output_name + strlen(output_name);
+            if ((p - output_name) + strlen(consoles[machine].name) + strlen(p) + 2 > sizeof(target_name)) {
+                fprintf(stderr, "Output name too long.\n");
+                exit(EXIT_FAILURE + 1);
+            }
+            memcpy(target_name, output_name, p - output_name);
+            target_name[p - output_name] = '\0';
+            strcat(target_name, "_");
+            strcat(target_name, consoles[machine].name);
+            strcat(target_name, p);
+        }
+        compile_program(source, target_name, argc, argv, first_define);
+        if (err_code != EXIT_SUCCESS)
+            result = err_code;
+    }
+    exit(result);
+}
@@ -77,12 +77,20 @@ extern int optimized;
 extern FILE *output;
 extern int next_local;
 
-#define HASH_PRIME    1103    /* A prime number */
-
 struct label {
     struct label *next;
     int used;
     int length;         /* For arrays */
+    int weight;         /* References weighted by loop nesting (for variables and arrays) */
+    struct label *scope;    /* PROCEDURE using the variable, or containing the label */
+    int offset;         /* Inside the overlay area (LOCAL variables) */
+    int known;          /* Constant value held by the variable */
+    int known_block;    /* Basic block where the value is known (0 if none) */
+    int low;            /* Range of values held by the variable (unsigned) */
+    int high;
+    int range_block;    /* Basic block where the range is known (0 if none) */
+    int store;          /* Place in the instruction stream of the last assignment */
+    int store_block;    /* Block where the last assignment isn't read yet (0 if none) */
     char name[1];
 };
 
@@ -110,5 +118,13 @@ struct label {
 #define LABEL_VAR_READ          0x0800
 #define LABEL_VAR_WRITE         0x1000
 #define LABEL_VAR_ACCESS        (LABEL_VAR_READ | LABEL_VAR_WRITE)
+#define LABEL_IN_SCRATCHPAD     0x2000  /* TI-99/4A variable placed in scratchpad */
+#define LABEL_IS_LOCAL          0x4000  /* Declared with LOCAL */
+#define LABEL_SCOPED            0x8000  /* The scope field is valid */
+#define LABEL_NOT_LOCAL         0x10000 /* Used by several PROCEDUREs or by address */
+#define LABEL_IN_OVERLAY        0x20000 /* LOCAL variable sharing RAM */
+#define LABEL_BY_ADDRESS        0x40000 /* VARPTR used (it can be read with PEEK) */
+#define LABEL_WRITE_ONLY        0x80000 /* Never read, the stores were removed */
 
 extern void emit_error(char *);
+extern int propagate_range(struct label *, int *, int *);
@@ -49,6 +49,7 @@ mywp      equ >8300
 myintwp   equ >8320
 
 ; data storage in scratchpad
+; (the compiler knows the size of this area, see SCRATCHPAD_RUNTIME in cvbasic.c)
     dorg >8340
 
 ; used to track scratchpad variables
@@ -124,6 +125,12 @@ music_bank          bss 2
     even
 lastsp              equ $
 
+; The compiler places its most used variables from lastsp up to freesp,
+; and OPTION SCRATCHPAD copies a PROCEDURE to scratchpad_run (up to >83bf,
+; the GPL substack isn't used because GPL never runs)
+freesp              equ >8378
+scratchpad_run      equ >8380
+
 ; While we don't mean to USE the console ROM, for interrupts we
 ; are forced to interface with some of it. We need these addresses
 ; to minimize what it does so we can maximize our use of scratchpad.
@@ -1923,8 +1930,17 @@ START
     li r0,firstsp       ; clear variables in scratchpad
 stlp1
     clr *r0+
-    ci r0,lastsp
+    ci r0,freesp
     jl stlp1
+
+    .ifne CVBASIC_SCRATCHPAD_CODE
+    li r0,scratchpad_code   ; copy the PROCEDURE that runs from scratchpad
+    li r1,scratchpad_run
+stlp3
+    mov *r0+,*r1+
+    ci r0,scratchpad_end
+    jl stlp3
+    .endif
     
     li r0,>2000         ; clear lower 8k RAM
 stlp2
@@ -10,6 +10,7 @@
 #include <string.h>
 #include "cvbasic.h"
 #include "node.h"
+#include "inst.h"
 #include "driver.h"
 #include "cpuz80.h"
 #include "cpu6502.h"
@@ -20,10 +21,64 @@
  */
 void generic_dump(void)
 {
+    if (target == CPU_6502)
+        cpu6502_dump();
+    if (target == CPU_9900)
+        cpu9900_dump();
     if (target == CPU_Z80)
         cpuz80_dump();
 }
 
+/*
+ ** Reset the optimizer state (start of a new program)
+ */
+void generic_reset(void)
+{
+    if (target == CPU_6502)
+        cpu6502_empty();
+    if (target == CPU_9900)
+        cpu9900_reset();
+    if (target == CPU_Z80)
+        cpuz80_reset();
+}
+
+/*
+ ** Branch relaxation
+ */
+void generic_relax(void)
+{
+    if (target == CPU_6502)
+        cpu6502_relax();
+    if (target == CPU_9900)
+        cpu9900_relax();
+    if (target == CPU_Z80)
+        cpuz80_relax();
+}
+
+/*
+ ** Stack effect of an entry of the instruction stream
+ */
+int generic_stack(int index, char **callee)
+{
+    if (target == CPU_6502)
+        return cpu6502_stack(index, callee);
+    if (target == CPU_9900)
+        return cpu9900_stack(index, callee);
+    return cpuz80_stack(index, callee);
+}
+
+/*
+ ** Store into a variable by an entry of the instruction stream
+ */
+char *generic_store(int index, char *variable)
+{
+    if (target == CPU_6502)
+        return cpu6502_store(index, variable);
+    if (target == CPU_9900)
+        return cpu9900_store(index, variable);
+    return cpuz80_store(index, variable);
+}
+
 /*
  ** 8-bit test
  */
@@ -155,6 +210,318 @@ void generic_jump_zero(char *label)
         cpuz80_2op("JP", "Z", label);
 }
 
+/*
+ ** Jump if not zero
+ */
+void generic_jump_nonzero(char *label)
+{
+    if (target == CPU_6502)
+        cpu6502_1op("BNE.L", label);
+    if (target == CPU_9900) {
+        char internal_label[256], internal_label2[256];
+        int number = next_local++;
+        
+        sprintf(internal_label, INTERNAL_PREFIX "%d", number);
+        sprintf(internal_label2, "@%s", label);
+        
+        cpu9900_1op("jeq", internal_label);
+        cpu9900_1op("b", internal_label2);
+        cpu9900_label(internal_label);
+    }
+    if (target == CPU_Z80)
+        cpuz80_2op("JP", "NZ", label);
+}
+
+/*
+ ** Keep the counter of a FOR loop in a register (8-bit unsigned
+ ** variable, STEP 1 or -1, and a constant limit). The body starts at
+ ** the loop label in start. Returns zero if the body cannot keep it.
+ **
+ ** The loop repeats while the counter is below the limit (positive)
+ ** or while it isn't below the limit (negative).
+ **
+ ** The counter goes to the register before the loop, and the step and
+ ** the comparison are generated here. generic_for_store() saves it
+ ** at the exit.
+ */
+int generic_for_register(int start, char *variable, int positive, int limit, char *loop, char *exit)
+{
+    char temp[256];
+    char skip[256];
+    int init;
+    int size;
+    int c;
+    
+    if (target == CPU_Z80 && !cpuz80_for_register(start, variable, exit))
+        return 0;
+    if (target == CPU_6502 && !cpu6502_for_register(start, variable, exit))
+        return 0;
+    if (target == CPU_9900 && !cpu9900_for_register(start, variable, exit))
+        return 0;
+    size = 0;
+    for (c = start; c < inst_count; c++) {
+        if (inst_stream[c].type == INST_OP)
+            size++;
+    }
+    generic_reset();
+    init = inst_count;
+    if (target == CPU_Z80) {
+        sprintf(temp, "(%s)", variable);
+        cpuz80_2op("LD", "A", temp);
+        cpuz80_2op("LD", "B", "A");
+    }
+    if (target == CPU_6502)
+        cpu6502_1op("LDX", variable);
+    if (target == CPU_9900) {
+        sprintf(temp, "@%s", variable);
+        cpu9900_2op("movb", temp, "r9");
+    }
+    generic_dump();
+    inst_move(start, init);
+    generic_reset();
+    if (target == CPU_Z80) {
+        if (positive) {
+            cpuz80_1op("INC", "B");
+            cpuz80_2op("LD", "A", "B");
+            sprintf(temp, "%d", limit);
+            cpuz80_1op("CP", temp);
+            cpuz80_2op("JP", "C", loop);
+        } else if (limit == 1 && size <= 30) {  /* DJNZ reaches about 30 instructions back */
+            cpuz80_1op("DJNZ", loop);
+        } else if (limit == 1) {
+            cpuz80_1op("DEC", "B");
+            cpuz80_2op("JP", "NZ", loop);
+        } else {
+            cpuz80_1op("DEC", "B");
+            cpuz80_2op("LD", "A", "B");
+            sprintf(temp, "%d", limit);
+            cpuz80_1op("CP", temp);
+            cpuz80_2op("JP", "NC", loop);
+        }
+    }
+    if (target == CPU_6502) {
+        if (positive) {
+            cpu6502_noop("INX");
+            sprintf(temp, "#%d", limit);
+            cpu6502_1op("CPX", temp);
+            cpu6502_1op("BCC.L", loop);
+        } else if (limit == 1) {
+            cpu6502_noop("DEX");
+            cpu6502_1op("BNE.L", loop);
+        } else {
+            cpu6502_noop("DEX");
+            sprintf(temp, "#%d", limit);
+            cpu6502_1op("CPX", temp);
+            cpu6502_1op("BCS.L", loop);
+        }
+    }
+    if (target == CPU_9900) {
+        sprintf(skip, INTERNAL_PREFIX "%d", next_local++);
+        if (positive) {
+            cpu9900_2op("ai", "r9", "256");
+            sprintf(temp, "%d", limit * 256);
+            cpu9900_2op("ci", "r9", temp);
+            cpu9900_1op("jhe", skip);
+        } else {
+            cpu9900_2op("ai", "r9", "-256");
+            sprintf(temp, "%d", limit * 256);
+            cpu9900_2op("ci", "r9", temp);
+            cpu9900_1op("jl", skip);
+        }
+        sprintf(temp, "@%s", loop);
+        cpu9900_1op("b", temp);
+        cpu9900_label(skip);
+    }
+    return 1;
+}
+
+/*
+ ** Check for the address of an array element indexed by a 8-bit variable
+ */
+static int generic_index(int index, char *variable, char *array, int *last)
+{
+    if (target == CPU_Z80)
+        return cpuz80_index(index, variable, array, last);
+    if (target == CPU_6502)
+        return cpu6502_index(index, variable, array, last);
+    return cpu9900_index(index, variable, array, last);
+}
+
+/*
+ ** Replace the address calculation of an array indexed by the counter
+ ** of a FOR loop (8-bit unsigned variable, constant step that cannot
+ ** wrap around) with a pointer that advances with the counter. The body
+ ** starts at the loop label in start.
+ **
+ ** The pointer is set before the loop, and it advances here. Returns
+ ** the number of entries added before the loop (zero if it isn't
+ ** possible).
+ */
+int generic_for_pointer(int start, char *variable, int step, char *exit)
+{
+    char array[MAX_LINE_SIZE];
+    char name[MAX_LINE_SIZE];
+    char other[MAX_LINE_SIZE];
+    char temp[256];
+    char skip[256];
+    int amount;
+    int added;
+    int init;
+    int size;
+    int found;
+    int count;
+    int best;
+    int last;
+    int c;
+    int d;
+    
+    /*
+     ** The pointer goes to the array used most times
+     */
+    size = 0;
+    best = 0;
+    for (c = start; c < inst_count; c++) {
+        found = generic_index(c, variable, name, &last);
+        if (found == 0)
+            continue;
+        count = 0;
+        for (d = c; d < inst_count; d++) {
+            if (generic_index(d, variable, other, &last) == found &&
+                (target == CPU_9900 || strcmp(other, name) == 0))   /* The TMS9900 reaches the other arrays at an offset */
+                count++;
+        }
+        if (count > best) {
+            best = count;
+            size = found;
+            strcpy(array, name);
+        }
+    }
+    if (size == 0)
+        return 0;
+    if (target == CPU_Z80 && !cpuz80_for_pointer(start, variable, exit, array, size))
+        return 0;
+    if (target == CPU_6502 && !cpu6502_for_pointer(start, variable, exit, array, size))
+        return 0;
+    if (target == CPU_9900 && !cpu9900_for_pointer(start, variable, exit, array, size))
+        return 0;
+    generic_reset();
+    init = inst_count;
+    if (target == CPU_Z80) {
+        sprintf(temp, "(%s)", variable);
+        cpuz80_2op("LD", "HL", temp);
+        cpuz80_2op("LD", "H", "0");
+        if (size == 2)
+            cpuz80_2op("ADD", "HL", "HL");
+        cpuz80_2op("LD", "DE", array);
+        cpuz80_2op("ADD", "HL", "DE");
+        cpuz80_1op("PUSH", "HL");
+        cpuz80_1op("POP", "IY");
+    }
+    if (target == CPU_6502) {
+        cpu6502_1op("LDA", variable);
+        if (size == 2)
+            cpu6502_1op("ASL", "A");
+        cpu6502_1op("LDY", "#0");
+        if (size == 2) {
+            cpu6502_1op("BCC", "$+3");
+            cpu6502_noop("INY");
+        }
+        cpu6502_noop("CLC");
+        sprintf(temp, "#%s", array);
+        cpu6502_1op("ADC", temp);
+        cpu6502_1op("STA", "loop_pointer");
+        cpu6502_noop("TYA");
+        strcat(temp, ">>8");
+        cpu6502_1op("ADC", temp);
+        cpu6502_1op("STA", "loop_pointer+1");
+    }
+    if (target == CPU_9900) {
+        sprintf(temp, "@%s", variable);
+        cpu9900_2op("movb", temp, "r8");
+        cpu9900_2op("srl", "r8", "8");
+        if (size == 2)
+            cpu9900_2op("sla", "r8", "1");
+        cpu9900_2op("ai", "r8", array);
+    }
+    generic_dump();
+    added = inst_count - init;
+    inst_move(start, init);
+    generic_reset();
+    amount = step * size;
+    if (target == CPU_Z80) {
+        if (amount >= -4 && amount <= 4) {
+            for (c = 0; c < amount; c++)
+                cpuz80_1op("INC", "IY");
+            for (c = 0; c > amount; c--)
+                cpuz80_1op("DEC", "IY");
+        } else {
+            sprintf(temp, "%d", amount & 0xffff);
+            cpuz80_2op("LD", "DE", temp);
+            cpuz80_2op("ADD", "IY", "DE");
+        }
+    }
+    if (target == CPU_6502) {
+        sprintf(skip, INTERNAL_PREFIX "%d", next_local++);
+        if (amount == 1) {
+            cpu6502_1op("INC", "loop_pointer");
+            cpu6502_1op("BNE", skip);
+            cpu6502_1op("INC", "loop_pointer+1");
+            cpu6502_label(skip);
+        } else if (amount == -1) {
+            cpu6502_1op("LDA", "loop_pointer");
+            cpu6502_1op("BNE", skip);
+            cpu6502_1op("DEC", "loop_pointer+1");
+            cpu6502_label(skip);
+            cpu6502_1op("DEC", "loop_pointer");
+        } else {
+            cpu6502_1op("LDA", "loop_pointer");
+            cpu6502_noop("CLC");
+            sprintf(temp, "#%d", amount & 0xff);
+            cpu6502_1op("ADC", temp);
+            cpu6502_1op("STA", "loop_pointer");
+            cpu6502_1op("LDA", "loop_pointer+1");
+            sprintf(temp, "#%d", (amount >> 8) & 0xff);
+            cpu6502_1op("ADC", temp);
+            cpu6502_1op("STA", "loop_pointer+1");
+        }
+    }
+    if (target == CPU_9900) {
+        if (amount == 1)
+            cpu9900_1op("inc", "r8");
+        else if (amount == 2)
+            cpu9900_1op("inct", "r8");
+        else if (amount == -1)
+            cpu9900_1op("dec", "r8");
+        else if (amount == -2)
+            cpu9900_1op("dect", "r8");
+        else {
+            sprintf(temp, "%d", amount);
+            cpu9900_2op("ai", "r8", temp);
+        }
+    }
+    return added;
+}
+
+/*
+ ** Save the counter of a FOR loop kept in a register
+ */
+void generic_for_store(char *variable)
+{
+    char temp[256];
+    
+    if (target == CPU_Z80) {
+        sprintf(temp, "(%s)", variable);
+        cpuz80_2op("LD", "A", "B");
+        cpuz80_2op("LD", temp, "A");
+    }
+    if (target == CPU_6502)
+        cpu6502_1op("STX", variable);
+    if (target == CPU_9900) {
+        sprintf(temp, "@%s", variable);
+        cpu9900_2op("movb", "r9", temp);
+    }
+}
+
 /*
  ** Generic range comparison (8-bit)
  */
@@ -322,6 +689,416 @@ void generic_comparison_16bit(int min, int max, char *label)
     }
 }
 
+/*
+ ** Jump to label if the value is inside the range (SELECT CASE dispatch)
+ */
+void generic_select_range(int bits16, int min, int max, char *label)
+{
+    char value[256];
+    char skip[256];
+    char far_label[256];
+    
+    sprintf(skip, INTERNAL_PREFIX "%d", next_local++);
+    sprintf(far_label, "@%s", label);
+    if (!bits16) {
+        if (target == CPU_Z80) {
+            if (min == max) {
+                if (min == 0) {
+                    cpuz80_1op("OR", "A");
+                } else {
+                    sprintf(value, "%d", min);
+                    cpuz80_1op("CP", value);
+                }
+                cpuz80_2op("JP", "Z", label);
+                return;
+            }
+            if (max == 255) {
+                sprintf(value, "%d", min);
+                cpuz80_1op("CP", value);
+                cpuz80_2op("JP", "NC", label);
+                return;
+            }
+            if (min != 0) {
+                sprintf(value, "%d", min);
+                cpuz80_1op("CP", value);
+                cpuz80_2op("JP", "C", skip);
+            }
+            sprintf(value, "%d", max + 1);
+            cpuz80_1op("CP", value);
+            cpuz80_2op("JP", "C", label);
+            if (min != 0)
+                cpuz80_label(skip);
+        }
+        if (target == CPU_6502) {
+            if (min == max) {
+                sprintf(value, "#%d", min);
+                cpu6502_1op("CMP", value);
+                cpu6502_1op("BEQ.L", label);
+                return;
+            }
+            if (max == 255) {
+                sprintf(value, "#%d", min);
+                cpu6502_1op("CMP", value);
+                cpu6502_1op("BCS.L", label);
+                return;
+            }
+            if (min != 0) {
+                sprintf(value, "#%d", min);
+                cpu6502_1op("CMP", value);
+                cpu6502_1op("BCC.L", skip);
+            }
+            sprintf(value, "#%d", max + 1);
+            cpu6502_1op("CMP", value);
+            cpu6502_1op("BCC.L", label);
+            if (min != 0)
+                cpu6502_label(skip);
+        }
+        if (target == CPU_9900) {
+            if (min == max) {
+                sprintf(value, "%d   ; %d*256", min * 256, min);
+                cpu9900_2op("li", "r1", value);
+                cpu9900_2op("cb", "r1", "r0");
+                cpu9900_1op("jne", skip);
+            } else {
+                if (min != 0) {
+                    sprintf(value, "%d", min * 256);
+                    cpu9900_2op("ci", "r0", value);
+                    cpu9900_1op("jl", skip);
+                }
+                if (max != 255) {
+                    sprintf(value, "%d", max * 256 + 255);
+                    cpu9900_2op("ci", "r0", value);
+                    cpu9900_1op("jh", skip);
+                }
+            }
+            cpu9900_1op("b", far_label);
+            cpu9900_label(skip);
+        }
+        return;
+    }
+    if (target == CPU_Z80) {
+        if (min == 0 && max == 0) {
+            cpuz80_2op("LD", "A", "H");
+            cpuz80_1op("OR", "L");
+            cpuz80_2op("JP", "Z", label);
+            return;
+        }
+        if (min == 0 && max != 65535) {
+            generic_select_below(bits16, max + 1, label);
+            return;
+        }
+        sprintf(value, "%d", min);
+        cpuz80_2op("LD", "DE", value);
+        cpuz80_1op("OR", "A");
+        cpuz80_2op("SBC", "HL", "DE");
+        cpuz80_2op("ADD", "HL", "DE");
+        if (min == max) {
+            cpuz80_2op("JP", "Z", label);
+            return;
+        }
+        if (max == 65535) {
+            cpuz80_2op("JP", "NC", label);
+            return;
+        }
+        cpuz80_2op("JP", "C", skip);
+        sprintf(value, "%d", max + 1);
+        cpuz80_2op("LD", "DE", value);
+/*      cpuz80_1op("OR", "A"); */ /* Guaranteed */
+        cpuz80_2op("SBC", "HL", "DE");
+        cpuz80_2op("ADD", "HL", "DE");
+        cpuz80_2op("JP", "C", label);
+        cpuz80_label(skip);
+    }
+    if (target == CPU_6502) {
+        if (min == max) {
+            sprintf(value, "#%d", min & 0xff);
+            cpu6502_1op("CMP", value);
+            cpu6502_1op("BNE.L", skip);
+            sprintf(value, "#%d", (min >> 8) & 0xff);
+            cpu6502_1op("CPY", value);
+            cpu6502_1op("BEQ.L", label);
+            cpu6502_label(skip);
+            return;
+        }
+        if (min == 0 && max != 65535) {
+            generic_select_below(bits16, max + 1, label);
+            return;
+        }
+        cpu6502_noop("PHA");
+        cpu6502_noop("SEC");
+        sprintf(value, "#%d", min & 0xff);
+        cpu6502_1op("SBC", value);
+        cpu6502_noop("TYA");
+        sprintf(value, "#%d", (min >> 8) & 0xff);
+        cpu6502_1op("SBC", value);
+        cpu6502_noop("PLA");
+        if (max == 65535) {
+            cpu6502_1op("BCS.L", label);
+            return;
+        }
+        cpu6502_1op("BCC.L", skip);
+        cpu6502_noop("PHA");
+/*      cpu6502_noop("SEC"); */ /* Guaranteed */
+        sprintf(value, "#%d", (max + 1) & 0xff);
+        cpu6502_1op("SBC", value);
+        cpu6502_noop("TYA");
+        sprintf(value, "#%d", ((max + 1) >> 8) & 0xff);
+        cpu6502_1op("SBC", value);
+        cpu6502_noop("PLA");
+        cpu6502_1op("BCC.L", label);
+        cpu6502_label(skip);
+    }
+    if (target == CPU_9900) {
+        if (min == max) {
+            sprintf(value, "%d", min);
+            cpu9900_2op("ci", "r0", value);
+            cpu9900_1op("jne", skip);
+        } else {
+            if (min != 0) {
+                sprintf(value, "%d", min);
+                cpu9900_2op("ci", "r0", value);
+                cpu9900_1op("jl", skip);
+            }
+            if (max != 65535) {
+                sprintf(value, "%d", max);
+                cpu9900_2op("ci", "r0", value);
+                cpu9900_1op("jh", skip);
+            }
+        }
+        cpu9900_1op("b", far_label);
+        cpu9900_label(skip);
+    }
+}
+
+/*
+ ** Jump to label if the value is below another value (SELECT CASE)
+ */
+void generic_select_below(int bits16, int value, char *label)
+{
+    char temp[256];
+    char skip[256];
+    
+    if (target == CPU_Z80) {
+        sprintf(temp, "%d", value);
+        if (!bits16) {
+            cpuz80_1op("CP", temp);
+        } else {
+            cpuz80_2op("LD", "DE", temp);
+            cpuz80_1op("OR", "A");
+            cpuz80_2op("SBC", "HL", "DE");
+            cpuz80_2op("ADD", "HL", "DE");
+        }
+        cpuz80_2op("JP", "C", label);
+    }
+    if (target == CPU_6502) {
+        if (!bits16) {
+            sprintf(temp, "#%d", value);
+            cpu6502_1op("CMP", temp);
+        } else {
+            cpu6502_noop("PHA");
+            cpu6502_noop("SEC");
+            sprintf(temp, "#%d", value & 0xff);
+            cpu6502_1op("SBC", temp);
+            cpu6502_noop("TYA");
+            sprintf(temp, "#%d", (value >> 8) & 0xff);
+            cpu6502_1op("SBC", temp);
+            cpu6502_noop("PLA");
+        }
+        cpu6502_1op("BCC.L", label);
+    }
+    if (target == CPU_9900) {
+        sprintf(skip, INTERNAL_PREFIX "%d", next_local++);
+        sprintf(temp, "%d", bits16 ? value : value * 256);
+        cpu9900_2op("ci", "r0", temp);
+        cpu9900_1op("jhe", skip);
+        sprintf(temp, "@%s", label);
+        cpu9900_1op("b", temp);
+        cpu9900_label(skip);
+    }
+}
+
+/*
+ ** Jump to below if the value is below the split value, and to equal
+ ** if it is the split value. The flags of the comparison are reused
+ ** when the processor keeps them (SELECT CASE).
+ */
+void generic_select_split(int bits16, int value, char *below, char *equal)
+{
+    char skip[256];
+    char far_label[256];
+    
+    generic_select_below(bits16, value, below);
+    if (target == CPU_Z80) {
+        cpuz80_2op("JP", "Z", equal);
+        return;
+    }
+    if (target == CPU_6502 && !bits16) {
+        cpu6502_1op("BEQ.L", equal);
+        return;
+    }
+    if (target == CPU_9900 && bits16) {
+        sprintf(skip, INTERNAL_PREFIX "%d", next_local++);
+        sprintf(far_label, "@%s", equal);
+        cpu9900_1op("jne", skip);
+        cpu9900_1op("b", far_label);
+        cpu9900_label(skip);
+        return;
+    }
+    generic_select_range(bits16, value, value, equal);  /* The comparison didn't see all the bits */
+}
+
+/*
+ ** Approximate cost of each SELECT CASE dispatch step.
+ **
+ ** Cycles of the path taken and bytes of code, both are already scaled
+ ** so a cycle and a byte weigh about the same on each processor.
+ */
+static const int select_costs[3][2][SELECT_TOTAL_TESTS][2] = {
+    {   /* Z80 (T-states, ROM is cheap) */
+        {{17, 5}, {34, 10}, {17, 5}, {17, 5}, {10, 3}, {95, 22}, {0, 2}, {14, 4}, {10, 3}},
+        {{50, 10}, {96, 18}, {50, 10}, {50, 10}, {10, 3}, {139, 29}, {0, 2}, {18, 5}, {10, 3}},
+    },
+    {   /* 6502 (cycles are four times the Z80 T-states) */
+        {{20, 5}, {36, 9}, {20, 5}, {20, 5}, {12, 3}, {124, 22}, {0, 2}, {20, 5}, {12, 3}},
+        {{40, 10}, {136, 24}, {68, 12}, {68, 12}, {12, 3}, {172, 30}, {0, 2}, {40, 10}, {40, 10}},
+    },
+    {   /* TMS9900 (clock cycles, every byte counts double) */
+        {{50, 24}, {64, 32}, {40, 20}, {40, 20}, {16, 8}, {120, 52}, {0, 4}, {50, 24}, {50, 24}},
+        {{40, 20}, {64, 32}, {40, 20}, {40, 20}, {16, 8}, {100, 44}, {0, 4}, {40, 20}, {24, 12}},
+    },
+};
+
+/*
+ ** Get the cost of a SELECT CASE dispatch step
+ */
+void generic_select_cost(enum select_test test, int bits16, int *cycles, int *bytes)
+{
+    int cpu;
+    
+    cpu = (target == CPU_6502) ? 1 : (target == CPU_9900) ? 2 : 0;
+    *cycles = select_costs[cpu][bits16 != 0][test][0];
+    *bytes = select_costs[cpu][bits16 != 0][test][1];
+}
+
+/*
+ ** Jump through a table of labels indexed by the value minus low,
+ ** values outside the table go to outside (SELECT CASE dispatch)
+ */
+void generic_select_table(int bits16, int low, int total, int *labels, char *outside)
+{
+    char table[256];
+    char value[sizeof(table) + 8];  /* Table label plus addressing mode */
+    char skip[256];
+    int c;
+    
+    sprintf(table, INTERNAL_PREFIX "%d", next_local++);
+    if (target == CPU_Z80) {
+        if (!bits16) {
+            if (low != 0) {
+                sprintf(value, "%d", low);
+                cpuz80_1op("SUB", value);
+            }
+            if (total < 256) {
+                sprintf(value, "%d", total);
+                cpuz80_1op("CP", value);
+                cpuz80_2op("JP", "NC", outside);
+            }
+            cpuz80_2op("LD", "L", "A");
+            cpuz80_2op("LD", "H", "0");
+        } else {
+            if (low != 0 && low <= 3) {
+                for (c = 0; c < low; c++)
+                    cpuz80_1op("DEC", "HL");
+            } else if (low != 0) {
+                sprintf(value, "%d", low);
+                cpuz80_2op("LD", "DE", value);
+                cpuz80_1op("OR", "A");
+                cpuz80_2op("SBC", "HL", "DE");
+            }
+            sprintf(value, "%d", total);
+            cpuz80_2op("LD", "DE", value);
+            cpuz80_1op("OR", "A");
+            cpuz80_2op("SBC", "HL", "DE");
+            cpuz80_2op("ADD", "HL", "DE");
+            cpuz80_2op("JP", "NC", outside);
+        }
+        cpuz80_2op("ADD", "HL", "HL");
+        cpuz80_2op("LD", "DE", table);
+        cpuz80_2op("ADD", "HL", "DE");
+        cpuz80_2op("LD", "A", "(HL)");
+        cpuz80_1op("INC", "HL");
+        cpuz80_2op("LD", "H", "(HL)");
+        cpuz80_2op("LD", "L", "A");
+        cpuz80_1op("JP", "(HL)");
+    }
+    if (target == CPU_6502) {   /* Up to 128 entries */
+        if (bits16) {
+            if (low != 0) {
+                cpu6502_noop("SEC");
+                sprintf(value, "#%d", low & 0xff);
+                cpu6502_1op("SBC", value);
+                cpu6502_noop("TAX");
+                cpu6502_noop("TYA");
+                sprintf(value, "#%d", (low >> 8) & 0xff);
+                cpu6502_1op("SBC", value);
+                cpu6502_1op("BNE.L", outside);
+                cpu6502_noop("TXA");
+            } else {
+                cpu6502_1op("CPY", "#0");
+                cpu6502_1op("BNE.L", outside);
+            }
+        } else if (low != 0) {
+            cpu6502_noop("SEC");
+            sprintf(value, "#%d", low);
+            cpu6502_1op("SBC", value);
+        }
+        sprintf(value, "#%d", total);
+        cpu6502_1op("CMP", value);
+        cpu6502_1op("BCS.L", outside);
+        cpu6502_1op("ASL", "A");
+        cpu6502_noop("TAX");
+        sprintf(value, "%s,X", table);
+        cpu6502_1op("LDA", value);
+        cpu6502_1op("STA", "temp");
+        sprintf(value, "%s+1,X", table);
+        cpu6502_1op("LDA", value);
+        cpu6502_1op("STA", "temp+1");
+        cpu6502_1op("JMP", "(temp)");
+    }
+    if (target == CPU_9900) {
+        sprintf(skip, INTERNAL_PREFIX "%d", next_local++);
+        if (!bits16)
+            cpu9900_2op("srl", "r0", "8");
+        if (low != 0) {
+            sprintf(value, "%d", (65536 - low) & 0xffff);
+            cpu9900_2op("ai", "r0", value);
+        }
+        if (bits16 || total < 256) {
+            sprintf(value, "%d", total);
+            cpu9900_2op("ci", "r0", value);
+            cpu9900_1op("jl", skip);
+            sprintf(value, "@%s", outside);
+            cpu9900_1op("b", value);
+            cpu9900_label(skip);
+        }
+        cpu9900_2op("sla", "r0", "1");
+        cpu9900_2op("mov", "r0", "r1");
+        sprintf(value, "@%s(r1)", table);
+        cpu9900_2op("mov", value, "r0");
+        cpu9900_1op("b", "*r0");
+    }
+    generic_label(table);
+    for (c = 0; c < total; c++) {
+        sprintf(value, INTERNAL_PREFIX "%d", labels[c]);
+        if (target == CPU_6502)
+            cpu6502_1op("DW", value);
+        else if (target == CPU_9900)
+            cpu9900_1op("data", value);
+        else
+            cpuz80_1op("DW", value);
+    }
+}
+
 /*
  ** Generic disable interrupt
  */
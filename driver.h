@@ -7,6 +7,10 @@
 */
 
 extern void generic_dump(void);
+extern void generic_relax(void);
+extern int generic_stack(int, char **);
+extern char *generic_store(int, char *);
+extern void generic_reset(void);
 extern void generic_test_8(void);
 extern void generic_test_16(void);
 extern void generic_label(char *);
@@ -15,7 +19,32 @@ extern void generic_return(void);
 extern void generic_jump(char *);
 extern void generic_jump_short(char *);
 extern void generic_jump_zero(char *);
+extern void generic_jump_nonzero(char *);
+extern int generic_for_register(int, char *, int, int, char *, char *);
+extern void generic_for_store(char *);
+extern int generic_for_pointer(int, char *, int, char *);
 extern void generic_comparison_8bit(int, int, char *);
 extern void generic_comparison_16bit(int, int, char *);
+/*
+ ** Steps of the SELECT CASE dispatch (for the cost model)
+ */
+enum select_test {
+    SELECT_EQUAL,       /* Compare for a single value */
+    SELECT_RANGE,       /* Compare for a range of values */
+    SELECT_BOUND,       /* Compare for a range open at one side */
+    SELECT_BELOW,       /* Split for a binary search */
+    SELECT_JUMP,        /* Jump to CASE ELSE or END SELECT */
+    SELECT_TABLE,       /* Jump table lookup */
+    SELECT_ENTRY,       /* Each entry of a jump table */
+    SELECT_ZERO,        /* Compare for zero */
+    SELECT_SPLIT,       /* Compare for the split value, after the split */
+    SELECT_TOTAL_TESTS
+};
+
+extern void generic_select_range(int, int, int, char *);
+extern void generic_select_below(int, int, char *);
+extern void generic_select_split(int, int, char *, char *);
+extern void generic_select_table(int, int, int, int *, char *);
+extern void generic_select_cost(enum select_test, int, int *, int *);
 extern void generic_interrupt_disable(void);
 extern void generic_interrupt_enable(void);
@@ -0,0 +1,420 @@
+/*
+ ** CVBasic - Assembler instruction stream
+ **
+ ** by Oscar Toledo G.
+ **
+ ** Creation date: Oct/17/2026. Separated from the backends' line buffers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include "cvbasic.h"
+#include "inst.h"
+#include "stats.h"
+
+/*
+ ** The backends emit into this stream, the peephole optimizers work over
+ ** it, and it is converted to text only when flushed.
+ */
+struct inst *inst_stream;
+int inst_count;
+int inst_barrier;       /* The peephole optimizer doesn't look before this entry */
+int inst_labels;        /* Labels added so far (each one can start a basic block) */
+
+static int inst_size;
+
+static char *inst_pool;
+static int inst_pool_used;
+static int inst_pool_size;
+
+/*
+ ** Reset the instruction stream
+ */
+void inst_reset(void)
+{
+    inst_count = 0;
+    inst_barrier = 0;
+    inst_pool_used = 0;
+}
+
+/*
+ ** Search a mnemonic in a sorted table
+ */
+int inst_lookup(char **table, int size, char *mnemonic)
+{
+    int low;
+    int high;
+    int middle;
+    int c;
+
+    low = 0;
+    high = size - 1;
+    while (low <= high) {
+        middle = (low + high) / 2;
+        c = strcmp(mnemonic, table[middle]);
+        if (c == 0)
+            return middle;
+        if (c < 0)
+            high = middle - 1;
+        else
+            low = middle + 1;
+    }
+    return -1;
+}
+
+/*
+ ** Save a string in the pool
+ */
+static int inst_save(char *string)
+{
+    int length;
+    int offset;
+
+    if (string == NULL)
+        return -1;
+    length = (int) strlen(string) + 1;
+    if (inst_pool_used + length > inst_pool_size) {
+        inst_pool_size = (inst_pool_size + length) * 2;
+        inst_pool = realloc(inst_pool, inst_pool_size);
+        if (inst_pool == NULL) {
+            emit_error("out of memory");
+            exit(1);
+        }
+    }
+    offset = inst_pool_used;
+    memcpy(inst_pool + offset, string, length);
+    inst_pool_used += length;
+    return offset;
+}
+
+/*
+ ** Get a string from the pool
+ */
+char *inst_string(int offset)
+{
+    if (offset < 0)
+        return "";
+    return inst_pool + offset;
+}
+
+/*
+ ** Add an entry to the stream
+ */
+int inst_add(enum inst_type type, int opcode, char *text)
+{
+    struct inst *new_inst;
+
+    if (inst_count == inst_size) {
+        inst_size = inst_size * 2 + 256;
+        inst_stream = realloc(inst_stream, inst_size * sizeof(struct inst));
+        if (inst_stream == NULL) {
+            emit_error("out of memory");
+            exit(1);
+        }
+    }
+    STATS_COUNT(STATS_INSTRUCTIONS);
+    new_inst = &inst_stream[inst_count];
+    new_inst->type = type;
+    new_inst->opcode = opcode;
+    new_inst->text = inst_save(text);
+    new_inst->operand[0] = -1;
+    new_inst->operand[1] = -1;
+    new_inst->kind[0] = OPERAND_NONE;
+    new_inst->kind[1] = OPERAND_NONE;
+    new_inst->suffix = -1;
+    if (type == INST_LABEL)
+        inst_labels++;
+    return inst_count++;
+}
+
+/*
+ ** Replace the text of an entry
+ */
+void inst_set_text(int index, char *text)
+{
+    inst_stream[index].text = inst_save(text);
+}
+
+/*
+ ** Replace an operand of an entry
+ */
+void inst_set_operand(int index, int operand, char *text, enum operand_kind kind)
+{
+    inst_stream[index].operand[operand] = inst_save(text);
+    inst_stream[index].kind[operand] = (text == NULL) ? OPERAND_NONE : kind;
+}
+
+/*
+ ** Replace the trailing text of an entry
+ */
+void inst_set_suffix(int index, char *suffix)
+{
+    inst_stream[index].suffix = inst_save(suffix);
+}
+
+/*
+ ** Remove an entry
+ */
+void inst_delete(int index)
+{
+    inst_stream[index].type = INST_NONE;
+}
+
+/*
+ ** Move the entries from start to the end of the stream so they are
+ ** placed before the entry at where (used for code generated after
+ ** the code it precedes, like the dispatch of SELECT CASE)
+ */
+void inst_move(int where, int start)
+{
+    struct inst *moved;
+    int count;
+
+    count = inst_count - start;
+    if (count == 0 || where == start)
+        return;
+    moved = malloc(count * sizeof(struct inst));
+    if (moved == NULL) {
+        emit_error("out of memory");
+        exit(1);
+    }
+    memcpy(moved, &inst_stream[start], count * sizeof(struct inst));
+    memmove(&inst_stream[where + count], &inst_stream[where], (start - where) * sizeof(struct inst));
+    memcpy(&inst_stream[where], moved, count * sizeof(struct inst));
+    free(moved);
+    if (inst_barrier < inst_count)
+        inst_barrier = inst_count;
+}
+
+/*
+ ** Get the entry before the given one, skipping over removed entries and
+ ** comments. Returns -1 if it reaches the start of the peephole window.
+ */
+int inst_previous(int index)
+{
+    while (--index >= inst_barrier) {
+        if (inst_stream[index].type != INST_NONE && inst_stream[index].type != INST_COMMENT)
+            return index;
+    }
+    return -1;
+}
+
+/*
+ ** Get the last entry
+ */
+int inst_last(void)
+{
+    return inst_previous(inst_count);
+}
+
+/*
+ ** Get the entry after the given one, skipping over removed entries and
+ ** comments. Returns -1 if it reaches the end of the stream.
+ */
+int inst_next(int index)
+{
+    while (++index < inst_count) {
+        if (inst_stream[index].type != INST_NONE && inst_stream[index].type != INST_COMMENT)
+            return index;
+    }
+    return -1;
+}
+
+/*
+ ** Check if a symbol appears as a whole name inside an operand
+ */
+int inst_symbol(char *text, char *symbol)
+{
+    char *p;
+    int length;
+    
+    length = strlen(symbol);
+    p = text;
+    while ((p = strstr(p, symbol)) != NULL) {
+        if ((p == text || (!isalnum(p[-1]) && p[-1] != '_' && p[-1] != '#'))
+         && !isalnum(p[length]) && p[length] != '_' && p[length] != '#')
+            return 1;
+        p++;
+    }
+    return 0;
+}
+
+/*
+ ** Check if a label is one created by the compiler
+ */
+int inst_internal(char *label)
+{
+    return memcmp(label, INTERNAL_PREFIX, 2) == 0 && isdigit(label[2]);
+}
+
+/*
+ ** Check if a jump target is a label inside the entries from start
+ ** to the end of the stream, or the given exit label.
+ */
+int inst_inside(int start, char *target, char *exit)
+{
+    int c;
+    
+    if (target[0] == '$')   /* Relative to the instruction */
+        return 1;
+    if (exit != NULL && strcmp(target, exit) == 0)
+        return 1;
+    for (c = start; c < inst_count; c++) {
+        if (inst_stream[c].type == INST_LABEL && strcmp(inst_string(inst_stream[c].text), target) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ ** Check if a label is referenced by the entries before end
+ */
+int inst_referenced(int end, char *label)
+{
+    struct inst *inst;
+    int c;
+    
+    for (c = 0; c < end; c++) {
+        inst = &inst_stream[c];
+        if (inst->type == INST_OP) {
+            if (inst->operand[0] >= 0 && inst_symbol(inst_string(inst->operand[0]), label))
+                return 1;
+            if (inst->operand[1] >= 0 && inst_symbol(inst_string(inst->operand[1]), label))
+                return 1;
+        } else if (inst->type == INST_TEXT) {
+            if (inst_symbol(inst_string(inst->text), label))
+                return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ ** Remove the entries from start to the end of the stream, because
+ ** they can't be reached. Nothing is removed if there is a label that
+ ** can be reached from outside (a BASIC label, a compiler label
+ ** referenced before start, or raw text defining a label).
+ ** Returns TRUE if the entries were removed.
+ */
+int inst_unreachable(int start)
+{
+    struct inst *inst;
+    char *p;
+    int line_start;
+    int c;
+    
+    line_start = 1;
+    for (c = start; c < inst_count; c++) {
+        inst = &inst_stream[c];
+        if (inst->type == INST_LABEL) {
+            p = inst_string(inst->text);
+            if (!inst_internal(p) || inst_referenced(start, p))
+                return 0;
+        } else if (inst->type == INST_TEXT) {   /* Can come in pieces */
+            for (p = inst_string(inst->text); *p; p++) {
+                if (line_start && *p != ' ' && *p != '\t' && *p != '\n')
+                    return 0;
+                line_start = (*p == '\n');
+            }
+            continue;
+        }
+        line_start = 1;
+    }
+    for (c = start; c < inst_count; c++) {
+        if (inst_stream[c].type != INST_COMMENT)
+            inst_delete(c);
+    }
+    return 1;
+}
+
+/*
+ ** Add a comment
+ */
+void inst_comment(char *text)
+{
+    char buffer[MAX_LINE_SIZE + 4];
+
+    sprintf(buffer, "\t; %s\n", text);
+    inst_add(INST_COMMENT, -1, buffer);
+}
+
+/*
+ ** Add an invisible mark holding a name, it goes around code that
+ ** could be removed later (the assignment of a variable never read)
+ */
+void inst_mark(char *name)
+{
+    inst_set_operand(inst_add(INST_COMMENT, -1, ""), 0, name, OPERAND_LABEL);
+}
+
+/*
+ ** Check if an entry is a mark with the given name
+ */
+int inst_is_mark(int index, char *name)
+{
+    struct inst *inst;
+
+    inst = &inst_stream[index];
+    return inst->type == INST_COMMENT && inst->operand[0] >= 0 && strcmp(inst_string(inst->operand[0]), name) == 0;
+}
+
+/*
+ ** Add raw assembler text
+ */
+void inst_printf(char *format, ...)
+{
+    va_list ap;
+    char buffer[MAX_LINE_SIZE * 2];
+
+    va_start(ap, format);
+    vsnprintf(buffer, sizeof(buffer), format, ap);
+    va_end(ap);
+    inst_add(INST_TEXT, -1, buffer);
+}
+
+/*
+ ** Write the entries starting at the given one as text, and remove them
+ */
+void inst_flush_from(FILE *file, int start)
+{
+    struct inst *inst;
+    int c;
+
+    for (c = start; c < inst_count; c++) {
+        inst = &inst_stream[c];
+        switch (inst->type) {
+            case INST_NONE:
+                break;
+            case INST_LABEL:
+                fprintf(file, "%s%s\n", inst_string(inst->text), inst_string(inst->suffix));
+                break;
+            case INST_OP:
+                fprintf(file, "\t%s", inst_string(inst->text));
+                if (inst->operand[0] >= 0)
+                    fprintf(file, " %s", inst_string(inst->operand[0]));
+                if (inst->operand[1] >= 0)
+                    fprintf(file, ",%s", inst_string(inst->operand[1]));
+                fprintf(file, "%s\n", inst_string(inst->suffix));
+                break;
+            case INST_COMMENT:
+            case INST_TEXT:
+                fprintf(file, "%s", inst_string(inst->text));
+                break;
+        }
+    }
+    inst_count = start;
+    if (inst_barrier > start)
+        inst_barrier = start;
+}
+
+/*
+ ** Write the stream as text, and empty it
+ */
+void inst_flush(FILE *file)
+{
+    inst_flush_from(file, 0);
+    inst_reset();
+}
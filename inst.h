@@ -0,0 +1,75 @@
+/*
+ ** CVBasic - Assembler instruction stream (headers)
+ **
+ ** by Oscar Toledo G.
+ **
+ ** Creation date: Oct/17/2026. Separated from the backends' line buffers.
+ */
+
+/*
+ ** Types of entries in the instruction stream.
+ */
+enum inst_type {
+    INST_NONE,      /* Removed by the peephole optimizer */
+    INST_LABEL,     /* Label */
+    INST_OP,        /* Processor instruction or assembler directive */
+    INST_COMMENT,   /* Comment (transparent for the peephole optimizer) */
+    INST_TEXT,      /* Raw assembler text (data), stops the peephole optimizer */
+};
+
+/*
+ ** Kinds of operands.
+ */
+enum operand_kind {
+    OPERAND_NONE,
+    OPERAND_REGISTER,   /* Processor register */
+    OPERAND_CONDITION,  /* Condition code (Z80) */
+    OPERAND_NUMBER,     /* Immediate value */
+    OPERAND_MEMORY,     /* Memory reference */
+    OPERAND_LABEL,      /* Jump or call target */
+    OPERAND_OTHER,
+};
+
+/*
+ ** An entry in the instruction stream.
+ **
+ ** Strings are kept as offsets inside the string pool (-1 for none), because
+ ** the pool can move when it grows.
+ */
+struct inst {
+    enum inst_type type;
+    int opcode;             /* Processor-dependent opcode (-1 if unknown) */
+    int text;               /* Mnemonic, label name or raw text */
+    int operand[2];         /* Operands */
+    enum operand_kind kind[2];
+    int suffix;             /* Trailing text (label colon or comment) */
+};
+
+extern struct inst *inst_stream;
+extern int inst_count;
+extern int inst_barrier;
+extern int inst_labels;
+
+extern void inst_reset(void);
+extern int inst_lookup(char **, int, char *);
+extern char *inst_string(int);
+extern int inst_add(enum inst_type, int, char *);
+extern void inst_set_text(int, char *);
+extern void inst_set_operand(int, int, char *, enum operand_kind);
+extern void inst_set_suffix(int, char *);
+extern void inst_delete(int);
+extern void inst_move(int, int);
+extern int inst_previous(int);
+extern int inst_last(void);
+extern int inst_next(int);
+extern int inst_symbol(char *, char *);
+extern int inst_internal(char *);
+extern int inst_inside(int, char *, char *);
+extern int inst_referenced(int, char *);
+extern int inst_unreachable(int);
+extern void inst_comment(char *);
+extern void inst_mark(char *);
+extern int inst_is_mark(int, char *);
+extern void inst_printf(char *, ...);
+extern void inst_flush_from(FILE *, int);
+extern void inst_flush(FILE *);
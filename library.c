@@ -0,0 +1,1237 @@
+/*
+ ** CVBasic - Runtime library linker
+ **
+ ** by Oscar Toledo G.
+ **
+ ** Creation date: Oct/17/2026.
+ */
+
+/*
+ ** The prologue and epilogue files are divided in blocks, each one starting
+ ** at a global label and ending before the next global label or directive
+ ** that cannot be moved. A block is kept only if its label is referenced by
+ ** the compiled program, by the fixed parts of the library, or by another
+ ** kept block, or if a kept block can continue executing into it.
+ **
+ ** Conditional assembly is evaluated using the constants emitted by the
+ ** compiler, so the music player isn't kept when it is disabled.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "cvbasic.h"
+#include "inst.h"
+#include "library.h"
+
+#define LIBRARY_BUCKETS 512     /* Hash table for block names */
+#define LIBRARY_DEPTH   64      /* Maximum nesting of conditional assembly */
+
+/*
+ ** Kinds of lines.
+ */
+enum line_kind {
+    LINE_EMPTY,     /* Blank line or comment */
+    LINE_IF,        /* Start of conditional assembly */
+    LINE_ELSE,
+    LINE_ENDIF,
+    LINE_FIXED,     /* Directive that cannot be moved (org, times, bank...) */
+    LINE_DEFINE,    /* Constant or RAM definition (equ, rb, bss...) */
+    LINE_LABEL,     /* Global label (maybe followed by an instruction) */
+    LINE_CODE,      /* Instruction */
+    LINE_DATA,      /* Data (db, dw, byte, data...) */
+};
+
+/*
+ ** State of conditional assembly.
+ */
+enum line_state {
+    STATE_FALSE,    /* Never assembled */
+    STATE_MAYBE,    /* The condition couldn't be evaluated */
+    STATE_TRUE,     /* Assembled */
+};
+
+struct library_line {
+    char *text;
+    enum line_kind kind;
+    enum line_state state;
+    int end;        /* Unconditional jump or return */
+    int size;       /* Estimated bytes */
+    int match;      /* if: its else or endif, else/endif: its if */
+    int block;      /* Block containing the line (-1 if always kept) */
+};
+
+struct library_block {
+    char *name;
+    int first;      /* First line */
+    int last;       /* One past the last line */
+    int live;
+    int next;       /* Next block in the same hash bucket */
+};
+
+struct library_define {
+    char *name;
+    int value;
+};
+
+int library_strip = 1;
+int library_removed_routines;
+int library_removed_bytes;
+
+static struct library_line *library_lines;
+static int library_count;
+static int library_size;
+static int library_start[TOTAL_PARTS + 1];
+
+static struct library_block *library_blocks;
+static int library_total_blocks;
+static int library_size_blocks;
+static int library_hash[LIBRARY_BUCKETS];
+
+static int *library_edges;      /* Pairs of blocks (from, to) */
+static int library_total_edges;
+static int library_size_edges;
+
+static int *library_pending;
+static int library_total_pending;
+
+static struct library_define *library_defines;
+static int library_total_defines;
+static int library_size_defines;
+
+static int library_include;     /* The program includes assembler files */
+
+static char *library_expr;
+static int library_error;
+
+/*
+ ** Get memory or fail
+ */
+static void *library_grow(void *pointer, int size)
+{
+    pointer = realloc(pointer, size);
+    if (pointer == NULL) {
+        fprintf(stderr, "Out of memory for library linker\n");
+        exit(1);
+    }
+    return pointer;
+}
+
+/*
+ ** Reset the linker (start of a new program)
+ */
+void library_reset(void)
+{
+    int c;
+
+    for (c = 0; c < library_count; c++)
+        free(library_lines[c].text);
+    for (c = 0; c < library_total_defines; c++)
+        free(library_defines[c].name);
+    for (c = 0; c < library_total_blocks; c++)
+        free(library_blocks[c].name);
+    library_count = 0;
+    library_total_defines = 0;
+    library_total_blocks = 0;
+    library_total_edges = 0;
+    library_include = 0;
+    library_removed_routines = 0;
+    library_removed_bytes = 0;
+    for (c = 0; c <= TOTAL_PARTS; c++)
+        library_start[c] = 0;
+}
+
+/*
+ ** Hash a name (the assemblers don't care about case)
+ */
+static int library_hash_name(char *name)
+{
+    unsigned int h;
+
+    h = 0;
+    while (*name)
+        h = h * 31 + tolower(*name++);
+    return h % LIBRARY_BUCKETS;
+}
+
+/*
+ ** Compare names ignoring case
+ */
+static int library_same_name(char *a, char *b)
+{
+    while (*a && tolower(*a) == tolower(*b)) {
+        a++;
+        b++;
+    }
+    return *a == '\0' && *b == '\0';
+}
+
+/*
+ ** Define a constant for conditional assembly
+ */
+void library_define(char *name, int value)
+{
+    int c;
+
+    for (c = 0; c < library_total_defines; c++) {
+        if (library_same_name(library_defines[c].name, name)) {
+            library_defines[c].value = value;
+            return;
+        }
+    }
+    if (library_total_defines == library_size_defines) {
+        library_size_defines = library_size_defines ? library_size_defines * 2 : 64;
+        library_defines = library_grow(library_defines, library_size_defines * sizeof(struct library_define));
+    }
+    library_defines[library_total_defines].name = library_grow(NULL, strlen(name) + 1);
+    strcpy(library_defines[library_total_defines].name, name);
+    library_defines[library_total_defines].value = value;
+    library_total_defines++;
+}
+
+/*
+ ** Read a word (name or mnemonic)
+ */
+static char *library_word(char *p, char *word, int size)
+{
+    int c;
+
+    c = 0;
+    while (isalnum(*p) || *p == '_' || *p == '.') {
+        if (c < size - 1)
+            word[c++] = tolower(*p);
+        p++;
+    }
+    word[c] = '\0';
+    return p;
+}
+
+/*
+ ** Skip spaces
+ */
+static char *library_spaces(char *p)
+{
+    while (*p == ' ' || *p == '\t')
+        p++;
+    return p;
+}
+
+/*
+ ** Evaluate an expression, sets library_error if it cannot be evaluated
+ */
+static int library_eval_or(void);
+
+static int library_eval_primary(void)
+{
+    char word[MAX_LINE_SIZE];
+    int value;
+    int c;
+
+    library_expr = library_spaces(library_expr);
+    if (*library_expr == '(') {
+        library_expr++;
+        value = library_eval_or();
+        library_expr = library_spaces(library_expr);
+        if (*library_expr == ')')
+            library_expr++;
+        else
+            library_error = 1;
+        return value;
+    }
+    if (*library_expr == '-') {
+        library_expr++;
+        return -library_eval_primary();
+    }
+    if (*library_expr == '~') {
+        library_expr++;
+        return ~library_eval_primary();
+    }
+    if ((*library_expr == '$' || *library_expr == '>') && isxdigit(library_expr[1])) {
+        library_expr++;
+        value = 0;
+        while (isxdigit(*library_expr)) {
+            c = tolower(*library_expr++);
+            value = value * 16 + (isdigit(c) ? c - '0' : c - 'a' + 10);
+        }
+        return value;
+    }
+    if (isdigit(*library_expr)) {
+        value = 0;
+        while (isdigit(*library_expr))
+            value = value * 10 + *library_expr++ - '0';
+        if (isalnum(*library_expr))     /* Other bases aren't used */
+            library_error = 1;
+        return value;
+    }
+    if (isalpha(*library_expr) || *library_expr == '_') {
+        library_expr = library_word(library_expr, word, sizeof(word));
+        for (c = 0; c < library_total_defines; c++) {
+            if (library_same_name(library_defines[c].name, word))
+                return library_defines[c].value;
+        }
+    }
+    library_error = 1;
+    return 0;
+}
+
+static int library_eval_product(void)
+{
+    int value;
+    int divisor;
+
+    value = library_eval_primary();
+    while (1) {
+        library_expr = library_spaces(library_expr);
+        if (*library_expr == '*') {
+            library_expr++;
+            value *= library_eval_primary();
+        } else if (*library_expr == '/') {
+            library_expr++;
+            divisor = library_eval_primary();
+            if (divisor == 0)
+                library_error = 1;
+            else
+                value /= divisor;
+        } else {
+            return value;
+        }
+    }
+}
+
+static int library_eval_sum(void)
+{
+    int value;
+
+    value = library_eval_product();
+    while (1) {
+        library_expr = library_spaces(library_expr);
+        if (*library_expr == '+') {
+            library_expr++;
+            value += library_eval_product();
+        } else if (*library_expr == '-') {
+            library_expr++;
+            value -= library_eval_product();
+        } else {
+            return value;
+        }
+    }
+}
+
+static int library_eval_and(void)
+{
+    int value;
+
+    value = library_eval_sum();
+    while (1) {
+        library_expr = library_spaces(library_expr);
+        if (*library_expr != '&')
+            return value;
+        library_expr++;
+        value &= library_eval_sum();
+    }
+}
+
+static int library_eval_or(void)
+{
+    int value;
+
+    value = library_eval_and();
+    while (1) {
+        library_expr = library_spaces(library_expr);
+        if (*library_expr == '|') {
+            library_expr++;
+            value |= library_eval_and();
+        } else if (*library_expr == '^') {
+            library_expr++;
+            value ^= library_eval_and();
+        } else {
+            return value;
+        }
+    }
+}
+
+/*
+ ** Evaluate a complete expression (until a comment or the end of the line)
+ */
+static int library_eval(char *p, int *value)
+{
+    library_expr = p;
+    library_error = 0;
+    *value = library_eval_or();
+    library_expr = library_spaces(library_expr);
+    if (*library_expr != '\0' && *library_expr != '\n' && *library_expr != '\r' && *library_expr != ';')
+        library_error = 1;
+    return !library_error;
+}
+
+/*
+ ** Find the end of the operands (start of comment), respecting quotes
+ */
+static char *library_comment(char *p)
+{
+    char *q;
+
+    while (*p && *p != '\n' && *p != '\r' && *p != ';') {
+        if (*p == '"' || *p == '\'') {
+            q = strchr(p + 1, *p);
+            if (q != NULL)      /* Z80 has af' */
+                p = q;
+        }
+        p++;
+    }
+    return p;
+}
+
+/*
+ ** Separate the operands (in lowercase, except for strings)
+ */
+static int library_operands(char *p, char operand[2][MAX_LINE_SIZE])
+{
+    char *end;
+    char *q;
+    int count;
+    int level;
+    int c;
+
+    operand[0][0] = '\0';
+    operand[1][0] = '\0';
+    end = library_comment(p);
+    count = 0;
+    while (1) {
+        p = library_spaces(p);
+        if (p >= end)
+            break;
+        level = 0;
+        c = 0;
+        while (p < end && (*p != ',' || level > 0)) {
+            q = p + 1;
+            if ((*p == '"' || *p == '\'') && (q = strchr(p + 1, *p)) != NULL && q < end)
+                q++;
+            else
+                q = p + 1;
+            if (*p == '(')
+                level++;
+            else if (*p == ')')
+                level--;
+            while (p < q) {
+                if (count < 2 && c < MAX_LINE_SIZE - 1)
+                    operand[count][c++] = (q - p > 1) ? *p : tolower(*p);
+                p++;
+            }
+        }
+        if (count < 2) {
+            while (c > 0 && isspace(operand[count][c - 1]))
+                c--;
+            operand[count][c] = '\0';
+        }
+        count++;
+        if (p >= end)
+            break;
+        p++;    /* Skip comma */
+    }
+    return count;
+}
+
+/*
+ ** Estimate bytes used by data
+ */
+static int library_data_size(char *p, int item)
+{
+    char *end;
+    char *q;
+    int size;
+
+    end = library_comment(p);
+    size = 0;
+    while (1) {
+        p = library_spaces(p);
+        if (p >= end)
+            break;
+        if ((*p == '"' || *p == '\'') && (q = strchr(p + 1, *p)) != NULL && q < end) {
+            size += q - p - 1;
+            p = q + 1;
+        } else {
+            size += item;
+            while (p < end && *p != ',')
+                p++;
+        }
+        p = library_spaces(p);
+        if (p >= end || *p != ',')
+            break;
+        p++;
+    }
+    return size;
+}
+
+/*
+ ** Check for 8-bit Z80 register
+ */
+static int library_z80_register8(char *operand)
+{
+    static char *registers[] = {
+        "a", "b", "c", "d", "e", "h", "l", "i", "r",
+        "ixh", "ixl", "iyh", "iyl", NULL
+    };
+    int c;
+
+    for (c = 0; registers[c] != NULL; c++) {
+        if (strcmp(operand, registers[c]) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ ** Check for 16-bit Z80 register
+ */
+static int library_z80_register16(char *operand)
+{
+    static char *registers[] = {
+        "bc", "de", "hl", "sp", "ix", "iy", "af", "af'", NULL
+    };
+    int c;
+
+    for (c = 0; registers[c] != NULL; c++) {
+        if (strcmp(operand, registers[c]) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ ** Check for Z80 indirect register, returns 2 for index registers
+ */
+static int library_z80_indirect(char *operand)
+{
+    if (strcmp(operand, "(hl)") == 0 || strcmp(operand, "(bc)") == 0 ||
+        strcmp(operand, "(de)") == 0 || strcmp(operand, "(sp)") == 0 ||
+        strcmp(operand, "(c)") == 0)
+        return 1;
+    if (strncmp(operand, "(ix", 3) == 0 || strncmp(operand, "(iy", 3) == 0)
+        return 2;
+    return 0;
+}
+
+/*
+ ** Check if a mnemonic is in a list
+ */
+static int library_in_list(char *mnemonic, char **list)
+{
+    while (*list != NULL) {
+        if (strcmp(mnemonic, *list) == 0)
+            return 1;
+        list++;
+    }
+    return 0;
+}
+
+/*
+ ** Estimate the size of a Z80 instruction
+ */
+static int library_z80_size(char *mnemonic, int count, char operand[2][MAX_LINE_SIZE])
+{
+    static char *prefix_cb[] = {
+        "bit", "set", "res", "rl", "rr", "rlc", "rrc", "sla", "sra", "srl", "sll", NULL
+    };
+    static char *prefix_ed[] = {
+        "ldir", "lddr", "ldi", "ldd", "cpir", "cpdr", "cpi", "cpd",
+        "ini", "inir", "ind", "indr", "outi", "otir", "outd", "otdr",
+        "neg", "reti", "retn", "rld", "rrd", "im", "in", "out", NULL
+    };
+    static char *alu[] = {
+        "add", "adc", "sub", "sbc", "and", "or", "xor", "cp", NULL
+    };
+    char *a;
+    char *b;
+    int index;
+
+    a = operand[0];
+    b = operand[1];
+    index = 0;
+    if (strncmp(a, "ix", 2) == 0 || strncmp(a, "iy", 2) == 0 ||
+        strncmp(b, "ix", 2) == 0 || strncmp(b, "iy", 2) == 0)
+        index = 1;
+    if (library_z80_indirect(a) == 2 || library_z80_indirect(b) == 2)
+        index = 2;
+    if (strcmp(mnemonic, "jp") == 0) {
+        if (count == 1 && a[0] == '(')
+            return 1 + (index != 0);
+        return 3;
+    }
+    if (strcmp(mnemonic, "call") == 0)
+        return 3;
+    if (strcmp(mnemonic, "jr") == 0 || strcmp(mnemonic, "djnz") == 0)
+        return 2;
+    if (library_in_list(mnemonic, prefix_cb))
+        return 2 + index;
+    if (library_in_list(mnemonic, prefix_ed))
+        return 2;
+    if ((strcmp(mnemonic, "adc") == 0 || strcmp(mnemonic, "sbc") == 0) && strcmp(a, "hl") == 0)
+        return 2;
+    if (strcmp(mnemonic, "add") == 0 && library_z80_register16(a))
+        return 1 + (index != 0);
+    if (library_in_list(mnemonic, alu)) {
+        if (count == 2)
+            a = b;
+        if (library_z80_register8(a) || library_z80_indirect(a) == 1)
+            return 1 + (index != 0);
+        return 2 + index;
+    }
+    if (strcmp(mnemonic, "ld") == 0 && count == 2) {
+        if (strcmp(a, "i") == 0 || strcmp(a, "r") == 0 || strcmp(b, "i") == 0 || strcmp(b, "r") == 0)
+            return 2;
+        if ((library_z80_register8(a) || library_z80_indirect(a)) &&
+            (library_z80_register8(b) || library_z80_indirect(b)))
+            return 1 + index;
+        if (library_z80_register16(a)) {
+            if (library_z80_register16(b))
+                return 1 + (index != 0);
+            if (b[0] == '(')
+                return (strcmp(a, "hl") == 0) ? 3 : 4;
+            return 3 + (index != 0);
+        }
+        if (a[0] == '(' && !library_z80_indirect(a))
+            return (strcmp(b, "a") == 0 || strcmp(b, "hl") == 0) ? 3 : 4;
+        if (b[0] == '(' && !library_z80_indirect(b))
+            return 3;
+        return 2 + index;
+    }
+    return 1 + (index != 0);
+}
+
+/*
+ ** Estimate the size of a 6502 instruction
+ */
+static int library_6502_size(char *mnemonic, int count, char operand[2][MAX_LINE_SIZE])
+{
+    static char *branches[] = {
+        "bcc", "bcs", "beq", "bmi", "bne", "bpl", "bvc", "bvs", NULL
+    };
+    int value;
+
+    if (count == 0 || strcmp(operand[0], "a") == 0)
+        return 1;
+    if (library_in_list(mnemonic, branches))
+        return 2;
+    if (strcmp(mnemonic, "jmp") == 0 || strcmp(mnemonic, "jsr") == 0)
+        return 3;
+    if (operand[0][0] == '#' || operand[0][0] == '(')
+        return 2;
+    if (library_eval(operand[0], &value) && value >= 0 && value < 0x0100)
+        return 2;   /* Zero page */
+    return 3;
+}
+
+/*
+ ** Estimate the size of a 9900 instruction
+ */
+static int library_9900_size(char *mnemonic, int count, char operand[2][MAX_LINE_SIZE])
+{
+    static char *immediate[] = {
+        "li", "ai", "andi", "ori", "ci", "limi", "lwpi", NULL
+    };
+    int size;
+    int c;
+
+    size = 2;
+    if (library_in_list(mnemonic, immediate))
+        size += 2;
+    for (c = 0; c < count && c < 2; c++) {
+        if (operand[c][0] == '@')
+            size += 2;
+    }
+    return size;
+}
+
+/*
+ ** Classify a line of the library
+ */
+static void library_classify(struct library_line *line)
+{
+    static char *fixed[] = {
+        "org", "forg", "aorg", "dorg", "rorg", "bank", "times", "even", "align",
+        "cpu", "end", "include", "copy", NULL
+    };
+    static char *define[] = {
+        "equ", "=", "set", NULL
+    };
+    static char *reserve[] = {
+        "rb", "rw", "ds", "defs", "bss", NULL
+    };
+    static char *terminator_z80[] = {
+        "ret", "reti", "retn", NULL
+    };
+    static char *terminator_6502[] = {
+        "rts", "rti", "jmp", NULL
+    };
+    static char *terminator_9900[] = {
+        "b", "rt", "rtwp", "jmp", NULL
+    };
+    char word[MAX_LINE_SIZE];
+    char mnemonic[MAX_LINE_SIZE];
+    char operand[2][MAX_LINE_SIZE];
+    char *p;
+    int label;
+    int count;
+    int value;
+
+    line->kind = LINE_EMPTY;
+    line->end = 0;
+    line->size = 0;
+    line->match = -1;
+    line->block = -1;
+    p = line->text;
+    if (*p == ';' || (target == CPU_9900 && *p == '*'))
+        return;
+    label = 0;
+    if (isalpha(*p) || *p == '_') {
+        p = library_word(p, word, sizeof(word));
+        if (*p == ':')
+            p++;
+        label = 1;
+    } else if (*p == '.' || *p == '!') {   /* Local label */
+        while (*p && !isspace(*p))
+            p++;
+        line->kind = LINE_CODE;
+    }
+    p = library_spaces(p);
+    if (*p == '=') {
+        strcpy(mnemonic, "=");
+        p++;
+    } else {
+        p = library_word(p, mnemonic, sizeof(mnemonic));
+    }
+    p = library_spaces(p);
+    if (mnemonic[0] == '\0') {
+        if (label)
+            line->kind = LINE_LABEL;
+        return;
+    }
+    if (strcmp(mnemonic, "if") == 0 || strncmp(mnemonic, ".if", 3) == 0 ||
+        strcmp(mnemonic, "ifdef") == 0 || strcmp(mnemonic, "ifndef") == 0) {
+        line->kind = LINE_IF;
+        return;
+    }
+    if (strcmp(mnemonic, "else") == 0 || strcmp(mnemonic, ".else") == 0) {
+        line->kind = LINE_ELSE;
+        return;
+    }
+    if (strcmp(mnemonic, "endif") == 0 || strcmp(mnemonic, ".endif") == 0) {
+        line->kind = LINE_ENDIF;
+        return;
+    }
+    if (library_in_list(mnemonic, fixed)) {
+        line->kind = LINE_FIXED;
+        return;
+    }
+    if ((label && library_in_list(mnemonic, define)) || library_in_list(mnemonic, reserve)) {
+        line->kind = LINE_DEFINE;
+        if (label && line->state == STATE_TRUE && strcmp(mnemonic, "equ") == 0 && library_eval(p, &value))
+            library_define(word, value);
+        return;
+    }
+    if (strcmp(mnemonic, "db") == 0 || strcmp(mnemonic, "defb") == 0 || strcmp(mnemonic, "defm") == 0 ||
+        strcmp(mnemonic, "byte") == 0 || strcmp(mnemonic, "text") == 0) {
+        line->kind = label ? LINE_LABEL : LINE_DATA;
+        line->size = library_data_size(p, 1);
+        return;
+    }
+    if (strcmp(mnemonic, "dw") == 0 || strcmp(mnemonic, "defw") == 0 || strcmp(mnemonic, "word") == 0 ||
+        strcmp(mnemonic, "data") == 0) {
+        line->kind = label ? LINE_LABEL : LINE_DATA;
+        line->size = library_data_size(p, 2);
+        return;
+    }
+    line->kind = label ? LINE_LABEL : LINE_CODE;
+    count = library_operands(p, operand);
+    if (target == CPU_Z80) {
+        line->size = library_z80_size(mnemonic, count, operand);
+        if (library_in_list(mnemonic, terminator_z80) && count == 0)
+            line->end = 1;
+        if ((strcmp(mnemonic, "jp") == 0 || strcmp(mnemonic, "jr") == 0) && count == 1)
+            line->end = 1;
+    } else if (target == CPU_6502) {
+        line->size = library_6502_size(mnemonic, count, operand);
+        if (library_in_list(mnemonic, terminator_6502))
+            line->end = 1;
+    } else {
+        line->size = library_9900_size(mnemonic, count, operand);
+        if (library_in_list(mnemonic, terminator_9900))
+            line->end = 1;
+    }
+}
+
+/*
+ ** Read a part of the library
+ */
+void library_read(char *path, enum library_part part)
+{
+    FILE *file;
+    char text[MAX_LINE_SIZE];
+    struct library_line *line;
+    int stack[LIBRARY_DEPTH];
+    enum line_state state[LIBRARY_DEPTH + 1];
+    int condition[LIBRARY_DEPTH];
+    int depth;
+    int value;
+    char *p;
+
+    file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Unable to open '%s'.\n", path);
+        exit(EXIT_FAILURE + 1);
+    }
+    library_start[part] = library_count;
+    depth = 0;
+    state[0] = STATE_TRUE;
+    while (fgets(text, sizeof(text) - 1, file)) {
+        if (library_count == library_size) {
+            library_size = library_size ? library_size * 2 : 4096;
+            library_lines = library_grow(library_lines, library_size * sizeof(struct library_line));
+        }
+        line = &library_lines[library_count];
+        line->text = library_grow(NULL, strlen(text) + 1);
+        strcpy(line->text, text);
+        line->state = state[depth];
+        library_classify(line);
+        if (line->kind == LINE_IF) {
+            p = library_spaces(line->text);
+            p = library_spaces(p + strcspn(p, " \t;\r\n"));
+            if (!library_eval(p, &value))
+                condition[depth] = STATE_MAYBE;
+            else if (strncmp(library_spaces(line->text), ".ifeq", 5) == 0)
+                condition[depth] = value == 0 ? STATE_TRUE : STATE_FALSE;
+            else if (strncmp(library_spaces(line->text), ".ifdef", 6) == 0 ||
+                     strncmp(library_spaces(line->text), ".ifndef", 7) == 0 ||
+                     strncmp(library_spaces(line->text), "ifdef", 5) == 0 ||
+                     strncmp(library_spaces(line->text), "ifndef", 6) == 0)
+                condition[depth] = STATE_MAYBE;
+            else
+                condition[depth] = value != 0 ? STATE_TRUE : STATE_FALSE;
+            if (depth < LIBRARY_DEPTH - 1) {
+                stack[depth] = library_count;
+                depth++;
+            }
+            if (state[depth - 1] == STATE_FALSE || condition[depth - 1] == STATE_FALSE)
+                state[depth] = STATE_FALSE;
+            else if (state[depth - 1] == STATE_MAYBE || condition[depth - 1] == STATE_MAYBE)
+                state[depth] = STATE_MAYBE;
+            else
+                state[depth] = STATE_TRUE;
+        } else if (line->kind == LINE_ELSE && depth > 0) {
+            line->state = state[depth - 1];
+            line->match = stack[depth - 1];
+            library_lines[stack[depth - 1]].match = library_count;
+            if (state[depth - 1] == STATE_FALSE || condition[depth - 1] == STATE_TRUE)
+                state[depth] = STATE_FALSE;
+            else if (state[depth - 1] == STATE_MAYBE || condition[depth - 1] == STATE_MAYBE)
+                state[depth] = STATE_MAYBE;
+            else
+                state[depth] = STATE_TRUE;
+        } else if (line->kind == LINE_ENDIF && depth > 0) {
+            depth--;
+            line->state = state[depth];
+            line->match = stack[depth];
+            if (library_lines[stack[depth]].match == -1)
+                library_lines[stack[depth]].match = library_count;
+        } else if (line->kind == LINE_ELSE || line->kind == LINE_ENDIF) {
+            line->kind = LINE_FIXED;    /* Unbalanced, don't touch anything */
+        }
+        library_count++;
+    }
+    fclose(file);
+    while (depth > 0) {     /* Unbalanced, make it fixed */
+        depth--;
+        library_lines[stack[depth]].kind = LINE_FIXED;
+    }
+    library_start[part + 1] = library_count;
+}
+
+/*
+ ** Mark a block as used
+ */
+static void library_use_block(int block)
+{
+    if (library_blocks[block].live)
+        return;
+    library_blocks[block].live = 1;
+    library_pending[library_total_pending++] = block;
+}
+
+/*
+ ** Mark the blocks with a name as used
+ */
+static void library_use(char *name)
+{
+    int block;
+
+    block = library_hash[library_hash_name(name)];
+    while (block != -1) {
+        if (library_same_name(library_blocks[block].name, name))
+            library_use_block(block);
+        block = library_blocks[block].next;
+    }
+}
+
+/*
+ ** Mark the names referenced by a line as used
+ */
+static void library_references(char *p, int skip_label)
+{
+    char word[MAX_LINE_SIZE];
+    char *end;
+    char *q;
+
+    if (skip_label && (isalpha(*p) || *p == '_'))
+        p = library_word(p, word, sizeof(word));
+    end = library_comment(p);
+    while (p < end) {
+        if (isalpha(*p) || *p == '_') {
+            q = p;
+            while (q < end && (isalnum(*q) || *q == '_'))
+                q++;
+            if (q - p < MAX_LINE_SIZE) {
+                memcpy(word, p, q - p);
+                word[q - p] = '\0';
+                library_use(word);
+            }
+            p = q;
+        } else if (isdigit(*p)) {
+            while (p < end && (isalnum(*p) || *p == '_'))
+                p++;
+        } else {
+            p++;
+        }
+    }
+}
+
+/*
+ ** Check for local labels used in a line
+ */
+static int library_has_local(char *p)
+{
+    char *end;
+
+    if (*p == '.' || *p == '!')
+        return 1;
+    end = library_comment(p);
+    p = library_spaces(p);
+    while (p < end && !isspace(*p))     /* Skip label or mnemonic */
+        p++;
+    while (p < end) {
+        if (*p == '!' || (*p == '.' && isalnum(p[1]) && !isalnum(p[-1])))
+            return 1;
+        p++;
+    }
+    return 0;
+}
+
+/*
+ ** Check that a block doesn't refer to local labels outside it (9900)
+ */
+static int library_locals_inside(int first, int last)
+{
+    char local[MAX_LINE_SIZE];
+    char *p;
+    char *end;
+    int c;
+    int d;
+    int found;
+
+    if (target != CPU_9900)
+        return 1;
+    for (c = first; c < last; c++) {
+        p = library_lines[c].text;
+        if (*p == '!')      /* Definition */
+            p++;
+        end = library_comment(p);
+        while (p < end) {
+            if (p[0] == '+' && p[1] == '!')
+                return 0;
+            if (p[0] == '-' && p[1] == '!') {
+                p = library_word(p + 2, local, sizeof(local));
+                found = 0;
+                for (d = first; d < c; d++) {
+                    if (library_lines[d].text[0] == '!' &&
+                        strncmp(library_lines[d].text + 1, local, strlen(local)) == 0 &&
+                        !isalnum(library_lines[d].text[1 + strlen(local)]) &&
+                        library_lines[d].text[1 + strlen(local)] != '_')
+                        found = 1;
+                }
+                if (!found)
+                    return 0;
+                continue;
+            }
+            p++;
+        }
+    }
+    return 1;
+}
+
+/*
+ ** Add a block
+ */
+static void library_add_block(int first, int last)
+{
+    char word[MAX_LINE_SIZE];
+    struct library_block *block;
+    int bucket;
+    int c;
+
+    if (library_total_blocks == library_size_blocks) {
+        library_size_blocks = library_size_blocks ? library_size_blocks * 2 : 256;
+        library_blocks = library_grow(library_blocks, library_size_blocks * sizeof(struct library_block));
+    }
+    library_word(library_lines[first].text, word, sizeof(word));
+    block = &library_blocks[library_total_blocks];
+    block->name = library_grow(NULL, strlen(word) + 1);
+    strcpy(block->name, word);
+    block->first = first;
+    block->last = last;
+    block->live = 0;
+    bucket = library_hash_name(word);
+    block->next = library_hash[bucket];
+    library_hash[bucket] = library_total_blocks;
+    for (c = first; c < last; c++)
+        library_lines[c].block = library_total_blocks;
+    library_total_blocks++;
+}
+
+/*
+ ** Divide a part of the library in blocks
+ */
+static void library_divide(enum library_part part)
+{
+    int start;
+    int end;
+    int c;
+    int d;
+    int e;
+    int depth;
+    int open;
+    int removable;
+    enum line_kind kind;
+
+    start = library_start[part];
+    end = library_start[part + 1];
+    c = start;
+    while (c < end) {
+        if (library_lines[c].kind != LINE_LABEL || library_lines[c].state == STATE_FALSE) {
+            c++;
+            continue;
+        }
+        depth = 0;
+        open = -1;
+        for (d = c + 1; d < end; d++) {
+            kind = library_lines[d].kind;
+            if (kind == LINE_LABEL || kind == LINE_DEFINE || kind == LINE_FIXED)
+                break;
+            if (kind == LINE_IF) {
+                if (depth == 0)
+                    open = d;
+                depth++;
+            } else if (kind == LINE_ELSE) {
+                if (depth == 0)
+                    break;
+            } else if (kind == LINE_ENDIF) {
+                if (depth == 0)
+                    break;
+                depth--;
+            }
+        }
+
+        /*
+         ** A conditional that continues after the block (usually around
+         ** the next label) isn't part of it.
+         */
+        if (depth != 0)
+            d = open;
+        removable = library_locals_inside(c, d);
+
+        /*
+         ** Code after the block that isn't inside another block could
+         ** be using its local labels.
+         */
+        for (e = d; removable && e < end && library_lines[e].kind != LINE_LABEL; e++) {
+            if (library_lines[e].kind != LINE_EMPTY && library_has_local(library_lines[e].text))
+                removable = 0;
+        }
+        if (removable)
+            library_add_block(c, d);
+        c = d;
+    }
+}
+
+/*
+ ** Add a block that can continue executing into another
+ */
+static void library_add_edge(int from, int to)
+{
+    if (library_total_edges + 2 > library_size_edges) {
+        library_size_edges = library_size_edges ? library_size_edges * 2 : 512;
+        library_edges = library_grow(library_edges, library_size_edges * sizeof(int));
+    }
+    library_edges[library_total_edges++] = from;
+    library_edges[library_total_edges++] = to;
+}
+
+/*
+ ** Find what can execute before a line and continue into a block
+ */
+static void library_flow(int index, int start, int block)
+{
+    struct library_line *line;
+    int other;
+
+    while (1) {
+        if (index < start) {    /* Start of the file or after the program */
+            library_use_block(block);
+            return;
+        }
+        line = &library_lines[index];
+        switch (line->kind) {
+            case LINE_EMPTY:
+            case LINE_DEFINE:
+            case LINE_IF:
+                index--;
+                break;
+            case LINE_ELSE:     /* The condition was false, comes from before the if */
+                index = line->match - 1;
+                break;
+            case LINE_ENDIF:
+                other = library_lines[line->match].match;
+                if (other != index)     /* The end of the if part */
+                    library_flow(other - 1, start, block);
+                else                    /* Or the condition was false */
+                    library_flow(line->match - 1, start, block);
+                index--;
+                break;
+            case LINE_FIXED:
+                library_use_block(block);
+                return;
+            default:
+                if (line->end)
+                    return;
+                if (line->block == -1)
+                    library_use_block(block);
+                else if (line->block != block)
+                    library_add_edge(line->block, block);
+                return;
+        }
+    }
+}
+
+/*
+ ** Link the library with the program (first 'count' entries of the
+ ** instruction stream) marking the used blocks
+ */
+void library_link(int count)
+{
+    enum library_part part;
+    struct library_line *line;
+    struct inst *inst;
+    char word[MAX_LINE_SIZE];
+    char *p;
+    int block;
+    int c;
+    int d;
+
+    for (c = 0; c < LIBRARY_BUCKETS; c++)
+        library_hash[c] = -1;
+    for (part = LIBRARY_PROLOGUE; part < TOTAL_PARTS; part++)
+        library_divide(part);
+    library_pending = library_grow(NULL, (library_total_blocks + 1) * sizeof(int));
+    library_total_pending = 0;
+
+    /*
+     ** References from the program
+     */
+    for (c = 0; c < count; c++) {
+        inst = &inst_stream[c];
+        if (inst->type == INST_OP) {
+            for (d = 0; d < 2; d++) {
+                if (inst->operand[d] != -1)
+                    library_references(inst_string(inst->operand[d]), 0);
+            }
+        } else if (inst->type == INST_TEXT) {
+            p = inst_string(inst->text);
+            library_references(p, 0);
+            if (isalpha(*p) || *p == '_') {     /* Skip label */
+                p = library_word(p, word, sizeof(word));
+                if (*p == ':')
+                    p++;
+            }
+            library_word(library_spaces(p), word, sizeof(word));
+            if (strcmp(word, "include") == 0 || (target == CPU_9900 && strcmp(word, "copy") == 0))
+                library_include = 1;
+        }
+    }
+    if (!library_strip || library_include) {
+        for (c = 0; c < library_total_blocks; c++)
+            library_blocks[c].live = 1;
+        free(library_pending);
+        return;
+    }
+
+    /*
+     ** References from the fixed parts, and blocks entered from them.
+     */
+    for (part = LIBRARY_PROLOGUE; part < TOTAL_PARTS; part++) {
+        for (c = library_start[part]; c < library_start[part + 1]; c++) {
+            line = &library_lines[c];
+            if (line->block == -1 && line->state != STATE_FALSE && line->kind != LINE_EMPTY)
+                library_references(line->text, 1);
+            if (line->block != -1 && library_blocks[line->block].first == c)
+                library_flow(c - 1, library_start[part], line->block);
+        }
+    }
+
+    /*
+     ** Follow the references of the used blocks
+     */
+    while (library_total_pending > 0) {
+        block = library_pending[--library_total_pending];
+        for (c = library_blocks[block].first; c < library_blocks[block].last; c++) {
+            if (library_lines[c].state != STATE_FALSE)
+                library_references(library_lines[c].text, 1);
+        }
+        for (c = 0; c < library_total_edges; c += 2) {
+            if (library_edges[c] == block)
+                library_use_block(library_edges[c + 1]);
+        }
+    }
+    free(library_pending);
+
+    /*
+     ** Sum the removed bytes
+     */
+    for (c = 0; c < library_total_blocks; c++) {
+        if (library_blocks[c].live)
+            continue;
+        library_removed_routines++;
+        for (d = library_blocks[c].first; d < library_blocks[c].last; d++) {
+            if (library_lines[d].state != STATE_FALSE)
+                library_removed_bytes += library_lines[d].size;
+        }
+    }
+}
+
+/*
+ ** Write a part of the library, without the unused blocks
+ */
+void library_write(FILE *output, enum library_part part, void (*mark)(FILE *))
+{
+    struct library_line *line;
+    int c;
+
+    for (c = library_start[part]; c < library_start[part + 1]; c++) {
+        line = &library_lines[c];
+        if (line->block != -1 && !library_blocks[line->block].live)
+            continue;
+        if (memcmp(library_spaces(line->text), ";CVBASIC MARK DON'T CHANGE", 26) == 0)   /* Location to replace */
+            mark(output);
+        else
+            fputs(line->text, output);
+    }
+}
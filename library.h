@@ -0,0 +1,26 @@
+/*
+ ** CVBasic - Runtime library linker (headers)
+ **
+ ** by Oscar Toledo G.
+ **
+ ** Creation date: Oct/17/2026.
+ */
+
+/*
+ ** Parts of the runtime library.
+ */
+enum library_part {
+    LIBRARY_PROLOGUE,
+    LIBRARY_EPILOGUE,
+    TOTAL_PARTS
+};
+
+extern int library_strip;
+extern int library_removed_routines;
+extern int library_removed_bytes;
+
+extern void library_reset(void);
+extern void library_define(char *, int);
+extern void library_read(char *, enum library_part);
+extern void library_link(int);
+extern void library_write(FILE *, enum library_part, void (*)(FILE *));
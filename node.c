@@ -17,6 +17,84 @@
 #include "cpuz80.h"
 #include "cpu6502.h"
 #include "cpu9900.h"
+#include "stats.h"
+
+/*
+ ** Expression nodes are allocated from an arena, in blocks that never move.
+ ** The arena is emptied after each statement, except for the nodes kept
+ ** by FOR until the matching NEXT.
+ */
+#define NODE_BLOCK  1024    /* Nodes per block */
+
+static struct node **node_blocks;
+static int node_total_blocks;
+static int node_used;       /* Nodes allocated */
+static int node_base;       /* Nodes kept across statements */
+int node_peak;              /* Maximum nodes allocated at the same time */
+
+/*
+ ** Allocate a node from the arena
+ */
+static struct node *node_alloc(void)
+{
+    if (node_used == node_total_blocks * NODE_BLOCK) {
+        node_blocks = realloc(node_blocks, (node_total_blocks + 1) * sizeof(struct node *));
+        if (node_blocks == NULL) {
+            emit_error("out of memory");
+            exit(1);
+        }
+        node_blocks[node_total_blocks] = malloc(NODE_BLOCK * sizeof(struct node));
+        if (node_blocks[node_total_blocks] == NULL) {
+            emit_error("out of memory");
+            exit(1);
+        }
+        node_total_blocks++;
+    }
+    node_used++;
+    STATS_COUNT(STATS_NODES);
+    if (node_used > node_peak)
+        node_peak = node_used;
+    return &node_blocks[(node_used - 1) / NODE_BLOCK][(node_used - 1) % NODE_BLOCK];
+}
+
+/*
+ ** Keep the nodes created up to now after the end of the statement.
+ ** Returns the previous limit for node_arena_release.
+ */
+int node_arena_keep(void)
+{
+    int previous;
+    
+    previous = node_base;
+    node_base = node_used;
+    return previous;
+}
+
+/*
+ ** Stop keeping the nodes (they will be freed at the end of the statement)
+ */
+void node_arena_release(int previous)
+{
+    node_base = previous;
+}
+
+/*
+ ** Free all the nodes of the statement
+ */
+void node_arena_reset(void)
+{
+    node_used = node_base;
+}
+
+/*
+ ** Free all the nodes (start of a new program)
+ */
+void node_arena_clear(void)
+{
+    node_used = 0;
+    node_base = 0;
+    node_peak = 0;
+}
 
 /*
  ** Comparison of tree nodes.
@@ -113,6 +191,139 @@ int is_power_of_two(int value)
     return 0;
 }
 
+/*
+ ** Check if multiplying by a constant is cheaper with shifts and adds
+ ** than with the general multiplication (runtime library or MPY).
+ **
+ ** The multiplication goes from the top bit down, doubling and adding
+ ** the original value for each one bit. Cycles and bytes are scaled
+ ** like the SELECT CASE cost model.
+ */
+int is_cheap_multiply(int value)
+{
+    int shifts;
+    int adds;
+    int groups;
+    int cost;
+    int c;
+    
+    value &= 0xffff;
+    if (value < 2)
+        return 0;
+    if (is_power_of_two(value))
+        return 1;
+    shifts = -1;
+    adds = -1;
+    for (c = value; c != 0; c >>= 1) {
+        shifts++;
+        if (c & 1)
+            adds++;
+    }
+    if (target == CPU_6502) {
+        /* STA/STY temp2, ASL/ROL, 16-bit ADC, against JSR _mul16 */
+        /* A byte weighs four cycles, the inline code is repeated at each use */
+        cost = (48 + 8 * 16) + shifts * (28 + 3 * 16) + adds * (72 + 11 * 16);
+        return cost <= 1320 + 13 * 16;
+    }
+    if (target == CPU_9900) {
+        /* MOV, SLA with a count for each group of shifts, A, against LI and MPY */
+        groups = adds + ((value & 1) == 0);
+        cost = (14 + 4) + groups * (12 + 4) + shifts * 2 + adds * (14 + 4);
+        return cost <= 78 + 16;
+    }
+    /* LD D,H / LD E,L, ADD HL,HL, ADD HL,DE, against CALL _mul16 */
+    cost = (8 + 2) + shifts * (11 + 1) + adds * (11 + 1);
+    return cost <= 280 + 6;
+}
+
+/*
+ ** Find a multiplier so (x * multiplier) >> shift is x / divisor for
+ ** every x of the given bits, and the product fits in twice the bits.
+ ** Returns zero if there is none.
+ */
+int reciprocal_of(int divisor, int bits, int *shift)
+{
+    unsigned long multiplier;
+    unsigned long limit;
+    unsigned long x;
+    int s;
+    
+    limit = 1UL << bits;
+    for (s = bits; s < bits * 2; s++) {
+        multiplier = ((1UL << s) + divisor - 1) / divisor;
+        if (multiplier > 0xffff)
+            break;
+        if ((limit - 1) * multiplier > (limit - 1) * (limit + 1))   /* Product overflows */
+            break;
+        for (x = 0; x < limit; x++) {
+            if (((x * multiplier) >> s) != x / divisor)
+                break;
+        }
+        if (x == limit) {
+            *shift = s;
+            return (int) multiplier;
+        }
+    }
+    return 0;
+}
+
+/*
+ ** Divide an extended 8-bit value by a constant using its reciprocal,
+ ** the result is 8-bit. Returns NULL if there is no reciprocal.
+ **
+ ** N_DIV8 (high byte of the product) / (2 ^ (shift - 8))
+ */
+static struct node *node_reciprocal8(struct node *left, int divisor)
+{
+    struct node *result;
+    int multiplier;
+    int shift;
+    
+    multiplier = reciprocal_of(divisor, 8, &shift);
+    if (multiplier == 0 || !is_cheap_multiply(multiplier))
+        return NULL;
+    result = node_create(N_MUL16, 0, left, node_create(N_NUM16, multiplier, NULL, NULL));
+    result = node_create(N_DIV16, 0, result, node_create(N_NUM16, 256, NULL, NULL));
+    result = node_create(N_REDUCE16, 0, result, NULL);
+    if (shift > 8)
+        result = node_create(N_DIV8, 0, result, node_create(N_NUM8, 1 << (shift - 8), NULL, NULL));
+    return result;
+}
+
+/*
+ ** Signed division or modulo of a variable by a power of two. The
+ ** negative values get a bias so the quotient is rounded to zero like
+ ** the runtime library does:
+ **
+ ** bias = (high byte > 127) AND (divisor - 1)
+ ** x / divisor = ((x + bias) / divisor XOR m) - m     (m = 32768 / divisor)
+ ** x % divisor = x - ((x + bias) AND -divisor)
+ */
+static struct node *node_signed_shift(enum node_type type, struct label *label, int divisor)
+{
+    struct node *variable;
+    struct node *sign;
+    struct node *result;
+
+    variable = node_create(N_LOAD16, 0, NULL, NULL);
+    variable->label = label;
+    sign = node_create(N_REDUCE16, 0, node_create(N_DIV16, 0, variable, node_create(N_NUM16, 256, NULL, NULL)), NULL);
+    sign = node_create(N_GREATER8, 0, sign, node_create(N_NUM8, 127, NULL, NULL));
+    sign = node_create(N_AND8, 0, sign, node_create(N_NUM8, divisor - 1, NULL, NULL));
+    variable = node_create(N_LOAD16, 0, NULL, NULL);
+    variable->label = label;
+    result = node_create(N_PLUS16, 0, node_create(N_EXTEND8, 0, sign, NULL), variable);
+    if (type == N_DIV16S) {
+        result = node_create(N_DIV16, 0, result, node_create(N_NUM16, divisor, NULL, NULL));
+        result = node_create(N_XOR16, 0, result, node_create(N_NUM16, 0x8000 / divisor, NULL, NULL));
+        return node_create(N_MINUS16, 0, result, node_create(N_NUM16, 0x8000 / divisor, NULL, NULL));
+    }
+    result = node_create(N_AND16, 0, result, node_create(N_NUM16, 0x10000 - divisor, NULL, NULL));
+    variable = node_create(N_LOAD16, 0, NULL, NULL);
+    variable->label = label;
+    return node_create(N_MINUS16, 0, variable, result);
+}
+
 /*
  ** Check if a node is commutative
  */
@@ -223,6 +434,202 @@ void node_visual(struct node *tree)
     fprintf(stderr, "%s", report);
 }
 
+/*
+ ** Compare two constants (unsigned), the result is like the generated code.
+ */
+static int node_compare(enum node_type type, int left, int right)
+{
+    int result;
+    
+    switch (type) {
+        case N_EQUAL8: case N_EQUAL16: result = (left == right); break;
+        case N_NOTEQUAL8: case N_NOTEQUAL16: result = (left != right); break;
+        case N_LESS8: case N_LESS16: result = (left < right); break;
+        case N_LESSEQUAL8: case N_LESSEQUAL16: result = (left <= right); break;
+        case N_GREATER8: case N_GREATER16: result = (left > right); break;
+        default: result = (left >= right); break;
+    }
+    return result ? 255 : 0;
+}
+
+/*
+ ** Find the range of (unsigned) values of an operation, from the
+ ** ranges of its operands. The worst case is the whole 16-bit range.
+ */
+static void node_range_operation(enum node_type type, struct node *left, struct node *right, int *low, int *high)
+{
+    int left_low;
+    int left_high;
+    int right_low;
+    int right_high;
+
+    node_range(left, &left_low, &left_high);
+    node_range(right, &right_low, &right_high);
+    *low = 0;
+    *high = 0xffff;
+    switch (type) {
+        case N_PLUS8:
+        case N_PLUS16:
+            *low = left_low + right_low;
+            *high = left_high + right_high;
+            break;
+        case N_MINUS8:
+        case N_MINUS16:
+            if (left_low >= right_high) {   /* It doesn't go below zero */
+                *low = left_low - right_high;
+                *high = left_high - right_low;
+            }
+            break;
+        case N_MUL8:
+        case N_MUL16:
+            if (left_high == 0 || right_high <= 0xffff / left_high) {
+                *low = left_low * right_low;
+                *high = left_high * right_high;
+            }
+            break;
+        case N_DIV8:
+        case N_DIV16:
+            if (right_low > 0) {
+                *low = left_low / right_high;
+                *high = left_high / right_low;
+            } else {
+                *high = left_high;
+            }
+            break;
+        case N_MOD16:
+            *high = left_high;
+            if (right_high > 0 && right_high - 1 < left_high)
+                *high = right_high - 1;
+            break;
+        case N_AND8:
+        case N_AND16:
+            *high = (left_high < right_high) ? left_high : right_high;
+            break;
+        case N_OR8:
+        case N_OR16:
+        case N_XOR8:
+        case N_XOR16:
+            *high = (left_high > right_high) ? left_high : right_high;
+            *high |= *high >> 1;
+            *high |= *high >> 2;
+            *high |= *high >> 4;
+            *high |= *high >> 8;
+            break;
+        default:
+            break;
+    }
+    if (*high > 0xffff) {   /* Wraps around */
+        *low = 0;
+        *high = 0xffff;
+    }
+}
+
+/*
+ ** Find the range of (unsigned) values of an expression, from
+ ** constants, AND masks, and variables with a known range.
+ */
+void node_range(struct node *node, int *low, int *high)
+{
+    switch (node->type) {
+        case N_NUM8:
+            *low = node->value & 0xff;
+            *high = *low;
+            return;
+        case N_NUM16:
+            *low = node->value & 0xffff;
+            *high = *low;
+            return;
+        case N_LOAD8:
+        case N_LOAD16:
+            if (node->label == NULL || !propagate_range(node->label, low, high)) {
+                *low = 0;
+                *high = 0xffff;
+            }
+            break;
+        case N_EXTEND8:
+        case N_REDUCE16:
+            node_range(node->left, low, high);
+            break;
+        case N_EXTEND8S:
+            node_range(node->left, low, high);
+            if (*high > 0x7f) {     /* It can be negative */
+                *low = 0;
+                *high = 0xffff;
+            }
+            return;
+        case N_PLUS8:
+        case N_MINUS8:
+        case N_MUL8:
+        case N_DIV8:
+        case N_AND8:
+        case N_OR8:
+        case N_XOR8:
+        case N_PLUS16:
+        case N_MINUS16:
+        case N_MUL16:
+        case N_DIV16:
+        case N_MOD16:
+        case N_AND16:
+        case N_OR16:
+        case N_XOR16:
+            node_range_operation(node->type, node->left, node->right, low, high);
+            break;
+        default:
+            *low = 0;
+            *high = 0xffff;
+            break;
+    }
+
+    /*
+     ** 8-bit results can only wrap around inside 8 bits.
+     */
+    switch (node->type) {
+        case N_LOAD8:
+        case N_EXTEND8:
+        case N_REDUCE16:
+        case N_PLUS8:
+        case N_MINUS8:
+        case N_MUL8:
+        case N_DIV8:
+        case N_AND8:
+        case N_OR8:
+        case N_XOR8:
+            if (*high > 0xff) {
+                *low = 0;
+                *high = 0xff;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ ** Check if a 16-bit expression can be reduced to 8 bits for free
+ ** (the TMS9900 reads the high byte of variables).
+ */
+static int node_reduces(struct node *node)
+{
+    if (node->type == N_EXTEND8 || node->type == N_NUM16)
+        return 1;
+    return target != CPU_9900 && node->type == N_LOAD16;
+}
+
+/*
+ ** Check if a 16-bit expression is known to fit in 8 bits, and it
+ ** can be reduced to 8 bits for free.
+ */
+static int node_fits8(struct node *node)
+{
+    int low;
+    int high;
+
+    if (!node_reduces(node))
+        return 0;
+    node_range(node, &low, &high);
+    return high <= 0xff;
+}
+
 /*
  ** Node creation.
  ** It also optimizes common patterns of expression node trees.
@@ -231,6 +638,8 @@ struct node *node_create(enum node_type type, int value, struct node *left, stru
 {
     struct node *new_node;
     struct node *extract;
+    int low;
+    int high;
     
     /*
      ** Convert signed operations to simpler operations
@@ -298,7 +707,7 @@ struct node *node_create(enum node_type type, int value, struct node *left, stru
                  left->type == N_OR16 ||
                  left->type == N_XOR16 ||
                  (left->type == N_MUL16 && left->right->type == N_NUM16 &&
-                  is_power_of_two(left->right->value & 0xff)) ||
+                  is_cheap_multiply(left->right->value & 0xff)) ||
                  (left->type == N_DIV16 && left->right->type == N_NUM16 &&
                   is_power_of_two(left->right->value & 0xff))) &&
                 (left->left->type == N_EXTEND8 || left->left->type == N_EXTEND8S) && left->right->type == N_NUM16) {
@@ -323,7 +732,6 @@ struct node *node_create(enum node_type type, int value, struct node *left, stru
                 new_node = left->left;
                 left->left = new_node->left;
                 new_node->left = NULL;
-                node_delete(new_node);
                 return left;
             }
             
@@ -338,7 +746,7 @@ struct node *node_create(enum node_type type, int value, struct node *left, stru
                  left->type == N_AND16 ||
                  left->type == N_OR16 ||
                  left->type == N_XOR16 ||
-                 (left->type == N_MUL16 && left->right->type == N_NUM16 && is_power_of_two(left->right->value & 0xff))) &&
+                 (left->type == N_MUL16 && left->right->type == N_NUM16 && is_cheap_multiply(left->right->value & 0xff))) &&
                 (left->right->type == N_NUM16)) {
                 
                 if (left->type == N_PLUS16)
@@ -368,7 +776,36 @@ struct node *node_create(enum node_type type, int value, struct node *left, stru
                 
                 extract->left = NULL;
                 extract->right = NULL;
-                node_delete(extract);
+            }
+            
+            /*
+             ** The low byte of these operations only depends on the low
+             ** bytes of the operands.
+             */
+            if ((left->type == N_PLUS16 ||
+                 left->type == N_MINUS16 ||
+                 left->type == N_AND16 ||
+                 left->type == N_OR16 ||
+                 left->type == N_XOR16) &&
+                node_reduces(left->left) && node_reduces(left->right)) {
+                
+                if (left->type == N_PLUS16)
+                    type = N_PLUS8;
+                else if (left->type == N_MINUS16)
+                    type = N_MINUS8;
+                else if (left->type == N_AND16)
+                    type = N_AND8;
+                else if (left->type == N_OR16)
+                    type = N_OR8;
+                else
+                    type = N_XOR8;
+                extract = left;
+                left = node_create(N_REDUCE16, 0, extract->left, NULL);
+                right = node_create(N_REDUCE16, 0, extract->right, NULL);
+                value = 0;
+                
+                extract->left = NULL;
+                extract->right = NULL;
             }
             
             /*
@@ -433,7 +870,6 @@ struct node *node_create(enum node_type type, int value, struct node *left, stru
         case N_MUL16:   /* 16-bit multiplication */
             if (left->type == N_NUM16 && right->type == N_NUM16) {  /* Optimize constant case */
                 left->value = (left->value * right->value) & 0xffff;
-                node_delete(right);
                 return left;
             }
             if (left->type == N_NUM16) {    /* Move constant to right */
@@ -442,25 +878,33 @@ struct node *node_create(enum node_type type, int value, struct node *left, stru
                 right = new_node;
             }
             if (right->type == N_NUM16 && right->value == 0) {  /* Nullify zero multiplication */
-                node_delete(left);
                 return right;
             }
             break;
         case N_DIV16:   /* 16-bit unsigned division */
             if (left->type == N_NUM16 && right->type == N_NUM16) {  /* Optimize constant case */
                 left->value = left->value / right->value;
-                node_delete(right);
                 return left;
             }
             if (right->type == N_NUM16 && right->value == 1) {
-                node_delete(right);
                 return left;
             }
+            
+            /*
+             ** Divide an 8-bit value by a constant multiplying by its reciprocal,
+             ** the TMS9900 does it in the code generator with MPY.
+             */
+            if (target != CPU_9900 && left->type == N_EXTEND8 && right->type == N_NUM16 &&
+                right->value > 2 && right->value < 256 && !is_power_of_two(right->value)) {
+                new_node = node_reciprocal8(left, right->value);
+                if (new_node != NULL) {
+                    return node_create(N_EXTEND8, 0, new_node, NULL);
+                }
+            }
             break;
         case N_MOD16:   /* 16-bit unsigned modulo */
             if (left->type == N_NUM16 && right->type == N_NUM16) {  /* Optimize constant case */
                 left->value = left->value % right->value;
-                node_delete(right);
                 return left;
             }
             if (right->type == N_NUM16) {   /* Optimize power of 2 constant case */
@@ -469,6 +913,59 @@ struct node *node_create(enum node_type type, int value, struct node *left, stru
                     type = N_AND16;
                 }
             }
+            
+            /*
+             ** Modulo of an 8-bit variable by a constant: x - x / c * c
+             */
+            if (target != CPU_9900 && left->type == N_EXTEND8 && left->left->type == N_LOAD8 &&
+                right->type == N_NUM16 && right->value > 2 && right->value < 256 && !is_power_of_two(right->value)) {
+                extract = node_create(N_LOAD8, 0, NULL, NULL);
+                extract->label = left->left->label;
+                new_node = node_reciprocal8(left, right->value);
+                if (new_node != NULL) {
+                    new_node = node_create(N_MUL8, 0, new_node, node_create(N_NUM8, right->value, NULL, NULL));
+                    return node_create(N_EXTEND8, 0, node_create(N_MINUS8, 0, extract, new_node), NULL);
+                }
+            }
+            break;
+        case N_DIV16S:  /* 16-bit signed division */
+        case N_MOD16S:  /* 16-bit signed modulo */
+            if (left->type == N_NUM16 && right->type == N_NUM16 && right->value != 0) {  /* Optimize constant case */
+                low = (left->value & 0x8000) ? 0x10000 - left->value : left->value;
+                high = (right->value & 0x8000) ? 0x10000 - right->value : right->value;
+                if (type == N_DIV16S) {
+                    value = low / high;
+                    if ((left->value ^ right->value) & 0x8000)
+                        value = -value;
+                } else {
+                    value = low % high;
+                    if (left->value & 0x8000)
+                        value = -value;
+                }
+                left->value = value & 0xffff;
+                return left;
+            }
+
+            /*
+             ** Signed division of a variable by a power of two, the
+             ** TMS9900 does it in the code generator with SRA.
+             */
+            if (target != CPU_9900 && left->type == N_LOAD16 && right->type == N_NUM16 &&
+                (right->value == 2 || right->value == 4 || right->value == 8 ||
+                 (right->value == 16 && target == CPU_Z80))) {
+                return node_signed_shift(type, left->label, right->value);
+            }
+            break;
+        case N_EQUAL8:
+        case N_NOTEQUAL8:
+        case N_LESS8:
+        case N_LESSEQUAL8:
+        case N_GREATER8:
+        case N_GREATEREQUAL8:
+            if (left->type == N_NUM8 && right->type == N_NUM8) {    /* Optimize constant case */
+                left->value = node_compare(type, left->value & 0xff, right->value & 0xff);
+                return left;
+            }
             break;
         case N_EQUAL16:
         case N_NOTEQUAL16:
@@ -476,6 +973,11 @@ struct node *node_create(enum node_type type, int value, struct node *left, stru
         case N_LESSEQUAL16:
         case N_GREATER16:
         case N_GREATEREQUAL16:
+            if (left->type == N_NUM16 && right->type == N_NUM16) {  /* Optimize constant case */
+                left->type = N_NUM8;
+                left->value = node_compare(type, left->value & 0xffff, right->value & 0xffff);
+                return left;
+            }
             if (left->type == N_EXTEND8 && right->type == N_NUM16 && (right->value & ~0xff) == 0) {
                 extract = left;
                 if (type == N_EQUAL16)
@@ -494,13 +996,30 @@ struct node *node_create(enum node_type type, int value, struct node *left, stru
                 right->type = N_NUM8;
                 
                 extract->left = NULL;
-                node_delete(extract);
+            } else if (node_fits8(left) && node_fits8(right)) {
+                
+                /*
+                 ** Both sides are known to fit in 8 bits
+                 */
+                if (type == N_EQUAL16)
+                    type = N_EQUAL8;
+                else if (type == N_NOTEQUAL16)
+                    type = N_NOTEQUAL8;
+                else if (type == N_LESS16)
+                    type = N_LESS8;
+                else if (type == N_LESSEQUAL16)
+                    type = N_LESSEQUAL8;
+                else if (type == N_GREATER16)
+                    type = N_GREATER8;
+                else if (type == N_GREATEREQUAL16)
+                    type = N_GREATEREQUAL8;
+                left = node_create(N_REDUCE16, 0, left, NULL);
+                right = node_create(N_REDUCE16, 0, right, NULL);
             }
             break;
         case N_PLUS16:  /* 16-bit addition */
             if (left->type == N_NUM16 && right->type == N_NUM16) {  /* Optimize constant case */
                 left->value = (left->value + right->value) & 0xffff;
-                node_delete(right);
                 return left;
             }
             
@@ -515,12 +1034,10 @@ struct node *node_create(enum node_type type, int value, struct node *left, stru
              */
             if (left->type == N_PLUS16 && left->right->type == N_NUM16 && right->type == N_NUM16) {
                 left->right->value = (left->right->value + right->value) & 0xffff;
-                node_delete(right);
                 return left;
             }
             if (left->type == N_MINUS16 && left->right->type == N_NUM16 && right->type == N_NUM16) {
                 left->right->value = (left->right->value - right->value) & 0xffff;
-                node_delete(right);
                 return left;
             }
             if (left->type == N_NUM16) {    /* Move constant to right */
@@ -529,14 +1046,12 @@ struct node *node_create(enum node_type type, int value, struct node *left, stru
                 right = new_node;
             }
             if (right->type == N_NUM16 && right->value == 0) {  /* Remove zero add */
-                node_delete(right);
                 return left;
             }
             break;
         case N_MINUS16: /* 16-bit subtraction */
             if (left->type == N_NUM16 && right->type == N_NUM16) {  /* Optimize constant case */
                 left->value = (left->value - right->value) & 0xffff;
-                node_delete(right);
                 return left;
             }
             
@@ -551,23 +1066,19 @@ struct node *node_create(enum node_type type, int value, struct node *left, stru
              */
             if (left->type == N_PLUS16 && left->right->type == N_NUM16 && right->type == N_NUM16) {
                 left->right->value = (left->right->value - right->value) & 0xffff;
-                node_delete(right);
                 return left;
             }
             if (left->type == N_MINUS16 && left->right->type == N_NUM16 && right->type == N_NUM16) {
                 left->right->value = (left->right->value + right->value) & 0xffff;
-                node_delete(right);
                 return left;
             }
             if (right->type == N_NUM16 && right->value == 0) {  /* Remove zero subtraction */
-                node_delete(right);
                 return left;
             }
             break;
         case N_AND16:   /* 16-bit AND */
             if (left->type == N_NUM16 && right->type == N_NUM16) {  /* Optimize constant case */
                 left->value &= right->value;
-                node_delete(right);
                 return left;
             }
             if (left->type == N_NUM16) {    /* Move constant to right */
@@ -577,11 +1088,9 @@ struct node *node_create(enum node_type type, int value, struct node *left, stru
             }
             if (right->type == N_NUM16) {   /* Remove no operation */
                 if (right->value == 0xffff) {
-                    node_delete(right);
                     return left;
                 }
                 if (right->value == 0x0000) {
-                    node_delete(left);
                     return right;
                 }
                 if ((right->value & 0xff00) == 0x0000 && left->type == N_EXTEND8) {
@@ -596,7 +1105,6 @@ struct node *node_create(enum node_type type, int value, struct node *left, stru
         case N_OR16:    /* 16-bit OR */
             if (left->type == N_NUM16 && right->type == N_NUM16) {  /* Optimize constant case */
                 left->value |= right->value;
-                node_delete(right);
                 return left;
             }
             if (left->type == N_NUM16) {    /* Move constant to right */
@@ -606,11 +1114,9 @@ struct node *node_create(enum node_type type, int value, struct node *left, stru
             }
             if (right->type == N_NUM16) {   /* Remove no operation */
                 if (right->value == 0x0000) {
-                    node_delete(right);
                     return left;
                 }
                 if (right->value == 0xffff) {
-                    node_delete(left);
                     return right;
                 }
                 if ((right->value & 0xff00) == 0x0000 && left->type == N_EXTEND8) {
@@ -625,7 +1131,6 @@ struct node *node_create(enum node_type type, int value, struct node *left, stru
         case N_XOR16:   /* 16-bit XOR */
             if (left->type == N_NUM16 && right->type == N_NUM16) {  /* Optimize constant case */
                 left->value ^= right->value;
-                node_delete(right);
                 return left;
             }
             if (left->type == N_NUM16) {    /* Move constant to right */
@@ -635,7 +1140,6 @@ struct node *node_create(enum node_type type, int value, struct node *left, stru
             }
             if (right->type == N_NUM16) {   /* Remove no operation */
                 if (right->value == 0) {
-                    node_delete(right);
                     return left;
                 }
                 if ((right->value & 0xff00) == 0x0000 && left->type == N_EXTEND8) {
@@ -650,7 +1154,6 @@ struct node *node_create(enum node_type type, int value, struct node *left, stru
         case N_PLUS8:   /* 8-bit addition */
             if (left->type == N_NUM8 && right->type == N_NUM8) {    /* Optimize constant case */
                 left->value = (left->value + right->value) & 0xff;
-                node_delete(right);
                 return left;
             }
             if (left->type == N_NUM8) {    /* Move constant to right */
@@ -659,25 +1162,21 @@ struct node *node_create(enum node_type type, int value, struct node *left, stru
                 right = new_node;
             }
             if (right->type == N_NUM8 && right->value == 0) {
-                node_delete(right);
                 return left;
             }
             break;
         case N_MINUS8:  /* 8-bit subtraction */
             if (left->type == N_NUM8 && right->type == N_NUM8) {    /* Optimize constant case */
                 left->value = (left->value - right->value) & 0xff;
-                node_delete(right);
                 return left;
             }
             if (right->type == N_NUM8 && right->value == 0) {   /* Remove no operation */
-                node_delete(right);
                 return left;
             }
             break;
         case N_AND8:    /* 8-bit AND */
             if (left->type == N_NUM8 && right->type == N_NUM8) {    /* Optimize constant case */
                 left->value &= right->value;
-                node_delete(right);
                 return left;
             }
             if (left->type == N_NUM8) {    /* Move constant to right */
@@ -687,11 +1186,9 @@ struct node *node_create(enum node_type type, int value, struct node *left, stru
             }
             if (right->type == N_NUM8) {    /* Remove no operation */
                 if (right->value == 0xff) {
-                    node_delete(right);
                     return left;
                 }
                 if (right->value == 0x00) {
-                    node_delete(left);
                     return right;
                 }
             }
@@ -699,7 +1196,6 @@ struct node *node_create(enum node_type type, int value, struct node *left, stru
         case N_OR8:     /* 8-bit OR */
             if (left->type == N_NUM8 && right->type == N_NUM8) {    /* Optimize constant case */
                 left->value |= right->value;
-                node_delete(right);
                 return left;
             }
             if (left->type == N_NUM8) {    /* Move constant to right */
@@ -709,11 +1205,9 @@ struct node *node_create(enum node_type type, int value, struct node *left, stru
             }
             if (right->type == N_NUM8) {    /* Remove no operation */
                 if (right->value == 0x00) {
-                    node_delete(right);
                     return left;
                 }
                 if (right->value == 0xff) {
-                    node_delete(left);
                     return right;
                 }
             }
@@ -721,7 +1215,6 @@ struct node *node_create(enum node_type type, int value, struct node *left, stru
         case N_XOR8:    /* 8-bit XOR */
             if (left->type == N_NUM8 && right->type == N_NUM8) {    /* Optimize constant case */
                 left->value ^= right->value;
-                node_delete(right);
                 return left;
             }
             if (left->type == N_NUM8) {    /* Move constant to right */
@@ -731,7 +1224,6 @@ struct node *node_create(enum node_type type, int value, struct node *left, stru
             }
             if (right->type == N_NUM8) {    /* Remove no operation */
                 if (right->value == 0x00) {
-                    node_delete(right);
                     return left;
                 }
             }
@@ -740,6 +1232,31 @@ struct node *node_create(enum node_type type, int value, struct node *left, stru
             break;
     }
     
+    /*
+     ** The 6502 is a lot faster doing 8-bit arithmetic, use it when
+     ** the result is known to fit in 8 bits.
+     */
+    if (target == CPU_6502 && (type == N_PLUS16 || type == N_MINUS16 || type == N_AND16 ||
+                               type == N_OR16 || type == N_XOR16) &&
+        node_reduces(left) && node_reduces(right)) {
+        node_range_operation(type, left, right, &low, &high);
+        if (high <= 0xff) {
+            if (type == N_PLUS16)
+                type = N_PLUS8;
+            else if (type == N_MINUS16)
+                type = N_MINUS8;
+            else if (type == N_AND16)
+                type = N_AND8;
+            else if (type == N_OR16)
+                type = N_OR8;
+            else
+                type = N_XOR8;
+            new_node = node_create(type, 0, node_create(N_REDUCE16, 0, left, NULL),
+                                   node_create(N_REDUCE16, 0, right, NULL));
+            return node_create(N_EXTEND8, 0, new_node, NULL);
+        }
+    }
+    
     /*
      ** Optimize difficult comparisons with constants to use simpler comparisons.
      */
@@ -771,11 +1288,7 @@ struct node *node_create(enum node_type type, int value, struct node *left, stru
         default:
             break;
     }
-    new_node = malloc(sizeof(struct node));
-    if (new_node == NULL) {
-        emit_error("out of memory");
-        exit(1);
-    }
+    new_node = node_alloc();
     new_node->type = type;
     new_node->value = value;
     new_node->left = left;
@@ -835,26 +1348,14 @@ void node_label(struct node *node)
  */
 void node_generate(struct node *node, int decision)
 {
+    stats_start(PHASE_GENERATE);
     if (target == CPU_Z80)
         cpuz80_node_generate(node, decision);
     if (target == CPU_6502)
         cpu6502_node_generate(node, decision);
     if (target == CPU_9900)
         cpu9900_node_generate(node, decision);
-}
-
-/*
- ** Delete an expression node
- */
-void node_delete(struct node *tree)
-{
-    if (tree == NULL)
-        return;
-    if (tree->left != NULL)
-        node_delete(tree->left);
-    if (tree->right != NULL)
-        node_delete(tree->right);
-    free(tree);
+    stats_stop();
 }
 
 
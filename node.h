@@ -46,13 +46,21 @@ struct node {
 };
 
 extern int is_power_of_two(int);
+extern int is_cheap_multiply(int);
+extern int reciprocal_of(int, int, int *);
 extern int is_commutative(enum node_type);
 
 extern int node_same_tree(struct node *, struct node *);
 extern int node_same_address(struct node *, struct node *);
 extern void node_visual(struct node *);
+extern void node_range(struct node *, int *, int *);
 extern struct node *node_create(enum node_type, int, struct node *, struct node *);
 extern void node_get_label(struct node *, int);
 extern void node_label(struct node *);
 extern void node_generate(struct node *, int);
-extern void node_delete(struct node *);
+
+extern int node_peak;
+extern int node_arena_keep(void);
+extern void node_arena_release(int);
+extern void node_arena_reset(void);
+extern void node_arena_clear(void);
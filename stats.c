@@ -0,0 +1,174 @@
+/*
+ ** CVBasic - Compilation statistics
+ **
+ ** by Oscar Toledo G.
+ **
+ ** Creation date: Oct/17/2026.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "cvbasic.h"
+#include "node.h"
+#include "stats.h"
+
+#define STATS_DEPTH 16      /* Maximum nesting of phases */
+#define STATS_RULES 64      /* Maximum different peephole rules */
+
+int stats_enabled;
+int stats_counter[TOTAL_COUNTERS];
+
+static double stats_time[TOTAL_PHASES];
+static enum stats_phase stats_stack[STATS_DEPTH];
+static int stats_depth;
+static double stats_mark;
+static double stats_begin;
+
+static struct {
+    char *rule;
+    int count;
+} stats_rules[STATS_RULES];
+static int stats_total_rules;
+
+static char *stats_phase_name[TOTAL_PHASES] = {
+    "parse",
+    "generate",
+    "peephole",
+    "relax",
+    "variables",
+    "library",
+    "output",
+};
+
+static char *stats_counter_name[TOTAL_COUNTERS] = {
+    "lines",
+    "statements",
+    "nodes",
+    "instructions",
+    "labels",
+    "internal_labels",
+    "symbols",
+    "output_bytes",
+};
+
+/*
+ ** Get the wall clock time in milliseconds
+ */
+static double stats_clock(void)
+{
+#ifdef _WIN32
+    return (double) clock() * 1000.0 / CLOCKS_PER_SEC;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+#endif
+}
+
+/*
+ ** Reset the statistics (start of a new program)
+ */
+void stats_reset(void)
+{
+    int c;
+
+    for (c = 0; c < TOTAL_PHASES; c++)
+        stats_time[c] = 0.0;
+    for (c = 0; c < TOTAL_COUNTERS; c++)
+        stats_counter[c] = 0;
+    stats_total_rules = 0;
+    stats_depth = 0;
+    stats_begin = stats_clock();
+}
+
+/*
+ ** Start a phase, the current one is paused
+ */
+void stats_start(enum stats_phase phase)
+{
+    double now;
+
+    if (!stats_enabled)
+        return;
+    now = stats_clock();
+    if (stats_depth > 0)
+        stats_time[stats_stack[stats_depth - 1]] += now - stats_mark;
+    if (stats_depth < STATS_DEPTH)
+        stats_stack[stats_depth] = phase;
+    stats_depth++;
+    stats_mark = now;
+}
+
+/*
+ ** End the current phase, the previous one continues
+ */
+void stats_stop(void)
+{
+    double now;
+
+    if (!stats_enabled || stats_depth == 0)
+        return;
+    now = stats_clock();
+    stats_depth--;
+    if (stats_depth < STATS_DEPTH)
+        stats_time[stats_stack[stats_depth]] += now - stats_mark;
+    stats_mark = now;
+}
+
+/*
+ ** Count a peephole rule applied
+ */
+void stats_rule(char *rule)
+{
+    int c;
+
+    if (!stats_enabled)
+        return;
+    for (c = 0; c < stats_total_rules; c++) {
+        if (strcmp(stats_rules[c].rule, rule) == 0) {
+            stats_rules[c].count++;
+            return;
+        }
+    }
+    if (stats_total_rules < STATS_RULES) {
+        stats_rules[stats_total_rules].rule = rule;
+        stats_rules[stats_total_rules].count = 1;
+        stats_total_rules++;
+    }
+}
+
+/*
+ ** Report the statistics, as text (stderr) or as a JSON line (stdout)
+ */
+void stats_report(char *target_name, int json)
+{
+    double total;
+    int c;
+
+    total = stats_clock() - stats_begin;
+    if (json) {
+        printf("{\"target\":\"%s\",\"time_ms\":{", target_name);
+        for (c = 0; c < TOTAL_PHASES; c++)
+            printf("\"%s\":%.3f,", stats_phase_name[c], stats_time[c]);
+        printf("\"total\":%.3f},\"counters\":{", total);
+        for (c = 0; c < TOTAL_COUNTERS; c++)
+            printf("\"%s\":%d,", stats_counter_name[c], stats_counter[c]);
+        printf("\"nodes_peak\":%d},\"peephole\":{", node_peak);
+        for (c = 0; c < stats_total_rules; c++)
+            printf("%s\"%s\":%d", c ? "," : "", stats_rules[c].rule, stats_rules[c].count);
+        printf("}}\n");
+        fflush(stdout);
+        return;
+    }
+    fprintf(stderr, "Statistics for %s:\n", target_name);
+    for (c = 0; c < TOTAL_PHASES; c++)
+        fprintf(stderr, "  %-24s %10.3f ms\n", stats_phase_name[c], stats_time[c]);
+    fprintf(stderr, "  %-24s %10.3f ms\n", "total", total);
+    for (c = 0; c < TOTAL_COUNTERS; c++)
+        fprintf(stderr, "  %-24s %10d\n", stats_counter_name[c], stats_counter[c]);
+    fprintf(stderr, "  %-24s %10d (%d bytes)\n", "nodes_peak", node_peak, node_peak * (int) sizeof(struct node));
+    for (c = 0; c < stats_total_rules; c++)
+        fprintf(stderr, "  peephole: %-40s %6d\n", stats_rules[c].rule, stats_rules[c].count);
+}
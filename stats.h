@@ -0,0 +1,48 @@
+/*
+ ** CVBasic - Compilation statistics (headers)
+ **
+ ** by Oscar Toledo G.
+ **
+ ** Creation date: Oct/17/2026.
+ */
+
+/*
+ ** Compilation phases. The time of a phase doesn't include the time
+ ** of the phases started inside it.
+ */
+enum stats_phase {
+    PHASE_PARSE,        /* Lexing and parsing (compile_basic) */
+    PHASE_GENERATE,     /* Code generation from expression trees */
+    PHASE_PEEPHOLE,     /* Peephole optimization */
+    PHASE_RELAX,        /* Branch relaxation */
+    PHASE_VARIABLES,    /* Variable allocation (process_variables) */
+    PHASE_LIBRARY,      /* Prologue and epilogue copying */
+    PHASE_OUTPUT,       /* Writing the instruction stream */
+    TOTAL_PHASES
+};
+
+/*
+ ** Counters.
+ */
+enum stats_counter {
+    STATS_LINES,            /* Source lines */
+    STATS_STATEMENTS,       /* Statements */
+    STATS_NODES,            /* Expression nodes created */
+    STATS_INSTRUCTIONS,     /* Entries added to the instruction stream */
+    STATS_LABELS,           /* BASIC labels */
+    STATS_INTERNAL_LABELS,  /* Labels created by the compiler */
+    STATS_SYMBOLS,          /* Interned identifiers */
+    STATS_OUTPUT_BYTES,     /* Size of the assembler file */
+    TOTAL_COUNTERS
+};
+
+#define STATS_COUNT(counter)   (stats_counter[counter]++)
+
+extern int stats_enabled;
+extern int stats_counter[TOTAL_COUNTERS];
+
+extern void stats_reset(void);
+extern void stats_start(enum stats_phase);
+extern void stats_stop(void);
+extern void stats_rule(char *);
+extern void stats_report(char *, int);
@@ -0,0 +1,106 @@
+/*
+ ** Generate the perfect hash for CVBasic keywords
+ **
+ ** by Oscar Toledo G.
+ ** https://nanochess.org/
+ **
+ ** Creation date: Oct/17/2026.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SLOTS   256     /* Size of the hash table (must match KEYWORD_SLOTS) */
+
+/*
+ ** Keywords recognized by get_lex(), in alphabetical order.
+ ** After changing this list, paste the output over the tables in cvbasic.c
+ */
+char *keywords[] = {
+    "ABS", "ASM", "BANK", "BITMAP", "BORDER", "BUTTON", "BUTTON2", "CALL",
+    "CASE", "CHRRAM", "CHRROM", "CLS", "CONST", "CONT", "CONT1", "CONT2",
+    "DATA", "DEF", "DEFINE", "DIM", "DO", "DOWN", "ELSE", "ELSEIF",
+    "END", "EXIT", "FM_AVAILABLE", "FM_ENABLED", "FOR", "FRAME", "GOSUB", "GOTO",
+    "IF", "INCLUDE", "INP", "KEY", "LEFT", "LEN", "LOOP", "MODE",
+    "MUSIC", "NAMETABLE", "NEXT", "NTSC", "ON", "OPTION", "OUT", "PALETTE",
+    "PEEK", "PLAY", "PLAYING", "POKE", "POS", "PRINT", "PROCEDURE", "RANDOM",
+    "READ", "REM", "RESTORE", "RETURN", "RIGHT", "SCREEN", "SCROLL", "SELECT",
+    "SGN", "SIGNED", "SOUND", "SPINNER", "SPRITE", "STATUS", "UNSIGNED", "UP",
+    "USR", "VARPTR", "VDP", "VPEEK", "VPOKE", "WAIT", "WEND", "WHILE",
+    NULL,
+};
+
+int slot[SLOTS];
+
+/*
+ ** Same hash function as keyword_lookup() in cvbasic.c
+ */
+int hash(char *name, unsigned long multiplier)
+{
+    unsigned long h;
+
+    h = 0;
+    while (*name)
+        h = (h * multiplier + (unsigned char) *name++) & 0xffffffffUL;
+    return (int) ((h ^ (h >> 11)) % SLOTS);
+}
+
+/*
+ ** Main program
+ */
+int main(void)
+{
+    unsigned long multiplier;
+    int c;
+    int d;
+    int s;
+
+    for (multiplier = 3; multiplier < 0x1000000; multiplier += 2) {
+        for (c = 0; c < SLOTS; c++)
+            slot[c] = 0;
+        for (c = 0; keywords[c] != NULL; c++) {
+            s = hash(keywords[c], multiplier);
+            if (slot[s] != 0)
+                break;
+            slot[s] = c + 1;
+        }
+        if (keywords[c] == NULL)
+            break;
+    }
+    if (multiplier >= 0x1000000) {
+        fprintf(stderr, "No perfect hash found\n");
+        exit(1);
+    }
+
+    printf("static enum keyword_code {\n");
+    printf("    K_NONE,");
+    for (c = 0; keywords[c] != NULL; c++) {
+        if (c % 8 == 0)
+            printf("\n   ");
+        printf(" K_%s,", keywords[c]);
+    }
+    printf("\n} keyword;\n\n");
+
+    printf("#define KEYWORD_MULTIPLIER  %luUL\n", multiplier);
+    printf("#define KEYWORD_SLOTS   %d\n\n", SLOTS);
+
+    printf("static char *keyword_name[] = {\n");
+    printf("    \"\",");
+    for (c = 0; keywords[c] != NULL; c++) {
+        if (c % 8 == 0)
+            printf("\n   ");
+        printf(" \"%s\",", keywords[c]);
+    }
+    printf("\n};\n\n");
+
+    printf("static unsigned char keyword_slot[KEYWORD_SLOTS] = {\n");
+    for (c = 0; c < SLOTS; c += 16) {
+        printf("   ");
+        for (d = c; d < c + 16; d++)
+            printf(" %2d,", slot[d]);
+        printf("\n");
+    }
+    printf("};\n");
+    exit(0);
+}